@@ -44,6 +44,14 @@
 #include "exec-memory.h"
 #include "hw/pcspk.h"
 #include "cloudlet/qemu-cloudlet.h"
+#include "page_cache.h"
+#include "host-utils.h"
+#include "qemu-thread.h"
+#include "postcopy-ram.h"
+#include "bitmap.h"
+#include "cpus.h"
+#include "block.h"
+#include <zlib.h>
 
 #define DEBUG_ARCH_INIT
 
@@ -98,13 +106,20 @@ const uint32_t arch_type = QEMU_ARCH;
 /***********************************************************/
 /* ram save/restore */
 
-#define RAM_SAVE_FLAG_FULL     0x01 /* Obsolete, not used anymore */
+/*
+ * The flags share the be64 with the page address, so they must fit into the
+ * smallest TARGET_PAGE_BITS (10): 0x200 is the highest flag available.
+ */
+#define RAM_SAVE_FLAG_EXTENTS  0x01 /* Was RAM_SAVE_FLAG_FULL, unused since v4 */
 #define RAM_SAVE_FLAG_COMPRESS 0x02
 #define RAM_SAVE_FLAG_MEM_SIZE 0x04
 #define RAM_SAVE_FLAG_PAGE     0x08
 #define RAM_SAVE_FLAG_EOS      0x10
 #define RAM_SAVE_FLAG_CONTINUE 0x20
 #define RAM_SAVE_FLAG_RAW      0x40
+#define RAM_SAVE_FLAG_XBZRLE   0x80
+#define RAM_SAVE_FLAG_COMPRESS_PAGE 0x100
+#define RAM_SAVE_FLAG_POSTCOPY 0x200
 
 #ifdef __ALTIVEC__
 #include <altivec.h>
@@ -165,70 +180,512 @@ static int is_dup_page(uint8_t *page) {
 	return 1;
 }
 
+/* XBZRLE encoding header flag, sent before each encoded page */
+#define ENCODING_FLAG_XBZRLE 0x1
+
+/* struct contains XBZRLE cache and the buffers used by the compression */
+static struct {
+	/* buffer used for XBZRLE encoding */
+	uint8_t *encoded_buf;
+	/* buffer for storing page content */
+	uint8_t *current_buf;
+	/* buffer used for XBZRLE decoding */
+	uint8_t *decoded_buf;
+	/* Cache for XBZRLE, resized from the monitor while migrating */
+	PageCache *cache;
+	QemuMutex lock;
+} XBZRLE;
+
+typedef struct AccountingInfo {
+	uint64_t xbzrle_bytes;
+	uint64_t xbzrle_pages;
+	uint64_t xbzrle_cache_hit;
+	uint64_t xbzrle_cache_miss;
+	uint64_t xbzrle_overflows;
+} AccountingInfo;
+
+static AccountingInfo acct_info;
+
+static void acct_clear(void)
+{
+	memset(&acct_info, 0, sizeof(acct_info));
+}
+
+uint64_t xbzrle_mig_bytes_transferred(void)
+{
+	return acct_info.xbzrle_bytes;
+}
+
+uint64_t xbzrle_mig_pages_transferred(void)
+{
+	return acct_info.xbzrle_pages;
+}
+
+uint64_t xbzrle_mig_pages_cache_hit(void)
+{
+	return acct_info.xbzrle_cache_hit;
+}
+
+uint64_t xbzrle_mig_pages_cache_miss(void)
+{
+	return acct_info.xbzrle_cache_miss;
+}
+
+uint64_t xbzrle_mig_pages_overflow(void)
+{
+	return acct_info.xbzrle_overflows;
+}
+
+void xbzrle_init(void)
+{
+	qemu_mutex_init(&XBZRLE.lock);
+}
+
+int64_t xbzrle_cache_resize(int64_t new_size)
+{
+	int64_t ret;
+
+	if (new_size < TARGET_PAGE_SIZE)
+		return -1;
+
+	qemu_mutex_lock(&XBZRLE.lock);
+	if (XBZRLE.cache != NULL) {
+		ret = cache_resize(XBZRLE.cache, new_size / TARGET_PAGE_SIZE);
+		if (ret > 0)
+			ret *= TARGET_PAGE_SIZE;
+	} else {
+		ret = 1ULL << (63 - clz64(new_size));
+	}
+	qemu_mutex_unlock(&XBZRLE.lock);
+
+	return ret;
+}
+
+static int xbzrle_start(void)
+{
+	PageCache *cache;
+
+	cache = cache_init(migrate_xbzrle_cache_size() / TARGET_PAGE_SIZE,
+			TARGET_PAGE_SIZE);
+	if (!cache) {
+		fprintf(stderr, "Error creating XBZRLE cache\n");
+		return -1;
+	}
+
+	qemu_mutex_lock(&XBZRLE.lock);
+	XBZRLE.cache = cache;
+	qemu_mutex_unlock(&XBZRLE.lock);
+
+	XBZRLE.encoded_buf = g_malloc0(TARGET_PAGE_SIZE);
+	XBZRLE.current_buf = g_malloc(TARGET_PAGE_SIZE);
+	acct_clear();
+
+	return 0;
+}
+
+static void xbzrle_end(void)
+{
+	qemu_mutex_lock(&XBZRLE.lock);
+	if (XBZRLE.cache) {
+		cache_fini(XBZRLE.cache);
+		XBZRLE.cache = NULL;
+	}
+	qemu_mutex_unlock(&XBZRLE.lock);
+
+	g_free(XBZRLE.encoded_buf);
+	g_free(XBZRLE.current_buf);
+	XBZRLE.encoded_buf = NULL;
+	XBZRLE.current_buf = NULL;
+}
+
+/* block named by the last page header written to the stream */
+static RAMBlock *last_sent_block;
+
+static void save_block_hdr(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
+		int flag)
+{
+	int cont = (block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+
+	qemu_put_be64(f, offset | cont | flag);
+	if (!cont) {
+		qemu_put_byte(f, strlen(block->idstr));
+		qemu_put_buffer(f, (uint8_t *) block->idstr,
+				strlen(block->idstr));
+		last_sent_block = block;
+	}
+}
+
+/*
+ * Try to send @current_data as a delta against the copy of the page kept in
+ * the XBZRLE cache.  On return, XBZRLE.current_buf holds the contents the
+ * destination will have for this page.
+ *
+ * Returns the number of bytes sent, 0 if the page is unmodified since it was
+ * last sent, or -1 if the caller must send the full page from
+ * XBZRLE.current_buf.  Called with XBZRLE.lock held.
+ */
+static int save_xbzrle_page(QEMUFile *f, uint8_t *current_data,
+		ram_addr_t current_addr, RAMBlock *block, ram_addr_t offset,
+		bool last_stage)
+{
+	int encoded_len = 0, bytes_sent = -1;
+	uint8_t *prev_cached_page;
+
+	/* take a stable copy, the guest may be writing to the page */
+	memcpy(XBZRLE.current_buf, current_data, TARGET_PAGE_SIZE);
+
+	prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
+	if (!prev_cached_page) {
+		if (!last_stage) {
+			cache_insert(XBZRLE.cache, current_addr,
+					g_memdup(XBZRLE.current_buf, TARGET_PAGE_SIZE));
+		}
+		acct_info.xbzrle_cache_miss++;
+		return -1;
+	}
+	acct_info.xbzrle_cache_hit++;
+
+	/* XBZRLE encoding (if there is no overflow) */
+	encoded_len = xbzrle_encode_buffer(prev_cached_page, XBZRLE.current_buf,
+			TARGET_PAGE_SIZE, XBZRLE.encoded_buf, TARGET_PAGE_SIZE);
+	if (encoded_len == 0) {
+		return 0;
+	}
+
+	/* the cache must mirror what the destination holds */
+	memcpy(prev_cached_page, XBZRLE.current_buf, TARGET_PAGE_SIZE);
+
+	if (encoded_len == -1) {
+		acct_info.xbzrle_overflows++;
+		return -1;
+	}
+
+	/* Send XBZRLE based compressed page */
+	save_block_hdr(f, block, offset, RAM_SAVE_FLAG_XBZRLE);
+	qemu_put_byte(f, ENCODING_FLAG_XBZRLE);
+	qemu_put_be16(f, encoded_len);
+	qemu_put_buffer(f, XBZRLE.encoded_buf, encoded_len);
+	bytes_sent = encoded_len + 1 + 2;
+	acct_info.xbzrle_pages++;
+	acct_info.xbzrle_bytes += bytes_sent;
+
+	return bytes_sent;
+}
+
+static uint64_t bytes_transferred;
+
+/*
+ * Multi-threaded page compression.  Each thread owns one page slot; the
+ * migration thread copies a page into an idle slot and the worker deflates
+ * it.  The result is written to the stream by the migration thread the next
+ * time the slot is reused, or when the slots are flushed, so the stream is
+ * only ever touched by one thread.
+ */
+typedef struct CompressParam {
+	QemuThread thread;
+	QemuMutex mutex;
+	QemuCond cond;
+	bool start;			/* page queued, worker has not finished it */
+	bool quit;
+	RAMBlock *block;		/* page held by the slot, NULL if none */
+	ram_addr_t offset;
+	uint8_t *in;
+	uint8_t *out;
+	unsigned long out_size;
+	int out_len;			/* compressed length, -1 on error */
+	z_stream stream;
+} CompressParam;
+
+static CompressParam *comp_param;
+static int comp_thread_count;
+static int comp_next;
+
+static void *do_data_compress(void *opaque)
+{
+	CompressParam *param = opaque;
+	int ret;
+
+	qemu_mutex_lock(&param->mutex);
+	while (!param->quit) {
+		if (!param->start) {
+			qemu_cond_wait(&param->cond, &param->mutex);
+			continue;
+		}
+		qemu_mutex_unlock(&param->mutex);
+
+		deflateReset(&param->stream);
+		param->stream.next_in = param->in;
+		param->stream.avail_in = TARGET_PAGE_SIZE;
+		param->stream.next_out = param->out;
+		param->stream.avail_out = param->out_size;
+		ret = deflate(&param->stream, Z_FINISH);
+
+		qemu_mutex_lock(&param->mutex);
+		if (ret == Z_STREAM_END)
+			param->out_len = param->out_size - param->stream.avail_out;
+		else
+			param->out_len = -1;
+		param->start = false;
+		qemu_cond_broadcast(&param->cond);
+	}
+	qemu_mutex_unlock(&param->mutex);
+
+	return NULL;
+}
+
+static int compress_threads_start(void)
+{
+	int i;
+
+	comp_thread_count = migrate_compress_threads();
+	comp_param = g_malloc0(comp_thread_count * sizeof(*comp_param));
+	comp_next = 0;
+
+	for (i = 0; i < comp_thread_count; i++) {
+		CompressParam *param = &comp_param[i];
+
+		if (deflateInit(&param->stream, migrate_compress_level()) != Z_OK) {
+			fprintf(stderr, "Error initializing page compression\n");
+			comp_thread_count = i;
+			return -1;
+		}
+		param->out_size = compressBound(TARGET_PAGE_SIZE);
+		param->in = g_malloc(TARGET_PAGE_SIZE);
+		param->out = g_malloc(param->out_size);
+		qemu_mutex_init(&param->mutex);
+		qemu_cond_init(&param->cond);
+		qemu_thread_create(&param->thread, do_data_compress, param,
+				QEMU_THREAD_JOINABLE);
+	}
+
+	return 0;
+}
+
+static void compress_threads_end(void)
+{
+	int i;
+
+	for (i = 0; i < comp_thread_count; i++) {
+		CompressParam *param = &comp_param[i];
+
+		qemu_mutex_lock(&param->mutex);
+		param->quit = true;
+		qemu_cond_broadcast(&param->cond);
+		qemu_mutex_unlock(&param->mutex);
+		qemu_thread_join(&param->thread);
+
+		qemu_mutex_destroy(&param->mutex);
+		qemu_cond_destroy(&param->cond);
+		deflateEnd(&param->stream);
+		g_free(param->in);
+		g_free(param->out);
+	}
+
+	g_free(comp_param);
+	comp_param = NULL;
+	comp_thread_count = 0;
+}
+
+/* Wait for the slot's worker and write its page, if any, to the stream. */
+static void flush_compressed_slot(QEMUFile *f, CompressParam *param)
+{
+	if (!param->block)
+		return;
+
+	qemu_mutex_lock(&param->mutex);
+	while (param->start)
+		qemu_cond_wait(&param->cond, &param->mutex);
+	qemu_mutex_unlock(&param->mutex);
+
+	if (param->out_len < 0) {
+		/* deflate failed, fall back to the uncompressed copy */
+		save_block_hdr(f, param->block, param->offset, RAM_SAVE_FLAG_PAGE);
+		qemu_put_buffer(f, param->in, TARGET_PAGE_SIZE);
+		bytes_transferred += TARGET_PAGE_SIZE;
+	} else {
+		save_block_hdr(f, param->block, param->offset,
+				RAM_SAVE_FLAG_COMPRESS_PAGE);
+		qemu_put_be32(f, param->out_len);
+		qemu_put_buffer(f, param->out, param->out_len);
+		bytes_transferred += param->out_len + 4;
+	}
+	param->block = NULL;
+}
+
+static void flush_compressed_data(QEMUFile *f)
+{
+	int i;
+
+	for (i = 0; i < comp_thread_count; i++)
+		flush_compressed_slot(f, &comp_param[i]);
+}
+
+/*
+ * A newer copy of a page must not reach the stream ahead of an older one
+ * still sitting in a compression slot.
+ */
+static void flush_compressed_page(QEMUFile *f, RAMBlock *block,
+		ram_addr_t offset)
+{
+	int i;
+
+	for (i = 0; i < comp_thread_count; i++) {
+		CompressParam *param = &comp_param[i];
+
+		if (param->block == block && param->offset == offset)
+			flush_compressed_slot(f, param);
+	}
+}
+
+static void save_compressed_page(QEMUFile *f, RAMBlock *block,
+		ram_addr_t offset, uint8_t *data)
+{
+	CompressParam *param = &comp_param[comp_next];
+
+	comp_next = (comp_next + 1) % comp_thread_count;
+	flush_compressed_slot(f, param);
+
+	memcpy(param->in, data, TARGET_PAGE_SIZE);
+	param->block = block;
+	param->offset = offset;
+
+	qemu_mutex_lock(&param->mutex);
+	param->start = true;
+	qemu_cond_broadcast(&param->cond);
+	qemu_mutex_unlock(&param->mutex);
+}
+
+/* Send a full page, through the compression threads if they are running */
+static void save_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
+		uint8_t *data)
+{
+	if (comp_param) {
+		save_compressed_page(f, block, offset, data);
+	} else {
+		save_block_hdr(f, block, offset, RAM_SAVE_FLAG_PAGE);
+		qemu_put_buffer(f, data, TARGET_PAGE_SIZE);
+		bytes_transferred += TARGET_PAGE_SIZE;
+	}
+}
+
 static RAMBlock *last_block;
 static ram_addr_t last_offset;
+/* set once ram_save_block() has gone over all of guest memory */
+static bool ram_round_complete;
+/* pre-copy stopped early, the remaining pages are sent after the devices */
+static bool postcopy_pending;
+
+/*
+ * auto-converge: each time the guest has dirtied more than half of what
+ * was sent during two iterations, slow its vCPUs down further
+ */
+#define THROTTLE_PCT_INITIAL 20
+#define THROTTLE_PCT_INCREMENT 10
+
+static int dirty_rate_high_cnt;
+
+static void mig_throttle_check(uint64_t bytes_dirty, uint64_t bytes_xfer)
+{
+	if (bytes_dirty <= bytes_xfer / 2 || ++dirty_rate_high_cnt < 2)
+		return;
 
-static int ram_save_block(QEMUFile *f) {
+	dirty_rate_high_cnt = 0;
+	if (!cpu_throttle_active())
+		cpu_throttle_set(THROTTLE_PCT_INITIAL);
+	else
+		cpu_throttle_set(cpu_throttle_get_percentage() +
+				THROTTLE_PCT_INCREMENT);
+}
+
+/*
+ * ram_save_block: Writes the next dirty page of memory to the stream f.
+ * Dirty pages whose contents match the XBZRLE cache are skipped.  Pages
+ * handed to the compression threads reach the stream later, see
+ * flush_compressed_data().  The bytes written are added to
+ * bytes_transferred.
+ *
+ * Returns the number of pages sent, 0 if there are no more pages to send
+ */
+static int ram_save_block(QEMUFile *f, bool last_stage) {
 	RAMBlock *block = last_block;
 	ram_addr_t offset = last_offset;
-	int bytes_sent = 0;
+	int pages = 0;
 	MemoryRegion *mr;
+	ram_addr_t current_addr;
 
 	if (!block)
 		block = QLIST_FIRST(&ram_list.blocks);
 
 	do {
 		mr = block->mr;
-		if (memory_region_get_dirty(mr, offset, TARGET_PAGE_SIZE,
+		if (memory_region_test_and_clear_dirty(mr, offset, TARGET_PAGE_SIZE,
 				DIRTY_MEMORY_MIGRATION)) {
 			uint8_t *p;
-			int cont = (block == last_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
-
-			memory_region_reset_dirty(mr, offset, TARGET_PAGE_SIZE,
-					DIRTY_MEMORY_MIGRATION);
+			int bytes_sent;
 
 			p = memory_region_get_ram_ptr(mr) + offset;
 
+			if (comp_param)
+				flush_compressed_page(f, block, offset);
+
 			if (is_dup_page(p)) {
-				qemu_put_be64(f, offset | cont | RAM_SAVE_FLAG_COMPRESS);
-				if (!cont) {
-					qemu_put_byte(f, strlen(block->idstr));
-					qemu_put_buffer(f, (uint8_t *) block->idstr,
-							strlen(block->idstr));
-				}
+				save_block_hdr(f, block, offset, RAM_SAVE_FLAG_COMPRESS);
 				qemu_put_byte(f, *p);
-				bytes_sent = 1;
-			} else {
-				qemu_put_be64(f, offset | cont | RAM_SAVE_FLAG_PAGE);
-				if (!cont) {
-					qemu_put_byte(f, strlen(block->idstr));
-					qemu_put_buffer(f, (uint8_t *) block->idstr,
-							strlen(block->idstr));
+				bytes_transferred += 1;
+				pages = 1;
+
+				/* keep the cached copy in sync with the destination */
+				if (migrate_use_xbzrle()) {
+					uint8_t *cached;
+
+					current_addr = block->offset + offset;
+					qemu_mutex_lock(&XBZRLE.lock);
+					cached = get_cached_data(XBZRLE.cache, current_addr);
+					if (cached)
+						memset(cached, *p, TARGET_PAGE_SIZE);
+					qemu_mutex_unlock(&XBZRLE.lock);
 				}
-				qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
-				bytes_sent = TARGET_PAGE_SIZE;
+			} else if (migrate_use_xbzrle()) {
+				current_addr = block->offset + offset;
+				qemu_mutex_lock(&XBZRLE.lock);
+				bytes_sent = save_xbzrle_page(f, p, current_addr, block,
+						offset, last_stage);
+				qemu_mutex_unlock(&XBZRLE.lock);
+				/* XBZRLE overflow or cache miss, send the stable copy */
+				if (bytes_sent == -1) {
+					save_page(f, block, offset, XBZRLE.current_buf);
+					pages = 1;
+				} else if (bytes_sent > 0) {
+					bytes_transferred += bytes_sent;
+					pages = 1;
+				}
+			} else {
+				save_page(f, block, offset, p);
+				pages = 1;
 			}
 
-			break;
+			/* if page is unmodified, continue to the next */
+			if (pages != 0)
+				break;
 		}
 
 		offset += TARGET_PAGE_SIZE;
 		if (offset >= block->length) {
 			offset = 0;
 			block = QLIST_NEXT(block, next);
-			if (!block)
+			if (!block) {
 				block = QLIST_FIRST(&ram_list.blocks);
+				ram_round_complete = true;
+			}
 		}
 	} while (block != last_block || offset != last_offset);
 
 	last_block = block;
 	last_offset = offset;
 
-	return bytes_sent;
+	return pages;
 }
 
-static uint64_t bytes_transferred;
-
 static ram_addr_t ram_save_remaining(void) {
 	RAMBlock *block;
 	ram_addr_t count = 0;
@@ -376,11 +833,9 @@ static void ram_save_raw_bh(QEMUFile *f, void *opaque) {
 			else
 				offset = TARGET_PAGE_SIZE * i;
 
-			if (memory_region_get_dirty(block->mr, offset,
+			if (memory_region_test_and_clear_dirty(block->mr, offset,
 						    TARGET_PAGE_SIZE, DIRTY_MEMORY_MIGRATION)) {
 				set_blob_pos(f, block->blob_pos + offset);
-				memory_region_reset_dirty(block->mr, offset,
-							  TARGET_PAGE_SIZE, DIRTY_MEMORY_MIGRATION);
 				qemu_put_buffer(f, block->host + offset, TARGET_PAGE_SIZE);
 				count++;
 			}
@@ -512,13 +967,18 @@ static int ram_save_live_orig(QEMUFile *f, int stage, void *opaque)
 	uint64_t bytes_transferred_last;
 	double bwidth = 0;
 	uint64_t expected_time = 0;
-	int ret;
+	int ret = 0;
 
 	if (!use_raw_none(f))
 		return 1;
 
 	if (stage < 0) {
 		memory_global_dirty_log_stop();
+		if (migrate_use_xbzrle())
+			xbzrle_end();
+		if (comp_param)
+			compress_threads_end();
+		cpu_throttle_stop();
 		return 0;
 	}
 
@@ -530,8 +990,19 @@ static int ram_save_live_orig(QEMUFile *f, int stage, void *opaque)
 		bytes_transferred = 0;
 		last_block = NULL;
 		last_offset = 0;
+		last_sent_block = NULL;
+		ram_round_complete = false;
+		postcopy_pending = false;
+		dirty_rate_high_cnt = 0;
 		sort_ram_list();
 
+		if (migrate_use_xbzrle() && xbzrle_start() < 0)
+			return -1;
+		if (migrate_use_compression() && compress_threads_start() < 0) {
+			compress_threads_end();
+			return -1;
+		}
+
 		/* Make sure all dirty bits are set */
 		QLIST_FOREACH(block, &ram_list.blocks, next) {
 			for (addr = 0; addr < block->length; addr += TARGET_PAGE_SIZE) {
@@ -555,18 +1026,19 @@ static int ram_save_live_orig(QEMUFile *f, int stage, void *opaque)
 	bytes_transferred_last = bytes_transferred;
 	bwidth = qemu_get_clock_ns(rt_clock);
 
-	while ((ret = qemu_file_rate_limit(f)) == 0) {
-		int bytes_sent;
-
-		bytes_sent = ram_save_block(f);
-		bytes_transferred += bytes_sent;
-		if (bytes_sent == 0) { /* no more blocks */
+	/* once post-copy is pending the remaining pages are sent on demand */
+	while (!postcopy_pending && (ret = qemu_file_rate_limit(f)) == 0) {
+		if (ram_save_block(f, false) == 0) { /* no more blocks */
 			break;
 		}
 	}
 	if (ret < 0)
 		return ret;
 
+	/* the destination waits for its decompression threads at EOS */
+	if (comp_param)
+		flush_compressed_data(f);
+
 	bwidth = qemu_get_clock_ns(rt_clock) - bwidth;
 	bwidth = (bytes_transferred - bytes_transferred_last) / bwidth;
 
@@ -578,32 +1050,405 @@ static int ram_save_live_orig(QEMUFile *f, int stage, void *opaque)
 
 	/* try transferring iterative blocks of memory */
 	if (stage == 3) {
-		int bytes_sent;
-
 		/* flush all remaining blocks regardless of rate limiting */
-		while ((bytes_sent = ram_save_block(f)) != 0) {
-			bytes_transferred += bytes_sent;
+		while (!postcopy_pending && ram_save_block(f, true) != 0) {
+		}
+		if (postcopy_pending)
+			qemu_put_be64(f, RAM_SAVE_FLAG_POSTCOPY);
+		if (comp_param) {
+			flush_compressed_data(f);
+			compress_threads_end();
 		}
 		memory_global_dirty_log_stop();
+		if (migrate_use_xbzrle())
+			xbzrle_end();
+		cpu_throttle_stop();
 	}
 
 	qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
 
 	expected_time = ram_save_remaining() * TARGET_PAGE_SIZE / bwidth;
 
+	if (stage == 2 && (migrate_auto_converge() ||
+			(migrate_use_postcopy() && ram_round_complete))) {
+		uint64_t bytes_dirty;
+
+		/* count what the guest dirtied while this iteration was sent */
+		memory_global_sync_dirty_bitmap(get_system_memory());
+		bytes_dirty = ram_save_remaining() * TARGET_PAGE_SIZE;
+		expected_time = bytes_dirty / bwidth;
+
+		if (expected_time > migrate_max_downtime()) {
+			/*
+			 * bound the pre-copy phase: once every page has been sent,
+			 * leave the rest to post-copy rather than waiting for the
+			 * dirty rate to drop
+			 */
+			if (migrate_use_postcopy() && ram_round_complete) {
+				postcopy_pending = true;
+				return 1;
+			}
+			mig_throttle_check(bytes_dirty,
+					bytes_transferred - bytes_transferred_last);
+		}
+	}
+
 	return (stage == 2) && (expected_time <= migrate_max_downtime());
 }
 
+bool ram_postcopy_pending(void)
+{
+	return postcopy_pending;
+}
+
+static void ram_postcopy_save_page(QEMUFile *f, RAMBlock *block,
+		ram_addr_t offset)
+{
+	uint8_t *p = memory_region_get_ram_ptr(block->mr) + offset;
+
+	memory_region_reset_dirty(block->mr, offset, TARGET_PAGE_SIZE,
+			DIRTY_MEMORY_MIGRATION);
+
+	if (is_dup_page(p)) {
+		save_block_hdr(f, block, offset, RAM_SAVE_FLAG_COMPRESS);
+		qemu_put_byte(f, *p);
+		bytes_transferred += 1;
+	} else {
+		save_block_hdr(f, block, offset, RAM_SAVE_FLAG_PAGE);
+		qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+		bytes_transferred += TARGET_PAGE_SIZE;
+	}
+}
+
+/*
+ * Send the page the destination is waiting for if there is one, otherwise
+ * the next page it has not received yet.
+ *
+ * Returns the number of pages sent, 0 if every page has been sent
+ */
+static int ram_postcopy_send_page(QEMUFile *f)
+{
+	RAMBlock *block;
+	ram_addr_t offset;
+
+	while (postcopy_return_path_next(&block, &offset)) {
+		if (memory_region_get_dirty(block->mr, offset, TARGET_PAGE_SIZE,
+				DIRTY_MEMORY_MIGRATION)) {
+			ram_postcopy_save_page(f, block, offset);
+			/* do not let it sit behind the background pages */
+			qemu_fflush(f);
+			return 1;
+		}
+	}
+
+	block = last_block ? last_block : QLIST_FIRST(&ram_list.blocks);
+	offset = last_offset;
+	do {
+		if (memory_region_get_dirty(block->mr, offset, TARGET_PAGE_SIZE,
+				DIRTY_MEMORY_MIGRATION)) {
+			ram_postcopy_save_page(f, block, offset);
+			last_block = block;
+			last_offset = offset;
+			return 1;
+		}
+
+		offset += TARGET_PAGE_SIZE;
+		if (offset >= block->length) {
+			offset = 0;
+			block = QLIST_NEXT(block, next);
+			if (!block)
+				block = QLIST_FIRST(&ram_list.blocks);
+		}
+	} while (block != last_block || offset != last_offset);
+
+	return 0;
+}
+
+/*
+ * Post-copy phase, run once the devices have been sent: tell the
+ * destination which pages it is still missing, then send them, serving
+ * the ones it faults on first.
+ */
+int ram_postcopy_outgoing(QEMUFile *f, int fd)
+{
+	RAMBlock *block;
+	int ret;
+
+	QLIST_FOREACH(block, &ram_list.blocks, next) {
+		ram_addr_t npages = block->length >> TARGET_PAGE_BITS;
+		ram_addr_t i;
+		uint64_t bits = 0;
+
+		save_block_hdr(f, block, 0, RAM_SAVE_FLAG_POSTCOPY);
+		for (i = 0; i < npages; i++) {
+			if (memory_region_get_dirty(block->mr, i << TARGET_PAGE_BITS,
+					TARGET_PAGE_SIZE, DIRTY_MEMORY_MIGRATION))
+				bits |= 1ULL << (i % 64);
+			if (i % 64 == 63 || i == npages - 1) {
+				qemu_put_be64(f, bits);
+				bits = 0;
+			}
+		}
+	}
+	qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+	qemu_fflush(f);
+
+	if (postcopy_return_path_start(fd) < 0)
+		return -1;
+
+	last_block = QLIST_FIRST(&ram_list.blocks);
+	last_offset = 0;
+	while ((ret = qemu_file_get_error(f)) == 0 &&
+			ram_postcopy_send_page(f) != 0) {
+	}
+
+	qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+	qemu_fflush(f);
+	if (ret == 0)
+		ret = qemu_file_get_error(f);
+
+	/* the destination hangs up once it has every page */
+	postcopy_return_path_join();
+	postcopy_pending = false;
+
+	return ret;
+}
+
+/*
+ * Snapshots to an image are taken with the VM stopped, so RAM does not need
+ * to go through the page stream.  The stream only says which pages are
+ * stored and what the others are filled with; the stored pages follow in a
+ * contiguous, aligned area of the VM state that is preallocated and written
+ * with large requests, several of them in flight at a time.
+ */
+#define RAM_EXTENT_SIZE		(1 << 20)
+#define RAM_EXTENT_PAGES	(RAM_EXTENT_SIZE / TARGET_PAGE_SIZE)
+#define RAM_EXTENTS_IN_FLIGHT	8
+
+typedef struct RAMExtent {
+	BlockDriverState *bs;
+	bool is_write;
+	int64_t pos;
+	int nb_pages;
+	uint8_t *buf;
+	uint8_t *host[RAM_EXTENT_PAGES];	/* where a load puts the pages */
+} RAMExtent;
+
+static int ram_extents_in_flight;
+static int ram_extents_ret;
+
+static void coroutine_fn ram_extent_entry(void *opaque)
+{
+	RAMExtent *ext = opaque;
+	int size = ext->nb_pages * TARGET_PAGE_SIZE;
+	int i, ret;
+
+	if (ext->is_write) {
+		ret = bdrv_save_vmstate(ext->bs, ext->buf, ext->pos, size);
+	} else {
+		ret = bdrv_load_vmstate(ext->bs, ext->buf, ext->pos, size);
+		for (i = 0; ret >= 0 && i < ext->nb_pages; i++)
+			memcpy(ext->host[i], ext->buf + i * TARGET_PAGE_SIZE,
+					TARGET_PAGE_SIZE);
+	}
+	if (ret < 0 && ram_extents_ret == 0)
+		ram_extents_ret = ret;
+
+	qemu_vfree(ext->buf);
+	g_free(ext);
+	ram_extents_in_flight--;
+}
+
+static RAMExtent *ram_extent_new(BlockDriverState *bs, bool is_write,
+		int64_t pos)
+{
+	RAMExtent *ext = g_malloc0(sizeof(*ext));
+
+	ext->bs = bs;
+	ext->is_write = is_write;
+	ext->pos = pos;
+	ext->buf = qemu_blockalign(bs, RAM_EXTENT_SIZE);
+	return ext;
+}
+
+/* Starts the I/O of @ext once fewer than RAM_EXTENTS_IN_FLIGHT are running */
+static void ram_extent_submit(RAMExtent *ext)
+{
+	Coroutine *co;
+
+	while (ram_extents_in_flight >= RAM_EXTENTS_IN_FLIGHT)
+		qemu_aio_wait();
+
+	ram_extents_in_flight++;
+	co = qemu_coroutine_create(ram_extent_entry);
+	qemu_coroutine_enter(co, ext);
+}
+
+/* Waits for all extents, returns the first error */
+static int ram_extents_drain(void)
+{
+	int ret;
+
+	while (ram_extents_in_flight > 0)
+		qemu_aio_wait();
+
+	ret = ram_extents_ret;
+	ram_extents_ret = 0;
+	return ret;
+}
+
+static int ram_save_extents(QEMUFile *f, BlockDriverState *bs)
+{
+	BlockDriverInfo bdi;
+	RAMBlock *block;
+	RAMExtent *ext = NULL;
+	uint8_t **fill;
+	ram_addr_t *nb_fill;
+	int64_t align = RAM_EXTENT_SIZE;
+	int64_t meta_size, data_pos, data_size = 0, pos;
+	uint32_t nb_blocks = 0, i;
+	int ret;
+
+	QLIST_FOREACH(block, &ram_list.blocks, next)
+		nb_blocks++;
+	fill = g_new0(uint8_t *, nb_blocks);
+	nb_fill = g_new0(ram_addr_t, nb_blocks);
+
+	/* Sort out the dup pages first, the stream needs their number up front */
+	meta_size = 8 + 8 + 8 + 4;
+	i = 0;
+	QLIST_FOREACH(block, &ram_list.blocks, next) {
+		ram_addr_t npages = block->length >> TARGET_PAGE_BITS;
+		ram_addr_t page;
+
+		fill[i] = g_malloc(npages);
+		for (page = 0; page < npages; page++) {
+			uint8_t *p = block->host + (page << TARGET_PAGE_BITS);
+
+			if (is_dup_page(p))
+				fill[i][nb_fill[i]++] = *p;
+			else
+				data_size += TARGET_PAGE_SIZE;
+		}
+		meta_size += 1 + strlen(block->idstr) +
+			DIV_ROUND_UP(npages, 64) * 8 + nb_fill[i];
+		i++;
+	}
+
+	if (bdrv_get_info(bs, &bdi) >= 0 && bdi.cluster_size > align)
+		align = bdi.cluster_size;
+	data_pos = QEMU_ALIGN_UP(qemu_ftell(f) + meta_size, align);
+
+	if (data_size > 0) {
+		ret = bdrv_preallocate_vmstate(bs, data_pos, data_size);
+		if (ret < 0 && ret != -ENOTSUP)
+			goto out;
+	}
+
+	qemu_put_be64(f, RAM_SAVE_FLAG_EXTENTS);
+	qemu_put_be64(f, data_pos);
+	qemu_put_be64(f, data_size);
+	qemu_put_be32(f, nb_blocks);
+
+	i = 0;
+	QLIST_FOREACH(block, &ram_list.blocks, next) {
+		ram_addr_t npages = block->length >> TARGET_PAGE_BITS;
+		ram_addr_t page;
+		uint64_t bits = 0;
+
+		qemu_put_byte(f, strlen(block->idstr));
+		qemu_put_buffer(f, (uint8_t *) block->idstr, strlen(block->idstr));
+		for (page = 0; page < npages; page++) {
+			if (!is_dup_page(block->host + (page << TARGET_PAGE_BITS)))
+				bits |= 1ULL << (page % 64);
+			if (page % 64 == 63 || page == npages - 1) {
+				qemu_put_be64(f, bits);
+				bits = 0;
+			}
+		}
+		qemu_put_buffer(f, fill[i], nb_fill[i]);
+		i++;
+	}
+
+	/* Stored pages, in the order of the bitmaps */
+	pos = data_pos;
+	QLIST_FOREACH(block, &ram_list.blocks, next) {
+		ram_addr_t npages = block->length >> TARGET_PAGE_BITS;
+		ram_addr_t page;
+
+		for (page = 0; page < npages; page++) {
+			uint8_t *p = block->host + (page << TARGET_PAGE_BITS);
+
+			if (is_dup_page(p))
+				continue;
+
+			if (!ext)
+				ext = ram_extent_new(bs, true, pos);
+			memcpy(ext->buf + ext->nb_pages * TARGET_PAGE_SIZE, p,
+					TARGET_PAGE_SIZE);
+			pos += TARGET_PAGE_SIZE;
+			if (++ext->nb_pages == RAM_EXTENT_PAGES) {
+				ram_extent_submit(ext);
+				ext = NULL;
+			}
+		}
+	}
+	if (ext)
+		ram_extent_submit(ext);
+	ret = ram_extents_drain();
+	bytes_transferred += data_size;
+
+	/* The rest of the stream goes after the pages */
+	qemu_fseek(f, data_pos + data_size, SEEK_SET);
+	if (ret == 0)
+		ret = qemu_file_get_error(f);
+
+out:
+	for (i = 0; i < nb_blocks; i++)
+		g_free(fill[i]);
+	g_free(fill);
+	g_free(nb_fill);
+	return ret;
+}
+
+static int ram_save_extents_live(QEMUFile *f, int stage, void *opaque)
+{
+	RAMBlock *block;
+	int ret;
+
+	if (stage < 0)
+		return 0;
+
+	if (stage == 1) {
+		qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
+		QLIST_FOREACH(block, &ram_list.blocks, next) {
+			qemu_put_byte(f, strlen(block->idstr));
+			qemu_put_buffer(f, (uint8_t *) block->idstr,
+					strlen(block->idstr));
+			qemu_put_be64(f, block->length);
+		}
+
+		ret = ram_save_extents(f, qemu_file_get_bdrv(f));
+		if (ret < 0)
+			return ret;
+	}
+
+	/* Everything was written in the first stage */
+	qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+	return stage == 2;
+}
+
 int ram_save_live(QEMUFile *f, int stage, void *opaque)
 {
 	if (use_raw_live(f))
 		return ram_save_raw_live(f, stage, opaque);
+	else if (qemu_file_get_bdrv(f) && !runstate_is_running())
+		return ram_save_extents_live(f, stage, opaque);
 	else
 		return ram_save_live_orig(f, stage, opaque);
 }
 
-static inline void *host_from_stream_offset(QEMUFile *f,
-					    ram_addr_t offset, int flags)
+static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
 {
 	static RAMBlock *block = NULL;
 	char id[256];
@@ -615,7 +1460,7 @@ static inline void *host_from_stream_offset(QEMUFile *f,
 			return NULL;
 		}
 
-		return memory_region_get_ram_ptr(block->mr) + offset;
+		return block;
 	}
 
 	len = qemu_get_byte(f);
@@ -624,13 +1469,108 @@ static inline void *host_from_stream_offset(QEMUFile *f,
 
 	QLIST_FOREACH(block, &ram_list.blocks, next) {
 		if (!strncmp(id, block->idstr, sizeof(id)))
-			return memory_region_get_ram_ptr(block->mr) + offset;
+			return block;
 	}
 
 	fprintf(stderr, "Can't find block %s!\n", id);
 	return NULL;
 }
 
+static inline void *host_from_stream_offset(QEMUFile *f,
+					    ram_addr_t offset, int flags)
+{
+	RAMBlock *block = ram_block_from_stream(f, flags);
+
+	if (!block)
+		return NULL;
+
+	return memory_region_get_ram_ptr(block->mr) + offset;
+}
+
+static int ram_load_extents(QEMUFile *f)
+{
+	BlockDriverState *bs = qemu_file_get_bdrv(f);
+	RAMExtent *ext = NULL;
+	int64_t data_pos, data_size, pos;
+	uint32_t nb_blocks, i;
+	int ret = 0;
+
+	if (!bs) {
+		fprintf(stderr, "RAM extents outside of an image\n");
+		return -EINVAL;
+	}
+
+	data_pos = qemu_get_be64(f);
+	data_size = qemu_get_be64(f);
+	nb_blocks = qemu_get_be32(f);
+
+	pos = data_pos;
+	for (i = 0; i < nb_blocks && ret == 0; i++) {
+		RAMBlock *block = ram_block_from_stream(f, 0);
+		ram_addr_t npages, page;
+		unsigned long *stored;
+
+		if (!block) {
+			ret = -EINVAL;
+			break;
+		}
+
+		npages = block->length >> TARGET_PAGE_BITS;
+		stored = bitmap_new(npages);
+		for (page = 0; page < npages; page += 64) {
+			uint64_t bits = qemu_get_be64(f);
+			ram_addr_t j;
+
+			for (j = page; j < MIN(page + 64, npages); j++) {
+				if (bits & (1ULL << (j % 64)))
+					set_bit(j, stored);
+			}
+		}
+
+		/* Pages that are not stored are filled from the stream, leaving
+		 * those that are zero already untouched */
+		for (page = 0; page < npages; page++) {
+			uint8_t *host = block->host + (page << TARGET_PAGE_BITS);
+			uint8_t ch;
+
+			if (test_bit(page, stored))
+				continue;
+			ch = qemu_get_byte(f);
+			if (ch != 0 || !buffer_is_zero(host, TARGET_PAGE_SIZE))
+				memset(host, ch, TARGET_PAGE_SIZE);
+		}
+
+		for (page = 0; page < npages; page++) {
+			if (!test_bit(page, stored))
+				continue;
+			if (pos + TARGET_PAGE_SIZE > data_pos + data_size) {
+				ret = -EINVAL;
+				break;
+			}
+
+			if (!ext)
+				ext = ram_extent_new(bs, false, pos);
+			ext->host[ext->nb_pages] = block->host +
+				(page << TARGET_PAGE_BITS);
+			pos += TARGET_PAGE_SIZE;
+			if (++ext->nb_pages == RAM_EXTENT_PAGES) {
+				ram_extent_submit(ext);
+				ext = NULL;
+			}
+		}
+		g_free(stored);
+	}
+	if (ext)
+		ram_extent_submit(ext);
+	if (ram_extents_drain() < 0 && ret == 0)
+		ret = -EIO;
+	if (ret == 0 && pos != data_pos + data_size)
+		ret = -EINVAL;
+
+	qemu_fseek(f, data_pos + data_size, SEEK_SET);
+	return ret;
+}
+
 int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
 	if (!use_raw_none(f))
@@ -822,6 +1762,211 @@ int ram_load_raw(QEMUFile *f, void *opaque, int version_id)
 	return 0;
 }
 
+static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
+{
+	int ret, rc = 0;
+	unsigned int xh_len;
+	int xh_flags;
+
+	if (!XBZRLE.decoded_buf)
+		XBZRLE.decoded_buf = g_malloc(TARGET_PAGE_SIZE);
+
+	/* extract RLE header */
+	xh_flags = qemu_get_byte(f);
+	xh_len = qemu_get_be16(f);
+
+	if (xh_flags != ENCODING_FLAG_XBZRLE) {
+		fprintf(stderr, "Failed to load XBZRLE page - wrong compression!\n");
+		return -1;
+	}
+
+	if (xh_len > TARGET_PAGE_SIZE) {
+		fprintf(stderr, "Failed to load XBZRLE page - len overflow!\n");
+		return -1;
+	}
+	/* load data and decode */
+	qemu_get_buffer(f, XBZRLE.decoded_buf, xh_len);
+
+	/* decode RLE */
+	ret = xbzrle_decode_buffer(XBZRLE.decoded_buf, xh_len, host,
+			TARGET_PAGE_SIZE);
+	if (ret == -1) {
+		fprintf(stderr, "Failed to load XBZRLE page - decode error!\n");
+		rc = -1;
+	} else if (ret > TARGET_PAGE_SIZE) {
+		fprintf(stderr, "Failed to load XBZRLE page - size %d exceeds %d!\n",
+				ret, TARGET_PAGE_SIZE);
+		abort();
+	}
+
+	return rc;
+}
+
+/*
+ * Decompression threads on the destination.  Records are read from the
+ * stream by the loading thread and inflated straight into guest memory by
+ * the worker; any other record for the same page waits for the worker.
+ */
+typedef struct DecompressParam {
+	QemuThread thread;
+	QemuMutex mutex;
+	QemuCond cond;
+	bool start;
+	bool quit;
+	void *des;			/* destination page, NULL if none */
+	uint8_t *compbuf;
+	int len;
+	z_stream stream;
+} DecompressParam;
+
+static DecompressParam *decomp_param;
+static int decomp_thread_count;
+static int decomp_next;
+static bool decomp_error;
+
+static void *do_data_decompress(void *opaque)
+{
+	DecompressParam *param = opaque;
+	int ret;
+
+	qemu_mutex_lock(&param->mutex);
+	while (!param->quit) {
+		if (!param->start) {
+			qemu_cond_wait(&param->cond, &param->mutex);
+			continue;
+		}
+		qemu_mutex_unlock(&param->mutex);
+
+		inflateReset(&param->stream);
+		param->stream.next_in = param->compbuf;
+		param->stream.avail_in = param->len;
+		param->stream.next_out = param->des;
+		param->stream.avail_out = TARGET_PAGE_SIZE;
+		ret = inflate(&param->stream, Z_FINISH);
+
+		qemu_mutex_lock(&param->mutex);
+		if (ret != Z_STREAM_END || param->stream.avail_out != 0)
+			decomp_error = true;
+		param->start = false;
+		qemu_cond_broadcast(&param->cond);
+	}
+	qemu_mutex_unlock(&param->mutex);
+
+	return NULL;
+}
+
+static int decompress_threads_start(void)
+{
+	int i;
+
+	decomp_thread_count = migrate_decompress_threads();
+	decomp_param = g_malloc0(decomp_thread_count * sizeof(*decomp_param));
+	decomp_next = 0;
+	decomp_error = false;
+
+	for (i = 0; i < decomp_thread_count; i++) {
+		DecompressParam *param = &decomp_param[i];
+
+		if (inflateInit(&param->stream) != Z_OK) {
+			fprintf(stderr, "Error initializing page decompression\n");
+			decomp_thread_count = i;
+			return -1;
+		}
+		param->compbuf = g_malloc(compressBound(TARGET_PAGE_SIZE));
+		qemu_mutex_init(&param->mutex);
+		qemu_cond_init(&param->cond);
+		qemu_thread_create(&param->thread, do_data_decompress, param,
+				QEMU_THREAD_JOINABLE);
+	}
+
+	return 0;
+}
+
+static void wait_for_decompress_slot(DecompressParam *param)
+{
+	qemu_mutex_lock(&param->mutex);
+	while (param->start)
+		qemu_cond_wait(&param->cond, &param->mutex);
+	qemu_mutex_unlock(&param->mutex);
+}
+
+static void wait_for_decompress_page(void *host)
+{
+	int i;
+
+	for (i = 0; i < decomp_thread_count; i++) {
+		if (decomp_param[i].des == host)
+			wait_for_decompress_slot(&decomp_param[i]);
+	}
+}
+
+static int wait_for_decompress_done(void)
+{
+	int i;
+
+	for (i = 0; i < decomp_thread_count; i++)
+		wait_for_decompress_slot(&decomp_param[i]);
+
+	return decomp_error ? -1 : 0;
+}
+
+void migrate_decompress_threads_join(void)
+{
+	int i;
+
+	for (i = 0; i < decomp_thread_count; i++) {
+		DecompressParam *param = &decomp_param[i];
+
+		qemu_mutex_lock(&param->mutex);
+		param->quit = true;
+		qemu_cond_broadcast(&param->cond);
+		qemu_mutex_unlock(&param->mutex);
+		qemu_thread_join(&param->thread);
+
+		qemu_mutex_destroy(&param->mutex);
+		qemu_cond_destroy(&param->cond);
+		inflateEnd(&param->stream);
+		g_free(param->compbuf);
+	}
+
+	g_free(decomp_param);
+	decomp_param = NULL;
+	decomp_thread_count = 0;
+}
+
+static int load_compressed_page(QEMUFile *f, void *host)
+{
+	DecompressParam *param;
+	int len;
+
+	if (!decomp_param && decompress_threads_start() < 0)
+		return -1;
+
+	len = qemu_get_be32(f);
+	if (len < 0 || len > compressBound(TARGET_PAGE_SIZE)) {
+		fprintf(stderr, "Failed to load compressed page - len %d!\n", len);
+		return -1;
+	}
+
+	param = &decomp_param[decomp_next];
+	decomp_next = (decomp_next + 1) % decomp_thread_count;
+	wait_for_decompress_slot(param);
+
+	qemu_get_buffer(f, param->compbuf, len);
+	param->des = host;
+	param->len = len;
+
+	qemu_mutex_lock(&param->mutex);
+	param->start = true;
+	qemu_cond_broadcast(&param->cond);
+	qemu_mutex_unlock(&param->mutex);
+
+	return 0;
+}
+
+/* the source asked for post-copy, see ram_postcopy_incoming() */
+static bool postcopy_incoming;
+
 int ram_load_live(QEMUFile *f, void *opaque, int version_id)
 {
 	ram_addr_t addr;
@@ -880,6 +2025,7 @@ int ram_load_live(QEMUFile *f, void *opaque, int version_id)
 			host = host_from_stream_offset(f, addr, flags);
 			if (!host)
 				return -EINVAL;
+			wait_for_decompress_page(host);
 
 			ch = qemu_get_byte(f);
 			memset(host, ch, TARGET_PAGE_SIZE);
@@ -892,8 +2038,42 @@ int ram_load_live(QEMUFile *f, void *opaque, int version_id)
 			void *host;
 
 			host = host_from_stream_offset(f, addr, flags);
+			wait_for_decompress_page(host);
 
 			qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+		} else if (flags & RAM_SAVE_FLAG_XBZRLE) {
+			void *host;
+
+			host = host_from_stream_offset(f, addr, flags);
+			if (!host)
+				return -EINVAL;
+			wait_for_decompress_page(host);
+
+			if (load_xbzrle(f, addr, host) < 0)
+				return -EINVAL;
+		} else if (flags & RAM_SAVE_FLAG_COMPRESS_PAGE) {
+			void *host;
+
+			host = host_from_stream_offset(f, addr, flags);
+			if (!host)
+				return -EINVAL;
+			wait_for_decompress_page(host);
+
+			if (load_compressed_page(f, host) < 0)
+				return -EINVAL;
+		}
+		if (flags & RAM_SAVE_FLAG_EXTENTS) {
+			int ret = ram_load_extents(f);
+
+			if (ret < 0)
+				return ret;
+		}
+		if (flags & RAM_SAVE_FLAG_POSTCOPY)
+			postcopy_incoming = true;
+		if ((flags & RAM_SAVE_FLAG_EOS) && wait_for_decompress_done() < 0) {
+			fprintf(stderr, "Failed to load compressed page - "
+					"decompression error!\n");
+			return -EINVAL;
 		}
 		error = qemu_file_get_error(f);
 		if (error)
@@ -903,6 +2083,126 @@ int ram_load_live(QEMUFile *f, void *opaque, int version_id)
 	return 0;
 }
 
+static void *ram_postcopy_listen_thread(void *opaque)
+{
+	QEMUFile *f = opaque;
+	int fd = qemu_socket_fd(f);
+	uint8_t *buf = g_malloc(TARGET_PAGE_SIZE);
+	ram_addr_t addr;
+	int flags = 0;
+
+	for (;;) {
+		void *host;
+
+		addr = qemu_get_be64(f);
+		flags = addr & ~TARGET_PAGE_MASK;
+		addr &= TARGET_PAGE_MASK;
+
+		if (qemu_file_get_error(f) || (flags & RAM_SAVE_FLAG_EOS))
+			break;
+
+		host = host_from_stream_offset(f, addr, flags);
+		if (!host)
+			break;
+
+		if (flags & RAM_SAVE_FLAG_COMPRESS) {
+			uint8_t ch = qemu_get_byte(f);
+
+			if (ch == 0) {
+				if (postcopy_place_page(host, NULL) < 0)
+					break;
+				continue;
+			}
+			memset(buf, ch, TARGET_PAGE_SIZE);
+		} else if (flags & RAM_SAVE_FLAG_PAGE) {
+			qemu_get_buffer(f, buf, TARGET_PAGE_SIZE);
+		} else {
+			break;
+		}
+
+		if (qemu_file_get_error(f) || postcopy_place_page(host, buf) < 0)
+			break;
+	}
+
+	if (!(flags & RAM_SAVE_FLAG_EOS) || qemu_file_get_error(f)) {
+		/* the guest is running and would wait forever on missing pages */
+		fprintf(stderr, "post-copy migration failed, "
+				"guest memory is incomplete\n");
+		exit(1);
+	}
+
+	postcopy_ram_incoming_cleanup();
+	g_free(buf);
+	qemu_fclose(f);
+	close(fd);
+
+	return NULL;
+}
+
+/*
+ * Called once the devices have been loaded.  If the source switched to
+ * post-copy, read the list of pages it still has to send and start
+ * receiving them in the background.
+ *
+ * Returns 0 if there is no post-copy phase, 1 if it has started and owns
+ * @f, or -1 on error.
+ */
+int ram_postcopy_incoming(QEMUFile *f)
+{
+	QemuThread thread;
+	ram_addr_t addr;
+	int flags;
+
+	if (!postcopy_incoming)
+		return 0;
+	postcopy_incoming = false;
+
+	if (postcopy_ram_incoming_init(qemu_socket_fd(f)) < 0)
+		return -1;
+
+	for (;;) {
+		RAMBlock *block;
+		unsigned long *bitmap;
+		ram_addr_t npages, i;
+		uint64_t bits = 0;
+
+		addr = qemu_get_be64(f);
+		flags = addr & ~TARGET_PAGE_MASK;
+		if (qemu_file_get_error(f) || (flags & RAM_SAVE_FLAG_EOS))
+			break;
+		if (!(flags & RAM_SAVE_FLAG_POSTCOPY))
+			goto fail;
+
+		block = ram_block_from_stream(f, flags);
+		if (!block)
+			goto fail;
+
+		npages = block->length >> TARGET_PAGE_BITS;
+		bitmap = bitmap_new(npages);
+		for (i = 0; i < npages; i++) {
+			if (i % 64 == 0)
+				bits = qemu_get_be64(f);
+			if (bits & (1ULL << (i % 64)))
+				set_bit(i, bitmap);
+		}
+		if (postcopy_ram_discard(block, bitmap) < 0)
+			goto fail;
+	}
+	if (qemu_file_get_error(f))
+		goto fail;
+
+	if (postcopy_ram_incoming_start() < 0)
+		goto fail;
+	qemu_thread_create(&thread, ram_postcopy_listen_thread, f,
+			QEMU_THREAD_DETACHED);
+
+	return 1;
+
+fail:
+	postcopy_ram_incoming_cleanup();
+	return -1;
+}
+
 #ifdef HAS_AUDIO
 struct soundhw {
 	const char *name;
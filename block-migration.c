@@ -270,6 +270,7 @@ static void set_dirty_tracking(int enable)
 
 static void init_blk_migration_it(void *opaque, BlockDriverState *bs)
 {
+    int *ret = opaque;
     BlkMigDevState *bmds;
     int64_t sectors;
 
@@ -279,6 +280,16 @@ static void init_blk_migration_it(void *opaque, BlockDriverState *bs)
             return;
         }
 
+        /* A block job writes to the device behind our back, and may be
+         * using its dirty bitmap itself.
+         */
+        if (bdrv_in_use(bs)) {
+            error_report("Block device %s is in use, cannot migrate it",
+                         bdrv_get_device_name(bs));
+            *ret = -EBUSY;
+            return;
+        }
+
         bmds = g_malloc0(sizeof(BlkMigDevState));
         bmds->bs = bs;
         bmds->bulk_completed = 0;
@@ -302,8 +313,10 @@ static void init_blk_migration_it(void *opaque, BlockDriverState *bs)
     }
 }
 
-static void init_blk_migration(QEMUFile *f)
+static int init_blk_migration(QEMUFile *f)
 {
+    int ret = 0;
+
     block_mig_state.submitted = 0;
     block_mig_state.read_done = 0;
     block_mig_state.transferred = 0;
@@ -313,7 +326,8 @@ static void init_blk_migration(QEMUFile *f)
     block_mig_state.total_time = 0;
     block_mig_state.reads = 0;
 
-    bdrv_iterate(init_blk_migration_it, NULL);
+    bdrv_iterate(init_blk_migration_it, &ret);
+    return ret;
 }
 
 static int blk_mig_save_bulked_block(QEMUFile *f)
@@ -555,7 +569,11 @@ static int block_save_live(QEMUFile *f, int stage, void *opaque)
     }
 
     if (stage == 1) {
-        init_blk_migration(f);
+        ret = init_blk_migration(f);
+        if (ret < 0) {
+            blk_mig_cleanup();
+            return ret;
+        }
 
         /* start track dirty blocks */
         set_dirty_tracking(1);
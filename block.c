@@ -91,6 +91,8 @@ static bool bdrv_exceed_iops_limits(BlockDriverState *bs, bool is_write,
         double elapsed_time, uint64_t *wait);
 static bool bdrv_exceed_io_limits(BlockDriverState *bs, int nb_sectors,
         bool is_write, int64_t *wait);
+static int bdrv_file_open_depth(BlockDriverState **pbs, const char *filename,
+                                int flags, unsigned int queue_depth);
 
 static QTAILQ_HEAD(, BlockDriverState) bdrv_states =
     QTAILQ_HEAD_INITIALIZER(bdrv_states);
@@ -671,7 +673,9 @@ static int bdrv_open_common(BlockDriverState *bs, const char *filename,
     if (drv->bdrv_file_open) {
         ret = drv->bdrv_file_open(bs, filename, open_flags);
     } else {
-        ret = bdrv_file_open(&bs->file, filename, open_flags);
+        /* The protocol does the actual I/O, so it gets the queue depth */
+        ret = bdrv_file_open_depth(&bs->file, filename, open_flags,
+                                   bs->queue_depth);
         if (ret >= 0) {
             ret = drv->bdrv_open(bs, open_flags);
         }
@@ -707,7 +711,8 @@ free_and_fail:
 /*
  * Opens a file using a protocol (file, host_device, nbd, ...)
  */
-int bdrv_file_open(BlockDriverState **pbs, const char *filename, int flags)
+static int bdrv_file_open_depth(BlockDriverState **pbs, const char *filename,
+                                int flags, unsigned int queue_depth)
 {
     BlockDriverState *bs;
     BlockDriver *drv;
@@ -719,6 +724,7 @@ int bdrv_file_open(BlockDriverState **pbs, const char *filename, int flags)
     }
 
     bs = bdrv_new("");
+    bs->queue_depth = queue_depth;
     ret = bdrv_open_common(bs, filename, flags, drv);
     if (ret < 0) {
         bdrv_delete(bs);
@@ -729,6 +735,11 @@ int bdrv_file_open(BlockDriverState **pbs, const char *filename, int flags)
     return 0;
 }
 
+int bdrv_file_open(BlockDriverState **pbs, const char *filename, int flags)
+{
+    return bdrv_file_open_depth(pbs, filename, flags, 0);
+}
+
 /*
  * Opens a disk image (raw, qcow2, vmdk, ...)
  */
@@ -972,98 +983,136 @@ static void bdrv_rebind(BlockDriverState *bs)
     }
 }
 
+static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
+                                     BlockDriverState *bs_src)
+{
+    /* move some fields that need to stay attached to the device */
+    bs_dest->open_flags         = bs_src->open_flags;
+
+    /* dev info */
+    bs_dest->dev_ops            = bs_src->dev_ops;
+    bs_dest->dev_opaque         = bs_src->dev_opaque;
+    bs_dest->dev                = bs_src->dev;
+    bs_dest->buffer_alignment   = bs_src->buffer_alignment;
+    bs_dest->copy_on_read       = bs_src->copy_on_read;
+    bs_dest->enable_write_cache = bs_src->enable_write_cache;
+
+    /* i/o timing parameters */
+    bs_dest->slice_time         = bs_src->slice_time;
+    bs_dest->slice_start        = bs_src->slice_start;
+    bs_dest->slice_end          = bs_src->slice_end;
+    bs_dest->io_limits          = bs_src->io_limits;
+    bs_dest->io_base            = bs_src->io_base;
+    bs_dest->throttled_reqs     = bs_src->throttled_reqs;
+    bs_dest->block_timer        = bs_src->block_timer;
+    bs_dest->io_limits_enabled  = bs_src->io_limits_enabled;
+
+    /* i/o stats */
+    memcpy(bs_dest->nr_bytes, bs_src->nr_bytes, sizeof(bs_dest->nr_bytes));
+    memcpy(bs_dest->nr_ops, bs_src->nr_ops, sizeof(bs_dest->nr_ops));
+    memcpy(bs_dest->total_time_ns, bs_src->total_time_ns,
+           sizeof(bs_dest->total_time_ns));
+    bs_dest->wr_highest_sector  = bs_src->wr_highest_sector;
+
+    /* geometry */
+    bs_dest->cyls               = bs_src->cyls;
+    bs_dest->heads              = bs_src->heads;
+    bs_dest->secs               = bs_src->secs;
+    bs_dest->translation        = bs_src->translation;
+
+    /* r/w error */
+    bs_dest->on_read_error      = bs_src->on_read_error;
+    bs_dest->on_write_error     = bs_src->on_write_error;
+
+    /* i/o status */
+    bs_dest->iostatus_enabled   = bs_src->iostatus_enabled;
+    bs_dest->iostatus           = bs_src->iostatus;
+
+    /* dirty bitmap */
+    bs_dest->dirty_count        = bs_src->dirty_count;
+    bs_dest->dirty_bitmap       = bs_src->dirty_bitmap;
+
+    /* job */
+    bs_dest->in_use             = bs_src->in_use;
+    bs_dest->job                = bs_src->job;
+
+    /* keep the same entry in bdrv_states */
+    pstrcpy(bs_dest->device_name, sizeof(bs_dest->device_name),
+            bs_src->device_name);
+    bs_dest->list = bs_src->list;
+}
+
 /*
- * Add new bs contents at the top of an image chain while the chain is
- * live, while keeping required fields on the top layer.
+ * Swap bs contents for two image chains while they are live,
+ * while keeping required fields on the BlockDriverState that is
+ * actually attached to a device.
  *
  * This will modify the BlockDriverState fields, and swap contents
- * between bs_new and bs_top. Both bs_new and bs_top are modified.
+ * between bs_new and bs_old. Both bs_new and bs_old are modified.
  *
  * bs_new is required to be anonymous.
  *
  * This function does not create any image files.
  */
-void bdrv_append(BlockDriverState *bs_new, BlockDriverState *bs_top)
+void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old)
 {
     BlockDriverState tmp;
 
-    /* bs_new must be anonymous */
+    /* bs_new must be anonymous and shouldn't have anything fancy enabled */
     assert(bs_new->device_name[0] == '\0');
+    assert(bs_new->dirty_bitmap == NULL);
+    assert(bs_new->job == NULL);
+    assert(bs_new->dev == NULL);
+    assert(bs_new->in_use == 0);
+    assert(bs_new->io_limits_enabled == false);
+    assert(bs_new->block_timer == NULL);
 
     tmp = *bs_new;
+    *bs_new = *bs_old;
+    *bs_old = tmp;
 
-    /* there are some fields that need to stay on the top layer: */
-    tmp.open_flags        = bs_top->open_flags;
-
-    /* dev info */
-    tmp.dev_ops           = bs_top->dev_ops;
-    tmp.dev_opaque        = bs_top->dev_opaque;
-    tmp.dev               = bs_top->dev;
-    tmp.buffer_alignment  = bs_top->buffer_alignment;
-    tmp.copy_on_read      = bs_top->copy_on_read;
-
-    /* i/o timing parameters */
-    tmp.slice_time        = bs_top->slice_time;
-    tmp.slice_start       = bs_top->slice_start;
-    tmp.slice_end         = bs_top->slice_end;
-    tmp.io_limits         = bs_top->io_limits;
-    tmp.io_base           = bs_top->io_base;
-    tmp.throttled_reqs    = bs_top->throttled_reqs;
-    tmp.block_timer       = bs_top->block_timer;
-    tmp.io_limits_enabled = bs_top->io_limits_enabled;
-
-    /* geometry */
-    tmp.cyls              = bs_top->cyls;
-    tmp.heads             = bs_top->heads;
-    tmp.secs              = bs_top->secs;
-    tmp.translation       = bs_top->translation;
+    /* there are some fields that should not be swapped, move them back */
+    bdrv_move_feature_fields(&tmp, bs_old);
+    bdrv_move_feature_fields(bs_old, bs_new);
+    bdrv_move_feature_fields(bs_new, &tmp);
 
-    /* r/w error */
-    tmp.on_read_error     = bs_top->on_read_error;
-    tmp.on_write_error    = bs_top->on_write_error;
-
-    /* i/o status */
-    tmp.iostatus_enabled  = bs_top->iostatus_enabled;
-    tmp.iostatus          = bs_top->iostatus;
-
-    /* keep the same entry in bdrv_states */
-    pstrcpy(tmp.device_name, sizeof(tmp.device_name), bs_top->device_name);
-    tmp.list = bs_top->list;
-
-    /* The contents of 'tmp' will become bs_top, as we are
-     * swapping bs_new and bs_top contents. */
-    tmp.backing_hd = bs_new;
-    pstrcpy(tmp.backing_file, sizeof(tmp.backing_file), bs_top->filename);
-    bdrv_get_format(bs_top, tmp.backing_format, sizeof(tmp.backing_format));
-
-    /* swap contents of the fixed new bs and the current top */
-    *bs_new = *bs_top;
-    *bs_top = tmp;
-
-    /* device_name[] was carried over from the old bs_top.  bs_new
-     * shouldn't be in bdrv_states, so we need to make device_name[]
-     * reflect the anonymity of bs_new
-     */
-    bs_new->device_name[0] = '\0';
+    /* bs_new shouldn't be in bdrv_states even after the swap!  */
+    assert(bs_new->device_name[0] == '\0');
 
-    /* clear the copied fields in the new backing file */
-    bdrv_detach_dev(bs_new, bs_new->dev);
+    /* Check a few fields that should remain attached to the device */
+    assert(bs_new->dev == NULL);
+    assert(bs_new->job == NULL);
+    assert(bs_new->in_use == 0);
+    assert(bs_new->io_limits_enabled == false);
+    assert(bs_new->block_timer == NULL);
 
-    qemu_co_queue_init(&bs_new->throttled_reqs);
-    memset(&bs_new->io_base,   0, sizeof(bs_new->io_base));
-    memset(&bs_new->io_limits, 0, sizeof(bs_new->io_limits));
-    bdrv_iostatus_disable(bs_new);
+    bdrv_rebind(bs_new);
+    bdrv_rebind(bs_old);
+}
 
-    /* we don't use bdrv_io_limits_disable() for this, because we don't want
-     * to affect or delete the block_timer, as it has been moved to bs_top */
-    bs_new->io_limits_enabled = false;
-    bs_new->block_timer       = NULL;
-    bs_new->slice_time        = 0;
-    bs_new->slice_start       = 0;
-    bs_new->slice_end         = 0;
+/*
+ * Add new bs contents at the top of an image chain while the chain is
+ * live, while keeping required fields on the top layer.
+ *
+ * This will modify the BlockDriverState fields, and swap contents
+ * between bs_new and bs_top. Both bs_new and bs_top are modified.
+ *
+ * bs_new is required to be anonymous.
+ *
+ * This function does not create any image files.
+ */
+void bdrv_append(BlockDriverState *bs_new, BlockDriverState *bs_top)
+{
+    bdrv_swap(bs_new, bs_top);
 
-    bdrv_rebind(bs_new);
-    bdrv_rebind(bs_top);
+    /* bs_top now has the contents of the new image, chain the old top
+     * layer (now in bs_new) behind it */
+    bs_top->backing_hd = bs_new;
+    bs_top->open_flags &= ~BDRV_O_NO_BACKING;
+    pstrcpy(bs_top->backing_file, sizeof(bs_top->backing_file),
+            bs_new->filename);
+    pstrcpy(bs_top->backing_format, sizeof(bs_top->backing_format),
+            bs_new->drv ? bs_new->drv->format_name : "");
 }
 
 void bdrv_delete(BlockDriverState *bs)
@@ -1784,6 +1833,7 @@ static int coroutine_fn bdrv_co_do_copy_on_readv(BlockDriverState *bs,
     int64_t cluster_sector_num;
     int cluster_nb_sectors;
     size_t skip_bytes;
+    bool skip_write = false;
     int ret;
 
     /* Cover entire cluster so no additional backing file I/O is required when
@@ -1795,6 +1845,35 @@ static int coroutine_fn bdrv_co_do_copy_on_readv(BlockDriverState *bs,
     trace_bdrv_co_do_copy_on_readv(bs, sector_num, nb_sectors,
                                    cluster_sector_num, cluster_nb_sectors);
 
+    /* Clusters that no backing file has allocated read as zeroes and need
+     * not be copied.  For remote backing files like NBD this avoids
+     * transferring the holes of sparse images.  Parts of the cluster may
+     * still be allocated in the image itself, in which case it is read
+     * normally.
+     */
+    if (bs->backing_hd) {
+        int n;
+
+        ret = bdrv_co_is_allocated_above(bs->backing_hd, NULL,
+                                         cluster_sector_num,
+                                         cluster_nb_sectors, &n);
+        if (ret < 0) {
+            return ret;
+        }
+        if (ret == 0 && n >= cluster_nb_sectors) {
+            ret = bdrv_co_is_allocated(bs, cluster_sector_num,
+                                       cluster_nb_sectors, &n);
+            if (ret < 0) {
+                return ret;
+            }
+            if (ret == 0 && n >= cluster_nb_sectors) {
+                qemu_iovec_memset(qiov, 0, nb_sectors * BDRV_SECTOR_SIZE);
+                return 0;
+            }
+            skip_write = true;
+        }
+    }
+
     iov.iov_len = cluster_nb_sectors * BDRV_SECTOR_SIZE;
     iov.iov_base = bounce_buffer = qemu_blockalign(bs, iov.iov_len);
     qemu_iovec_init_external(&bounce_qiov, &iov, 1);
@@ -1805,8 +1884,10 @@ static int coroutine_fn bdrv_co_do_copy_on_readv(BlockDriverState *bs,
         goto err;
     }
 
-    if (drv->bdrv_co_write_zeroes &&
-        buffer_is_zero(bounce_buffer, iov.iov_len)) {
+    if (skip_write) {
+        ret = 0;
+    } else if (drv->bdrv_co_write_zeroes &&
+               buffer_is_zero(bounce_buffer, iov.iov_len)) {
         ret = bdrv_co_do_write_zeroes(bs, cluster_sector_num,
                                       cluster_nb_sectors);
     } else {
@@ -2234,6 +2315,22 @@ void bdrv_set_io_limits(BlockDriverState *bs,
     bs->io_limits_enabled = bdrv_io_limits_enabled(bs);
 }
 
+/* takes effect the next time an image is opened on @bs */
+void bdrv_set_metadata_cache(BlockDriverState *bs, uint64_t l2_cache_size,
+                             unsigned int l2_cache_coverage,
+                             uint64_t refcount_cache_size)
+{
+    bs->l2_cache_size = l2_cache_size;
+    bs->l2_cache_coverage = l2_cache_coverage;
+    bs->refcount_cache_size = refcount_cache_size;
+}
+
+/* takes effect the next time an image is opened on @bs */
+void bdrv_set_queue_depth(BlockDriverState *bs, unsigned int queue_depth)
+{
+    bs->queue_depth = queue_depth;
+}
+
 /* Recognize floppy formats */
 typedef struct FDFormat {
     FDriveType drive;
@@ -2535,6 +2632,35 @@ int coroutine_fn bdrv_co_is_allocated(BlockDriverState *bs, int64_t sector_num,
     return bs->drv->bdrv_co_is_allocated(bs, sector_num, nb_sectors, pnum);
 }
 
+/*
+ * Returns 1 if the sectors starting at sector_num are allocated in the image
+ * as zeroes, so that reading them needs neither the image data nor the
+ * backing file, and 0 if they are not (or -errno).  *pnum is set to the
+ * number of sectors from sector_num on that are in the same state.
+ */
+int coroutine_fn bdrv_co_is_zero(BlockDriverState *bs, int64_t sector_num,
+                                 int nb_sectors, int *pnum)
+{
+    int64_t n;
+
+    if (sector_num >= bs->total_sectors) {
+        *pnum = 0;
+        return 0;
+    }
+
+    n = bs->total_sectors - sector_num;
+    if (n < nb_sectors) {
+        nb_sectors = n;
+    }
+
+    if (!bs->drv->bdrv_co_is_zero) {
+        *pnum = nb_sectors;
+        return 0;
+    }
+
+    return bs->drv->bdrv_co_is_zero(bs, sector_num, nb_sectors, pnum);
+}
+
 /* Coroutine wrapper for bdrv_is_allocated() */
 static void coroutine_fn bdrv_is_allocated_co_entry(void *opaque)
 {
@@ -2571,6 +2697,57 @@ int bdrv_is_allocated(BlockDriverState *bs, int64_t sector_num, int nb_sectors,
     return data.ret;
 }
 
+/*
+ * Given an image chain: ... -> [BASE] -> [INTER1] -> [INTER2] -> [TOP]
+ *
+ * Return 1 if the given sector is allocated in any image between
+ * BASE (exclusive) and TOP (inclusive).  BASE can be NULL to check if
+ * the given sector is allocated in any image of the chain.  Return 0
+ * otherwise, or a negative errno value on failure.
+ *
+ * 'pnum' is set to the number of sectors (including and immediately
+ * following the specified sector) that are known to be in the same
+ * allocated/unallocated state.
+ */
+int coroutine_fn bdrv_co_is_allocated_above(BlockDriverState *top,
+                                            BlockDriverState *base,
+                                            int64_t sector_num,
+                                            int nb_sectors, int *pnum)
+{
+    BlockDriverState *intermediate;
+    int ret, n = nb_sectors;
+
+    intermediate = top;
+    while (intermediate && intermediate != base) {
+        int pnum_inter;
+        ret = bdrv_co_is_allocated(intermediate, sector_num, nb_sectors,
+                                   &pnum_inter);
+        if (ret < 0) {
+            return ret;
+        } else if (ret) {
+            *pnum = pnum_inter;
+            return 1;
+        }
+
+        /*
+         * [sector_num, nb_sectors] is unallocated on top but intermediate
+         * might have [sector_num+x, nr_sectors] allocated.  A backing
+         * file that is shorter than top reports nothing beyond its end,
+         * which must not shrink the result to zero.
+         */
+        if (n > pnum_inter &&
+            (intermediate == top ||
+             sector_num + pnum_inter < intermediate->total_sectors)) {
+            n = pnum_inter;
+        }
+
+        intermediate = intermediate->backing_hd;
+    }
+
+    *pnum = n;
+    return 0;
+}
+
 BlockInfoList *qmp_query_block(Error **errp)
 {
     BlockInfoList *head = NULL, *cur_item = NULL;
@@ -2636,7 +2813,7 @@ BlockInfoList *qmp_query_block(Error **errp)
 }
 
 /* Consider exposing this as a full fledged QMP command */
-static BlockStats *qmp_query_blockstat(const BlockDriverState *bs, Error **errp)
+static BlockStats *qmp_query_blockstat(BlockDriverState *bs, Error **errp)
 {
     BlockStats *s;
 
@@ -2658,6 +2835,11 @@ static BlockStats *qmp_query_blockstat(const BlockDriverState *bs, Error **errp)
     s->stats->rd_total_time_ns = bs->total_time_ns[BDRV_ACCT_READ];
     s->stats->flush_total_time_ns = bs->total_time_ns[BDRV_ACCT_FLUSH];
 
+    if (bs->drv && bs->drv->bdrv_get_cache_stats) {
+        s->stats->has_metadata_caches = true;
+        s->stats->metadata_caches = bs->drv->bdrv_get_cache_stats(bs);
+    }
+
     if (bs->file) {
         s->has_parent = true;
         s->parent = qmp_query_blockstat(bs->file, NULL);
@@ -2703,13 +2885,17 @@ void bdrv_get_backing_filename(BlockDriverState *bs,
     pstrcpy(filename, filename_size, bs->backing_file);
 }
 
-int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
-                          const uint8_t *buf, int nb_sectors)
+/*
+ * Drivers that implement bdrv_co_write_compressed compress in the thread
+ * pool, so several of these requests can be in flight at a time.
+ */
+int coroutine_fn bdrv_co_write_compressed(BlockDriverState *bs,
+    int64_t sector_num, const uint8_t *buf, int nb_sectors)
 {
     BlockDriver *drv = bs->drv;
     if (!drv)
         return -ENOMEDIUM;
-    if (!drv->bdrv_write_compressed)
+    if (!drv->bdrv_write_compressed && !drv->bdrv_co_write_compressed)
         return -ENOTSUP;
     if (bdrv_check_request(bs, sector_num, nb_sectors))
         return -EIO;
@@ -2718,9 +2904,53 @@ int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
         set_dirty_bitmap(bs, sector_num, nb_sectors, 1);
     }
 
+    if (drv->bdrv_co_write_compressed) {
+        return drv->bdrv_co_write_compressed(bs, sector_num, buf, nb_sectors);
+    }
     return drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
 }
 
+typedef struct WriteCompressedCo {
+    BlockDriverState *bs;
+    int64_t sector_num;
+    const uint8_t *buf;
+    int nb_sectors;
+    int ret;
+} WriteCompressedCo;
+
+static void coroutine_fn bdrv_write_compressed_co_entry(void *opaque)
+{
+    WriteCompressedCo *wco = opaque;
+
+    wco->ret = bdrv_co_write_compressed(wco->bs, wco->sector_num, wco->buf,
+                                        wco->nb_sectors);
+}
+
+int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
+                          const uint8_t *buf, int nb_sectors)
+{
+    Coroutine *co;
+    WriteCompressedCo wco = {
+        .bs = bs,
+        .sector_num = sector_num,
+        .buf = buf,
+        .nb_sectors = nb_sectors,
+        .ret = NOT_DONE,
+    };
+
+    if (qemu_in_coroutine()) {
+        /* Fast-path if already in coroutine context */
+        bdrv_write_compressed_co_entry(&wco);
+    } else {
+        co = qemu_coroutine_create(bdrv_write_compressed_co_entry);
+        qemu_coroutine_enter(co, &wco);
+        while (wco.ret == NOT_DONE) {
+            qemu_aio_wait();
+        }
+    }
+    return wco.ret;
+}
+
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 {
     BlockDriver *drv = bs->drv;
@@ -2758,6 +2988,61 @@ int bdrv_load_vmstate(BlockDriverState *bs, uint8_t *buf,
     return -ENOTSUP;
 }
 
+typedef struct PreallocVMStateCo {
+    BlockDriverState *bs;
+    int64_t pos;
+    int64_t size;
+    int ret;
+} PreallocVMStateCo;
+
+static void coroutine_fn bdrv_preallocate_vmstate_co_entry(void *opaque)
+{
+    PreallocVMStateCo *pco = opaque;
+    BlockDriverState *bs = pco->bs;
+
+    while (bs->drv && !bs->drv->bdrv_co_preallocate_vmstate &&
+           !bs->drv->bdrv_save_vmstate && bs->file) {
+        bs = bs->file;
+    }
+
+    if (!bs->drv) {
+        pco->ret = -ENOMEDIUM;
+    } else if (bs->drv->bdrv_co_preallocate_vmstate) {
+        pco->ret = bs->drv->bdrv_co_preallocate_vmstate(bs, pco->pos,
+                                                        pco->size);
+    } else {
+        pco->ret = -ENOTSUP;
+    }
+}
+
+/*
+ * Allocates the space for @size bytes of VM state at @pos, so that writing
+ * them does not have to allocate metadata on the way.  Returns -ENOTSUP if
+ * the format has nothing to allocate up front.
+ */
+int bdrv_preallocate_vmstate(BlockDriverState *bs, int64_t pos, int64_t size)
+{
+    Coroutine *co;
+    PreallocVMStateCo pco = {
+        .bs = bs,
+        .pos = pos,
+        .size = size,
+        .ret = NOT_DONE,
+    };
+
+    if (qemu_in_coroutine()) {
+        bdrv_preallocate_vmstate_co_entry(&pco);
+    } else {
+        co = qemu_coroutine_create(bdrv_preallocate_vmstate_co_entry);
+        qemu_coroutine_enter(co, &pco);
+        while (pco.ret == NOT_DONE) {
+            qemu_aio_wait();
+        }
+    }
+
+    return pco.ret;
+}
+
 void bdrv_debug_event(BlockDriverState *bs, BlkDebugEvent event)
 {
     BlockDriver *drv = bs->drv;
@@ -3066,12 +3351,16 @@ static int multiwrite_req_compare(const void *a, const void *b)
     }
 }
 
+/* Reads are only merged up to this size so that one large request does not
+ * hold up the completion of all the small ones merged into it */
+#define MULTIREAD_MAX_SECTORS 2048
+
 /*
  * Takes a bunch of requests and tries to merge them. Returns the number of
  * requests that remain after merging.
  */
 static int multiwrite_merge(BlockDriverState *bs, BlockRequest *reqs,
-    int num_reqs, MultiwriteCB *mcb)
+    int num_reqs, MultiwriteCB *mcb, bool is_write)
 {
     int i, outidx;
 
@@ -3085,9 +3374,19 @@ static int multiwrite_merge(BlockDriverState *bs, BlockRequest *reqs,
         int merge = 0;
         int64_t oldreq_last = reqs[outidx].sector + reqs[outidx].nb_sectors;
 
-        // Handle exactly sequential writes and overlapping writes.
-        if (reqs[i].sector <= oldreq_last) {
-            merge = 1;
+        if (is_write) {
+            // Handle exactly sequential writes and overlapping writes.
+            if (reqs[i].sector <= oldreq_last) {
+                merge = 1;
+            }
+        } else {
+            // Overlapping reads would leave the end of the first request
+            // unfilled, so only exactly sequential reads are merged.
+            if (reqs[i].sector == oldreq_last &&
+                reqs[outidx].nb_sectors + reqs[i].nb_sectors <=
+                MULTIREAD_MAX_SECTORS) {
+                merge = 1;
+            }
         }
 
         if (reqs[outidx].qiov->niov + reqs[i].qiov->niov + 1 > IOV_MAX) {
@@ -3126,26 +3425,13 @@ static int multiwrite_merge(BlockDriverState *bs, BlockRequest *reqs,
     return outidx + 1;
 }
 
-/*
- * Submit multiple AIO write requests at once.
- *
- * On success, the function returns 0 and all requests in the reqs array have
- * been submitted. In error case this function returns -1, and any of the
- * requests may or may not be submitted yet. In particular, this means that the
- * callback will be called for some of the requests, for others it won't. The
- * caller must check the error field of the BlockRequest to wait for the right
- * callbacks (if error != 0, no callback will be called).
- *
- * The implementation may modify the contents of the reqs array, e.g. to merge
- * requests. However, the fields opaque and error are left unmodified as they
- * are used to signal failure for a single request to the caller.
- */
-int bdrv_aio_multiwrite(BlockDriverState *bs, BlockRequest *reqs, int num_reqs)
+static int bdrv_aio_multi_rw(BlockDriverState *bs, BlockRequest *reqs,
+                             int num_reqs, bool is_write)
 {
     MultiwriteCB *mcb;
     int i;
 
-    /* don't submit writes if we don't have a medium */
+    /* don't submit requests if we don't have a medium */
     if (bs->drv == NULL) {
         for (i = 0; i < num_reqs; i++) {
             reqs[i].error = -ENOMEDIUM;
@@ -3168,20 +3454,88 @@ int bdrv_aio_multiwrite(BlockDriverState *bs, BlockRequest *reqs, int num_reqs)
     }
 
     // Check for mergable requests
-    num_reqs = multiwrite_merge(bs, reqs, num_reqs, mcb);
+    num_reqs = multiwrite_merge(bs, reqs, num_reqs, mcb, is_write);
 
-    trace_bdrv_aio_multiwrite(mcb, mcb->num_callbacks, num_reqs);
+    if (is_write) {
+        trace_bdrv_aio_multiwrite(mcb, mcb->num_callbacks, num_reqs);
+    } else {
+        trace_bdrv_aio_multiread(mcb, mcb->num_callbacks, num_reqs);
+    }
 
     /* Run the aio requests. */
     mcb->num_requests = num_reqs;
     for (i = 0; i < num_reqs; i++) {
-        bdrv_aio_writev(bs, reqs[i].sector, reqs[i].qiov,
-            reqs[i].nb_sectors, multiwrite_cb, mcb);
+        if (is_write) {
+            bdrv_aio_writev(bs, reqs[i].sector, reqs[i].qiov,
+                reqs[i].nb_sectors, multiwrite_cb, mcb);
+        } else {
+            bdrv_aio_readv(bs, reqs[i].sector, reqs[i].qiov,
+                reqs[i].nb_sectors, multiwrite_cb, mcb);
+        }
     }
 
     return 0;
 }
 
+/*
+ * Submit multiple AIO write requests at once.
+ *
+ * On success, the function returns 0 and all requests in the reqs array have
+ * been submitted. In error case this function returns -1, and any of the
+ * requests may or may not be submitted yet. In particular, this means that the
+ * callback will be called for some of the requests, for others it won't. The
+ * caller must check the error field of the BlockRequest to wait for the right
+ * callbacks (if error != 0, no callback will be called).
+ *
+ * The implementation may modify the contents of the reqs array, e.g. to merge
+ * requests. However, the fields opaque and error are left unmodified as they
+ * are used to signal failure for a single request to the caller.
+ */
+int bdrv_aio_multiwrite(BlockDriverState *bs, BlockRequest *reqs, int num_reqs)
+{
+    return bdrv_aio_multi_rw(bs, reqs, num_reqs, true);
+}
+
+/*
+ * Submit multiple AIO read requests at once.
+ *
+ * Works like bdrv_aio_multiwrite(), except that only requests for exactly
+ * sequential sectors are merged and a merged request is no larger than
+ * MULTIREAD_MAX_SECTORS.  Each caller's callback is invoked once the merged
+ * request containing it has completed.
+ */
+int bdrv_aio_multiread(BlockDriverState *bs, BlockRequest *reqs, int num_reqs)
+{
+    return bdrv_aio_multi_rw(bs, reqs, num_reqs, false);
+}
+
+/*
+ * Requests submitted until the matching bdrv_io_unplug() may be held back
+ * so that the host sees them as one batch.  Device models plug around the
+ * requests they get from one guest notification.
+ */
+void bdrv_io_plug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_io_plug) {
+        drv->bdrv_io_plug(bs);
+    } else if (bs->file) {
+        bdrv_io_plug(bs->file);
+    }
+}
+
+void bdrv_io_unplug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_io_unplug) {
+        drv->bdrv_io_unplug(bs);
+    } else if (bs->file) {
+        bdrv_io_unplug(bs->file);
+    }
+}
+
 void bdrv_aio_cancel(BlockDriverAIOCB *acb)
 {
     acb->pool->cancel(acb);
@@ -3955,6 +4309,12 @@ int bdrv_get_dirty(BlockDriverState *bs, int64_t sector)
     }
 }
 
+void bdrv_set_dirty(BlockDriverState *bs, int64_t cur_sector,
+                    int nr_sectors)
+{
+    set_dirty_bitmap(bs, cur_sector, nr_sectors, 1);
+}
+
 void bdrv_reset_dirty(BlockDriverState *bs, int64_t cur_sector,
                       int nr_sectors)
 {
@@ -4223,7 +4583,7 @@ void *block_job_create(const BlockJobType *job_type, BlockDriverState *bs,
     return job;
 }
 
-void block_job_complete(BlockJob *job, int ret)
+void block_job_completed(BlockJob *job, int ret)
 {
     BlockDriverState *bs = job->bs;
 
@@ -4259,6 +4619,38 @@ void block_job_cancel(BlockJob *job)
     }
 }
 
+void block_job_complete(BlockJob *job, Error **errp)
+{
+    if (!job->job_type->complete) {
+        error_set(errp, QERR_BLOCK_JOB_NOT_READY, job->bs->device_name);
+        return;
+    }
+
+    job->job_type->complete(job, errp);
+}
+
+QObject *block_job_qobject(BlockJob *job)
+{
+    return qobject_from_jsonf("{ 'type': %s,"
+                              "'device': %s,"
+                              "'len': %" PRId64 ","
+                              "'offset': %" PRId64 ","
+                              "'speed': %" PRId64 " }",
+                              job->job_type->job_type,
+                              bdrv_get_device_name(job->bs),
+                              job->len,
+                              job->offset,
+                              job->speed);
+}
+
+void block_job_ready(BlockJob *job)
+{
+    QObject *data = block_job_qobject(job);
+
+    monitor_protocol_event(QEVENT_BLOCK_JOB_READY, data);
+    qobject_decref(data);
+}
+
 bool block_job_is_cancelled(BlockJob *job)
 {
     return job->cancelled;
@@ -0,0 +1,721 @@
+/*
+ * Block protocol for caching a slow image in a local file
+ *
+ * Copyright Carnegie Mellon University 2012
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "block_int.h"
+#include "module.h"
+#include "qemu-coroutine.h"
+
+/*
+ * The cache file starts with a header and a bitmap with one bit per chunk of
+ * the origin image, set if the chunk is held in the cache.  The data of chunk
+ * N lives at data_offset + N * chunk_size, so the cache file is as sparse as
+ * the set of chunks that have been read.
+ *
+ * A chunk becomes valid once it was read from the origin and written to the
+ * cache file.  Its bit only reaches the disk when the cache file is flushed,
+ * after the data, so a crash can lose recently cached chunks but never makes
+ * the cache claim data it does not have.  Writes go to the origin and update
+ * the chunks that are already cached; while such updates are not flushed the
+ * header is marked dirty and the whole cache is discarded on the next open.
+ */
+
+#define BLKCACHE_MAGIC          (('Q' << 24) | ('B' << 16) | ('C' << 8) | 0xfb)
+#define BLKCACHE_VERSION        1
+#define BLKCACHE_F_DIRTY        1
+
+#define BLKCACHE_HEADER_SIZE    4096
+#define BLKCACHE_CHUNK_SIZE     65536
+
+/* Largest number of chunks read from the origin at once */
+#define BLKCACHE_MAX_FILL       16
+
+/* Reads that continue the previous one before read-ahead kicks in */
+#define BLKCACHE_SEQ_THRESHOLD  2
+
+/* Number of chunks read ahead of a sequential reader */
+#define BLKCACHE_PREFETCH       16
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t chunk_size;
+    uint32_t flags;
+    uint64_t origin_size;
+    uint64_t bitmap_offset;
+    uint64_t data_offset;
+    uint32_t origin_name_offset;
+    uint32_t origin_name_size;
+} BlkcacheHeader;
+
+typedef struct {
+    BlockDriverState *origin;
+    char *origin_name;
+    CoRwlock lock;
+
+    int chunk_sectors;
+    int64_t nb_chunks;
+    int64_t origin_sectors;
+    uint64_t bitmap_offset;
+    uint64_t data_offset;
+
+    uint8_t *bitmap;
+    size_t bitmap_size;
+    size_t bitmap_dirty_start;  /* bytes of the bitmap that need writing */
+    size_t bitmap_dirty_end;
+    bool header_dirty;          /* BLKCACHE_F_DIRTY is set on disk */
+
+    /* Sequential read detection */
+    int64_t last_read_end;
+    int seq_reads;
+    int64_t prefetch_next;      /* first chunk not yet read ahead */
+    int prefetching;            /* read-ahead coroutines in flight */
+
+    /* Statistics */
+    int64_t chunks_cached;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t prefetched;
+} BDRVBlkcacheState;
+
+typedef struct {
+    BlockDriverState *bs;
+    int64_t chunk;
+    int64_t nb_chunks;
+} BlkcachePrefetch;
+
+static bool blkcache_chunk_valid(BDRVBlkcacheState *s, int64_t chunk)
+{
+    return s->bitmap[chunk / 8] & (1 << (chunk % 8));
+}
+
+static void blkcache_set_chunk(BDRVBlkcacheState *s, int64_t chunk,
+                               bool valid)
+{
+    size_t byte = chunk / 8;
+    uint8_t mask = 1 << (chunk % 8);
+
+    if (!!(s->bitmap[byte] & mask) == valid) {
+        return;
+    }
+
+    if (valid) {
+        s->bitmap[byte] |= mask;
+        s->chunks_cached++;
+    } else {
+        s->bitmap[byte] &= ~mask;
+        s->chunks_cached--;
+    }
+
+    if (s->bitmap_dirty_start >= s->bitmap_dirty_end) {
+        s->bitmap_dirty_start = byte;
+        s->bitmap_dirty_end = byte + 1;
+    } else {
+        s->bitmap_dirty_start = MIN(s->bitmap_dirty_start, byte);
+        s->bitmap_dirty_end = MAX(s->bitmap_dirty_end, byte + 1);
+    }
+}
+
+static int blkcache_write_header(BlockDriverState *bs, const char *origin,
+                                 uint32_t flags)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    uint8_t *buf;
+    BlkcacheHeader *header;
+    size_t name_size = strlen(origin);
+    int ret;
+
+    if (name_size > BLKCACHE_HEADER_SIZE - sizeof(*header)) {
+        name_size = BLKCACHE_HEADER_SIZE - sizeof(*header);
+    }
+
+    buf = g_malloc0(BLKCACHE_HEADER_SIZE);
+    header = (BlkcacheHeader *)buf;
+    header->magic = cpu_to_be32(BLKCACHE_MAGIC);
+    header->version = cpu_to_be32(BLKCACHE_VERSION);
+    header->chunk_size = cpu_to_be32(BLKCACHE_CHUNK_SIZE);
+    header->flags = cpu_to_be32(flags);
+    header->origin_size = cpu_to_be64(s->origin_sectors * BDRV_SECTOR_SIZE);
+    header->bitmap_offset = cpu_to_be64(s->bitmap_offset);
+    header->data_offset = cpu_to_be64(s->data_offset);
+    header->origin_name_offset = cpu_to_be32(sizeof(*header));
+    header->origin_name_size = cpu_to_be32(name_size);
+    memcpy(buf + sizeof(*header), origin, name_size);
+
+    ret = bdrv_pwrite(bs->file, 0, buf, BLKCACHE_HEADER_SIZE);
+    g_free(buf);
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * Loads the bitmap of an existing cache file.  Returns 0 if the cache can be
+ * used for @origin, -EINVAL if it has to be started from scratch.
+ */
+static int blkcache_load(BlockDriverState *bs, const char *origin)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    uint8_t *buf;
+    BlkcacheHeader header;
+    uint32_t name_offset, name_size;
+    int ret;
+
+    if (bdrv_getlength(bs->file) < BLKCACHE_HEADER_SIZE) {
+        return -EINVAL;
+    }
+
+    buf = g_malloc(BLKCACHE_HEADER_SIZE);
+    ret = bdrv_pread(bs->file, 0, buf, BLKCACHE_HEADER_SIZE);
+    if (ret < 0) {
+        goto out;
+    }
+
+    memcpy(&header, buf, sizeof(header));
+    name_offset = be32_to_cpu(header.origin_name_offset);
+    name_size = be32_to_cpu(header.origin_name_size);
+
+    ret = -EINVAL;
+    if (be32_to_cpu(header.magic) != BLKCACHE_MAGIC ||
+        be32_to_cpu(header.version) != BLKCACHE_VERSION ||
+        be32_to_cpu(header.chunk_size) != BLKCACHE_CHUNK_SIZE ||
+        (be32_to_cpu(header.flags) & BLKCACHE_F_DIRTY) ||
+        be64_to_cpu(header.origin_size) !=
+            s->origin_sectors * BDRV_SECTOR_SIZE ||
+        be64_to_cpu(header.bitmap_offset) != s->bitmap_offset ||
+        be64_to_cpu(header.data_offset) != s->data_offset) {
+        goto out;
+    }
+
+    /* A cache is only valid for the image it was filled from */
+    if (name_offset > BLKCACHE_HEADER_SIZE ||
+        name_size > BLKCACHE_HEADER_SIZE - name_offset ||
+        name_size != MIN(strlen(origin),
+                         BLKCACHE_HEADER_SIZE - sizeof(header)) ||
+        memcmp(buf + name_offset, origin, name_size)) {
+        goto out;
+    }
+
+    ret = bdrv_pread(bs->file, s->bitmap_offset, s->bitmap, s->bitmap_size);
+    if (ret < 0) {
+        goto out;
+    }
+    ret = 0;
+
+out:
+    g_free(buf);
+    return ret;
+}
+
+/* Creates an empty cache for @origin, discarding any previous contents */
+static int blkcache_reset(BlockDriverState *bs, const char *origin)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    int ret;
+
+    memset(s->bitmap, 0, s->bitmap_size);
+
+    /* Invalidate the old header first in case we crash half-way */
+    ret = blkcache_write_header(bs, origin, BLKCACHE_F_DIRTY);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = bdrv_truncate(bs->file, s->bitmap_offset);
+    if (ret < 0 && ret != -ENOTSUP) {
+        return ret;
+    }
+
+    ret = bdrv_pwrite(bs->file, s->bitmap_offset, s->bitmap, s->bitmap_size);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = bdrv_flush(bs->file);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return blkcache_write_header(bs, origin, 0);
+}
+
+/* Writes the bitmap changes and clears the dirty flag of the header */
+static int blkcache_sync(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    int ret;
+
+    if (s->bitmap_dirty_start >= s->bitmap_dirty_end && !s->header_dirty) {
+        return 0;
+    }
+
+    /* Chunk data must be stable before the bitmap points to it */
+    ret = bdrv_flush(bs->file);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (s->bitmap_dirty_start < s->bitmap_dirty_end) {
+        ret = bdrv_pwrite(bs->file,
+                          s->bitmap_offset + s->bitmap_dirty_start,
+                          s->bitmap + s->bitmap_dirty_start,
+                          s->bitmap_dirty_end - s->bitmap_dirty_start);
+        if (ret < 0) {
+            return ret;
+        }
+        s->bitmap_dirty_start = s->bitmap_dirty_end = 0;
+    }
+
+    if (s->header_dirty) {
+        ret = bdrv_flush(bs->file);
+        if (ret < 0) {
+            return ret;
+        }
+        ret = blkcache_write_header(bs, s->origin_name, 0);
+        if (ret < 0) {
+            return ret;
+        }
+        s->header_dirty = false;
+    }
+
+    return bdrv_flush(bs->file);
+}
+
+/* Valid blkcache filenames look like blkcache:path/to/cache:path/to/image */
+static int blkcache_open(BlockDriverState *bs, const char *filename, int flags)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlockDriver *drv;
+    QEMUOptionParameter *options;
+    int64_t origin_size;
+    char *cache, *c;
+    int ret;
+
+    /* Parse the blkcache: prefix */
+    if (strncmp(filename, "blkcache:", strlen("blkcache:"))) {
+        return -EINVAL;
+    }
+    filename += strlen("blkcache:");
+
+    /* Parse the cache filename */
+    c = strchr(filename, ':');
+    if (c == NULL) {
+        return -EINVAL;
+    }
+    cache = g_strndup(filename, c - filename);
+    filename = c + 1;
+
+    /* Open the origin image */
+    s->origin = bdrv_new("");
+    ret = bdrv_open(s->origin, filename, flags, NULL);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    origin_size = bdrv_getlength(s->origin);
+    if (origin_size < 0) {
+        ret = origin_size;
+        goto fail;
+    }
+
+    /* Open the cache file, it is written even if the image is read-only */
+    ret = bdrv_file_open(&bs->file, cache, flags | BDRV_O_RDWR);
+    if (ret == -ENOENT) {
+        drv = bdrv_find_protocol(cache);
+        if (drv == NULL || drv->create_options == NULL) {
+            goto fail;
+        }
+        options = parse_option_parameters("", drv->create_options, NULL);
+        set_option_parameter_int(options, BLOCK_OPT_SIZE, 0);
+        ret = bdrv_create(drv, cache, options);
+        free_option_parameters(options);
+        if (ret < 0) {
+            goto fail;
+        }
+        ret = bdrv_file_open(&bs->file, cache, flags | BDRV_O_RDWR);
+    }
+    if (ret < 0) {
+        goto fail;
+    }
+
+    s->chunk_sectors = BLKCACHE_CHUNK_SIZE / BDRV_SECTOR_SIZE;
+    s->origin_sectors = origin_size / BDRV_SECTOR_SIZE;
+    s->nb_chunks = DIV_ROUND_UP(s->origin_sectors, s->chunk_sectors);
+    s->bitmap_size = DIV_ROUND_UP(s->nb_chunks, 8);
+    s->bitmap_offset = BLKCACHE_HEADER_SIZE;
+    s->data_offset = DIV_ROUND_UP(s->bitmap_offset + s->bitmap_size,
+                                  BLKCACHE_CHUNK_SIZE) * BLKCACHE_CHUNK_SIZE;
+    s->bitmap = g_malloc0(MAX(s->bitmap_size, 1));
+
+    s->origin_name = g_strdup(filename);
+
+    if (blkcache_load(bs, filename) == 0) {
+        int64_t i;
+
+        for (i = 0; i < s->nb_chunks; i++) {
+            if (blkcache_chunk_valid(s, i)) {
+                s->chunks_cached++;
+            }
+        }
+    } else {
+        ret = blkcache_reset(bs, filename);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    qemu_co_rwlock_init(&s->lock);
+    g_free(cache);
+    return 0;
+
+fail:
+    if (bs->file) {
+        bdrv_delete(bs->file);
+        bs->file = NULL;
+    }
+    bdrv_delete(s->origin);
+    s->origin = NULL;
+    g_free(s->bitmap);
+    s->bitmap = NULL;
+    g_free(s->origin_name);
+    s->origin_name = NULL;
+    g_free(cache);
+    return ret;
+}
+
+static void blkcache_close(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+
+    while (s->prefetching) {
+        qemu_aio_wait();
+    }
+
+    /* Cached chunks must not be newer than the origin on disk */
+    if (bdrv_flush(s->origin) == 0) {
+        blkcache_sync(bs);
+    }
+
+    bdrv_delete(s->origin);
+    s->origin = NULL;
+    g_free(s->bitmap);
+    g_free(s->origin_name);
+}
+
+static int64_t blkcache_getlength(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+
+    return bdrv_getlength(s->origin);
+}
+
+/*
+ * Reads @nb_chunks chunks starting at @chunk from the origin into @buf and
+ * adds them to the cache.  Failing to write the cache is not an error, the
+ * chunks just stay uncached.
+ */
+static int coroutine_fn blkcache_fill(BlockDriverState *bs, int64_t chunk,
+                                      int64_t nb_chunks, uint8_t *buf)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    int64_t sector_num = chunk * s->chunk_sectors;
+    int nb_sectors = MIN(nb_chunks * s->chunk_sectors,
+                         s->origin_sectors - sector_num);
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int64_t i;
+    int ret;
+
+    iov.iov_base = buf;
+    iov.iov_len = nb_sectors * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    ret = bdrv_co_readv(s->origin, sector_num, nb_sectors, &qiov);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = bdrv_co_writev(bs->file,
+                         s->data_offset / BDRV_SECTOR_SIZE + sector_num,
+                         nb_sectors, &qiov);
+    if (ret < 0) {
+        return 0;
+    }
+
+    for (i = 0; i < nb_chunks; i++) {
+        blkcache_set_chunk(s, chunk + i, true);
+    }
+    return 0;
+}
+
+static void coroutine_fn blkcache_prefetch_entry(void *opaque)
+{
+    BlkcachePrefetch *p = opaque;
+    BlockDriverState *bs = p->bs;
+    BDRVBlkcacheState *s = bs->opaque;
+    int64_t chunk = p->chunk;
+    int64_t end = p->chunk + p->nb_chunks;
+    uint8_t *buf;
+
+    buf = qemu_blockalign(bs, BLKCACHE_MAX_FILL * BLKCACHE_CHUNK_SIZE);
+
+    qemu_co_rwlock_rdlock(&s->lock);
+    while (chunk < end) {
+        int64_t n = 1;
+
+        if (blkcache_chunk_valid(s, chunk)) {
+            chunk++;
+            continue;
+        }
+        while (chunk + n < end && n < BLKCACHE_MAX_FILL &&
+               !blkcache_chunk_valid(s, chunk + n)) {
+            n++;
+        }
+        if (blkcache_fill(bs, chunk, n, buf) < 0) {
+            break;
+        }
+        s->prefetched += n;
+        chunk += n;
+    }
+    qemu_co_rwlock_unlock(&s->lock);
+
+    qemu_vfree(buf);
+    g_free(p);
+    s->prefetching--;
+}
+
+/* Reads ahead of a reader that keeps continuing where its last read ended */
+static void blkcache_detect_sequential(BlockDriverState *bs,
+                                       int64_t sector_num, int nb_sectors)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlkcachePrefetch *p;
+    Coroutine *co;
+    int64_t end = sector_num + nb_sectors;
+    int64_t first, last;
+
+    if (sector_num == s->last_read_end) {
+        s->seq_reads++;
+    } else {
+        s->seq_reads = 0;
+        s->prefetch_next = 0;
+    }
+    s->last_read_end = end;
+
+    if (s->seq_reads < BLKCACHE_SEQ_THRESHOLD) {
+        return;
+    }
+
+    first = MAX(DIV_ROUND_UP(end, s->chunk_sectors), s->prefetch_next);
+    last = MIN(DIV_ROUND_UP(end, s->chunk_sectors) + BLKCACHE_PREFETCH,
+               s->nb_chunks);
+    if (first >= last) {
+        return;
+    }
+    s->prefetch_next = last;
+
+    p = g_malloc(sizeof(*p));
+    p->bs = bs;
+    p->chunk = first;
+    p->nb_chunks = last - first;
+
+    s->prefetching++;
+    co = qemu_coroutine_create(blkcache_prefetch_entry);
+    qemu_coroutine_enter(co, p);
+}
+
+static int coroutine_fn blkcache_co_readv(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    QEMUIOVector hd_qiov;
+    uint8_t *buf = NULL;
+    int64_t start_sector = sector_num;
+    int total_sectors = nb_sectors;
+    uint64_t bytes_done = 0;
+    int ret = 0;
+
+    qemu_iovec_init(&hd_qiov, qiov->niov);
+    qemu_co_rwlock_rdlock(&s->lock);
+
+    while (nb_sectors > 0) {
+        int64_t chunk = sector_num / s->chunk_sectors;
+        int64_t end = chunk + 1;
+        bool valid = blkcache_chunk_valid(s, chunk);
+        int n;
+
+        /* Handle a run of chunks that are all cached or all missing */
+        while (end * s->chunk_sectors < sector_num + nb_sectors &&
+               end - chunk < BLKCACHE_MAX_FILL &&
+               blkcache_chunk_valid(s, end) == valid) {
+            end++;
+        }
+        n = MIN(nb_sectors, end * s->chunk_sectors - sector_num);
+
+        qemu_iovec_reset(&hd_qiov);
+        qemu_iovec_copy(&hd_qiov, qiov, bytes_done, n * BDRV_SECTOR_SIZE);
+
+        if (valid) {
+            ret = bdrv_co_readv(bs->file,
+                                s->data_offset / BDRV_SECTOR_SIZE + sector_num,
+                                n, &hd_qiov);
+            if (ret < 0) {
+                /* Stop using the broken chunks and go to the origin */
+                int64_t i;
+
+                for (i = chunk; i < end; i++) {
+                    blkcache_set_chunk(s, i, false);
+                }
+                ret = bdrv_co_readv(s->origin, sector_num, n, &hd_qiov);
+            } else {
+                s->hits += end - chunk;
+            }
+        } else {
+            if (buf == NULL) {
+                buf = qemu_blockalign(bs,
+                                      BLKCACHE_MAX_FILL * BLKCACHE_CHUNK_SIZE);
+            }
+            ret = blkcache_fill(bs, chunk, end - chunk, buf);
+            if (ret == 0) {
+                qemu_iovec_from_buffer(&hd_qiov,
+                    buf + (sector_num - chunk * s->chunk_sectors) *
+                          BDRV_SECTOR_SIZE,
+                    n * BDRV_SECTOR_SIZE);
+                s->misses += end - chunk;
+            }
+        }
+        if (ret < 0) {
+            break;
+        }
+
+        nb_sectors -= n;
+        sector_num += n;
+        bytes_done += n * BDRV_SECTOR_SIZE;
+    }
+
+    qemu_co_rwlock_unlock(&s->lock);
+    qemu_iovec_destroy(&hd_qiov);
+    qemu_vfree(buf);
+
+    if (ret == 0) {
+        blkcache_detect_sequential(bs, start_sector, total_sectors);
+    }
+    return ret;
+}
+
+static int coroutine_fn blkcache_co_writev(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    QEMUIOVector hd_qiov;
+    uint64_t bytes_done = 0;
+    int ret;
+
+    qemu_co_rwlock_wrlock(&s->lock);
+
+    ret = bdrv_co_writev(s->origin, sector_num, nb_sectors, qiov);
+    if (ret < 0) {
+        goto out;
+    }
+
+    /* Keep the chunks that are already cached up to date */
+    qemu_iovec_init(&hd_qiov, qiov->niov);
+    while (nb_sectors > 0) {
+        int64_t chunk = sector_num / s->chunk_sectors;
+        int n = MIN(nb_sectors, (chunk + 1) * s->chunk_sectors - sector_num);
+        int err;
+
+        if (blkcache_chunk_valid(s, chunk)) {
+            err = 0;
+            if (!s->header_dirty) {
+                err = blkcache_write_header(bs, s->origin_name,
+                                            BLKCACHE_F_DIRTY);
+                if (err == 0) {
+                    err = bdrv_co_flush(bs->file);
+                }
+                s->header_dirty = (err == 0);
+            }
+            if (err == 0) {
+                qemu_iovec_reset(&hd_qiov);
+                qemu_iovec_copy(&hd_qiov, qiov, bytes_done,
+                                n * BDRV_SECTOR_SIZE);
+                err = bdrv_co_writev(bs->file,
+                        s->data_offset / BDRV_SECTOR_SIZE + sector_num,
+                        n, &hd_qiov);
+            }
+            if (err < 0) {
+                blkcache_set_chunk(s, chunk, false);
+            }
+        }
+
+        nb_sectors -= n;
+        sector_num += n;
+        bytes_done += n * BDRV_SECTOR_SIZE;
+    }
+    qemu_iovec_destroy(&hd_qiov);
+
+out:
+    qemu_co_rwlock_unlock(&s->lock);
+    return ret;
+}
+
+static int coroutine_fn blkcache_co_flush_to_os(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    int ret;
+
+    qemu_co_rwlock_wrlock(&s->lock);
+    ret = bdrv_co_flush(s->origin);
+    if (ret == 0) {
+        ret = blkcache_sync(bs);
+    }
+    qemu_co_rwlock_unlock(&s->lock);
+
+    return ret;
+}
+
+static BlockCacheStatsList *blkcache_get_cache_stats(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlockCacheStatsList *list = g_malloc0(sizeof(*list));
+    BlockCacheStats *stats = g_malloc0(sizeof(*stats));
+
+    stats->name = g_strdup("data");
+    stats->size = s->chunks_cached * BLKCACHE_CHUNK_SIZE;
+    stats->hits = s->hits;
+    stats->misses = s->misses;
+    stats->has_prefetched = true;
+    stats->prefetched = s->prefetched;
+
+    list->value = stats;
+    return list;
+}
+
+static BlockDriver bdrv_blkcache = {
+    .format_name            = "blkcache",
+    .protocol_name          = "blkcache",
+
+    .instance_size          = sizeof(BDRVBlkcacheState),
+
+    .bdrv_getlength         = blkcache_getlength,
+
+    .bdrv_file_open         = blkcache_open,
+    .bdrv_close             = blkcache_close,
+
+    .bdrv_co_readv          = blkcache_co_readv,
+    .bdrv_co_writev         = blkcache_co_writev,
+    .bdrv_co_flush_to_os    = blkcache_co_flush_to_os,
+
+    .bdrv_get_cache_stats   = blkcache_get_cache_stats,
+};
+
+static void bdrv_blkcache_init(void)
+{
+    bdrv_register(&bdrv_blkcache);
+}
+
+block_init(bdrv_blkcache_init);
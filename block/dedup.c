@@ -0,0 +1,1199 @@
+/*
+ * Block driver for deduplicating image overlays
+ *
+ * Copyright Carnegie Mellon University 2012
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "block_int.h"
+#include "module.h"
+#include "qemu-coroutine.h"
+#include "bitmap.h"
+#include "qemu-error.h"
+#include "block/overlay.h"
+#ifdef CONFIG_POSIX
+#include "block/raw-posix-aio.h"
+#endif
+
+/*
+ * The guest disk is divided into fixed-size chunks.  The image file starts
+ * with a header, followed by the chunk map with one entry per chunk, the
+ * index of the base image and the chunk store:
+ *
+ *  - A chunk map entry says where the data of the chunk lives: in the base
+ *    image at the same place (0), nowhere because it reads as zeroes (1), in
+ *    another chunk of the base image (DEDUP_MAP_BASE | chunk number), or in
+ *    the store (byte offset of the stored chunk in the image file).
+ *
+ *  - The store only ever grows.  Stored chunks are never modified since any
+ *    number of map entries may point to them, a write to a chunk looks for
+ *    its new content among the stored chunks and the chunks of the base
+ *    image, and only adds it to the store if it is not found.
+ *
+ *  - Chunks are found by a 64-bit hash of their content, but they are also
+ *    compared byte by byte before a map entry is pointed at them, so a hash
+ *    collision costs a read rather than data.  The hashes of the base image
+ *    are computed when the image is created and kept in the base index.  The
+ *    hashes of the store are written after its end when the image is closed
+ *    and computed again from the stored chunks if QEMU crashed.
+ *
+ * The map is held in memory and written when the image is flushed, after the
+ * chunk data, so the image on disk only ever points to stored chunks that are
+ * complete.  Chunks that are no longer referenced stay in the store until the
+ * image is converted.
+ */
+
+#define DEDUP_MAGIC             (('Q' << 24) | ('D' << 16) | ('D' << 8) | 0xfb)
+#define DEDUP_VERSION           1
+#define DEDUP_F_DIRTY           1       /* store index must be rebuilt */
+
+#define DEDUP_HEADER_SIZE       4096
+
+/* Chunk map entries that are not an offset in the store */
+#define DEDUP_MAP_UNALLOCATED   0ULL
+#define DEDUP_MAP_ZERO          1ULL
+#define DEDUP_MAP_BASE          (1ULL << 63)
+
+/* The map is written in sectors */
+#define DEDUP_MAP_PER_SECTOR    (BDRV_SECTOR_SIZE / sizeof(uint64_t))
+
+/* Initial number of index slots, must be a power of two */
+#define DEDUP_MIN_INDEX_SIZE    1024
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t chunk_size;
+    uint32_t flags;
+    uint64_t image_size;
+    uint64_t map_offset;
+    uint64_t base_index_offset;
+    uint64_t base_index_entries;
+    uint64_t store_offset;
+    uint64_t store_end;             /* store index is written here on close */
+    uint64_t store_index_entries;
+    uint32_t backing_name_offset;
+    uint32_t backing_name_size;
+    uint32_t backing_fmt_offset;
+    uint32_t backing_fmt_size;
+} DedupHeader;
+
+/* Index entries, big-endian on disk */
+typedef struct {
+    uint64_t hash;
+    uint64_t location;              /* chunk map entry for the content */
+} DedupIndexEntry;
+
+/* Hash table with open addressing, a location of 0 marks a free slot */
+typedef struct {
+    DedupIndexEntry *entries;
+    uint64_t size;                  /* slots, a power of two */
+    uint64_t used;
+} DedupIndex;
+
+typedef struct DedupChunkWrite DedupChunkWrite;
+
+typedef struct {
+    DedupHeader header;             /* cpu-endian */
+    uint32_t chunk_size;
+    int chunk_sectors;
+    int64_t nb_chunks;
+
+    uint64_t *map;                  /* cpu-endian */
+    unsigned long *map_dirty;       /* map sectors that need writing */
+    int64_t map_sectors;
+
+    DedupIndex index;
+    uint64_t store_end;             /* where the next chunk is stored */
+    bool header_dirty;              /* DEDUP_F_DIRTY is set on disk */
+    CoMutex lock;                   /* header and map writes */
+
+    /* Writes to the same chunk read, modify and write it one at a time */
+    QLIST_HEAD(, DedupChunkWrite) writes;
+    CoQueue write_queue;
+
+    /* Statistics */
+    int64_t nb_stored;              /* chunks in the store */
+    int64_t nb_referenced;          /* map entries that share a chunk */
+} BDRVDedupState;
+
+/* A write request is split into one coroutine per chunk */
+typedef struct {
+    Coroutine *co;                  /* dedup_co_writev() waiting for them */
+    int in_flight;
+    int ret;
+} DedupWriteRequest;
+
+struct DedupChunkWrite {
+    BlockDriverState *bs;
+    DedupWriteRequest *req;
+    int64_t chunk;
+    int sector;                     /* first sector written in the chunk */
+    int nb_sectors;
+    QEMUIOVector qiov;
+    uint64_t hash;
+    bool storing;                   /* adding a chunk with @hash to the store */
+    QLIST_ENTRY(DedupChunkWrite) next;
+};
+
+#define DEDUP_PRIME1    0x9e3779b185ebca87ULL
+#define DEDUP_PRIME2    0xc2b2ae3d27d4eb4fULL
+#define DEDUP_PRIME3    0x165667b19e3779f9ULL
+
+static inline uint64_t dedup_rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t dedup_round(uint64_t acc, uint64_t word)
+{
+    acc += word * DEDUP_PRIME2;
+    return dedup_rotl(acc, 31) * DEDUP_PRIME1;
+}
+
+/*
+ * Hashes a chunk in four independent lanes of little-endian words, so that
+ * the result is the same on every host.  @len must be a multiple of 32.
+ */
+static uint64_t dedup_hash(const uint8_t *buf, size_t len)
+{
+    const uint64_t *p = (const uint64_t *)buf;
+    uint64_t v0 = DEDUP_PRIME1 + DEDUP_PRIME2;
+    uint64_t v1 = DEDUP_PRIME2;
+    uint64_t v2 = 0;
+    uint64_t v3 = -DEDUP_PRIME1;
+    uint64_t h;
+    size_t i;
+
+    for (i = 0; i < len / sizeof(uint64_t); i += 4) {
+        v0 = dedup_round(v0, le64_to_cpu(p[i]));
+        v1 = dedup_round(v1, le64_to_cpu(p[i + 1]));
+        v2 = dedup_round(v2, le64_to_cpu(p[i + 2]));
+        v3 = dedup_round(v3, le64_to_cpu(p[i + 3]));
+    }
+
+    h = dedup_rotl(v0, 1) + dedup_rotl(v1, 7) +
+        dedup_rotl(v2, 12) + dedup_rotl(v3, 18);
+    h ^= len;
+    h ^= h >> 33;
+    h *= DEDUP_PRIME2;
+    h ^= h >> 29;
+    h *= DEDUP_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+typedef struct {
+    const uint8_t *buf;
+    size_t len;
+    uint64_t hash;
+} DedupHashJob;
+
+static int dedup_hash_job(void *opaque)
+{
+    DedupHashJob *job = opaque;
+
+    job->hash = dedup_hash(job->buf, job->len);
+    return 0;
+}
+
+static void dedup_index_init(DedupIndex *index, uint64_t nb_entries)
+{
+    index->size = DEDUP_MIN_INDEX_SIZE;
+    while (index->size / 4 * 3 < nb_entries) {
+        index->size *= 2;
+    }
+    index->entries = g_malloc0(index->size * sizeof(DedupIndexEntry));
+    index->used = 0;
+}
+
+static void dedup_index_free(DedupIndex *index)
+{
+    g_free(index->entries);
+    index->entries = NULL;
+    index->size = index->used = 0;
+}
+
+static DedupIndexEntry *dedup_index_slot(DedupIndex *index, uint64_t hash)
+{
+    uint64_t mask = index->size - 1;
+    uint64_t i = hash & mask;
+
+    while (index->entries[i].location != 0 &&
+           index->entries[i].hash != hash) {
+        i = (i + 1) & mask;
+    }
+    return &index->entries[i];
+}
+
+/* Returns the location of a chunk with hash @hash, or 0 if there is none */
+static uint64_t dedup_index_lookup(DedupIndex *index, uint64_t hash)
+{
+    return dedup_index_slot(index, hash)->location;
+}
+
+/* Chunks whose hash is already in the index are not added again */
+static void dedup_index_insert(DedupIndex *index, uint64_t hash,
+                               uint64_t location)
+{
+    DedupIndexEntry *slot;
+
+    if (index->used + 1 > index->size / 4 * 3) {
+        DedupIndexEntry *old = index->entries;
+        uint64_t i, old_size = index->size;
+
+        index->size *= 2;
+        index->entries = g_malloc0(index->size * sizeof(DedupIndexEntry));
+        for (i = 0; i < old_size; i++) {
+            if (old[i].location != 0) {
+                *dedup_index_slot(index, old[i].hash) = old[i];
+            }
+        }
+        g_free(old);
+    }
+
+    slot = dedup_index_slot(index, hash);
+    if (slot->location == 0) {
+        slot->hash = hash;
+        slot->location = location;
+        index->used++;
+    }
+}
+
+/* Loads @nb_entries index entries from @offset into the in-memory index */
+static int dedup_index_load(BlockDriverState *file, DedupIndex *index,
+                            uint64_t offset, uint64_t nb_entries)
+{
+    DedupIndexEntry *buf;
+    size_t batch = 4096;
+    uint64_t i, j, n;
+    int ret = 0;
+
+    buf = g_malloc(batch * sizeof(*buf));
+    for (i = 0; i < nb_entries; i += n) {
+        n = MIN(batch, nb_entries - i);
+        ret = bdrv_pread(file, offset + i * sizeof(*buf), buf,
+                         n * sizeof(*buf));
+        if (ret < 0) {
+            break;
+        }
+        for (j = 0; j < n; j++) {
+            dedup_index_insert(index, be64_to_cpu(buf[j].hash),
+                               be64_to_cpu(buf[j].location));
+        }
+        ret = 0;
+    }
+    g_free(buf);
+    return ret;
+}
+
+static bool dedup_entry_is_shared(uint64_t entry)
+{
+    return entry != DEDUP_MAP_UNALLOCATED && entry != DEDUP_MAP_ZERO;
+}
+
+static void dedup_set_map(BDRVDedupState *s, int64_t chunk, uint64_t entry)
+{
+    uint64_t old = s->map[chunk];
+
+    if (old == entry) {
+        return;
+    }
+    s->nb_referenced += dedup_entry_is_shared(entry) -
+                        dedup_entry_is_shared(old);
+    s->map[chunk] = entry;
+    set_bit(chunk / DEDUP_MAP_PER_SECTOR, s->map_dirty);
+}
+
+static int dedup_write_header(BlockDriverState *file, const DedupHeader *cpu)
+{
+    DedupHeader header = *cpu;
+
+    header.magic = cpu_to_be32(header.magic);
+    header.version = cpu_to_be32(header.version);
+    header.chunk_size = cpu_to_be32(header.chunk_size);
+    header.flags = cpu_to_be32(header.flags);
+    header.image_size = cpu_to_be64(header.image_size);
+    header.map_offset = cpu_to_be64(header.map_offset);
+    header.base_index_offset = cpu_to_be64(header.base_index_offset);
+    header.base_index_entries = cpu_to_be64(header.base_index_entries);
+    header.store_offset = cpu_to_be64(header.store_offset);
+    header.store_end = cpu_to_be64(header.store_end);
+    header.store_index_entries = cpu_to_be64(header.store_index_entries);
+    header.backing_name_offset = cpu_to_be32(header.backing_name_offset);
+    header.backing_name_size = cpu_to_be32(header.backing_name_size);
+    header.backing_fmt_offset = cpu_to_be32(header.backing_fmt_offset);
+    header.backing_fmt_size = cpu_to_be32(header.backing_fmt_size);
+
+    return bdrv_pwrite(file, 0, &header, sizeof(header));
+}
+
+static void dedup_header_to_cpu(DedupHeader *header)
+{
+    header->magic = be32_to_cpu(header->magic);
+    header->version = be32_to_cpu(header->version);
+    header->chunk_size = be32_to_cpu(header->chunk_size);
+    header->flags = be32_to_cpu(header->flags);
+    header->image_size = be64_to_cpu(header->image_size);
+    header->map_offset = be64_to_cpu(header->map_offset);
+    header->base_index_offset = be64_to_cpu(header->base_index_offset);
+    header->base_index_entries = be64_to_cpu(header->base_index_entries);
+    header->store_offset = be64_to_cpu(header->store_offset);
+    header->store_end = be64_to_cpu(header->store_end);
+    header->store_index_entries = be64_to_cpu(header->store_index_entries);
+    header->backing_name_offset = be32_to_cpu(header->backing_name_offset);
+    header->backing_name_size = be32_to_cpu(header->backing_name_size);
+    header->backing_fmt_offset = be32_to_cpu(header->backing_fmt_offset);
+    header->backing_fmt_size = be32_to_cpu(header->backing_fmt_size);
+}
+
+static int dedup_probe(const uint8_t *buf, int buf_size, const char *filename)
+{
+    if (buf_size < sizeof(uint32_t)) {
+        return 0;
+    }
+    if (be32_to_cpu(*(const uint32_t *)buf) != DEDUP_MAGIC) {
+        return 0;
+    }
+    return 100;
+}
+
+/*
+ * Computes the hashes of the store again after a crash.  The map on disk may
+ * point to chunks that were stored after the last header update, so the
+ * store is taken to extend to the end of the file.
+ */
+static int dedup_rebuild_store_index(BlockDriverState *bs)
+{
+    BDRVDedupState *s = bs->opaque;
+    int64_t file_size;
+    uint8_t *buf;
+    uint64_t offset;
+    int ret = 0;
+
+    file_size = bdrv_getlength(bs->file);
+    if (file_size < 0) {
+        return file_size;
+    }
+    s->store_end = MAX(s->store_end,
+                       QEMU_ALIGN_UP(file_size, s->chunk_size));
+    s->nb_stored = (s->store_end - s->header.store_offset) / s->chunk_size;
+
+    buf = qemu_blockalign(bs, s->chunk_size);
+    for (offset = s->header.store_offset; offset < s->store_end;
+         offset += s->chunk_size) {
+        int n = MIN(s->chunk_size, MAX(file_size - (int64_t)offset, 0));
+
+        memset(buf + n, 0, s->chunk_size - n);
+        ret = bdrv_pread(bs->file, offset, buf, n);
+        if (ret < 0) {
+            break;
+        }
+        dedup_index_insert(&s->index, dedup_hash(buf, s->chunk_size), offset);
+        ret = 0;
+    }
+    qemu_vfree(buf);
+    return ret;
+}
+
+static int dedup_open(BlockDriverState *bs, int flags)
+{
+    BDRVDedupState *s = bs->opaque;
+    uint8_t *buf;
+    DedupHeader *header = &s->header;
+    uint64_t map_bytes, *map_buf;
+    int64_t i;
+    int ret;
+
+    buf = g_malloc(DEDUP_HEADER_SIZE);
+    ret = bdrv_pread(bs->file, 0, buf, DEDUP_HEADER_SIZE);
+    if (ret < 0) {
+        goto fail;
+    }
+    memcpy(header, buf, sizeof(*header));
+    dedup_header_to_cpu(header);
+
+    ret = -EINVAL;
+    if (header->magic != DEDUP_MAGIC || header->version != DEDUP_VERSION ||
+        !overlay_is_chunk_size_valid(header->chunk_size) ||
+        header->image_size % BDRV_SECTOR_SIZE ||
+        header->map_offset < DEDUP_HEADER_SIZE ||
+        header->store_offset % header->chunk_size ||
+        header->store_end < header->store_offset ||
+        (header->store_end - header->store_offset) % header->chunk_size) {
+        goto fail;
+    }
+
+    s->chunk_size = header->chunk_size;
+    s->chunk_sectors = s->chunk_size / BDRV_SECTOR_SIZE;
+    s->nb_chunks = DIV_ROUND_UP(header->image_size, s->chunk_size);
+    map_bytes = s->nb_chunks * sizeof(uint64_t);
+    if (header->map_offset + map_bytes > header->base_index_offset ||
+        header->base_index_offset + header->base_index_entries *
+            sizeof(DedupIndexEntry) > header->store_offset) {
+        goto fail;
+    }
+
+    if (header->backing_name_size) {
+        ret = overlay_read_string(buf, DEDUP_HEADER_SIZE,
+                                  header->backing_name_offset,
+                                  header->backing_name_size,
+                                  bs->backing_file, sizeof(bs->backing_file));
+        if (ret < 0) {
+            goto fail;
+        }
+        ret = overlay_read_string(buf, DEDUP_HEADER_SIZE,
+                                  header->backing_fmt_offset,
+                                  header->backing_fmt_size,
+                                  bs->backing_format,
+                                  sizeof(bs->backing_format));
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    bs->total_sectors = header->image_size / BDRV_SECTOR_SIZE;
+    s->store_end = header->store_end;
+    s->nb_stored = (s->store_end - header->store_offset) / s->chunk_size;
+    s->header_dirty = header->flags & DEDUP_F_DIRTY;
+
+    /* The whole map is kept in memory */
+    s->map_sectors = DIV_ROUND_UP(s->nb_chunks, DEDUP_MAP_PER_SECTOR);
+    s->map = g_malloc0(s->map_sectors * BDRV_SECTOR_SIZE);
+    s->map_dirty = bitmap_new(s->map_sectors);
+    ret = bdrv_pread(bs->file, header->map_offset, s->map, map_bytes);
+    if (ret < 0) {
+        goto fail;
+    }
+    map_buf = s->map;
+    for (i = 0; i < s->nb_chunks; i++) {
+        map_buf[i] = be64_to_cpu(map_buf[i]);
+        if (dedup_entry_is_shared(map_buf[i])) {
+            s->nb_referenced++;
+        }
+    }
+
+    dedup_index_init(&s->index, header->base_index_entries + s->nb_stored);
+    ret = dedup_index_load(bs->file, &s->index, header->base_index_offset,
+                           header->base_index_entries);
+    if (ret < 0) {
+        goto fail;
+    }
+    if (s->header_dirty) {
+        ret = dedup_rebuild_store_index(bs);
+    } else {
+        ret = dedup_index_load(bs->file, &s->index, s->store_end,
+                               header->store_index_entries);
+    }
+    if (ret < 0) {
+        goto fail;
+    }
+
+    qemu_co_mutex_init(&s->lock);
+    QLIST_INIT(&s->writes);
+    qemu_co_queue_init(&s->write_queue);
+    g_free(buf);
+    return 0;
+
+fail:
+    g_free(buf);
+    g_free(s->map);
+    s->map = NULL;
+    g_free(s->map_dirty);
+    s->map_dirty = NULL;
+    dedup_index_free(&s->index);
+    return ret;
+}
+
+/* Writes the map sectors that changed, once the chunks they point to are */
+static int dedup_sync(BlockDriverState *bs)
+{
+    BDRVDedupState *s = bs->opaque;
+    uint64_t *buf;
+    int64_t start, end, i;
+    int ret;
+
+    start = find_first_bit(s->map_dirty, s->map_sectors);
+    if (start >= s->map_sectors) {
+        return 0;
+    }
+
+    ret = bdrv_flush(bs->file);
+    if (ret < 0) {
+        return ret;
+    }
+
+    while (start < s->map_sectors) {
+        end = find_next_zero_bit(s->map_dirty, s->map_sectors, start);
+        for (i = start; i < end; i++) {
+            clear_bit(i, s->map_dirty);
+        }
+
+        buf = g_malloc((end - start) * BDRV_SECTOR_SIZE);
+        for (i = 0; i < (end - start) * DEDUP_MAP_PER_SECTOR; i++) {
+            buf[i] = cpu_to_be64(s->map[start * DEDUP_MAP_PER_SECTOR + i]);
+        }
+        ret = bdrv_pwrite(bs->file,
+                          s->header.map_offset + start * BDRV_SECTOR_SIZE,
+                          buf, (end - start) * BDRV_SECTOR_SIZE);
+        g_free(buf);
+        if (ret < 0) {
+            for (i = start; i < end; i++) {
+                set_bit(i, s->map_dirty);
+            }
+            return ret;
+        }
+
+        start = find_next_bit(s->map_dirty, s->map_sectors, end);
+    }
+
+    /* Tell a rebuild after a crash how far the store goes */
+    if (s->header_dirty && s->header.store_end != s->store_end) {
+        s->header.store_end = s->store_end;
+        ret = dedup_write_header(bs->file, &s->header);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/* Writes the hashes of the store after its end and marks the image clean */
+static int dedup_write_store_index(BlockDriverState *bs)
+{
+    BDRVDedupState *s = bs->opaque;
+    DedupIndexEntry *buf;
+    uint64_t i, n = 0;
+    int ret;
+
+    buf = g_malloc(MAX(s->index.used, 1) * sizeof(*buf));
+    for (i = 0; i < s->index.size; i++) {
+        uint64_t location = s->index.entries[i].location;
+
+        if (location != 0 && !(location & DEDUP_MAP_BASE)) {
+            buf[n].hash = cpu_to_be64(s->index.entries[i].hash);
+            buf[n].location = cpu_to_be64(location);
+            n++;
+        }
+    }
+
+    ret = bdrv_pwrite(bs->file, s->store_end, buf, n * sizeof(*buf));
+    g_free(buf);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = bdrv_flush(bs->file);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->header.flags &= ~DEDUP_F_DIRTY;
+    s->header.store_end = s->store_end;
+    s->header.store_index_entries = n;
+    ret = dedup_write_header(bs->file, &s->header);
+    if (ret < 0) {
+        return ret;
+    }
+    s->header_dirty = false;
+    return bdrv_flush(bs->file);
+}
+
+static void dedup_close(BlockDriverState *bs)
+{
+    BDRVDedupState *s = bs->opaque;
+
+    if (!bs->read_only && dedup_sync(bs) == 0 && s->header_dirty) {
+        dedup_write_store_index(bs);
+    }
+
+    g_free(s->map);
+    g_free(s->map_dirty);
+    dedup_index_free(&s->index);
+}
+
+/* Sets DEDUP_F_DIRTY before the store grows over its index */
+static int coroutine_fn dedup_co_mark_dirty(BlockDriverState *bs)
+{
+    BDRVDedupState *s = bs->opaque;
+    int ret = 0;
+
+    qemu_co_mutex_lock(&s->lock);
+    if (!s->header_dirty) {
+        s->header.flags |= DEDUP_F_DIRTY;
+        s->header.store_end = s->store_end;
+        ret = dedup_write_header(bs->file, &s->header);
+        if (ret >= 0) {
+            ret = bdrv_co_flush(bs->file);
+        }
+        if (ret < 0) {
+            s->header.flags &= ~DEDUP_F_DIRTY;
+        } else {
+            s->header_dirty = true;
+        }
+    }
+    qemu_co_mutex_unlock(&s->lock);
+    return ret;
+}
+
+/* Returns where the data of a chunk with map entry @entry comes from */
+static int dedup_entry_source(BDRVDedupState *s, int64_t chunk,
+                              uint64_t entry, int64_t *sector)
+{
+    if (entry == DEDUP_MAP_ZERO) {
+        *sector = 0;
+        return OVERLAY_SRC_ZERO;
+    } else if (entry == DEDUP_MAP_UNALLOCATED) {
+        *sector = chunk * s->chunk_sectors;
+        return OVERLAY_SRC_BASE;
+    } else if (entry & DEDUP_MAP_BASE) {
+        *sector = (entry & ~DEDUP_MAP_BASE) * s->chunk_sectors;
+        return OVERLAY_SRC_BASE;
+    }
+    *sector = entry / BDRV_SECTOR_SIZE;
+    return OVERLAY_SRC_FILE;
+}
+
+static int dedup_chunk_source(BlockDriverState *bs, int64_t chunk,
+                              int64_t *sector)
+{
+    BDRVDedupState *s = bs->opaque;
+
+    return dedup_entry_source(s, chunk, s->map[chunk], sector);
+}
+
+/* Reads the whole chunk that map entry @entry of chunk @chunk points to */
+static int coroutine_fn dedup_co_read_chunk(BlockDriverState *bs,
+    int64_t chunk, uint64_t entry, uint8_t *buf)
+{
+    BDRVDedupState *s = bs->opaque;
+    struct iovec iov = {
+        .iov_base = buf,
+        .iov_len = s->chunk_size,
+    };
+    QEMUIOVector qiov;
+    int64_t sector;
+    int src;
+
+    qemu_iovec_init_external(&qiov, &iov, 1);
+    src = dedup_entry_source(s, chunk, entry, &sector);
+    return overlay_co_read_source(bs, src, sector, s->chunk_sectors, &qiov);
+}
+
+static int coroutine_fn dedup_co_readv(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
+{
+    BDRVDedupState *s = bs->opaque;
+
+    return overlay_co_readv(bs, s->chunk_sectors, dedup_chunk_source,
+                            sector_num, nb_sectors, qiov);
+}
+
+static bool dedup_chunk_busy(BDRVDedupState *s, int64_t chunk)
+{
+    DedupChunkWrite *w;
+
+    QLIST_FOREACH(w, &s->writes, next) {
+        if (w->chunk == chunk) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Equal chunks written at the same time must only be stored once */
+static bool dedup_hash_busy(BDRVDedupState *s, uint64_t hash)
+{
+    DedupChunkWrite *w;
+
+    QLIST_FOREACH(w, &s->writes, next) {
+        if (w->storing && w->hash == hash) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Finds the new content of a chunk in the index and checks that it really is
+ * the same.  Returns its map entry, or 0 if it has to be stored.
+ */
+static uint64_t coroutine_fn dedup_co_find(BlockDriverState *bs,
+    const uint8_t *buf, uint64_t hash)
+{
+    BDRVDedupState *s = bs->opaque;
+    uint64_t location;
+    uint8_t *cmp_buf;
+    int ret;
+
+    location = dedup_index_lookup(&s->index, hash);
+    if (location == 0) {
+        return 0;
+    }
+
+    cmp_buf = qemu_blockalign(bs, s->chunk_size);
+    ret = dedup_co_read_chunk(bs, 0, location, cmp_buf);
+    if (ret < 0 || memcmp(buf, cmp_buf, s->chunk_size)) {
+        location = 0;
+    }
+    qemu_vfree(cmp_buf);
+    return location;
+}
+
+static int coroutine_fn dedup_co_write_chunk(DedupChunkWrite *w)
+{
+    BlockDriverState *bs = w->bs;
+    BDRVDedupState *s = bs->opaque;
+    struct iovec iov;
+    QEMUIOVector qiov;
+    DedupHashJob job;
+    uint64_t entry;
+    uint8_t *buf;
+    int ret;
+
+    while (dedup_chunk_busy(s, w->chunk)) {
+        qemu_co_queue_wait(&s->write_queue);
+    }
+    QLIST_INSERT_HEAD(&s->writes, w, next);
+
+    buf = qemu_blockalign(bs, s->chunk_size);
+    iov.iov_base = buf;
+    iov.iov_len = s->chunk_size;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    /* Build the new content of the chunk */
+    if (w->nb_sectors < s->chunk_sectors) {
+        ret = dedup_co_read_chunk(bs, w->chunk, s->map[w->chunk], buf);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+    qemu_iovec_to_buffer(&w->qiov, buf + w->sector * BDRV_SECTOR_SIZE);
+
+    if (buffer_is_zero(buf, s->chunk_size)) {
+        entry = bs->backing_hd ? DEDUP_MAP_ZERO : DEDUP_MAP_UNALLOCATED;
+        goto update;
+    }
+
+    /* Hashing is the expensive part, leave it to the thread pool so that the
+     * chunks of several requests are hashed in parallel */
+    job.buf = buf;
+    job.len = s->chunk_size;
+#ifdef CONFIG_POSIX
+    ret = paio_co_submit_func(bs, dedup_hash_job, &job);
+#else
+    ret = dedup_hash_job(&job);
+#endif
+    if (ret < 0) {
+        goto out;
+    }
+
+    while (dedup_hash_busy(s, job.hash)) {
+        qemu_co_queue_wait(&s->write_queue);
+    }
+
+    entry = dedup_co_find(bs, buf, job.hash);
+    if (entry == (DEDUP_MAP_BASE | w->chunk)) {
+        /* Unchanged from the base image */
+        entry = DEDUP_MAP_UNALLOCATED;
+    } else if (entry == 0) {
+        w->hash = job.hash;
+        w->storing = true;
+        ret = dedup_co_mark_dirty(bs);
+        if (ret < 0) {
+            goto out;
+        }
+
+        entry = s->store_end;
+        s->store_end += s->chunk_size;
+        ret = bdrv_co_writev(bs->file, entry / BDRV_SECTOR_SIZE,
+                             s->chunk_sectors, &qiov);
+        if (ret < 0) {
+            goto out;
+        }
+        s->nb_stored++;
+        dedup_index_insert(&s->index, job.hash, entry);
+    }
+
+update:
+    dedup_set_map(s, w->chunk, entry);
+    ret = 0;
+
+out:
+    qemu_vfree(buf);
+    QLIST_REMOVE(w, next);
+    qemu_co_queue_restart_all(&s->write_queue);
+    return ret;
+}
+
+static void coroutine_fn dedup_write_chunk_entry(void *opaque)
+{
+    DedupChunkWrite *w = opaque;
+    DedupWriteRequest *req = w->req;
+    int ret;
+
+    ret = dedup_co_write_chunk(w);
+    if (ret < 0 && req->ret == 0) {
+        req->ret = ret;
+    }
+    qemu_iovec_destroy(&w->qiov);
+    g_free(w);
+
+    if (--req->in_flight == 0 && req->co) {
+        qemu_coroutine_enter(req->co, NULL);
+    }
+}
+
+static int coroutine_fn dedup_co_writev(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
+{
+    BDRVDedupState *s = bs->opaque;
+    DedupWriteRequest req = {
+        .in_flight = 1,
+    };
+    uint64_t bytes_done = 0;
+
+    /* All chunks of the request are processed at the same time */
+    while (nb_sectors > 0) {
+        DedupChunkWrite *w = g_malloc0(sizeof(*w));
+        Coroutine *co;
+
+        w->bs = bs;
+        w->req = &req;
+        w->chunk = sector_num / s->chunk_sectors;
+        w->sector = sector_num % s->chunk_sectors;
+        w->nb_sectors = MIN(nb_sectors, s->chunk_sectors - w->sector);
+        qemu_iovec_init(&w->qiov, qiov->niov);
+        qemu_iovec_copy(&w->qiov, qiov, bytes_done,
+                        w->nb_sectors * BDRV_SECTOR_SIZE);
+
+        nb_sectors -= w->nb_sectors;
+        sector_num += w->nb_sectors;
+        bytes_done += w->nb_sectors * BDRV_SECTOR_SIZE;
+
+        req.in_flight++;
+        co = qemu_coroutine_create(dedup_write_chunk_entry);
+        qemu_coroutine_enter(co, w);
+    }
+
+    if (--req.in_flight > 0) {
+        req.co = qemu_coroutine_self();
+        qemu_coroutine_yield();
+    }
+    return req.ret;
+}
+
+static int coroutine_fn dedup_co_flush_to_os(BlockDriverState *bs)
+{
+    BDRVDedupState *s = bs->opaque;
+    int ret;
+
+    qemu_co_mutex_lock(&s->lock);
+    ret = dedup_sync(bs);
+    qemu_co_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
+static int coroutine_fn dedup_co_is_allocated(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, int *pnum)
+{
+    BDRVDedupState *s = bs->opaque;
+    int64_t chunk = sector_num / s->chunk_sectors;
+    bool allocated = s->map[chunk] != DEDUP_MAP_UNALLOCATED;
+    int n = s->chunk_sectors - sector_num % s->chunk_sectors;
+
+    while (n < nb_sectors &&
+           (s->map[++chunk] != DEDUP_MAP_UNALLOCATED) == allocated) {
+        n += s->chunk_sectors;
+    }
+
+    *pnum = MIN(n, nb_sectors);
+    return allocated;
+}
+
+static int dedup_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
+{
+    BDRVDedupState *s = bs->opaque;
+
+    bdi->cluster_size = s->chunk_size;
+    bdi->dedup_referenced_bytes = s->nb_referenced * s->chunk_size;
+    bdi->dedup_stored_bytes = s->nb_stored * s->chunk_size;
+    bdi->dedup_index_memory = s->index.size * sizeof(DedupIndexEntry);
+    return 0;
+}
+
+static int dedup_check(BlockDriverState *bs, BdrvCheckResult *result)
+{
+    BDRVDedupState *s = bs->opaque;
+    uint64_t base_chunks = 0;
+    int64_t i;
+
+    if (bs->backing_hd) {
+        base_chunks = DIV_ROUND_UP(bdrv_getlength(bs->backing_hd),
+                                   s->chunk_size);
+    }
+
+    result->bfi.total_clusters = s->nb_chunks;
+    for (i = 0; i < s->nb_chunks; i++) {
+        uint64_t entry = s->map[i];
+
+        if (entry == DEDUP_MAP_UNALLOCATED || entry == DEDUP_MAP_ZERO) {
+            continue;
+        }
+        result->bfi.allocated_clusters++;
+
+        if (entry & DEDUP_MAP_BASE) {
+            if ((entry & ~DEDUP_MAP_BASE) >= base_chunks) {
+                fprintf(stderr, "ERROR chunk %" PRId64 " refers to base "
+                        "chunk %" PRIu64 " after the end of the base image\n",
+                        i, (uint64_t)(entry & ~DEDUP_MAP_BASE));
+                result->corruptions++;
+            }
+        } else if (entry < s->header.store_offset || entry >= s->store_end ||
+                   entry % s->chunk_size) {
+            fprintf(stderr, "ERROR chunk %" PRId64 " refers to invalid "
+                    "offset %" PRIu64 "\n", i, entry);
+            result->corruptions++;
+        }
+    }
+    return 0;
+}
+
+/* Adds the hashes of all chunks of the base image to @index */
+static int dedup_index_base(const char *filename, const char *backing_file,
+                            const char *backing_fmt, uint32_t chunk_size,
+                            DedupIndex *index)
+{
+    BlockDriverState *base;
+    BlockDriver *drv = NULL;
+    char path[PATH_MAX];
+    uint8_t *buf;
+    int64_t size, chunk;
+    int ret;
+
+    if (backing_fmt) {
+        drv = bdrv_find_format(backing_fmt);
+        if (!drv) {
+            error_report("Unknown backing file format '%s'", backing_fmt);
+            return -EINVAL;
+        }
+    }
+
+    path_combine(path, sizeof(path), filename, backing_file);
+    base = bdrv_new("");
+    ret = bdrv_open(base, path, BDRV_O_CACHE_WB, drv);
+    if (ret < 0) {
+        error_report("Could not open '%s'", path);
+        bdrv_delete(base);
+        return ret;
+    }
+
+    size = bdrv_getlength(base);
+    if (size < 0) {
+        bdrv_delete(base);
+        return size;
+    }
+
+    buf = qemu_blockalign(base, chunk_size);
+    for (chunk = 0; chunk * chunk_size < size; chunk++) {
+        int n = MIN(chunk_size, size - chunk * chunk_size);
+
+        memset(buf + n, 0, chunk_size - n);
+        ret = bdrv_pread(base, chunk * chunk_size, buf, n);
+        if (ret < 0) {
+            break;
+        }
+        if (!buffer_is_zero(buf, chunk_size)) {
+            dedup_index_insert(index, dedup_hash(buf, chunk_size),
+                               DEDUP_MAP_BASE | chunk);
+        }
+        ret = 0;
+    }
+    qemu_vfree(buf);
+    bdrv_delete(base);
+    return ret;
+}
+
+static int dedup_create(const char *filename, QEMUOptionParameter *options)
+{
+    uint64_t image_size = 0;
+    uint32_t chunk_size = OVERLAY_DEFAULT_CHUNK_SIZE;
+    const char *backing_file = NULL;
+    const char *backing_fmt = NULL;
+    DedupHeader header = {
+        .magic = DEDUP_MAGIC,
+        .version = DEDUP_VERSION,
+    };
+    DedupIndex index = { .entries = NULL };
+    DedupIndexEntry *entries = NULL;
+    BlockDriverState *bs = NULL;
+    uint8_t *names;
+    uint64_t i, n = 0;
+    int ret;
+
+    while (options && options->name) {
+        if (!strcmp(options->name, BLOCK_OPT_SIZE)) {
+            image_size = options->value.n;
+        } else if (!strcmp(options->name, BLOCK_OPT_BACKING_FILE)) {
+            backing_file = options->value.s;
+        } else if (!strcmp(options->name, BLOCK_OPT_BACKING_FMT)) {
+            backing_fmt = options->value.s;
+        } else if (!strcmp(options->name, BLOCK_OPT_CLUSTER_SIZE)) {
+            if (options->value.n) {
+                chunk_size = options->value.n;
+            }
+        }
+        options++;
+    }
+
+    if (!overlay_is_chunk_size_valid(chunk_size)) {
+        error_report("Chunk size must be a power of two between %d and %d",
+                     OVERLAY_MIN_CHUNK_SIZE, OVERLAY_MAX_CHUNK_SIZE);
+        return -EINVAL;
+    }
+    if (backing_file &&
+        strlen(backing_file) + (backing_fmt ? strlen(backing_fmt) : 0) >
+            DEDUP_HEADER_SIZE - sizeof(header)) {
+        error_report("Backing file name too long");
+        return -EINVAL;
+    }
+
+    /* Index the base image first, the layout depends on its size */
+    dedup_index_init(&index, 0);
+    if (backing_file) {
+        ret = dedup_index_base(filename, backing_file, backing_fmt,
+                               chunk_size, &index);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    header.chunk_size = chunk_size;
+    header.image_size = QEMU_ALIGN_UP(image_size, BDRV_SECTOR_SIZE);
+    header.map_offset = DEDUP_HEADER_SIZE;
+    header.base_index_offset = header.map_offset +
+        QEMU_ALIGN_UP(DIV_ROUND_UP(header.image_size, chunk_size) *
+                      sizeof(uint64_t), BDRV_SECTOR_SIZE);
+    header.base_index_entries = index.used;
+    header.store_offset = QEMU_ALIGN_UP(header.base_index_offset +
+                                        index.used * sizeof(DedupIndexEntry),
+                                        chunk_size);
+    header.store_end = header.store_offset;
+    if (backing_file) {
+        header.backing_name_offset = sizeof(header);
+        header.backing_name_size = strlen(backing_file);
+        header.backing_fmt_offset = sizeof(header) + strlen(backing_file);
+        header.backing_fmt_size = backing_fmt ? strlen(backing_fmt) : 0;
+    }
+
+    ret = bdrv_create_file(filename, NULL);
+    if (ret < 0) {
+        goto out;
+    }
+    ret = bdrv_file_open(&bs, filename, BDRV_O_RDWR | BDRV_O_CACHE_WB);
+    if (ret < 0) {
+        goto out;
+    }
+    ret = bdrv_truncate(bs, 0);
+    if (ret < 0) {
+        goto out;
+    }
+
+    ret = dedup_write_header(bs, &header);
+    if (ret < 0) {
+        goto out;
+    }
+
+    names = g_malloc0(DEDUP_HEADER_SIZE - sizeof(header));
+    if (backing_file) {
+        memcpy(names, backing_file, header.backing_name_size);
+        memcpy(names + header.backing_name_size, backing_fmt ?: "",
+               header.backing_fmt_size);
+    }
+    ret = bdrv_pwrite(bs, sizeof(header), names,
+                      DEDUP_HEADER_SIZE - sizeof(header));
+    g_free(names);
+    if (ret < 0) {
+        goto out;
+    }
+
+    entries = g_malloc(MAX(index.used, 1) * sizeof(*entries));
+    for (i = 0; i < index.size; i++) {
+        if (index.entries[i].location != 0) {
+            entries[n].hash = cpu_to_be64(index.entries[i].hash);
+            entries[n].location = cpu_to_be64(index.entries[i].location);
+            n++;
+        }
+    }
+    ret = bdrv_pwrite(bs, header.base_index_offset, entries,
+                      n * sizeof(*entries));
+    if (ret < 0) {
+        goto out;
+    }
+
+    /* The map is all zeroes, which the file reads as after its end */
+    ret = bdrv_truncate(bs, header.store_offset);
+
+out:
+    g_free(entries);
+    dedup_index_free(&index);
+    if (bs) {
+        bdrv_delete(bs);
+    }
+    return ret < 0 ? ret : 0;
+}
+
+static QEMUOptionParameter dedup_create_options[] = {
+    {
+        .name = BLOCK_OPT_SIZE,
+        .type = OPT_SIZE,
+        .help = "Virtual disk size"
+    },
+    {
+        .name = BLOCK_OPT_BACKING_FILE,
+        .type = OPT_STRING,
+        .help = "File name of the base image"
+    },
+    {
+        .name = BLOCK_OPT_BACKING_FMT,
+        .type = OPT_STRING,
+        .help = "Image format of the base image"
+    },
+    {
+        .name = BLOCK_OPT_CLUSTER_SIZE,
+        .type = OPT_SIZE,
+        .help = "Deduplication chunk size",
+        .value = { .n = OVERLAY_DEFAULT_CHUNK_SIZE },
+    },
+    { NULL }
+};
+
+static BlockDriver bdrv_dedup = {
+    .format_name            = "dedup",
+    .instance_size          = sizeof(BDRVDedupState),
+
+    .bdrv_probe             = dedup_probe,
+    .bdrv_open              = dedup_open,
+    .bdrv_close             = dedup_close,
+    .bdrv_create            = dedup_create,
+
+    .bdrv_co_readv          = dedup_co_readv,
+    .bdrv_co_writev         = dedup_co_writev,
+    .bdrv_co_flush_to_os    = dedup_co_flush_to_os,
+    .bdrv_co_is_allocated   = dedup_co_is_allocated,
+
+    .bdrv_get_info          = dedup_get_info,
+    .bdrv_check             = dedup_check,
+
+    .create_options         = dedup_create_options,
+};
+
+static void bdrv_dedup_init(void)
+{
+    bdrv_register(&bdrv_dedup);
+}
+
+block_init(bdrv_dedup_init);
@@ -0,0 +1,544 @@
+/*
+ * Block driver for sparse disk deltas
+ *
+ * Copyright Carnegie Mellon University 2012
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "block_int.h"
+#include "module.h"
+#include "qemu-coroutine.h"
+#include "qemu-error.h"
+#include "qerror.h"
+#include "block/overlay.h"
+
+/*
+ * A delta holds the chunks of a disk that differ from its base image, like
+ * the disk overlays that cloudlets ship to synthesize a VM from a base VM.
+ * The file is laid out as follows:
+ *
+ * +--------+-------+--------+--------+-----+
+ * | header | index | chunk0 | chunk1 | ... |
+ * +--------+-------+--------+--------+-----+
+ *
+ * The index has an entry for each chunk of the disk, which is either the
+ * offset of the chunk data in the file, DELTA_ENTRY_ZERO for a chunk that
+ * reads as zeroes, or DELTA_ENTRY_BASE for a chunk that is read from the base
+ * image at the same place.  The whole index is kept in memory, so looking up a
+ * chunk never costs I/O.
+ *
+ * Deltas are meant to be opened read-only as the backing file of a qcow2 image
+ * that receives the writes of the VM.  Writing to a delta directly is supported
+ * so that qemu-img can create one, but is not optimized: chunks are appended
+ * to the file and the index is updated one entry at a time.
+ *
+ * All fields are big-endian on disk.
+ */
+
+#define DELTA_MAGIC             (('Q' << 24) | ('D' << 16) | ('L' << 8) | 'T')
+
+/* Feature bits must be used when the on-disk format changes */
+#define DELTA_FEATURE_MASK      0
+
+#define DELTA_HEADER_SIZE       4096
+
+/* Index entries that are not an offset in the file */
+#define DELTA_ENTRY_BASE    0ULL
+#define DELTA_ENTRY_ZERO    1ULL
+
+typedef struct {
+    uint32_t magic;
+    uint32_t chunk_size;
+    uint64_t features;
+    uint64_t image_size;
+    uint64_t index_offset;
+    uint32_t backing_filename_offset;   /* in bytes from start of header */
+    uint32_t backing_filename_size;
+    uint32_t backing_fmt_offset;
+    uint32_t backing_fmt_size;
+} DeltaHeader;
+
+typedef struct {
+    DeltaHeader header;                 /* cpu-endian */
+    int chunk_sectors;
+    int64_t nb_chunks;
+    uint64_t *index;                    /* cpu-endian */
+    uint64_t data_end;                  /* where the next chunk is appended */
+    CoMutex lock;                       /* serializes writes */
+} BDRVDeltaState;
+
+static void delta_header_to_cpu(DeltaHeader *header)
+{
+    header->magic = be32_to_cpu(header->magic);
+    header->chunk_size = be32_to_cpu(header->chunk_size);
+    header->features = be64_to_cpu(header->features);
+    header->image_size = be64_to_cpu(header->image_size);
+    header->index_offset = be64_to_cpu(header->index_offset);
+    header->backing_filename_offset =
+        be32_to_cpu(header->backing_filename_offset);
+    header->backing_filename_size = be32_to_cpu(header->backing_filename_size);
+    header->backing_fmt_offset = be32_to_cpu(header->backing_fmt_offset);
+    header->backing_fmt_size = be32_to_cpu(header->backing_fmt_size);
+}
+
+static void delta_header_to_be(DeltaHeader *header)
+{
+    header->magic = cpu_to_be32(header->magic);
+    header->chunk_size = cpu_to_be32(header->chunk_size);
+    header->features = cpu_to_be64(header->features);
+    header->image_size = cpu_to_be64(header->image_size);
+    header->index_offset = cpu_to_be64(header->index_offset);
+    header->backing_filename_offset =
+        cpu_to_be32(header->backing_filename_offset);
+    header->backing_filename_size = cpu_to_be32(header->backing_filename_size);
+    header->backing_fmt_offset = cpu_to_be32(header->backing_fmt_offset);
+    header->backing_fmt_size = cpu_to_be32(header->backing_fmt_size);
+}
+
+static uint64_t delta_index_size(uint64_t image_size, uint32_t chunk_size)
+{
+    return QEMU_ALIGN_UP(DIV_ROUND_UP(image_size, chunk_size) *
+                         sizeof(uint64_t), BDRV_SECTOR_SIZE);
+}
+
+static int delta_probe(const uint8_t *buf, int buf_size, const char *filename)
+{
+    if (buf_size < sizeof(uint32_t)) {
+        return 0;
+    }
+    if (be32_to_cpu(*(const uint32_t *)buf) != DELTA_MAGIC) {
+        return 0;
+    }
+    return 100;
+}
+
+static int delta_open(BlockDriverState *bs, int flags)
+{
+    BDRVDeltaState *s = bs->opaque;
+    DeltaHeader *header = &s->header;
+    uint8_t *buf;
+    uint64_t index_size;
+    int64_t file_size, i;
+    int ret;
+
+    buf = g_malloc(DELTA_HEADER_SIZE);
+    ret = bdrv_pread(bs->file, 0, buf, DELTA_HEADER_SIZE);
+    if (ret < 0) {
+        goto out;
+    }
+    memcpy(header, buf, sizeof(*header));
+    delta_header_to_cpu(header);
+
+    ret = -EINVAL;
+    if (header->magic != DELTA_MAGIC ||
+        !overlay_is_chunk_size_valid(header->chunk_size) ||
+        header->image_size % BDRV_SECTOR_SIZE ||
+        header->index_offset < DELTA_HEADER_SIZE ||
+        header->index_offset % BDRV_SECTOR_SIZE) {
+        goto out;
+    }
+    if (header->features & ~DELTA_FEATURE_MASK) {
+        char msg[64];
+        snprintf(msg, sizeof(msg), "%" PRIx64,
+                 header->features & ~DELTA_FEATURE_MASK);
+        qerror_report(QERR_UNKNOWN_BLOCK_FORMAT_FEATURE,
+            bs->device_name, "delta", msg);
+        ret = -ENOTSUP;
+        goto out;
+    }
+
+    if (header->backing_filename_size) {
+        ret = overlay_read_string(buf, DELTA_HEADER_SIZE,
+                                  header->backing_filename_offset,
+                                  header->backing_filename_size,
+                                  bs->backing_file, sizeof(bs->backing_file));
+        if (ret < 0) {
+            goto out;
+        }
+        ret = overlay_read_string(buf, DELTA_HEADER_SIZE,
+                                  header->backing_fmt_offset,
+                                  header->backing_fmt_size,
+                                  bs->backing_format,
+                                  sizeof(bs->backing_format));
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    bs->total_sectors = header->image_size / BDRV_SECTOR_SIZE;
+    s->chunk_sectors = header->chunk_size / BDRV_SECTOR_SIZE;
+    s->nb_chunks = DIV_ROUND_UP(header->image_size, header->chunk_size);
+
+    /* The index must be in the file before it is allocated in memory */
+    file_size = bdrv_getlength(bs->file);
+    if (file_size < 0) {
+        ret = file_size;
+        goto out;
+    }
+    index_size = delta_index_size(header->image_size, header->chunk_size);
+    if (header->index_offset > file_size ||
+        index_size > file_size - header->index_offset) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    /* Chunks are appended after the index and whatever else the file holds */
+    s->data_end = QEMU_ALIGN_UP(file_size, header->chunk_size);
+
+    s->index = g_malloc(s->nb_chunks * sizeof(uint64_t));
+    ret = bdrv_pread(bs->file, header->index_offset, s->index,
+                     s->nb_chunks * sizeof(uint64_t));
+    if (ret < 0) {
+        goto out;
+    }
+    for (i = 0; i < s->nb_chunks; i++) {
+        s->index[i] = be64_to_cpu(s->index[i]);
+    }
+
+    qemu_co_mutex_init(&s->lock);
+    ret = 0;
+
+out:
+    if (ret < 0) {
+        g_free(s->index);
+        s->index = NULL;
+    }
+    g_free(buf);
+    return ret;
+}
+
+static void delta_close(BlockDriverState *bs)
+{
+    BDRVDeltaState *s = bs->opaque;
+
+    g_free(s->index);
+}
+
+static int delta_chunk_source(BlockDriverState *bs, int64_t chunk,
+                              int64_t *sector)
+{
+    BDRVDeltaState *s = bs->opaque;
+    uint64_t entry = s->index[chunk];
+
+    if (entry == DELTA_ENTRY_ZERO) {
+        *sector = 0;
+        return OVERLAY_SRC_ZERO;
+    } else if (entry == DELTA_ENTRY_BASE) {
+        *sector = chunk * s->chunk_sectors;
+        return OVERLAY_SRC_BASE;
+    }
+    *sector = entry / BDRV_SECTOR_SIZE;
+    return OVERLAY_SRC_FILE;
+}
+
+static int coroutine_fn delta_co_readv(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
+{
+    BDRVDeltaState *s = bs->opaque;
+
+    return overlay_co_readv(bs, s->chunk_sectors, delta_chunk_source,
+                            sector_num, nb_sectors, qiov);
+}
+
+static int delta_write_index_entry(BlockDriverState *bs, int64_t chunk,
+                                   uint64_t entry)
+{
+    BDRVDeltaState *s = bs->opaque;
+    uint64_t be_entry = cpu_to_be64(entry);
+    int ret;
+
+    ret = bdrv_pwrite(bs->file, s->header.index_offset +
+                      chunk * sizeof(uint64_t), &be_entry, sizeof(be_entry));
+    if (ret < 0) {
+        return ret;
+    }
+    s->index[chunk] = entry;
+    return 0;
+}
+
+/* Writes part of a chunk that is not stored in the delta yet */
+static int coroutine_fn delta_co_write_new_chunk(BlockDriverState *bs,
+    int64_t chunk, int offset, int nb_sectors, QEMUIOVector *qiov)
+{
+    BDRVDeltaState *s = bs->opaque;
+    uint32_t chunk_size = s->header.chunk_size;
+    struct iovec iov;
+    QEMUIOVector chunk_qiov;
+    uint64_t data_offset;
+    uint8_t *buf;
+    int ret;
+
+    buf = qemu_blockalign(bs, chunk_size);
+    iov.iov_base = buf;
+    iov.iov_len = chunk_size;
+    qemu_iovec_init_external(&chunk_qiov, &iov, 1);
+
+    if (nb_sectors < s->chunk_sectors) {
+        ret = delta_co_readv(bs, chunk * s->chunk_sectors, s->chunk_sectors,
+                             &chunk_qiov);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+    qemu_iovec_to_buffer(qiov, buf + offset * BDRV_SECTOR_SIZE);
+
+    if (buffer_is_zero(buf, chunk_size)) {
+        ret = delta_write_index_entry(bs, chunk, bs->backing_hd ?
+                                      DELTA_ENTRY_ZERO : DELTA_ENTRY_BASE);
+        goto out;
+    }
+
+    /* The index entry is written once the data it points to is stable */
+    data_offset = s->data_end;
+    ret = bdrv_co_writev(bs->file, data_offset / BDRV_SECTOR_SIZE,
+                         s->chunk_sectors, &chunk_qiov);
+    if (ret < 0) {
+        goto out;
+    }
+    s->data_end += chunk_size;
+    ret = bdrv_co_flush(bs->file);
+    if (ret < 0) {
+        goto out;
+    }
+    ret = delta_write_index_entry(bs, chunk, data_offset);
+
+out:
+    qemu_vfree(buf);
+    return ret;
+}
+
+static int coroutine_fn delta_co_writev(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
+{
+    BDRVDeltaState *s = bs->opaque;
+    QEMUIOVector hd_qiov;
+    uint64_t bytes_done = 0;
+    int ret = 0;
+
+    qemu_co_mutex_lock(&s->lock);
+    qemu_iovec_init(&hd_qiov, qiov->niov);
+    while (nb_sectors > 0) {
+        int64_t chunk = sector_num / s->chunk_sectors;
+        int offset = sector_num % s->chunk_sectors;
+        uint64_t entry = s->index[chunk];
+        int n = MIN(nb_sectors, s->chunk_sectors - offset);
+
+        qemu_iovec_reset(&hd_qiov);
+        qemu_iovec_copy(&hd_qiov, qiov, bytes_done, n * BDRV_SECTOR_SIZE);
+
+        if (entry == DELTA_ENTRY_BASE || entry == DELTA_ENTRY_ZERO) {
+            ret = delta_co_write_new_chunk(bs, chunk, offset, n, &hd_qiov);
+        } else {
+            ret = bdrv_co_writev(bs->file, entry / BDRV_SECTOR_SIZE + offset,
+                                 n, &hd_qiov);
+        }
+        if (ret < 0) {
+            break;
+        }
+
+        nb_sectors -= n;
+        sector_num += n;
+        bytes_done += n * BDRV_SECTOR_SIZE;
+    }
+    qemu_iovec_destroy(&hd_qiov);
+    qemu_co_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
+static int coroutine_fn delta_co_is_allocated(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, int *pnum)
+{
+    BDRVDeltaState *s = bs->opaque;
+    int64_t chunk = sector_num / s->chunk_sectors;
+    bool allocated = s->index[chunk] != DELTA_ENTRY_BASE;
+    int n = s->chunk_sectors - sector_num % s->chunk_sectors;
+
+    while (n < nb_sectors &&
+           (s->index[++chunk] != DELTA_ENTRY_BASE) == allocated) {
+        n += s->chunk_sectors;
+    }
+
+    *pnum = MIN(n, nb_sectors);
+    return allocated;
+}
+
+static int delta_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
+{
+    BDRVDeltaState *s = bs->opaque;
+
+    bdi->cluster_size = s->header.chunk_size;
+    return 0;
+}
+
+static int delta_check(BlockDriverState *bs, BdrvCheckResult *result)
+{
+    BDRVDeltaState *s = bs->opaque;
+    uint64_t data_start = s->header.index_offset +
+        delta_index_size(s->header.image_size, s->header.chunk_size);
+    int64_t i;
+
+    result->bfi.total_clusters = s->nb_chunks;
+    for (i = 0; i < s->nb_chunks; i++) {
+        uint64_t entry = s->index[i];
+
+        if (entry == DELTA_ENTRY_BASE) {
+            continue;
+        }
+        result->bfi.allocated_clusters++;
+        if (entry == DELTA_ENTRY_ZERO) {
+            continue;
+        }
+        if (entry < data_start || entry >= s->data_end ||
+            entry % s->header.chunk_size) {
+            fprintf(stderr, "ERROR chunk %" PRId64 " refers to invalid "
+                    "offset %" PRIu64 "\n", i, entry);
+            result->corruptions++;
+        } else if (i > 0 && s->index[i - 1] > DELTA_ENTRY_ZERO &&
+                   entry != s->index[i - 1] + s->header.chunk_size) {
+            result->bfi.fragmented_clusters++;
+        }
+    }
+    return 0;
+}
+
+static int delta_create(const char *filename, QEMUOptionParameter *options)
+{
+    DeltaHeader header = {
+        .magic = DELTA_MAGIC,
+        .chunk_size = OVERLAY_DEFAULT_CHUNK_SIZE,
+        .index_offset = DELTA_HEADER_SIZE,
+    };
+    DeltaHeader be_header;
+    const char *backing_file = NULL;
+    const char *backing_fmt = NULL;
+    BlockDriverState *bs = NULL;
+    uint8_t *buf;
+    int ret;
+
+    while (options && options->name) {
+        if (!strcmp(options->name, BLOCK_OPT_SIZE)) {
+            header.image_size = options->value.n;
+        } else if (!strcmp(options->name, BLOCK_OPT_BACKING_FILE)) {
+            backing_file = options->value.s;
+        } else if (!strcmp(options->name, BLOCK_OPT_BACKING_FMT)) {
+            backing_fmt = options->value.s;
+        } else if (!strcmp(options->name, BLOCK_OPT_CLUSTER_SIZE)) {
+            if (options->value.n) {
+                header.chunk_size = options->value.n;
+            }
+        }
+        options++;
+    }
+
+    if (!overlay_is_chunk_size_valid(header.chunk_size)) {
+        error_report("Chunk size must be a power of two between %d and %d",
+                     OVERLAY_MIN_CHUNK_SIZE, OVERLAY_MAX_CHUNK_SIZE);
+        return -EINVAL;
+    }
+    header.image_size = QEMU_ALIGN_UP(header.image_size, BDRV_SECTOR_SIZE);
+
+    buf = g_malloc0(DELTA_HEADER_SIZE);
+    if (backing_file) {
+        size_t name_size = strlen(backing_file);
+        size_t fmt_size = backing_fmt ? strlen(backing_fmt) : 0;
+
+        if (name_size + fmt_size > DELTA_HEADER_SIZE - sizeof(header)) {
+            error_report("Backing file name too long");
+            ret = -EINVAL;
+            goto out;
+        }
+        header.backing_filename_offset = sizeof(header);
+        header.backing_filename_size = name_size;
+        header.backing_fmt_offset = sizeof(header) + name_size;
+        header.backing_fmt_size = fmt_size;
+        memcpy(buf + header.backing_filename_offset, backing_file, name_size);
+        memcpy(buf + header.backing_fmt_offset, backing_fmt ?: "", fmt_size);
+    }
+    be_header = header;
+    delta_header_to_be(&be_header);
+    memcpy(buf, &be_header, sizeof(be_header));
+
+    ret = bdrv_create_file(filename, NULL);
+    if (ret < 0) {
+        goto out;
+    }
+    ret = bdrv_file_open(&bs, filename, BDRV_O_RDWR | BDRV_O_CACHE_WB);
+    if (ret < 0) {
+        goto out;
+    }
+    ret = bdrv_truncate(bs, 0);
+    if (ret < 0) {
+        goto out;
+    }
+    ret = bdrv_pwrite(bs, 0, buf, DELTA_HEADER_SIZE);
+    if (ret < 0) {
+        goto out;
+    }
+
+    /* An index of zeroes refers to the base image for all chunks */
+    ret = bdrv_truncate(bs, header.index_offset +
+                        delta_index_size(header.image_size,
+                                         header.chunk_size));
+
+out:
+    if (bs) {
+        bdrv_delete(bs);
+    }
+    g_free(buf);
+    return ret < 0 ? ret : 0;
+}
+
+static QEMUOptionParameter delta_create_options[] = {
+    {
+        .name = BLOCK_OPT_SIZE,
+        .type = OPT_SIZE,
+        .help = "Virtual disk size"
+    },
+    {
+        .name = BLOCK_OPT_BACKING_FILE,
+        .type = OPT_STRING,
+        .help = "File name of the base image"
+    },
+    {
+        .name = BLOCK_OPT_BACKING_FMT,
+        .type = OPT_STRING,
+        .help = "Image format of the base image"
+    },
+    {
+        .name = BLOCK_OPT_CLUSTER_SIZE,
+        .type = OPT_SIZE,
+        .help = "Delta chunk size",
+        .value = { .n = OVERLAY_DEFAULT_CHUNK_SIZE },
+    },
+    { NULL }
+};
+
+static BlockDriver bdrv_delta = {
+    .format_name            = "delta",
+    .instance_size          = sizeof(BDRVDeltaState),
+
+    .bdrv_probe             = delta_probe,
+    .bdrv_open              = delta_open,
+    .bdrv_close             = delta_close,
+    .bdrv_create            = delta_create,
+
+    .bdrv_co_readv          = delta_co_readv,
+    .bdrv_co_writev         = delta_co_writev,
+    .bdrv_co_is_allocated   = delta_co_is_allocated,
+
+    .bdrv_get_info          = delta_get_info,
+    .bdrv_check             = delta_check,
+
+    .create_options         = delta_create_options,
+};
+
+static void bdrv_delta_init(void)
+{
+    bdrv_register(&bdrv_delta);
+}
+
+block_init(bdrv_delta_init);
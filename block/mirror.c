@@ -0,0 +1,386 @@
+/*
+ * Image mirroring
+ *
+ * Copyright Red Hat, Inc. 2012
+ *
+ * Authors:
+ *  Paolo Bonzini  <pbonzini@redhat.com>
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include "trace.h"
+#include "block_int.h"
+#include "ratelimit.h"
+#include "bitmap.h"
+
+enum {
+    /*
+     * Data is copied in units of the dirty bitmap, so that a chunk that is
+     * written by the guest while it is copied only has to be copied again.
+     */
+    MIRROR_CHUNK_SECTORS = BDRV_SECTORS_PER_DIRTY_CHUNK,
+
+    /* Number of copy requests that are kept in flight */
+    MIRROR_MAX_IN_FLIGHT = 16,
+};
+
+#define SLICE_TIME 100000000ULL /* ns */
+
+typedef struct MirrorBlockJob {
+    BlockJob common;
+    RateLimit limit;
+    BlockDriverState *target;
+    MirrorSyncMode mode;
+    bool synced;                /* BLOCK_JOB_READY was sent */
+    bool should_complete;       /* block-job-complete was requested */
+
+    int64_t end;                /* size of the source in sectors */
+    int64_t nb_chunks;
+    int64_t cursor;             /* where to look for dirty chunks next */
+    unsigned long *in_flight_bitmap; /* chunks that are being copied */
+    int in_flight;              /* mirror_copy_entry() coroutines */
+    bool waiting;               /* mirror_run() waits for a request */
+    int ret;                    /* first error of a request */
+} MirrorBlockJob;
+
+typedef struct {
+    MirrorBlockJob *job;
+    int64_t sector_num;
+    int nb_sectors;
+} MirrorRequest;
+
+static void coroutine_fn mirror_copy_entry(void *opaque)
+{
+    MirrorRequest *req = opaque;
+    MirrorBlockJob *s = req->job;
+    BlockDriverState *source = s->common.bs;
+    struct iovec iov;
+    QEMUIOVector qiov;
+    int ret;
+
+    iov.iov_len = req->nb_sectors * BDRV_SECTOR_SIZE;
+    iov.iov_base = qemu_blockalign(source, iov.iov_len);
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    ret = bdrv_co_readv(source, req->sector_num, req->nb_sectors, &qiov);
+    if (ret >= 0) {
+        ret = bdrv_co_writev(s->target, req->sector_num, req->nb_sectors,
+                             &qiov);
+    }
+    qemu_vfree(iov.iov_base);
+
+    if (ret < 0) {
+        /* The chunk has to be copied again if the job is restarted */
+        bdrv_set_dirty(source, req->sector_num, req->nb_sectors);
+        if (s->ret == 0) {
+            s->ret = ret;
+        }
+    }
+    clear_bit(req->sector_num / MIRROR_CHUNK_SECTORS, s->in_flight_bitmap);
+    g_free(req);
+
+    /* mirror_run() may complete the job, don't touch s afterwards */
+    s->in_flight--;
+    if (s->waiting) {
+        s->waiting = false;
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+}
+
+/* Wait until fewer than @max_in_flight requests are in flight */
+static void coroutine_fn mirror_wait_requests(MirrorBlockJob *s,
+                                              int max_in_flight)
+{
+    while (s->in_flight > 0 && s->in_flight >= max_in_flight) {
+        s->waiting = true;
+        qemu_coroutine_yield();
+    }
+}
+
+/*
+ * Return the first dirty chunk at or after the cursor that is not being
+ * copied, wrapping around at the end of the image, or -1 if there is none.
+ */
+static int64_t mirror_next_chunk(MirrorBlockJob *s)
+{
+    unsigned long *dirty = s->common.bs->dirty_bitmap;
+    int64_t start = s->cursor, limit = s->nb_chunks;
+    int64_t chunk;
+    int pass;
+
+    for (pass = 0; pass < 2; pass++) {
+        chunk = find_next_bit(dirty, limit, start);
+        while (chunk < limit) {
+            if (!test_bit(chunk, s->in_flight_bitmap)) {
+                return chunk;
+            }
+            chunk = find_next_bit(dirty, limit, chunk + 1);
+        }
+        limit = s->cursor;
+        start = 0;
+    }
+    return -1;
+}
+
+/*
+ * Start copying the next dirty chunk.  Returns how long the caller has to
+ * wait because of the rate limit before trying again.
+ */
+static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
+{
+    MirrorRequest *req;
+    Coroutine *co;
+    int64_t chunk, sector_num;
+    int nb_sectors;
+
+    mirror_wait_requests(s, MIRROR_MAX_IN_FLIGHT);
+
+    chunk = mirror_next_chunk(s);
+    if (chunk < 0) {
+        /* All dirty chunks are being copied already, and were written again
+         * while they were.  Wait for a request to complete so that they can
+         * be copied once more.
+         */
+        mirror_wait_requests(s, s->in_flight);
+        return 0;
+    }
+
+    sector_num = chunk * MIRROR_CHUNK_SECTORS;
+    nb_sectors = MIN(MIRROR_CHUNK_SECTORS, s->end - sector_num);
+    if (s->common.speed && !block_job_is_cancelled(&s->common)) {
+        uint64_t delay_ns = ratelimit_calculate_delay(&s->limit, nb_sectors);
+        if (delay_ns > 0) {
+            return delay_ns;
+        }
+    }
+
+    trace_mirror_one_iteration(s, sector_num, nb_sectors, s->in_flight);
+
+    /* Clear the dirty bit before reading, so that guest writes that land
+     * during the copy mark the chunk dirty again.
+     */
+    bdrv_reset_dirty(s->common.bs, sector_num, nb_sectors);
+    set_bit(chunk, s->in_flight_bitmap);
+    s->cursor = chunk + 1;
+
+    req = g_malloc(sizeof(*req));
+    req->job = s;
+    req->sector_num = sector_num;
+    req->nb_sectors = nb_sectors;
+
+    s->in_flight++;
+    co = qemu_coroutine_create(mirror_copy_entry);
+    qemu_coroutine_enter(co, req);
+    return 0;
+}
+
+static void coroutine_fn mirror_run(void *opaque)
+{
+    MirrorBlockJob *s = opaque;
+    BlockDriverState *bs = s->common.bs;
+    BlockDriverState *base;
+    int64_t sector_num, cnt;
+    int ret = 0;
+    int n;
+
+    if (block_job_is_cancelled(&s->common)) {
+        goto immediate_exit;
+    }
+
+    s->common.len = bdrv_getlength(bs);
+    if (s->common.len < 0) {
+        ret = s->common.len;
+        goto immediate_exit;
+    }
+
+    s->end = s->common.len >> BDRV_SECTOR_BITS;
+    s->nb_chunks = DIV_ROUND_UP(s->end, MIRROR_CHUNK_SECTORS);
+    s->in_flight_bitmap = bitmap_new(s->nb_chunks);
+
+    /* Mark the data that has to be copied as dirty.  In "top" mode the
+     * target shares the backing file of the source, so only what is
+     * allocated in the top image is copied.
+     */
+    base = s->mode == MIRROR_SYNC_MODE_FULL ? NULL : bs->backing_hd;
+    for (sector_num = 0; sector_num < s->end; sector_num += n) {
+        ret = bdrv_co_is_allocated_above(bs, base, sector_num,
+                                         MIN(s->end - sector_num, INT_MAX >> 1),
+                                         &n);
+        if (ret < 0) {
+            goto immediate_exit;
+        }
+
+        assert(n > 0);
+        if (ret == 1) {
+            bdrv_set_dirty(bs, sector_num, n);
+        }
+    }
+    ret = 0;
+
+    for (;;) {
+        uint64_t delay_ns = 0;
+        bool should_complete = false;
+
+        if (s->ret < 0) {
+            ret = s->ret;
+            break;
+        }
+
+        /* A cancelled job leaves the target alone, even if it was in sync
+         * already.  Copies in flight are waited for on the way out, but
+         * nothing new is copied, so guest writes cannot hold it up.
+         */
+        if (block_job_is_cancelled(&s->common)) {
+            break;
+        }
+
+        cnt = bdrv_get_dirty_count(bs);
+        if (cnt != 0) {
+            delay_ns = mirror_iteration(s);
+        } else if (s->in_flight > 0) {
+            /* Nothing left to start, the target can only be flushed once
+             * the copies in flight are complete.
+             */
+            mirror_wait_requests(s, s->in_flight);
+            continue;
+        }
+
+        if (s->in_flight == 0 && cnt == 0) {
+            /* Everything that was dirty has been written, make it stable
+             * before telling anybody that the target is in sync.
+             */
+            trace_mirror_before_flush(s);
+            ret = bdrv_co_flush(s->target);
+            if (ret < 0) {
+                break;
+            }
+
+            if (!s->synced) {
+                s->common.offset = s->common.len;
+                block_job_ready(&s->common);
+                s->synced = true;
+            }
+
+            should_complete = s->should_complete;
+            cnt = bdrv_get_dirty_count(bs);
+        }
+
+        if (cnt == 0 && should_complete) {
+            /* The dirty bitmap is updated when a guest write completes.
+             * Wait for pending writes so that none is missed by the
+             * target before giving up on the source.
+             */
+            trace_mirror_before_drain(s, cnt);
+            bdrv_drain_all();
+            cnt = bdrv_get_dirty_count(bs);
+        }
+
+        trace_mirror_before_sleep(s, cnt, s->synced);
+        if (!s->synced) {
+            /* Publish progress */
+            s->common.offset = MAX(s->common.len -
+                                   cnt * MIRROR_CHUNK_SECTORS *
+                                   BDRV_SECTOR_SIZE, 0);
+
+            /* Note that even when no rate limit is applied we need to yield
+             * with no new I/O here so that qemu_aio_flush() returns once the
+             * requests in flight have completed.
+             */
+            block_job_sleep_ns(&s->common, rt_clock, delay_ns);
+            if (block_job_is_cancelled(&s->common)) {
+                break;
+            }
+        } else if (!should_complete) {
+            /* In sync, keep copying guest writes as they come in */
+            if (cnt == 0 && delay_ns == 0) {
+                delay_ns = SLICE_TIME;
+            }
+            block_job_sleep_ns(&s->common, rt_clock, delay_ns);
+        } else if (cnt == 0) {
+            /* The source and the target are identical */
+            break;
+        }
+    }
+
+immediate_exit:
+    mirror_wait_requests(s, 1);
+    if (ret == 0) {
+        ret = s->ret;
+    }
+    g_free(s->in_flight_bitmap);
+    bdrv_set_dirty_tracking(bs, 0);
+
+    if (s->should_complete && ret == 0) {
+        /* Replace the image of the device with the target, in "top" mode
+         * the target keeps using the backing files of the source.
+         */
+        bdrv_swap(s->target, bs);
+        if (s->mode == MIRROR_SYNC_MODE_TOP) {
+            bs->backing_hd = s->target->backing_hd;
+            s->target->backing_hd = NULL;
+        }
+    }
+    bdrv_delete(s->target);
+    block_job_completed(&s->common, ret);
+}
+
+static void mirror_set_speed(BlockJob *job, int64_t speed, Error **errp)
+{
+    MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
+
+    if (speed < 0) {
+        error_set(errp, QERR_INVALID_PARAMETER, "speed");
+        return;
+    }
+    ratelimit_set_speed(&s->limit, speed / BDRV_SECTOR_SIZE, SLICE_TIME);
+}
+
+static void mirror_complete(BlockJob *job, Error **errp)
+{
+    MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
+
+    if (!s->synced) {
+        error_set(errp, QERR_BLOCK_JOB_NOT_READY, job->bs->device_name);
+        return;
+    }
+
+    s->should_complete = true;
+    if (job->co && !job->busy) {
+        qemu_coroutine_enter(job->co, NULL);
+    }
+}
+
+static BlockJobType mirror_job_type = {
+    .instance_size = sizeof(MirrorBlockJob),
+    .job_type      = "mirror",
+    .set_speed     = mirror_set_speed,
+    .complete      = mirror_complete,
+};
+
+void mirror_start(BlockDriverState *bs, BlockDriverState *target,
+                  int64_t speed, MirrorSyncMode mode,
+                  BlockDriverCompletionFunc *cb,
+                  void *opaque, Error **errp)
+{
+    MirrorBlockJob *s;
+
+    s = block_job_create(&mirror_job_type, bs, speed, cb, opaque, errp);
+    if (!s) {
+        return;
+    }
+
+    s->target = target;
+    s->mode = mode;
+
+    /* Writes from now on are tracked, anything older is found by the
+     * allocation scan in mirror_run().
+     */
+    bdrv_set_dirty_tracking(bs, 1);
+
+    s->common.co = qemu_coroutine_create(mirror_run);
+    trace_mirror_start(bs, target, s, s->common.co, opaque);
+    qemu_coroutine_enter(s->common.co, s);
+}
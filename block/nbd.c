@@ -65,6 +65,16 @@ typedef struct BDRVNBDState {
     Coroutine *recv_coroutine[MAX_NBD_REQUESTS];
     struct nbd_reply reply;
 
+    /* Extents of the last NBD_CMD_BLOCK_STATUS reply, so that the
+     * allocation status of a range needs one round trip to the server */
+    int64_t status_sector;
+    int nb_status_extents;
+    struct {
+        int nb_sectors;
+        uint32_t flags;
+    } status_extents[NBD_MAX_EXTENTS];
+    unsigned status_generation;     /* see nbd_invalidate_status() */
+
     /* If it begins with  '/', this is a UNIX domain socket. Otherwise,
      * it's a string of the form <hostname|ip4|\[ip6\]>:port
      */
@@ -243,6 +253,38 @@ static void nbd_co_receive_reply(BDRVNBDState *s, struct nbd_request *request,
     }
 }
 
+static void nbd_co_receive_status_reply(BDRVNBDState *s,
+                                        struct nbd_request *request,
+                                        struct nbd_reply *reply,
+                                        uint8_t *buf)
+{
+    uint32_t nb_extents;
+    int ret;
+
+    qemu_coroutine_yield();
+    *reply = s->reply;
+    if (reply->handle != request->handle) {
+        reply->error = EIO;
+        return;
+    }
+
+    if (reply->error == 0) {
+        ret = qemu_co_recv(s->sock, buf, 4);
+        nb_extents = be32_to_cpup((uint32_t*)buf);
+        if (ret != 4 || nb_extents == 0 || nb_extents > NBD_MAX_EXTENTS) {
+            reply->error = EIO;
+        } else {
+            ret = qemu_co_recv(s->sock, buf + 4, nb_extents * 8);
+            if (ret != nb_extents * 8) {
+                reply->error = EIO;
+            }
+        }
+    }
+
+    /* Tell the read handler to read another header.  */
+    s->reply.handle = 0;
+}
+
 static void nbd_coroutine_end(BDRVNBDState *s, struct nbd_request *request)
 {
     int i = HANDLE_TO_INDEX(s, request->handle);
@@ -331,6 +373,15 @@ static int nbd_open(BlockDriverState *bs, const char* filename, int flags)
     return result;
 }
 
+/* Drop the cached extents.  Writes and discards call this both when they
+ * are sent and when they complete, because the server may still be working
+ * on one while it answers a status query sent after it. */
+static void nbd_invalidate_status(BDRVNBDState *s)
+{
+    s->nb_status_extents = 0;
+    s->status_generation++;
+}
+
 static int nbd_co_readv_1(BlockDriverState *bs, int64_t sector_num,
                           int nb_sectors, QEMUIOVector *qiov,
                           int offset)
@@ -373,6 +424,8 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
+    nbd_invalidate_status(s);
+
     nbd_coroutine_start(s, &request);
     ret = nbd_co_send_request(s, &request, qiov->iov, offset);
     if (ret < 0) {
@@ -381,6 +434,7 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
         nbd_co_receive_reply(s, &request, &reply, NULL, 0);
     }
     nbd_coroutine_end(s, &request);
+    nbd_invalidate_status(s);
     return -reply.error;
 }
 
@@ -467,6 +521,8 @@ static int nbd_co_discard(BlockDriverState *bs, int64_t sector_num,
     request.from = sector_num * 512;;
     request.len = nb_sectors * 512;
 
+    nbd_invalidate_status(s);
+
     nbd_coroutine_start(s, &request);
     ret = nbd_co_send_request(s, &request, NULL, 0);
     if (ret < 0) {
@@ -475,9 +531,89 @@ static int nbd_co_discard(BlockDriverState *bs, int64_t sector_num,
         nbd_co_receive_reply(s, &request, &reply, NULL, 0);
     }
     nbd_coroutine_end(s, &request);
+    nbd_invalidate_status(s);
     return -reply.error;
 }
 
+/* Look up sector_num in the cached extents, returns -1 on a miss */
+static int nbd_cached_status(BDRVNBDState *s, int64_t sector_num,
+                             int nb_sectors, int *pnum)
+{
+    int64_t start = s->status_sector;
+    int i;
+
+    for (i = 0; i < s->nb_status_extents; i++) {
+        int64_t end = start + s->status_extents[i].nb_sectors;
+        if (sector_num >= start && sector_num < end) {
+            *pnum = MIN(nb_sectors, end - sector_num);
+            return !(s->status_extents[i].flags & NBD_STATE_HOLE);
+        }
+        start = end;
+    }
+    return -1;
+}
+
+static int coroutine_fn nbd_co_is_allocated(BlockDriverState *bs,
+                                            int64_t sector_num,
+                                            int nb_sectors, int *pnum)
+{
+    BDRVNBDState *s = bs->opaque;
+    struct nbd_request request;
+    struct nbd_reply reply;
+    uint8_t buf[NBD_STATUS_REPLY_SIZE];
+    unsigned generation = s->status_generation;
+    uint32_t nb_extents;
+    ssize_t ret;
+    int i;
+
+    if (!(s->nbdflags & NBD_FLAG_SEND_BLOCK_STATUS)) {
+        *pnum = nb_sectors;
+        return 1;
+    }
+
+    ret = nbd_cached_status(s, sector_num, nb_sectors, pnum);
+    if (ret >= 0) {
+        return ret;
+    }
+
+    /* Ask for as much as the 32-bit length allows, later queries of the
+     * following sectors are answered from the cache then */
+    request.type = NBD_CMD_BLOCK_STATUS;
+    request.from = sector_num * 512;
+    request.len = MIN(s->size / 512 - sector_num, UINT32_MAX / 512) * 512;
+
+    nbd_coroutine_start(s, &request);
+    ret = nbd_co_send_request(s, &request, NULL, 0);
+    if (ret < 0) {
+        reply.error = -ret;
+    } else {
+        nbd_co_receive_status_reply(s, &request, &reply, buf);
+    }
+    nbd_coroutine_end(s, &request);
+    if (reply.error) {
+        return -reply.error;
+    }
+
+    nb_extents = be32_to_cpup((uint32_t*)buf);
+    for (i = 0; i < nb_extents; i++) {
+        s->status_extents[i].nb_sectors =
+            be32_to_cpup((uint32_t*)(buf + 4 + i * 8)) / 512;
+        s->status_extents[i].flags =
+            be32_to_cpup((uint32_t*)(buf + 8 + i * 8));
+    }
+    s->status_sector = sector_num;
+    s->nb_status_extents = nb_extents;
+
+    ret = nbd_cached_status(s, sector_num, nb_sectors, pnum);
+
+    /* A write that was sent or completed meanwhile may have changed the
+     * status */
+    if (generation != s->status_generation) {
+        s->nb_status_extents = 0;
+    }
+    return ret < 0 ? -EIO : ret;
+}
+
 static void nbd_close(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
@@ -503,6 +639,7 @@ static BlockDriver bdrv_nbd = {
     .bdrv_close          = nbd_close,
     .bdrv_co_flush_to_os = nbd_co_flush,
     .bdrv_co_discard     = nbd_co_discard,
+    .bdrv_co_is_allocated = nbd_co_is_allocated,
     .bdrv_getlength      = nbd_getlength,
     .protocol_name       = "nbd",
 };
@@ -0,0 +1,131 @@
+/*
+ * Helpers for the chunked overlay formats
+ *
+ * Copyright Carnegie Mellon University 2012
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "block/overlay.h"
+
+bool overlay_is_chunk_size_valid(uint32_t chunk_size)
+{
+    return chunk_size >= OVERLAY_MIN_CHUNK_SIZE &&
+           chunk_size <= OVERLAY_MAX_CHUNK_SIZE &&
+           (chunk_size & (chunk_size - 1)) == 0;
+}
+
+/* Copies a string stored in the header area into @dest */
+int overlay_read_string(const uint8_t *header_buf, size_t header_size,
+                        uint32_t offset, uint32_t size,
+                        char *dest, size_t dest_size)
+{
+    if (offset > header_size || size > header_size - offset ||
+        size >= dest_size) {
+        return -EINVAL;
+    }
+    memcpy(dest, header_buf + offset, size);
+    dest[size] = '\0';
+    return 0;
+}
+
+/* Reads from the base image, which reads as zeroes after its end */
+static int coroutine_fn overlay_co_read_base(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
+{
+    QEMUIOVector base_qiov;
+    int64_t base_sectors;
+    int n = 0;
+    int ret;
+
+    if (bs->backing_hd) {
+        base_sectors = bdrv_getlength(bs->backing_hd);
+        if (base_sectors < 0) {
+            return base_sectors;
+        }
+        base_sectors /= BDRV_SECTOR_SIZE;
+        n = MAX(0, MIN(nb_sectors, base_sectors - sector_num));
+    }
+
+    if (n < nb_sectors) {
+        qemu_iovec_memset_skip(qiov, 0, (nb_sectors - n) * BDRV_SECTOR_SIZE,
+                               n * BDRV_SECTOR_SIZE);
+    }
+    if (n == 0) {
+        return 0;
+    } else if (n == nb_sectors) {
+        return bdrv_co_readv(bs->backing_hd, sector_num, n, qiov);
+    }
+
+    qemu_iovec_init(&base_qiov, qiov->niov);
+    qemu_iovec_copy(&base_qiov, qiov, 0, n * BDRV_SECTOR_SIZE);
+    ret = bdrv_co_readv(bs->backing_hd, sector_num, n, &base_qiov);
+    qemu_iovec_destroy(&base_qiov);
+    return ret;
+}
+
+int coroutine_fn overlay_co_read_source(BlockDriverState *bs, int src,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
+{
+    switch (src) {
+    case OVERLAY_SRC_ZERO:
+        qemu_iovec_memset(qiov, 0, nb_sectors * BDRV_SECTOR_SIZE);
+        return 0;
+    case OVERLAY_SRC_BASE:
+        return overlay_co_read_base(bs, sector_num, nb_sectors, qiov);
+    default:
+        return bdrv_co_readv(bs->file, sector_num, nb_sectors, qiov);
+    }
+}
+
+/*
+ * Reads as many chunks as possible with a single request, so that a run of
+ * chunks whose data is contiguous in its source becomes one vectored read.
+ */
+int coroutine_fn overlay_co_readv(BlockDriverState *bs, int chunk_sectors,
+    OverlayChunkSourceFunc *chunk_source,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
+{
+    QEMUIOVector hd_qiov;
+    uint64_t bytes_done = 0;
+    int ret = 0;
+
+    qemu_iovec_init(&hd_qiov, qiov->niov);
+    while (nb_sectors > 0) {
+        int64_t chunk = sector_num / chunk_sectors;
+        int offset = sector_num % chunk_sectors;
+        int64_t start, next_start;
+        int src, next_src, n;
+
+        src = chunk_source(bs, chunk, &start);
+        start += offset;
+        n = MIN(nb_sectors, chunk_sectors - offset);
+
+        /* Read on through the chunks that continue the same extent */
+        while (n < nb_sectors) {
+            chunk++;
+            next_src = chunk_source(bs, chunk, &next_start);
+            if (next_src != src ||
+                (src != OVERLAY_SRC_ZERO && next_start != start + n)) {
+                break;
+            }
+            n += MIN(nb_sectors - n, chunk_sectors);
+        }
+
+        qemu_iovec_reset(&hd_qiov);
+        qemu_iovec_copy(&hd_qiov, qiov, bytes_done, n * BDRV_SECTOR_SIZE);
+        ret = overlay_co_read_source(bs, src, start, n, &hd_qiov);
+        if (ret < 0) {
+            break;
+        }
+
+        nb_sectors -= n;
+        sector_num += n;
+        bytes_done += n * BDRV_SECTOR_SIZE;
+    }
+    qemu_iovec_destroy(&hd_qiov);
+
+    return ret;
+}
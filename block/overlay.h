@@ -0,0 +1,50 @@
+/*
+ * Helpers for the chunked overlay formats
+ *
+ * Copyright Carnegie Mellon University 2012
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef BLOCK_OVERLAY_H
+#define BLOCK_OVERLAY_H
+
+#include "block_int.h"
+
+/*
+ * The dedup and delta formats divide the guest disk into fixed-size chunks
+ * whose data is either stored in the image file, read from the base image or
+ * reads as zeroes.  Both keep their on-disk structures big-endian.
+ */
+
+#define OVERLAY_MIN_CHUNK_SIZE      4096
+#define OVERLAY_MAX_CHUNK_SIZE      (1 << 20)
+#define OVERLAY_DEFAULT_CHUNK_SIZE  65536
+
+/* Where the data of a chunk comes from */
+enum {
+    OVERLAY_SRC_ZERO,
+    OVERLAY_SRC_BASE,
+    OVERLAY_SRC_FILE,
+};
+
+/*
+ * Returns the OVERLAY_SRC_* of chunk @chunk and stores the sector of the
+ * source where its data starts in @sector
+ */
+typedef int OverlayChunkSourceFunc(BlockDriverState *bs, int64_t chunk,
+                                   int64_t *sector);
+
+bool overlay_is_chunk_size_valid(uint32_t chunk_size);
+int overlay_read_string(const uint8_t *header_buf, size_t header_size,
+                        uint32_t offset, uint32_t size,
+                        char *dest, size_t dest_size);
+
+int coroutine_fn overlay_co_read_source(BlockDriverState *bs, int src,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov);
+int coroutine_fn overlay_co_readv(BlockDriverState *bs, int chunk_sectors,
+    OverlayChunkSourceFunc *chunk_source,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov);
+
+#endif /* BLOCK_OVERLAY_H */
@@ -164,6 +164,7 @@ static int write_l1_entry(BlockDriverState *bs, int l1_index)
 static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
 {
     BDRVQcowState *s = bs->opaque;
+    QCowL2Alloc l2_alloc;
     uint64_t old_l2_offset;
     uint64_t *l2_table;
     int64_t l2_offset;
@@ -180,20 +181,20 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
         return l2_offset;
     }
 
-    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
-    if (ret < 0) {
-        goto fail;
+    if (qcow2_need_accurate_refcounts(s)) {
+        ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    } else {
+        ret = qcow2_mark_dirty(bs);
     }
-
-    /* allocate a new entry in the l2 cache */
-
-    trace_qcow2_l2_allocate_get_empty(bs, l1_index);
-    ret = qcow2_cache_get_empty(bs, s->l2_table_cache, l2_offset, (void**) table);
     if (ret < 0) {
         return ret;
     }
 
-    l2_table = *table;
+    /*
+     * Build the new table outside the cache, so that it doesn't pin a cache
+     * entry while it is written out below.
+     */
+    l2_table = qemu_blockalign(bs, s->cluster_size);
 
     if ((old_l2_offset & L1E_OFFSET_MASK) == 0) {
         /* if there was no old l2 table, clear the new table */
@@ -218,12 +219,30 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
         }
     }
 
-    /* write the l2 table to the file */
+    /*
+     * Write the l2 table to the file. Nothing points to the new table yet, so
+     * there is no need to flush the rest of the L2 cache, and requests from a
+     * coroutine can release the lock while it is written: only requests for
+     * the same table have to wait (see get_cluster_table), all other
+     * allocating writes go on.
+     */
     BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_WRITE);
 
     trace_qcow2_l2_allocate_write_l2(bs, l1_index);
-    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
-    ret = qcow2_cache_flush(bs, s->l2_table_cache);
+    if (qemu_in_coroutine()) {
+        l2_alloc.l1_index = l1_index;
+        qemu_co_queue_init(&l2_alloc.dependent_requests);
+        QLIST_INSERT_HEAD(&s->l2_allocs, &l2_alloc, next_in_flight);
+
+        qemu_co_mutex_unlock(&s->lock);
+        ret = bdrv_pwrite_sync(bs->file, l2_offset, l2_table, s->cluster_size);
+        qemu_co_mutex_lock(&s->lock);
+
+        QLIST_REMOVE(&l2_alloc, next_in_flight);
+        qemu_co_queue_restart_all(&l2_alloc.dependent_requests);
+    } else {
+        ret = bdrv_pwrite_sync(bs->file, l2_offset, l2_table, s->cluster_size);
+    }
     if (ret < 0) {
         goto fail;
     }
@@ -232,18 +251,26 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
     trace_qcow2_l2_allocate_write_l1(bs, l1_index);
     s->l1_table[l1_index] = l2_offset | QCOW_OFLAG_COPIED;
     ret = write_l1_entry(bs, l1_index);
+    if (ret < 0) {
+        s->l1_table[l1_index] = old_l2_offset;
+        goto fail;
+    }
+
+    /* allocate a new entry in the l2 cache */
+    trace_qcow2_l2_allocate_get_empty(bs, l1_index);
+    ret = qcow2_cache_get_empty(bs, s->l2_table_cache, l2_offset, (void**) table);
     if (ret < 0) {
         goto fail;
     }
+    memcpy(*table, l2_table, s->cluster_size);
 
-    *table = l2_table;
+    qemu_vfree(l2_table);
     trace_qcow2_l2_allocate_done(bs, l1_index, 0);
     return 0;
 
 fail:
     trace_qcow2_l2_allocate_done(bs, l1_index, ret);
-    qcow2_cache_put(bs, s->l2_table_cache, (void**) table);
-    s->l1_table[l1_index] = old_l2_offset;
+    qemu_vfree(l2_table);
     return ret;
 }
 
@@ -274,14 +301,15 @@ static int count_contiguous_clusters(uint64_t nb_clusters, int cluster_size,
 	return (i - start);
 }
 
-static int count_contiguous_free_clusters(uint64_t nb_clusters, uint64_t *l2_table)
+static int count_contiguous_clusters_by_type(uint64_t nb_clusters,
+    uint64_t *l2_table, int wanted_type)
 {
     int i;
 
     for (i = 0; i < nb_clusters; i++) {
         int type = qcow2_get_cluster_type(be64_to_cpu(l2_table[i]));
 
-        if (type != QCOW2_CLUSTER_UNALLOCATED) {
+        if (type != wanted_type) {
             break;
         }
     }
@@ -454,14 +482,15 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
         *cluster_offset &= L2E_COMPRESSED_OFFSET_SIZE_MASK;
         break;
     case QCOW2_CLUSTER_ZERO:
-        c = count_contiguous_clusters(nb_clusters, s->cluster_size,
-                &l2_table[l2_index], 0,
-                QCOW_OFLAG_COMPRESSED | QCOW_OFLAG_ZERO);
+        /* how many zero clusters ? (their data clusters don't matter) */
+        c = count_contiguous_clusters_by_type(nb_clusters, &l2_table[l2_index],
+                                              QCOW2_CLUSTER_ZERO);
         *cluster_offset = 0;
         break;
     case QCOW2_CLUSTER_UNALLOCATED:
         /* how many empty clusters ? */
-        c = count_contiguous_free_clusters(nb_clusters, &l2_table[l2_index]);
+        c = count_contiguous_clusters_by_type(nb_clusters, &l2_table[l2_index],
+                                              QCOW2_CLUSTER_UNALLOCATED);
         *cluster_offset = 0;
         break;
     case QCOW2_CLUSTER_NORMAL:
@@ -504,6 +533,7 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
                              int *new_l2_index)
 {
     BDRVQcowState *s = bs->opaque;
+    QCowL2Alloc *l2_alloc;
     unsigned int l1_index, l2_index;
     uint64_t l2_offset;
     uint64_t *l2_table = NULL;
@@ -512,6 +542,7 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
     /* seek the the l2 offset in the l1 table */
 
     l1_index = offset >> (s->l2_bits + s->cluster_bits);
+again:
     if (l1_index >= s->l1_size) {
         ret = qcow2_grow_l1_table(bs, l1_index + 1, false);
         if (ret < 0) {
@@ -519,6 +550,19 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
         }
     }
 
+    /*
+     * If another request is allocating this L2 table, wait until the L1
+     * entry points to it instead of allocating a second copy.
+     */
+    QLIST_FOREACH(l2_alloc, &s->l2_allocs, next_in_flight) {
+        if (l2_alloc->l1_index == l1_index) {
+            qemu_co_mutex_unlock(&s->lock);
+            qemu_co_queue_wait(&l2_alloc->dependent_requests);
+            qemu_co_mutex_lock(&s->lock);
+            goto again;
+        }
+    }
+
     l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
 
     /* seek the l2 table of the given l2 offset */
@@ -619,7 +663,7 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
 {
     BDRVQcowState *s = bs->opaque;
-    int i, j = 0, l2_index, ret;
+    int i, j = 0, n, l2_index, ret;
     uint64_t *old_cluster, start_sect, *l2_table;
     uint64_t cluster_offset = m->alloc_offset;
     bool cow = false;
@@ -664,7 +708,15 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
         qcow2_cache_depends_on_flush(s->l2_table_cache);
     }
 
-    qcow2_cache_set_dependency(bs, s->l2_table_cache, s->refcount_block_cache);
+    if (qcow2_need_accurate_refcounts(s)) {
+        qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                   s->refcount_block_cache);
+    } else {
+        ret = qcow2_mark_dirty(bs);
+        if (ret < 0) {
+            goto err;
+        }
+    }
     ret = get_cluster_table(bs, m->offset, &l2_table, &l2_index);
     if (ret < 0) {
         goto err;
@@ -694,11 +746,20 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
     /*
      * If this was a COW, we need to decrease the refcount of the old cluster.
      * Also flush bs->file to get the right order for L2 and refcount update.
+     *
+     * Runs of old clusters that are contiguous in the image file are freed
+     * with a single refcount update.
      */
-    if (j != 0) {
-        for (i = 0; i < j; i++) {
-            qcow2_free_any_clusters(bs, be64_to_cpu(old_cluster[i]), 1);
+    for (i = 0; i < j; i += n) {
+        uint64_t old_offset = be64_to_cpu(old_cluster[i]);
+
+        n = 1;
+        if (qcow2_get_cluster_type(old_offset) == QCOW2_CLUSTER_NORMAL) {
+            n = count_contiguous_clusters(j - i, s->cluster_size,
+                                          &old_cluster[i], 0,
+                                          QCOW_OFLAG_COPIED | QCOW_OFLAG_ZERO);
         }
+        qcow2_free_any_clusters(bs, old_offset, n);
     }
 
     ret = 0;
@@ -781,7 +842,7 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
         uint64_t old_start = old_alloc->offset >> s->cluster_bits;
         uint64_t old_end = old_start + old_alloc->nb_clusters;
 
-        if (end < old_start || start > old_end) {
+        if (end <= old_start || start >= old_end) {
             /* No intersection */
         } else {
             if (start < old_start) {
@@ -810,7 +871,7 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
     trace_qcow2_cluster_alloc_phys(qemu_coroutine_self());
     if (*host_offset == 0) {
         int64_t cluster_offset =
-            qcow2_alloc_clusters(bs, *nb_clusters * s->cluster_size);
+            qcow2_alloc_data_clusters(bs, guest_offset, nb_clusters);
         if (cluster_offset < 0) {
             return cluster_offset;
         }
@@ -1165,6 +1226,7 @@ static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
 int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors)
 {
     BDRVQcowState *s = bs->opaque;
+    uint64_t start = offset;
     unsigned int nb_clusters;
     int ret;
 
@@ -1186,5 +1248,13 @@ int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors)
         offset += (ret * s->cluster_size);
     }
 
+    /* A sequential writer that skipped over zeroes keeps its window */
+    if (s->next_alloc_guest_offset == start) {
+        s->next_alloc_guest_offset = offset;
+    }
+    if (s->prealloc_clusters && s->prealloc_guest_offset == start) {
+        s->prealloc_guest_offset = offset;
+    }
+
     return 0;
 }
@@ -616,6 +616,144 @@ int qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     return i;
 }
 
+/*
+ * Returns how many of the nb_clusters clusters starting at offset are
+ * described by refcount blocks that exist already.
+ */
+static unsigned int refcount_covered_clusters(BlockDriverState *bs,
+    int64_t offset, unsigned int nb_clusters)
+{
+    BDRVQcowState *s = bs->opaque;
+    int block_bits = s->cluster_bits - REFCOUNT_SHIFT;
+    uint64_t cluster_index = offset >> s->cluster_bits;
+    uint64_t table_index = cluster_index >> block_bits;
+    uint64_t end = cluster_index;
+
+    while (end - cluster_index < nb_clusters &&
+           table_index < s->refcount_table_size &&
+           (s->refcount_table[table_index] & REFT_OFFSET_MASK))
+    {
+        table_index++;
+        end = table_index << block_bits;
+    }
+
+    return MIN(end - cluster_index, nb_clusters);
+}
+
+/*
+ * Allocates *nb_clusters contiguous clusters for guest data at guest_offset.
+ *
+ * A write that continues where the previous allocation ended is taken as part
+ * of a sequential fill and is served from a window of PREALLOC_WINDOW_SIZE
+ * bytes that is allocated with a single refcount update, right after the
+ * previous allocation. This keeps the data of sequential writers contiguous in
+ * the image file and touches the refcount blocks once per window instead of
+ * once per request. Whatever is left of the window is freed by
+ * qcow2_release_prealloc(), or by qcow2_abort_prealloc() if a write fails.
+ *
+ * A window only spans clusters whose refcount blocks exist already. Growing
+ * the refcount structures is left to ordinary allocations, so that the window
+ * doesn't change what a failure there leaves behind.
+ *
+ * *nb_clusters is reduced if the window has fewer clusters left.
+ */
+int64_t qcow2_alloc_data_clusters(BlockDriverState *bs, uint64_t guest_offset,
+    unsigned int *nb_clusters)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t offset;
+    unsigned int n;
+    int ret;
+
+    if (s->prealloc_clusters == 0 || guest_offset != s->prealloc_guest_offset) {
+        ret = 0;
+        if (guest_offset == s->next_alloc_guest_offset) {
+            /* Start a new window for this writer */
+            qcow2_release_prealloc(bs);
+
+            offset = s->next_alloc_host_offset;
+            n = MAX(*nb_clusters, PREALLOC_WINDOW_SIZE >> s->cluster_bits);
+            n = refcount_covered_clusters(bs, offset, n);
+            if (n >= *nb_clusters) {
+                ret = qcow2_alloc_clusters_at(bs, offset, n);
+                if (ret < 0) {
+                    return ret;
+                }
+            }
+        }
+
+        if (ret == 0) {
+            offset = qcow2_alloc_clusters(bs,
+                (int64_t) *nb_clusters << s->cluster_bits);
+            if (offset >= 0) {
+                s->next_alloc_guest_offset = guest_offset +
+                    ((uint64_t) *nb_clusters << s->cluster_bits);
+                s->next_alloc_host_offset = offset +
+                    ((int64_t) *nb_clusters << s->cluster_bits);
+            }
+            return offset;
+        }
+
+        s->prealloc_offset = offset;
+        s->prealloc_clusters = ret;
+    }
+
+    n = MIN(*nb_clusters, s->prealloc_clusters);
+    offset = s->prealloc_offset;
+
+    s->prealloc_offset += (int64_t) n << s->cluster_bits;
+    s->prealloc_clusters -= n;
+    s->prealloc_guest_offset = guest_offset + ((uint64_t) n << s->cluster_bits);
+    s->next_alloc_guest_offset = s->prealloc_guest_offset;
+    s->next_alloc_host_offset = s->prealloc_offset;
+
+    *nb_clusters = n;
+    return offset;
+}
+
+void qcow2_release_prealloc(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (s->prealloc_clusters) {
+        qcow2_free_clusters(bs, s->prealloc_offset,
+                            (int64_t) s->prealloc_clusters << s->cluster_bits);
+        s->prealloc_clusters = 0;
+    }
+}
+
+/*
+ * Called when an allocating write failed before its clusters were linked into
+ * the L2 table. If they were the last ones taken from the preallocation window,
+ * they are given back to it, and the whole window is freed so that the error
+ * doesn't leave it allocated. Freeing is best effort: the write has already
+ * failed, so a refcount error here only means that the clusters are leaked.
+ */
+void qcow2_abort_prealloc(BlockDriverState *bs, uint64_t host_offset,
+    unsigned int nb_clusters)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+
+    if (s->prealloc_clusters == 0) {
+        return;
+    }
+
+    if (nb_clusters > 0 && host_offset +
+        ((uint64_t) nb_clusters << s->cluster_bits) == s->prealloc_offset)
+    {
+        s->prealloc_offset = host_offset;
+        s->prealloc_clusters += nb_clusters;
+    }
+
+    BLKDBG_EVENT(bs->file, BLKDBG_CLUSTER_FREE);
+    ret = update_refcount(bs, s->prealloc_offset,
+                          (int64_t) s->prealloc_clusters << s->cluster_bits, -1);
+    (void)ret;
+
+    s->prealloc_clusters = 0;
+}
+
 /* only used to allocate compressed sectors. We try to allocate
    contiguous sectors. size must be <= cluster_size */
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size)
@@ -702,8 +840,14 @@ void qcow2_free_any_clusters(BlockDriverState *bs,
         qcow2_free_clusters(bs, l2_entry & L2E_OFFSET_MASK,
                             nb_clusters << s->cluster_bits);
         break;
-    case QCOW2_CLUSTER_UNALLOCATED:
     case QCOW2_CLUSTER_ZERO:
+        /* A zero cluster may still own its preallocated data cluster */
+        if (l2_entry & L2E_OFFSET_MASK) {
+            qcow2_free_clusters(bs, l2_entry & L2E_OFFSET_MASK,
+                                nb_clusters << s->cluster_bits);
+        }
+        break;
+    case QCOW2_CLUSTER_UNALLOCATED:
         break;
     default:
         abort();
@@ -798,6 +942,9 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                         }
                         /* compressed clusters are never modified */
                         refcount = 2;
+                    } else if ((offset & L2E_OFFSET_MASK) == 0) {
+                        /* zero cluster without a data cluster */
+                        refcount = 0;
                     } else {
                         uint64_t cluster_index = (offset & L2E_OFFSET_MASK) >> s->cluster_bits;
                         if (addend != 0) {
@@ -975,6 +1122,13 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
             break;
 
         case QCOW2_CLUSTER_ZERO:
+            /* Version 2 images read the flag as part of the offset */
+            if (s->qcow_version < 3) {
+                fprintf(stderr, "ERROR: L2 entry %" PRIx64 ": "
+                    "zero flag is not supported in version 2 images\n",
+                    l2_entry);
+                res->corruptions++;
+            }
             if ((l2_entry & L2E_OFFSET_MASK) == 0) {
                 break;
             }
@@ -1119,10 +1273,15 @@ fail:
 /*
  * Checks an image for refcount consistency.
  *
+ * If repair is true, refcounts that don't match the number of references are
+ * corrected instead of being reported. This is how an image that was left
+ * dirty with lazy refcounts is brought back into a consistent state.
+ *
  * Returns 0 if no errors are found, the number of errors in case the image is
  * detected as corrupted, and -errno when an internal error occurred.
  */
-int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res)
+int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                          bool repair)
 {
     BDRVQcowState *s = bs->opaque;
     int64_t size;
@@ -1139,9 +1298,12 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res)
     inc_refcounts(bs, res, refcount_table, nb_clusters,
         0, s->cluster_size);
 
-    /* current L1 table */
+    /*
+     * current L1 table (the copied flags can't be checked against refcounts
+     * that are about to be repaired)
+     */
     ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
-                       s->l1_table_offset, s->l1_size, 1);
+                       s->l1_table_offset, s->l1_size, !repair);
     if (ret < 0) {
         goto fail;
     }
@@ -1193,6 +1355,15 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res)
         }
     }
 
+    /*
+     * Any cluster that a refcount block allocation takes during the repair
+     * must come from behind the clusters checked here, which may be in use
+     * despite a refcount of zero.
+     */
+    if (repair) {
+        s->free_cluster_index = nb_clusters;
+    }
+
     /* compare ref counts */
     for(i = 0; i < nb_clusters; i++) {
         refcount1 = get_refcount(bs, i);
@@ -1204,6 +1375,17 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res)
         }
 
         refcount2 = refcount_table[i];
+        if (refcount1 != refcount2 && repair) {
+            ret = update_refcount(bs, (int64_t) i << s->cluster_bits, 1,
+                                  refcount2 - refcount1);
+            s->free_cluster_index = MAX(s->free_cluster_index, nb_clusters);
+            if (ret >= 0) {
+                continue;
+            }
+            fprintf(stderr, "Can't repair refcount for cluster %d: %s\n",
+                i, strerror(-ret));
+            res->check_errors++;
+        }
         if (refcount1 != refcount2) {
             fprintf(stderr, "%s cluster %d refcount=%d reference=%d\n",
                    refcount1 < refcount2 ? "ERROR" : "Leaked",
@@ -1216,6 +1398,10 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res)
         }
     }
 
+    if (repair) {
+        s->free_cluster_index = 0;
+    }
+
     ret = 0;
 
 fail:
@@ -27,6 +27,9 @@
 #include <zlib.h>
 #include "aes.h"
 #include "block/qcow2.h"
+#ifdef CONFIG_POSIX
+#include "block/raw-posix-aio.h"
+#endif
 #include "qemu-error.h"
 #include "qerror.h"
 #include "trace.h"
@@ -214,6 +217,101 @@ static void report_unsupported_feature(BlockDriverState *bs,
     }
 }
 
+/*
+ * Number of L2 tables and refcount blocks to cache, from the cache sizes
+ * requested for the drive.  A coverage percentage is turned into the size
+ * of the L2 tables that map that part of the virtual disk.
+ */
+static void qcow2_cache_sizes(BlockDriverState *bs, int *l2_cache_tables,
+                              int *refcount_cache_tables)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t l2_cache_size = bs->l2_cache_size;
+    uint64_t tables;
+
+    if (bs->l2_cache_coverage) {
+        uint64_t covered = bs->total_sectors * BDRV_SECTOR_SIZE / 100 *
+                           bs->l2_cache_coverage;
+        l2_cache_size = DIV_ROUND_UP(covered, s->cluster_size) *
+                        sizeof(uint64_t);
+    }
+
+    *l2_cache_tables = L2_CACHE_SIZE;
+    if (l2_cache_size) {
+        /* there is no point in caching more L2 tables than there are */
+        tables = MIN(l2_cache_size >> s->cluster_bits, s->l1_size);
+        *l2_cache_tables = MAX(tables, MIN_L2_CACHE_SIZE);
+    }
+
+    *refcount_cache_tables = REFCOUNT_CACHE_SIZE;
+    if (bs->refcount_cache_size) {
+        tables = MIN(bs->refcount_cache_size >> s->cluster_bits, INT_MAX);
+        *refcount_cache_tables = MAX(tables, REFCOUNT_CACHE_SIZE);
+    }
+}
+
+/*
+ * Marks the image dirty before the first metadata update that isn't matched
+ * by its refcount update on disk. Only used with lazy refcounts.
+ */
+int qcow2_mark_dirty(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t val;
+    int ret;
+
+    assert(s->qcow_version >= 3);
+
+    if (s->incompatible_features & QCOW2_INCOMPAT_DIRTY) {
+        return 0; /* already dirty */
+    }
+
+    val = cpu_to_be64(s->incompatible_features | QCOW2_INCOMPAT_DIRTY);
+    ret = bdrv_pwrite(bs->file, offsetof(QCowHeader, incompatible_features),
+                      &val, sizeof(val));
+    if (ret < 0) {
+        return ret;
+    }
+    ret = bdrv_flush(bs->file);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Only treat image as dirty if the header was updated successfully */
+    s->incompatible_features |= QCOW2_INCOMPAT_DIRTY;
+    return 0;
+}
+
+/*
+ * Writes out all refcounts and clears the dirty bit, once the refcounts on
+ * disk are consistent again.
+ */
+static int qcow2_mark_clean(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+
+    if (!(s->incompatible_features & QCOW2_INCOMPAT_DIRTY)) {
+        return 0;
+    }
+
+    ret = qcow2_cache_flush(bs, s->l2_table_cache);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = bdrv_flush(bs->file);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->incompatible_features &= ~QCOW2_INCOMPAT_DIRTY;
+    return qcow2_update_header(bs);
+}
+
 static int qcow2_open(BlockDriverState *bs, int flags)
 {
     BDRVQcowState *s = bs->opaque;
@@ -221,6 +319,7 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     QCowHeader header;
     uint64_t ext_end;
     bool writethrough;
+    int l2_cache_tables, refcount_cache_tables;
 
     ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
     if (ret < 0) {
@@ -288,12 +387,13 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     s->compatible_features      = header.compatible_features;
     s->autoclear_features       = header.autoclear_features;
 
-    if (s->incompatible_features != 0) {
+    if (s->incompatible_features & ~QCOW2_INCOMPAT_MASK) {
         void *feature_table = NULL;
         qcow2_read_extensions(bs, header.header_length, ext_end,
                               &feature_table);
         report_unsupported_feature(bs, feature_table,
-                                   s->incompatible_features);
+                                   s->incompatible_features &
+                                   ~QCOW2_INCOMPAT_MASK);
         ret = -ENOTSUP;
         goto fail;
     }
@@ -360,9 +460,10 @@ static int qcow2_open(BlockDriverState *bs, int flags)
 
     /* alloc L2 table/refcount block cache */
     writethrough = ((flags & BDRV_O_CACHE_WB) == 0);
-    s->l2_table_cache = qcow2_cache_create(bs, L2_CACHE_SIZE, writethrough);
-    s->refcount_block_cache = qcow2_cache_create(bs, REFCOUNT_CACHE_SIZE,
-        writethrough);
+    qcow2_cache_sizes(bs, &l2_cache_tables, &refcount_cache_tables);
+    s->l2_table_cache = qcow2_cache_create(bs, l2_cache_tables, writethrough);
+    s->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_tables,
+        writethrough && qcow2_need_accurate_refcounts(s));
 
     s->cluster_cache = g_malloc(s->cluster_size);
     /* one more sector for decompressed data alignment */
@@ -371,12 +472,16 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     s->cluster_cache_offset = -1;
     s->flags = flags;
 
+    /* No allocation has happened yet that a first write could continue */
+    s->next_alloc_guest_offset = UINT64_MAX;
+
     ret = qcow2_refcount_init(bs);
     if (ret != 0) {
         goto fail;
     }
 
     QLIST_INIT(&s->cluster_allocs);
+    QLIST_INIT(&s->l2_allocs);
 
     /* read qcow2 extensions */
     if (qcow2_read_extensions(bs, header.header_length, ext_end, NULL)) {
@@ -415,10 +520,30 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     /* Initialise locks */
     qemu_co_mutex_init(&s->lock);
 
+    /*
+     * Repair the refcounts of an image that wasn't closed cleanly while using
+     * lazy refcounts. An incoming migration opens the image while the source
+     * still uses it; the source flushes its refcounts before it stops.
+     */
+    if (!bs->read_only && !(flags & BDRV_O_INCOMING) &&
+        (s->incompatible_features & QCOW2_INCOMPAT_DIRTY)) {
+        BdrvCheckResult result = {0};
+
+        ret = qcow2_check_refcounts(bs, &result, true);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        ret = qcow2_mark_clean(bs);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
 #ifdef DEBUG_ALLOC
     {
         BdrvCheckResult result = {0};
-        qcow2_check_refcounts(bs, &result);
+        qcow2_check_refcounts(bs, &result, false);
     }
 #endif
     return ret;
@@ -496,7 +621,26 @@ static int coroutine_fn qcow2_co_is_allocated(BlockDriverState *bs,
         *pnum = 0;
     }
 
-    return (cluster_offset != 0);
+    /* Zero clusters hide the backing file, so they count as allocated */
+    return (cluster_offset != 0) || (ret == QCOW2_CLUSTER_ZERO);
+}
+
+static int coroutine_fn qcow2_co_is_zero(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, int *pnum)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t cluster_offset;
+    int ret;
+
+    *pnum = nb_sectors;
+    qemu_co_mutex_lock(&s->lock);
+    ret = qcow2_get_cluster_offset(bs, sector_num << 9, pnum, &cluster_offset);
+    qemu_co_mutex_unlock(&s->lock);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return ret == QCOW2_CLUSTER_ZERO;
 }
 
 /* handle reading after the end of the backing file */
@@ -685,6 +829,7 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
     int n_end;
     int ret;
     int cur_nr_sectors; /* number of sectors in current iteration */
+    int nb_zero;
     uint64_t cluster_offset;
     QEMUIOVector hd_qiov;
     uint64_t bytes_done = 0;
@@ -714,6 +859,30 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
             n_end = QCOW_MAX_CRYPT_CLUSTERS * s->cluster_sectors;
         }
 
+        /*
+         * Clusters that are completely overwritten with zeroes don't need
+         * any data I/O, a zero flag in their L2 entries is enough.
+         */
+        nb_zero = 0;
+        if (s->qcow_version >= 3 && !s->crypt_method && index_in_cluster == 0) {
+            while ((nb_zero + 1) * s->cluster_sectors <= remaining_sectors &&
+                   qemu_iovec_is_zero(qiov, bytes_done +
+                                      nb_zero * s->cluster_size,
+                                      s->cluster_size)) {
+                nb_zero++;
+            }
+        }
+
+        if (nb_zero > 0) {
+            cur_nr_sectors = nb_zero * s->cluster_sectors;
+            ret = qcow2_zero_clusters(bs, sector_num << BDRV_SECTOR_BITS,
+                                      cur_nr_sectors);
+            if (ret < 0) {
+                goto fail;
+            }
+            goto next;
+        }
+
         ret = qcow2_alloc_cluster_offset(bs, sector_num << 9,
             index_in_cluster, n_end, &cur_nr_sectors, &l2meta);
         if (ret < 0) {
@@ -754,6 +923,7 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
                              cur_nr_sectors, &hd_qiov);
         qemu_co_mutex_lock(&s->lock);
         if (ret < 0) {
+            qcow2_abort_prealloc(bs, l2meta.alloc_offset, l2meta.nb_clusters);
             goto fail;
         }
 
@@ -764,6 +934,7 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
 
         run_dependent_requests(s, &l2meta);
 
+next:
         remaining_sectors -= cur_nr_sectors;
         sector_num += cur_nr_sectors;
         bytes_done += cur_nr_sectors * 512;
@@ -772,6 +943,10 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
     ret = 0;
 
 fail:
+    if (ret < 0) {
+        /* Don't keep a preallocation window for a writer that failed */
+        qcow2_abort_prealloc(bs, 0, 0);
+    }
     run_dependent_requests(s, &l2meta);
 
     qemu_co_mutex_unlock(&s->lock);
@@ -788,9 +963,13 @@ static void qcow2_close(BlockDriverState *bs)
     BDRVQcowState *s = bs->opaque;
     g_free(s->l1_table);
 
+    qcow2_release_prealloc(bs);
+
     qcow2_cache_flush(bs, s->l2_table_cache);
     qcow2_cache_flush(bs, s->refcount_block_cache);
 
+    qcow2_mark_clean(bs);
+
     qcow2_cache_destroy(bs, s->l2_table_cache);
     qcow2_cache_destroy(bs, s->refcount_block_cache);
 
@@ -955,7 +1134,16 @@ int qcow2_update_header(BlockDriverState *bs)
 
     /* Feature table */
     Qcow2Feature features[] = {
-        /* no feature defined yet */
+        {
+            .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+            .bit  = QCOW2_INCOMPAT_DIRTY_BITNR,
+            .name = "dirty bit",
+        },
+        {
+            .type = QCOW2_FEAT_TYPE_COMPATIBLE,
+            .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
+            .name = "lazy refcounts",
+        },
     };
 
     ret = header_ext_add(buf, QCOW2_EXT_MAGIC_FEATURE_TABLE,
@@ -1022,16 +1210,14 @@ static int qcow2_change_backing_file(BlockDriverState *bs,
     return qcow2_update_header(bs);
 }
 
-static int preallocate(BlockDriverState *bs)
+/* Allocates clusters for @nb_sectors at guest @offset without writing data */
+static int preallocate_range(BlockDriverState *bs, uint64_t offset,
+                             uint64_t nb_sectors)
 {
-    uint64_t nb_sectors;
-    uint64_t offset;
-    int num;
+    int num = 0;
     int ret;
     QCowL2Meta meta;
 
-    nb_sectors = bdrv_getlength(bs) >> 9;
-    offset = 0;
     qemu_co_queue_init(&meta.dependent_requests);
     meta.cluster_offset = 0;
 
@@ -1063,7 +1249,7 @@ static int preallocate(BlockDriverState *bs)
      * all of the allocated clusters (otherwise we get failing reads after
      * EOF). Extend the image to the last allocated sector.
      */
-    if (meta.cluster_offset != 0) {
+    if (meta.cluster_offset != 0 && meta.nb_clusters != 0) {
         uint8_t buf[512];
         memset(buf, 0, 512);
         ret = bdrv_write(bs->file, (meta.cluster_offset >> 9) + num - 1, buf, 1);
@@ -1075,6 +1261,11 @@ static int preallocate(BlockDriverState *bs)
     return 0;
 }
 
+static int preallocate(BlockDriverState *bs)
+{
+    return preallocate_range(bs, 0, bdrv_getlength(bs) >> 9);
+}
+
 static int qcow2_create2(const char *filename, int64_t total_size,
                          const char *backing_file, const char *backing_format,
                          int flags, size_t cluster_size, int prealloc,
@@ -1132,6 +1323,11 @@ static int qcow2_create2(const char *filename, int64_t total_size,
     header.refcount_order = cpu_to_be32(3 + REFCOUNT_SHIFT);
     header.header_length = cpu_to_be32(sizeof(header));
 
+    if (flags & BLOCK_FLAG_LAZY_REFCOUNTS) {
+        header.compatible_features |=
+            cpu_to_be64(QCOW2_COMPAT_LAZY_REFCOUNTS);
+    }
+
     if (flags & BLOCK_FLAG_ENCRYPT) {
         header.crypt_method = cpu_to_be32(QCOW_CRYPT_AES);
     } else {
@@ -1251,10 +1447,18 @@ static int qcow2_create(const char *filename, QEMUOptionParameter *options)
                     options->value.s);
                 return -EINVAL;
             }
+        } else if (!strcmp(options->name, BLOCK_OPT_LAZY_REFCOUNTS)) {
+            flags |= options->value.n ? BLOCK_FLAG_LAZY_REFCOUNTS : 0;
         }
         options++;
     }
 
+    if (version < 3 && (flags & BLOCK_FLAG_LAZY_REFCOUNTS)) {
+        fprintf(stderr, "Lazy refcounts only supported with compatibility "
+                "level 1.1 and above (use compat=1.1 or greater)\n");
+        return -EINVAL;
+    }
+
     if (backing_file && prealloc) {
         fprintf(stderr, "Backing file and preallocation cannot be used at "
             "the same time\n");
@@ -1358,15 +1562,57 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
     return 0;
 }
 
+typedef struct Qcow2CompressData {
+    const uint8_t *buf;
+    int len;
+    uint8_t *out_buf;
+    int out_len;                /* -1 if the data doesn't compress */
+} Qcow2CompressData;
+
+/* Runs in a worker thread, so it must not touch the BlockDriverState */
+static int qcow2_compress(void *opaque)
+{
+    Qcow2CompressData *c = opaque;
+    z_stream strm;
+    int ret;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+                       Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != 0) {
+        return -EINVAL;
+    }
+
+    strm.avail_in = c->len;
+    strm.next_in = (uint8_t *)c->buf;
+    strm.avail_out = c->len;
+    strm.next_out = c->out_buf;
+
+    ret = deflate(&strm, Z_FINISH);
+    if (ret != Z_STREAM_END && ret != Z_OK) {
+        deflateEnd(&strm);
+        return -EINVAL;
+    }
+    c->out_len = strm.next_out - c->out_buf;
+
+    deflateEnd(&strm);
+
+    if (ret != Z_STREAM_END || c->out_len >= c->len) {
+        c->out_len = -1;
+    }
+    return 0;
+}
+
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
-static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
-                                  const uint8_t *buf, int nb_sectors)
+static coroutine_fn int qcow2_co_write_compressed(BlockDriverState *bs,
+    int64_t sector_num, const uint8_t *buf, int nb_sectors)
 {
     BDRVQcowState *s = bs->opaque;
-    z_stream strm;
-    int ret, out_len;
-    uint8_t *out_buf;
+    Qcow2CompressData c;
+    int ret;
     uint64_t cluster_offset;
 
     if (nb_sectors == 0) {
@@ -1381,49 +1627,50 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
     if (nb_sectors != s->cluster_sectors)
         return -EINVAL;
 
-    out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
-
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
-    }
-
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
+    c.buf = buf;
+    c.len = s->cluster_size;
+    c.out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
 
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
-        ret = -EINVAL;
+    /* zlib is the expensive part, leave it to the thread pool so that the
+       clusters of several requests are compressed in parallel */
+#ifdef CONFIG_POSIX
+    ret = paio_co_submit_func(bs, qcow2_compress, &c);
+#else
+    ret = qcow2_compress(&c);
+#endif
+    if (ret < 0) {
         goto fail;
     }
-    out_len = strm.next_out - out_buf;
 
-    deflateEnd(&strm);
-
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
+    if (c.out_len < 0) {
         /* could not compress: write normal cluster */
-        ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
+        QEMUIOVector qiov;
+        struct iovec iov = {
+            .iov_base = (void *)buf,
+            .iov_len = s->cluster_size,
+        };
+
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        ret = bdrv_co_writev(bs, sector_num, s->cluster_sectors, &qiov);
         if (ret < 0) {
             goto fail;
         }
     } else {
+        /* Compressed clusters share sectors, keep the lock until the data is
+           written so that two requests can't read-modify-write the same
+           sector at the same time */
+        qemu_co_mutex_lock(&s->lock);
         cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
-            sector_num << 9, out_len);
+            sector_num << 9, c.out_len);
         if (!cluster_offset) {
+            qemu_co_mutex_unlock(&s->lock);
             ret = -EIO;
             goto fail;
         }
         cluster_offset &= s->cluster_offset_mask;
         BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
-        ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
+        ret = bdrv_pwrite(bs->file, cluster_offset, c.out_buf, c.out_len);
+        qemu_co_mutex_unlock(&s->lock);
         if (ret < 0) {
             goto fail;
         }
@@ -1431,7 +1678,7 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
 
     ret = 0;
 fail:
-    g_free(out_buf);
+    g_free(c.out_buf);
     return ret;
 }
 
@@ -1462,6 +1709,22 @@ static int64_t qcow2_vm_state_offset(BDRVQcowState *s)
 	return (int64_t)s->l1_vm_state_index << (s->cluster_bits + s->l2_bits);
 }
 
+static BlockCacheStatsList *qcow2_get_cache_stats(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    BlockCacheStatsList *l2, *refcount;
+
+    refcount = g_malloc0(sizeof(*refcount));
+    refcount->value = qcow2_cache_get_stats(s->refcount_block_cache,
+                                            "refcount");
+
+    l2 = g_malloc0(sizeof(*l2));
+    l2->value = qcow2_cache_get_stats(s->l2_table_cache, "l2");
+    l2->next = refcount;
+
+    return l2;
+}
+
 static int qcow2_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 {
     BDRVQcowState *s = bs->opaque;
@@ -1473,7 +1736,7 @@ static int qcow2_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 
 static int qcow2_check(BlockDriverState *bs, BdrvCheckResult *result)
 {
-    return qcow2_check_refcounts(bs, result);
+    return qcow2_check_refcounts(bs, result, false);
 }
 
 #if 0
@@ -1497,17 +1760,40 @@ static void dump_refcounts(BlockDriverState *bs)
 }
 #endif
 
+/*
+ * The VM state is stored after the end of the disk, so bs->growable is set
+ * while it is accessed.  Requests from coroutines may overlap, only the last
+ * one to complete restores the old value.
+ */
+static void qcow2_vmstate_begin(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (s->vmstate_in_flight++ == 0) {
+        s->vmstate_growable = bs->growable;
+        bs->growable = 1;
+    }
+}
+
+static void qcow2_vmstate_end(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (--s->vmstate_in_flight == 0) {
+        bs->growable = s->vmstate_growable;
+    }
+}
+
 static int qcow2_save_vmstate(BlockDriverState *bs, const uint8_t *buf,
                               int64_t pos, int size)
 {
     BDRVQcowState *s = bs->opaque;
-    int growable = bs->growable;
     int ret;
 
     BLKDBG_EVENT(bs->file, BLKDBG_VMSTATE_SAVE);
-    bs->growable = 1;
+    qcow2_vmstate_begin(bs);
     ret = bdrv_pwrite(bs, qcow2_vm_state_offset(s) + pos, buf, size);
-    bs->growable = growable;
+    qcow2_vmstate_end(bs);
 
     return ret;
 }
@@ -1516,13 +1802,32 @@ static int qcow2_load_vmstate(BlockDriverState *bs, uint8_t *buf,
                               int64_t pos, int size)
 {
     BDRVQcowState *s = bs->opaque;
-    int growable = bs->growable;
     int ret;
 
     BLKDBG_EVENT(bs->file, BLKDBG_VMSTATE_LOAD);
-    bs->growable = 1;
+    qcow2_vmstate_begin(bs);
     ret = bdrv_pread(bs, qcow2_vm_state_offset(s) + pos, buf, size);
-    bs->growable = growable;
+    qcow2_vmstate_end(bs);
+
+    return ret;
+}
+
+static int coroutine_fn qcow2_co_preallocate_vmstate(BlockDriverState *bs,
+                                                     int64_t pos, int64_t size)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t offset = qcow2_vm_state_offset(s) + pos;
+    int ret;
+
+    if (s->crypt_method) {
+        return -ENOTSUP;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    ret = preallocate_range(bs, offset & BDRV_SECTOR_MASK,
+                            DIV_ROUND_UP(size + (offset & ~BDRV_SECTOR_MASK),
+                                         BDRV_SECTOR_SIZE));
+    qemu_co_mutex_unlock(&s->lock);
 
     return ret;
 }
@@ -1564,6 +1869,11 @@ static QEMUOptionParameter qcow2_create_options[] = {
         .type = OPT_STRING,
         .help = "Preallocation mode (allowed values: off, metadata)"
     },
+    {
+        .name = BLOCK_OPT_LAZY_REFCOUNTS,
+        .type = OPT_FLAG,
+        .help = "Postpone refcount updates",
+    },
     { NULL }
 };
 
@@ -1575,6 +1885,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_close         = qcow2_close,
     .bdrv_create        = qcow2_create,
     .bdrv_co_is_allocated = qcow2_co_is_allocated,
+    .bdrv_co_is_zero    = qcow2_co_is_zero,
     .bdrv_set_key       = qcow2_set_key,
     .bdrv_make_empty    = qcow2_make_empty,
 
@@ -1585,7 +1896,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_co_write_zeroes   = qcow2_co_write_zeroes,
     .bdrv_co_discard        = qcow2_co_discard,
     .bdrv_truncate          = qcow2_truncate,
-    .bdrv_write_compressed  = qcow2_write_compressed,
+    .bdrv_co_write_compressed = qcow2_co_write_compressed,
 
     .bdrv_snapshot_create   = qcow2_snapshot_create,
     .bdrv_snapshot_goto     = qcow2_snapshot_goto,
@@ -1593,9 +1904,11 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_snapshot_list     = qcow2_snapshot_list,
     .bdrv_snapshot_load_tmp     = qcow2_snapshot_load_tmp,
     .bdrv_get_info      = qcow2_get_info,
+    .bdrv_get_cache_stats = qcow2_get_cache_stats,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
+    .bdrv_co_preallocate_vmstate = qcow2_co_preallocate_vmstate,
 
     .bdrv_change_backing_file   = qcow2_change_backing_file,
 
@@ -48,6 +48,13 @@
  * start reading the L2 table from the image file.  The first to finish will
  * commit its L2 table into the cache.  When the second tries to commit its
  * table will be deleted in favor of the existing cache entry.
+ *
+ * Allocating writes to different clusters of the same L2 table may update the
+ * table at the same time.  Each update rewrites whole sectors of the table, so
+ * two writes of the same sector must not be in flight at once or an older
+ * version could hit the disk last.  Updates that come in while the table is
+ * being written are therefore collected and written out together once that
+ * write has completed.
  */
 
 #include "trace.h"
@@ -91,6 +98,7 @@ CachedL2Table *qed_alloc_l2_cache_entry(L2TableCache *l2_cache)
 
     entry = g_malloc0(sizeof(*entry));
     entry->ref++;
+    QSIMPLEQ_INIT(&entry->updates);
 
     trace_qed_alloc_l2_cache_entry(l2_cache, entry);
 
@@ -185,3 +193,98 @@ void qed_commit_l2_cache_entry(L2TableCache *l2_cache, CachedL2Table *l2_table)
     l2_cache->n_entries++;
     QTAILQ_INSERT_TAIL(&l2_cache->entries, l2_table, node);
 }
+
+struct QEDL2Update {
+    GenericCB gencb;
+    QSIMPLEQ_ENTRY(QEDL2Update) next;
+};
+
+typedef struct {
+    BDRVQEDState *s;
+    CachedL2Table *entry;
+    QSIMPLEQ_HEAD(, QEDL2Update) updates;   /* completed by this write */
+} QEDL2WriteCB;
+
+static void qed_write_l2_cache_entry(BDRVQEDState *s, CachedL2Table *entry);
+
+static void qed_write_l2_cache_entry_cb(void *opaque, int ret)
+{
+    QEDL2WriteCB *write_cb = opaque;
+    CachedL2Table *entry = write_cb->entry;
+    QEDL2Update *update;
+
+    trace_qed_write_l2_cache_entry_cb(entry, ret);
+
+    /* Updates that came in meanwhile go out with the next write */
+    entry->writing = false;
+    if (!QSIMPLEQ_EMPTY(&entry->updates)) {
+        qed_write_l2_cache_entry(write_cb->s, entry);
+    }
+
+    while ((update = QSIMPLEQ_FIRST(&write_cb->updates)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&write_cb->updates, next);
+        gencb_complete(&update->gencb, ret);
+    }
+
+    qed_unref_l2_cache_entry(entry);
+    g_free(write_cb);
+}
+
+static void qed_write_l2_cache_entry(BDRVQEDState *s, CachedL2Table *entry)
+{
+    QEDL2WriteCB *write_cb = g_malloc(sizeof(*write_cb));
+    QEDRequest request = { .l2_table = entry };
+    unsigned int index = entry->dirty_index;
+    unsigned int n = entry->dirty_end - entry->dirty_index;
+
+    trace_qed_write_l2_cache_entry(entry, index, n);
+
+    write_cb->s = s;
+    write_cb->entry = entry;
+    entry->ref++;
+    QSIMPLEQ_INIT(&write_cb->updates);
+    QSIMPLEQ_CONCAT(&write_cb->updates, &entry->updates);
+
+    entry->writing = true;
+    entry->dirty_index = entry->dirty_end = 0;
+
+    qed_write_l2_table(s, &request, index, n, false,
+                       qed_write_l2_cache_entry_cb, write_cb);
+}
+
+/**
+ * Write out updated elements of a cached L2 table
+ *
+ * @s:          QED state
+ * @entry:      L2 cache entry whose table has been updated in memory
+ * @index:      Index of first updated element
+ * @n:          Number of updated elements
+ * @cb:         Completion function
+ * @opaque:     Argument for completion function
+ *
+ * The update is written immediately unless a write of this table is already
+ * in flight.  In that case it is batched with other updates into one write
+ * that is issued when the current one completes.  The completion function is
+ * invoked once the elements are on disk.
+ */
+void qed_update_l2_cache_entry(BDRVQEDState *s, CachedL2Table *entry,
+                               unsigned int index, unsigned int n,
+                               BlockDriverCompletionFunc *cb, void *opaque)
+{
+    QEDL2Update *update = gencb_alloc(sizeof(*update), cb, opaque);
+
+    trace_qed_update_l2_cache_entry(entry, index, n, entry->writing);
+
+    if (entry->dirty_end == 0) {
+        entry->dirty_index = index;
+        entry->dirty_end = index + n;
+    } else {
+        entry->dirty_index = MIN(entry->dirty_index, index);
+        entry->dirty_end = MAX(entry->dirty_end, index + n);
+    }
+    QSIMPLEQ_INSERT_TAIL(&entry->updates, update, next);
+
+    if (!entry->writing) {
+        qed_write_l2_cache_entry(s, entry);
+    }
+}
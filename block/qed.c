@@ -292,18 +292,31 @@ static void qed_plug_allocating_write_reqs(BDRVQEDState *s)
     s->allocating_write_reqs_plugged = true;
 }
 
-static void qed_unplug_allocating_write_reqs(BDRVQEDState *s)
+/**
+ * Restart allocating writes that are waiting
+ *
+ * Each request looks up its clusters again since they may have been allocated
+ * in the meantime, and goes back to waiting if it still has to.
+ */
+static void qed_restart_allocating_write_reqs(BDRVQEDState *s)
 {
+    QSIMPLEQ_HEAD(, QEDAIOCB) reqs = QSIMPLEQ_HEAD_INITIALIZER(reqs);
     QEDAIOCB *acb;
 
+    QSIMPLEQ_CONCAT(&reqs, &s->allocating_write_waiters);
+    while ((acb = QSIMPLEQ_FIRST(&reqs)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&reqs, next);
+        qed_aio_next_io(acb, 0);
+    }
+}
+
+static void qed_unplug_allocating_write_reqs(BDRVQEDState *s)
+{
     assert(s->allocating_write_reqs_plugged);
 
     s->allocating_write_reqs_plugged = false;
 
-    acb = QSIMPLEQ_FIRST(&s->allocating_write_reqs);
-    if (acb) {
-        qed_aio_next_io(acb, 0);
-    }
+    qed_restart_allocating_write_reqs(s);
 }
 
 static void qed_finish_clear_need_check(void *opaque, int ret)
@@ -339,7 +352,7 @@ static void qed_need_check_timer_cb(void *opaque)
     BDRVQEDState *s = opaque;
 
     /* The timer should only fire when allocating writes have drained */
-    assert(!QSIMPLEQ_FIRST(&s->allocating_write_reqs));
+    assert(QLIST_EMPTY(&s->allocating_write_reqs));
 
     trace_qed_need_check_timer_cb(s);
 
@@ -381,7 +394,8 @@ static int bdrv_qed_open(BlockDriverState *bs, int flags)
     int ret;
 
     s->bs = bs;
-    QSIMPLEQ_INIT(&s->allocating_write_reqs);
+    QLIST_INIT(&s->allocating_write_reqs);
+    QSIMPLEQ_INIT(&s->allocating_write_waiters);
 
     ret = bdrv_pread(bs->file, 0, &le_header, sizeof(le_header));
     if (ret < 0) {
@@ -652,7 +666,8 @@ static int bdrv_qed_create(const char *filename, QEMUOptionParameter *options)
 
 typedef struct {
     Coroutine *co;
-    int is_allocated;
+    bool done;
+    int ret;
     int *pnum;
 } QEDIsAllocatedCB;
 
@@ -660,21 +675,28 @@ static void qed_is_allocated_cb(void *opaque, int ret, uint64_t offset, size_t l
 {
     QEDIsAllocatedCB *cb = opaque;
     *cb->pnum = len / BDRV_SECTOR_SIZE;
-    cb->is_allocated = (ret == QED_CLUSTER_FOUND || ret == QED_CLUSTER_ZERO);
+    cb->ret = ret;
+    cb->done = true;
     if (cb->co) {
         qemu_coroutine_enter(cb->co, NULL);
     }
 }
 
-static int coroutine_fn bdrv_qed_co_is_allocated(BlockDriverState *bs,
-                                                 int64_t sector_num,
-                                                 int nb_sectors, int *pnum)
+/**
+ * Look up the cluster of a sector
+ *
+ * Returns the qed_find_cluster() result for @sector_num, and in @pnum the
+ * number of sectors in the same state.
+ */
+static int coroutine_fn qed_co_find_cluster(BlockDriverState *bs,
+                                            int64_t sector_num,
+                                            int nb_sectors, int *pnum)
 {
     BDRVQEDState *s = bs->opaque;
     uint64_t pos = (uint64_t)sector_num * BDRV_SECTOR_SIZE;
     size_t len = (size_t)nb_sectors * BDRV_SECTOR_SIZE;
     QEDIsAllocatedCB cb = {
-        .is_allocated = -1,
+        .done = false,
         .pnum = pnum,
     };
     QEDRequest request = { .l2_table = NULL };
@@ -682,14 +704,35 @@ static int coroutine_fn bdrv_qed_co_is_allocated(BlockDriverState *bs,
     qed_find_cluster(s, &request, pos, len, qed_is_allocated_cb, &cb);
 
     /* Now sleep if the callback wasn't invoked immediately */
-    while (cb.is_allocated == -1) {
+    while (!cb.done) {
         cb.co = qemu_coroutine_self();
         qemu_coroutine_yield();
     }
 
     qed_unref_l2_cache_entry(request.l2_table);
 
-    return cb.is_allocated;
+    return cb.ret;
+}
+
+static int coroutine_fn bdrv_qed_co_is_allocated(BlockDriverState *bs,
+                                                 int64_t sector_num,
+                                                 int nb_sectors, int *pnum)
+{
+    int ret = qed_co_find_cluster(bs, sector_num, nb_sectors, pnum);
+
+    return ret == QED_CLUSTER_FOUND || ret == QED_CLUSTER_ZERO;
+}
+
+static int coroutine_fn bdrv_qed_co_is_zero(BlockDriverState *bs,
+                                            int64_t sector_num,
+                                            int nb_sectors, int *pnum)
+{
+    int ret = qed_co_find_cluster(bs, sector_num, nb_sectors, pnum);
+
+    if (ret < 0) {
+        return ret;
+    }
+    return ret == QED_CLUSTER_ZERO;
 }
 
 static int bdrv_qed_make_empty(BlockDriverState *bs)
@@ -863,6 +906,34 @@ static void qed_aio_complete_bh(void *opaque)
     }
 }
 
+/**
+ * Finish the cluster allocation of a write request
+ *
+ * Called once the L2 table points to the new clusters, or when the request
+ * fails.  Requests that waited for this one are restarted.
+ */
+static void qed_aio_write_alloc_done(QEDAIOCB *acb)
+{
+    BDRVQEDState *s = acb_to_s(acb);
+
+    if (!acb->allocating) {
+        return;
+    }
+
+    QLIST_REMOVE(acb, alloc_next);
+    acb->allocating = false;
+
+    if (!s->allocating_write_reqs_plugged) {
+        qed_restart_allocating_write_reqs(s);
+    }
+
+    if (QLIST_EMPTY(&s->allocating_write_reqs) &&
+        QSIMPLEQ_EMPTY(&s->allocating_write_waiters) &&
+        (s->header.features & QED_F_NEED_CHECK)) {
+        qed_start_need_check_timer(s);
+    }
+}
+
 static void qed_aio_complete(QEDAIOCB *acb, int ret)
 {
     BDRVQEDState *s = acb_to_s(acb);
@@ -884,21 +955,7 @@ static void qed_aio_complete(QEDAIOCB *acb, int ret)
     acb->bh = qemu_bh_new(qed_aio_complete_bh, acb);
     qemu_bh_schedule(acb->bh);
 
-    /* Start next allocating write request waiting behind this one.  Note that
-     * requests enqueue themselves when they first hit an unallocated cluster
-     * but they wait until the entire request is finished before waking up the
-     * next request in the queue.  This ensures that we don't cycle through
-     * requests multiple times but rather finish one at a time completely.
-     */
-    if (acb == QSIMPLEQ_FIRST(&s->allocating_write_reqs)) {
-        QSIMPLEQ_REMOVE_HEAD(&s->allocating_write_reqs, next);
-        acb = QSIMPLEQ_FIRST(&s->allocating_write_reqs);
-        if (acb) {
-            qed_aio_next_io(acb, 0);
-        } else if (s->header.features & QED_F_NEED_CHECK) {
-            qed_start_need_check_timer(s);
-        }
-    }
+    qed_aio_write_alloc_done(acb);
 }
 
 /**
@@ -969,9 +1026,11 @@ static void qed_aio_write_l2_update(QEDAIOCB *acb, int ret, uint64_t offset)
         qed_write_l2_table(s, &acb->request, 0, s->table_nelems, true,
                             qed_aio_write_l1_update, acb);
     } else {
-        /* Write out only the updated part of the L2 table */
-        qed_write_l2_table(s, &acb->request, index, acb->cur_nclusters, false,
-                            qed_aio_next_io, acb);
+        /* Write out only the updated part of the L2 table, together with
+         * updates by other requests that allocate in the same table
+         */
+        qed_update_l2_cache_entry(s, acb->request.l2_table, index,
+                                  acb->cur_nclusters, qed_aio_next_io, acb);
     }
     return;
 
@@ -1072,6 +1131,11 @@ static void qed_aio_write_prefill(void *opaque, int ret)
     uint64_t start = qed_start_of_cluster(s, acb->cur_pos);
     uint64_t len = qed_offset_into_cluster(s, acb->cur_pos);
 
+    if (ret) {
+        qed_aio_complete(acb, ret);
+        return;
+    }
+
     trace_qed_aio_write_prefill(s, acb, start, len, acb->cur_cluster);
     qed_copy_from_backing_file(s, start, len, acb->cur_cluster,
                                 qed_aio_write_postfill, acb);
@@ -1102,6 +1166,82 @@ static void qed_aio_write_zero_cluster(void *opaque, int ret)
     qed_aio_write_l2_update(acb, 0, 1);
 }
 
+/**
+ * Start allocating once the need check flag is on disk
+ */
+static void qed_aio_write_need_check_cb(void *opaque, int ret)
+{
+    QEDAIOCB *acb = opaque;
+
+    /* Other allocating writes may go ahead now */
+    qed_unplug_allocating_write_reqs(acb_to_s(acb));
+
+    if (acb->flags & QED_AIOCB_ZERO) {
+        qed_aio_write_zero_cluster(acb, ret);
+    } else {
+        qed_aio_write_prefill(acb, ret);
+    }
+}
+
+/**
+ * Check if two allocating writes must not be in flight at the same time
+ *
+ * Writes to different data clusters go ahead concurrently, even in the same
+ * L2 table since qed_update_l2_cache_entry() orders the table updates.  A new
+ * L2 table is only linked into the L1 table after it has been written, so
+ * nobody else may allocate clusters in it until then.  New L2 tables are
+ * allocated one at a time because the L1 table is written in whole sectors.
+ */
+static bool qed_allocating_writes_overlap(BDRVQEDState *s, QEDAIOCB *a,
+                                          QEDAIOCB *b)
+{
+    bool a_new_l2 = a->find_cluster_ret == QED_CLUSTER_L1;
+    bool b_new_l2 = b->find_cluster_ret == QED_CLUSTER_L1;
+    unsigned int a_index, b_index;
+
+    if (a_new_l2 && b_new_l2) {
+        return true;
+    }
+    if (qed_l1_index(s, a->cur_pos) != qed_l1_index(s, b->cur_pos)) {
+        return false;
+    }
+    if (a_new_l2 || b_new_l2) {
+        return true;
+    }
+
+    a_index = qed_l2_index(s, a->cur_pos);
+    b_index = qed_l2_index(s, b->cur_pos);
+    return a_index < b_index + b->cur_nclusters &&
+           b_index < a_index + a->cur_nclusters;
+}
+
+/**
+ * Check if an allocating write has to wait for others
+ *
+ * Requests also wait behind overlapping requests that are already waiting so
+ * that those are not starved.
+ */
+static bool qed_aio_write_alloc_must_wait(QEDAIOCB *acb)
+{
+    BDRVQEDState *s = acb_to_s(acb);
+    QEDAIOCB *other;
+
+    if (s->allocating_write_reqs_plugged) {
+        return true;
+    }
+    QLIST_FOREACH(other, &s->allocating_write_reqs, alloc_next) {
+        if (qed_allocating_writes_overlap(s, acb, other)) {
+            return true;
+        }
+    }
+    QSIMPLEQ_FOREACH(other, &s->allocating_write_waiters, next) {
+        if (qed_allocating_writes_overlap(s, acb, other)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 /**
  * Write new data cluster
  *
@@ -1115,40 +1255,46 @@ static void qed_aio_write_alloc(QEDAIOCB *acb, size_t len)
     BDRVQEDState *s = acb_to_s(acb);
     BlockDriverCompletionFunc *cb;
 
-    /* Cancel timer when the first allocating request comes in */
-    if (QSIMPLEQ_EMPTY(&s->allocating_write_reqs)) {
-        qed_cancel_need_check_timer(s);
+    acb->cur_nclusters = qed_bytes_to_clusters(s,
+            qed_offset_into_cluster(s, acb->cur_pos) + len);
+
+    /* Skip ahead if the clusters are already zero */
+    if ((acb->flags & QED_AIOCB_ZERO) &&
+        acb->find_cluster_ret == QED_CLUSTER_ZERO) {
+        qemu_iovec_copy(&acb->cur_qiov, acb->qiov, acb->qiov_offset, len);
+        qed_aio_next_io(acb, 0);
+        return;
     }
 
-    /* Freeze this request if another allocating write is in progress */
-    if (acb != QSIMPLEQ_FIRST(&s->allocating_write_reqs)) {
-        QSIMPLEQ_INSERT_TAIL(&s->allocating_write_reqs, acb, next);
+    /* Freeze this request if it conflicts with allocating writes */
+    if (qed_aio_write_alloc_must_wait(acb)) {
+        trace_qed_aio_write_alloc_wait(s, acb, acb->cur_pos,
+                                       acb->cur_nclusters);
+        QSIMPLEQ_INSERT_TAIL(&s->allocating_write_waiters, acb, next);
+        return;
     }
-    if (acb != QSIMPLEQ_FIRST(&s->allocating_write_reqs) ||
-        s->allocating_write_reqs_plugged) {
-        return; /* wait for existing request to finish */
+
+    /* Cancel timer when the first allocating request comes in */
+    if (QLIST_EMPTY(&s->allocating_write_reqs)) {
+        qed_cancel_need_check_timer(s);
     }
+    QLIST_INSERT_HEAD(&s->allocating_write_reqs, acb, alloc_next);
+    acb->allocating = true;
 
-    acb->cur_nclusters = qed_bytes_to_clusters(s,
-            qed_offset_into_cluster(s, acb->cur_pos) + len);
     qemu_iovec_copy(&acb->cur_qiov, acb->qiov, acb->qiov_offset, len);
 
     if (acb->flags & QED_AIOCB_ZERO) {
-        /* Skip ahead if the clusters are already zero */
-        if (acb->find_cluster_ret == QED_CLUSTER_ZERO) {
-            qed_aio_next_io(acb, 0);
-            return;
-        }
-
         cb = qed_aio_write_zero_cluster;
     } else {
         cb = qed_aio_write_prefill;
         acb->cur_cluster = qed_alloc_clusters(s, acb->cur_nclusters);
     }
 
+    /* Nobody else may allocate before the need check flag is on disk */
     if (qed_should_set_need_check(s)) {
         s->header.features |= QED_F_NEED_CHECK;
-        qed_write_header(s, cb, acb);
+        qed_plug_allocating_write_reqs(s);
+        qed_write_header(s, qed_aio_write_need_check_cb, acb);
     } else {
         cb(acb, 0);
     }
@@ -1282,6 +1428,9 @@ static void qed_aio_next_io(void *opaque, int ret)
 
     trace_qed_aio_next_io(s, acb, ret, acb->cur_pos + acb->cur_qiov.size);
 
+    /* The clusters of the previous allocating write are in the L2 table */
+    qed_aio_write_alloc_done(acb);
+
     /* Handle I/O error */
     if (ret) {
         qed_aio_complete(acb, ret);
@@ -1317,6 +1466,7 @@ static BlockDriverAIOCB *qed_aio_setup(BlockDriverState *bs,
 
     acb->flags = flags;
     acb->finished = NULL;
+    acb->allocating = false;
     acb->qiov = qiov;
     acb->qiov_offset = 0;
     acb->cur_pos = (uint64_t)sector_num * BDRV_SECTOR_SIZE;
@@ -1561,6 +1711,7 @@ static BlockDriver bdrv_qed = {
     .bdrv_close               = bdrv_qed_close,
     .bdrv_create              = bdrv_qed_create,
     .bdrv_co_is_allocated     = bdrv_qed_co_is_allocated,
+    .bdrv_co_is_zero          = bdrv_qed_co_is_zero,
     .bdrv_make_empty          = bdrv_qed_make_empty,
     .bdrv_aio_readv           = bdrv_qed_aio_readv,
     .bdrv_aio_writev          = bdrv_qed_aio_writev,
@@ -106,12 +106,22 @@ typedef struct {
     uint64_t offsets[0];            /* in bytes */
 } QEDTable;
 
+typedef struct QEDL2Update QEDL2Update;
+
 /* The L2 cache is a simple write-through cache for L2 structures */
 typedef struct CachedL2Table {
     QEDTable *table;
     uint64_t offset;    /* offset=0 indicates an invalidate entry */
     QTAILQ_ENTRY(CachedL2Table) node;
     int ref;
+
+    /* Updates waiting for the next table write, see
+     * qed_update_l2_cache_entry()
+     */
+    QSIMPLEQ_HEAD(, QEDL2Update) updates;
+    unsigned int dirty_index;   /* first updated element */
+    unsigned int dirty_end;     /* one after last updated element, or 0 */
+    bool writing;               /* table write in flight */
 } CachedL2Table;
 
 typedef struct {
@@ -132,7 +142,9 @@ typedef struct QEDAIOCB {
     BlockDriverAIOCB common;
     QEMUBH *bh;
     int bh_ret;                     /* final return status for completion bh */
-    QSIMPLEQ_ENTRY(QEDAIOCB) next;  /* next request */
+    QSIMPLEQ_ENTRY(QEDAIOCB) next;  /* next waiting allocating write */
+    QLIST_ENTRY(QEDAIOCB) alloc_next; /* allocating writes in flight */
+    bool allocating;                /* in allocating_write_reqs list? */
     int flags;                      /* QED_AIOCB_* bits ORed together */
     bool *finished;                 /* signal for cancel completion */
     uint64_t end_pos;               /* request end on block device, in bytes */
@@ -163,8 +175,9 @@ typedef struct {
     uint32_t l2_shift;
     uint32_t l2_mask;
 
-    /* Allocating write request queue */
-    QSIMPLEQ_HEAD(, QEDAIOCB) allocating_write_reqs;
+    /* Allocating write requests in flight and those waiting for them */
+    QLIST_HEAD(, QEDAIOCB) allocating_write_reqs;
+    QSIMPLEQ_HEAD(, QEDAIOCB) allocating_write_waiters;
     bool allocating_write_reqs_plugged;
 
     /* Periodic flush and clear need check flag */
@@ -219,6 +232,9 @@ CachedL2Table *qed_alloc_l2_cache_entry(L2TableCache *l2_cache);
 void qed_unref_l2_cache_entry(CachedL2Table *entry);
 CachedL2Table *qed_find_l2_cache_entry(L2TableCache *l2_cache, uint64_t offset);
 void qed_commit_l2_cache_entry(L2TableCache *l2_cache, CachedL2Table *l2_table);
+void qed_update_l2_cache_entry(BDRVQEDState *s, CachedL2Table *entry,
+                               unsigned int index, unsigned int n,
+                               BlockDriverCompletionFunc *cb, void *opaque);
 
 /**
  * Table I/O functions
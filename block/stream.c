@@ -13,53 +13,50 @@
 
 #include "trace.h"
 #include "block_int.h"
+#include "ratelimit.h"
 
 enum {
     /*
      * Size of data buffer for populating the image file.  This should be large
      * enough to process multiple clusters in a single call, so that populating
-     * contiguous regions of the image is efficient.
+     * contiguous regions of the image is efficient.  The job starts with this
+     * size and adapts it to the latency of the requests, between
+     * STREAM_MIN_BUFFER_SIZE and STREAM_MAX_BUFFER_SIZE.
      */
     STREAM_BUFFER_SIZE = 512 * 1024, /* in bytes */
-};
-
-#define SLICE_TIME 100000000ULL /* ns */
-
-typedef struct {
-    int64_t next_slice_time;
-    uint64_t slice_quota;
-    uint64_t dispatched;
-} RateLimit;
+    STREAM_MIN_BUFFER_SIZE = 64 * 1024,
+    STREAM_MAX_BUFFER_SIZE = 4 * 1024 * 1024,
 
-static int64_t ratelimit_calculate_delay(RateLimit *limit, uint64_t n)
-{
-    int64_t now = qemu_get_clock_ns(rt_clock);
+    /* Number of copy-on-read requests that are kept in flight */
+    STREAM_MAX_IN_FLIGHT = 8,
+};
 
-    if (limit->next_slice_time < now) {
-        limit->next_slice_time = now + SLICE_TIME;
-        limit->dispatched = 0;
-    }
-    if (limit->dispatched == 0 || limit->dispatched + n <= limit->slice_quota) {
-        limit->dispatched += n;
-        return 0;
-    } else {
-        limit->dispatched = n;
-        return limit->next_slice_time - now;
-    }
-}
+/*
+ * Requests that take longer than this are made smaller so that guest requests
+ * to the same clusters do not wait too long, much faster ones are made larger.
+ */
+#define STREAM_TARGET_LATENCY 50000000LL /* ns */
 
-static void ratelimit_set_speed(RateLimit *limit, uint64_t speed)
-{
-    limit->slice_quota = speed / (1000000000ULL / SLICE_TIME);
-}
+#define SLICE_TIME 100000000ULL /* ns */
 
 typedef struct StreamBlockJob {
     BlockJob common;
     RateLimit limit;
     BlockDriverState *base;
     char backing_file_id[1024];
+
+    int chunk_sectors;          /* current request size */
+    int in_flight;              /* stream_populate_entry() coroutines */
+    bool waiting;               /* stream_run() waits for a request */
+    int ret;                    /* first error of a request */
 } StreamBlockJob;
 
+typedef struct {
+    StreamBlockJob *job;
+    int64_t sector_num;
+    int nb_sectors;
+} StreamRequest;
+
 static int coroutine_fn stream_populate(BlockDriverState *bs,
                                         int64_t sector_num, int nb_sectors,
                                         void *buf)
@@ -76,6 +73,82 @@ static int coroutine_fn stream_populate(BlockDriverState *bs,
     return bdrv_co_copy_on_readv(bs, sector_num, nb_sectors, &qiov);
 }
 
+/* Grow or shrink the request size depending on how long a request took */
+static void stream_adapt_chunk(StreamBlockJob *s, int nb_sectors,
+                               int64_t latency)
+{
+    int chunk = s->chunk_sectors;
+
+    if (latency > STREAM_TARGET_LATENCY) {
+        chunk = MAX(chunk / 2, STREAM_MIN_BUFFER_SIZE / BDRV_SECTOR_SIZE);
+    } else if (latency < STREAM_TARGET_LATENCY / 4 && nb_sectors == chunk) {
+        chunk = MIN(chunk * 2, STREAM_MAX_BUFFER_SIZE / BDRV_SECTOR_SIZE);
+    }
+
+    if (chunk != s->chunk_sectors) {
+        trace_stream_adapt_chunk(s, chunk, latency);
+        s->chunk_sectors = chunk;
+    }
+}
+
+static void coroutine_fn stream_populate_entry(void *opaque)
+{
+    StreamRequest *req = opaque;
+    StreamBlockJob *s = req->job;
+    BlockDriverState *bs = s->common.bs;
+    int64_t start = qemu_get_clock_ns(rt_clock);
+    void *buf;
+    int ret;
+
+    buf = qemu_blockalign(bs, req->nb_sectors * BDRV_SECTOR_SIZE);
+    ret = stream_populate(bs, req->sector_num, req->nb_sectors, buf);
+    qemu_vfree(buf);
+
+    if (ret < 0) {
+        if (s->ret == 0) {
+            s->ret = ret;
+        }
+    } else {
+        stream_adapt_chunk(s, req->nb_sectors,
+                           qemu_get_clock_ns(rt_clock) - start);
+        /* Publish progress */
+        s->common.offset += req->nb_sectors * BDRV_SECTOR_SIZE;
+    }
+    g_free(req);
+
+    /* stream_run() may complete the job, don't touch s afterwards */
+    s->in_flight--;
+    if (s->waiting) {
+        s->waiting = false;
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+}
+
+/* Wait until fewer than @max_in_flight requests are in flight */
+static void coroutine_fn stream_wait_requests(StreamBlockJob *s,
+                                              int max_in_flight)
+{
+    while (s->in_flight > 0 && s->in_flight >= max_in_flight) {
+        s->waiting = true;
+        qemu_coroutine_yield();
+    }
+}
+
+static void stream_start_request(StreamBlockJob *s, int64_t sector_num,
+                                 int nb_sectors)
+{
+    StreamRequest *req = g_malloc(sizeof(*req));
+    Coroutine *co;
+
+    req->job = s;
+    req->sector_num = sector_num;
+    req->nb_sectors = nb_sectors;
+
+    s->in_flight++;
+    co = qemu_coroutine_create(stream_populate_entry);
+    qemu_coroutine_enter(co, req);
+}
+
 static void close_unused_images(BlockDriverState *top, BlockDriverState *base,
                                 const char *base_id)
 {
@@ -167,16 +240,15 @@ static void coroutine_fn stream_run(void *opaque)
     int64_t sector_num, end;
     int ret = 0;
     int n = 0;
-    void *buf;
 
     s->common.len = bdrv_getlength(bs);
     if (s->common.len < 0) {
-        block_job_complete(&s->common, s->common.len);
+        block_job_completed(&s->common, s->common.len);
         return;
     }
 
     end = s->common.len >> BDRV_SECTOR_BITS;
-    buf = qemu_blockalign(bs, STREAM_BUFFER_SIZE);
+    s->chunk_sectors = STREAM_BUFFER_SIZE / BDRV_SECTOR_SIZE;
 
     /* Turn on copy-on-read for the whole block device so that guest read
      * requests help us make progress.  Only do this when copying the entire
@@ -192,32 +264,45 @@ static void coroutine_fn stream_run(void *opaque)
 
 wait:
         /* Note that even when no rate limit is applied we need to yield
-         * with no pending I/O here so that qemu_aio_flush() returns.
+         * with no new I/O here so that qemu_aio_flush() returns once the
+         * requests in flight have completed.
          */
         block_job_sleep_ns(&s->common, rt_clock, delay_ns);
-        if (block_job_is_cancelled(&s->common)) {
+        if (block_job_is_cancelled(&s->common) || s->ret < 0) {
             break;
         }
 
+        /* Look at the whole rest of the image so that large allocated or
+         * unallocated regions are skipped in one go.
+         */
         ret = is_allocated_base(bs, base, sector_num,
-                                STREAM_BUFFER_SIZE / BDRV_SECTOR_SIZE, &n);
+                                MIN(end - sector_num, INT_MAX >> 1), &n);
         trace_stream_one_iteration(s, sector_num, n, ret);
-        if (ret == 0) {
-            if (s->common.speed) {
-                delay_ns = ratelimit_calculate_delay(&s->limit, n);
-                if (delay_ns > 0) {
-                    goto wait;
-                }
-            }
-            ret = stream_populate(bs, sector_num, n, buf);
-        }
         if (ret < 0) {
             break;
         }
-        ret = 0;
+        if (ret == 1) {
+            s->common.offset += n * BDRV_SECTOR_SIZE;
+            continue;
+        }
 
-        /* Publish progress */
-        s->common.offset += n * BDRV_SECTOR_SIZE;
+        n = MIN(n, s->chunk_sectors);
+        if (s->common.speed) {
+            /* Keep a request within one time slice of the rate limit */
+            n = MAX(MIN(n, s->limit.slice_quota), 1);
+            delay_ns = ratelimit_calculate_delay(&s->limit, n);
+            if (delay_ns > 0) {
+                goto wait;
+            }
+        }
+
+        stream_wait_requests(s, STREAM_MAX_IN_FLIGHT);
+        stream_start_request(s, sector_num, n);
+    }
+
+    stream_wait_requests(s, 1);
+    if (ret >= 0) {
+        ret = s->ret;
     }
 
     if (!base) {
@@ -236,8 +321,7 @@ wait:
         close_unused_images(bs, base, base_id);
     }
 
-    qemu_vfree(buf);
-    block_job_complete(&s->common, ret);
+    block_job_completed(&s->common, ret);
 }
 
 static void stream_set_speed(BlockJob *job, int64_t speed, Error **errp)
@@ -248,7 +332,7 @@ static void stream_set_speed(BlockJob *job, int64_t speed, Error **errp)
         error_set(errp, QERR_INVALID_PARAMETER, "speed");
         return;
     }
-    ratelimit_set_speed(&s->limit, speed / BDRV_SECTOR_SIZE);
+    ratelimit_set_speed(&s->limit, speed / BDRV_SECTOR_SIZE, SLICE_TIME);
 }
 
 static BlockJobType stream_job_type = {
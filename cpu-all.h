@@ -502,11 +502,16 @@ typedef struct RAMBlock {
 } RAMBlock;
 
 typedef struct RAMList {
-    uint8_t *phys_dirty;
+    /* one bit per target page for each DIRTY_MEMORY_* client */
+    unsigned long *dirty_memory[DIRTY_MEMORY_NUM];
     QLIST_HEAD(, RAMBlock) blocks;
 } RAMList;
 extern RAMList ram_list;
 
+void cpu_physical_memory_set_dirty_lebitmap(unsigned long *bitmap,
+                                            ram_addr_t start,
+                                            ram_addr_t pages);
+
 extern const char *mem_path;
 extern int mem_prealloc;
 
@@ -626,6 +626,90 @@ static QemuCond qemu_cpu_cond;
 static QemuCond qemu_pause_cond;
 static QemuCond qemu_work_cond;
 
+/* vCPU throttling */
+#define CPU_THROTTLE_PCT_MIN 1
+#define CPU_THROTTLE_PCT_MAX 99
+#define CPU_THROTTLE_TIMESLICE_NS 10000000
+
+static QEMUTimer *throttle_timer;
+static QEMUBH *throttle_bh;
+static volatile int throttle_percentage;
+
+static void cpu_throttle_sleep(void)
+{
+    CPUArchState *self_env = cpu_single_env;
+    double pct;
+    int64_t sleeptime_ns;
+
+    pct = throttle_percentage / 100.0;
+    if (pct == 0) {
+        return;
+    }
+
+    /* sleep pct of the time, run for one timeslice in between */
+    sleeptime_ns = (int64_t)(pct / (1 - pct) * CPU_THROTTLE_TIMESLICE_NS);
+    qemu_mutex_unlock(&qemu_global_mutex);
+    g_usleep(sleeptime_ns / 1000);
+    qemu_mutex_lock(&qemu_global_mutex);
+    cpu_single_env = self_env;
+}
+
+static void cpu_throttle_timer_tick(void *opaque)
+{
+    CPUArchState *env;
+    double pct;
+
+    if (!throttle_percentage) {
+        return;
+    }
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        env->throttle_pending = 1;
+        qemu_cpu_kick(env);
+        /* with TCG, all vCPUs share one thread */
+        if (tcg_enabled()) {
+            break;
+        }
+    }
+
+    pct = throttle_percentage / 100.0;
+    qemu_mod_timer(throttle_timer, qemu_get_clock_ns(rt_clock) +
+                   CPU_THROTTLE_TIMESLICE_NS / (1 - pct));
+}
+
+static void cpu_throttle_bh(void *opaque)
+{
+    if (!throttle_percentage) {
+        qemu_del_timer(throttle_timer);
+    } else if (!qemu_timer_pending(throttle_timer)) {
+        cpu_throttle_timer_tick(NULL);
+    }
+}
+
+void cpu_throttle_set(int new_throttle_pct)
+{
+    new_throttle_pct = MIN(new_throttle_pct, CPU_THROTTLE_PCT_MAX);
+    new_throttle_pct = MAX(new_throttle_pct, CPU_THROTTLE_PCT_MIN);
+
+    throttle_percentage = new_throttle_pct;
+    qemu_bh_schedule(throttle_bh);
+}
+
+void cpu_throttle_stop(void)
+{
+    throttle_percentage = 0;
+    qemu_bh_schedule(throttle_bh);
+}
+
+bool cpu_throttle_active(void)
+{
+    return throttle_percentage != 0;
+}
+
+int cpu_throttle_get_percentage(void)
+{
+    return throttle_percentage;
+}
+
 void qemu_init_cpu_loop(void)
 {
     qemu_init_sigbus();
@@ -635,6 +719,9 @@ void qemu_init_cpu_loop(void)
     qemu_cond_init(&qemu_io_proceeded_cond);
     qemu_mutex_init(&qemu_global_mutex);
 
+    throttle_timer = qemu_new_timer_ns(rt_clock, cpu_throttle_timer_tick, NULL);
+    throttle_bh = qemu_bh_new(cpu_throttle_bh, NULL);
+
     qemu_thread_get_self(&io_thread);
 }
 
@@ -693,6 +780,10 @@ static void qemu_wait_io_event_common(CPUArchState *env)
     }
     flush_queued_work(env);
     env->thread_kicked = false;
+    if (env->throttle_pending) {
+        env->throttle_pending = 0;
+        cpu_throttle_sleep();
+    }
 }
 
 static void qemu_tcg_wait_io_event(void)
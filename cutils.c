@@ -27,6 +27,10 @@
 
 #include "qemu_socket.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 void pstrcpy(char *buf, int buf_size, const char *str)
 {
     int c;
@@ -322,6 +326,27 @@ bool buffer_is_zero(const void *buf, size_t len)
     const long * const data = buf;
 
     assert(len % (4 * sizeof(long)) == 0);
+
+#ifdef __SSE2__
+    /* Block layer buffers are normally aligned, so check 64 bytes at once */
+    if (((uintptr_t) buf % sizeof(__m128i)) == 0 &&
+        len % (4 * sizeof(__m128i)) == 0) {
+        const __m128i *vec = buf;
+        const __m128i zero = _mm_setzero_si128();
+        __m128i t;
+
+        for (i = 0; i < len / sizeof(__m128i); i += 4) {
+            t = _mm_or_si128(_mm_or_si128(vec[i + 0], vec[i + 1]),
+                             _mm_or_si128(vec[i + 2], vec[i + 3]));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(t, zero)) != 0xFFFF) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+#endif
+
     len /= sizeof(long);
 
     for (i = 0; i < len; i += 4) {
@@ -338,6 +363,42 @@ bool buffer_is_zero(const void *buf, size_t len)
     return true;
 }
 
+/*
+ * Checks if count bytes of a QEMUIOVector, starting at skip, are all zeroes
+ */
+bool qemu_iovec_is_zero(QEMUIOVector *qiov, size_t skip, size_t count)
+{
+    const size_t unit = 4 * sizeof(long);
+    const uint8_t *p;
+    size_t len, n;
+    int i;
+
+    for (i = 0; i < qiov->niov && count > 0; i++) {
+        if (skip >= qiov->iov[i].iov_len) {
+            skip -= qiov->iov[i].iov_len;
+            continue;
+        }
+
+        p = (const uint8_t *) qiov->iov[i].iov_base + skip;
+        len = MIN(qiov->iov[i].iov_len - skip, count);
+        skip = 0;
+        count -= len;
+
+        /* Fast path for the bulk of the element, then the odd tail */
+        n = ((uintptr_t) p % sizeof(long)) ? 0 : len - len % unit;
+        if (n && !buffer_is_zero(p, n)) {
+            return false;
+        }
+        for (; n < len; n++) {
+            if (p[n]) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
 #ifndef _WIN32
 /* Sets a specific flag */
 int fcntl_setfl(int fd, int flag)
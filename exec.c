@@ -1944,19 +1944,11 @@ void tb_flush_jmp_cache(CPUArchState *env, target_ulong addr)
             TB_JMP_PAGE_SIZE * sizeof(TranslationBlock *));
 }
 
-/* Note: start and end must be within the same ram block.  */
-void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
-                                     int dirty_flags)
+static void tlb_reset_dirty_range_all(ram_addr_t start, ram_addr_t end)
 {
     uintptr_t length, start1;
 
-    start &= TARGET_PAGE_MASK;
-    end = TARGET_PAGE_ALIGN(end);
-
     length = end - start;
-    if (length == 0)
-        return;
-    cpu_physical_memory_mask_dirty_range(start, length, dirty_flags);
 
     /* we modify the TLB cache so that the dirty bit will be set again
        when accessing the range */
@@ -1970,6 +1962,93 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
     cpu_tlb_reset_dirty_all(start1, length);
 }
 
+/* Note: start and start + length must be within the same ram block.  */
+bool cpu_physical_memory_test_and_clear_dirty(ram_addr_t start,
+                                              ram_addr_t length,
+                                              unsigned client)
+{
+    unsigned long *bitmap;
+    unsigned long end, page, num, mask;
+    unsigned long dirty = 0;
+
+    assert(client < DIRTY_MEMORY_NUM);
+
+    end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
+    page = start >> TARGET_PAGE_BITS;
+    if (page >= end) {
+        return false;
+    }
+
+    /* a word at a time; other threads may be setting bits concurrently */
+    bitmap = ram_list.dirty_memory[client];
+    while (page < end) {
+        num = MIN(end - page, BITS_PER_LONG - page % BITS_PER_LONG);
+        mask = num == BITS_PER_LONG ? ~0UL : ((1UL << num) - 1);
+        mask <<= page % BITS_PER_LONG;
+        dirty |= __sync_fetch_and_and(&bitmap[BIT_WORD(page)], ~mask) & mask;
+        page += num;
+    }
+
+    /* the TLB is only used for dirty tracking by TCG */
+    if (dirty && tcg_enabled()) {
+        tlb_reset_dirty_range_all(start & TARGET_PAGE_MASK,
+                                  end << TARGET_PAGE_BITS);
+    }
+
+    return dirty != 0;
+}
+
+/* Note: start and end must be within the same ram block.  */
+void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
+                                     unsigned client)
+{
+    if (end > start) {
+        cpu_physical_memory_test_and_clear_dirty(start, end - start, client);
+    }
+}
+
+void cpu_physical_memory_set_dirty_lebitmap(unsigned long *bitmap,
+                                            ram_addr_t start,
+                                            ram_addr_t pages)
+{
+    unsigned long hpratio = getpagesize() / TARGET_PAGE_SIZE;
+    unsigned long page = start >> TARGET_PAGE_BITS;
+    unsigned long i, j, c, len;
+    int client;
+
+    if (hpratio == 1 && page % BITS_PER_LONG == 0) {
+        /* word-aligned: merge the bitmap into every client a word at a time */
+        len = BITS_TO_LONGS(pages);
+        for (i = 0; i < len; i++) {
+            if (bitmap[i] == 0) {
+                continue;
+            }
+            c = leul_to_cpu(bitmap[i]);
+            for (client = 0; client < DIRTY_MEMORY_NUM; client++) {
+                __sync_fetch_and_or(
+                    &ram_list.dirty_memory[client][BIT_WORD(page) + i], c);
+            }
+        }
+        return;
+    }
+
+    /* one bit per host page, which may span several target pages */
+    len = (pages / hpratio + HOST_LONG_BITS - 1) / HOST_LONG_BITS;
+    for (i = 0; i < len; i++) {
+        if (bitmap[i] == 0) {
+            continue;
+        }
+        c = leul_to_cpu(bitmap[i]);
+        do {
+            j = ffsl(c) - 1;
+            c &= ~(1ul << j);
+            cpu_physical_memory_set_dirty_range(
+                start + ((i * HOST_LONG_BITS + j) * hpratio << TARGET_PAGE_BITS),
+                TARGET_PAGE_SIZE * hpratio);
+        } while (c != 0);
+    }
+}
+
 int cpu_physical_memory_set_dirty_tracking(int enable)
 {
     int ret = 0;
@@ -2623,6 +2702,8 @@ ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
                                    MemoryRegion *mr)
 {
     RAMBlock *new_block;
+    ram_addr_t old_ram_size, new_ram_size;
+    int i;
 
     size = TARGET_PAGE_ALIGN(size);
     new_block = g_malloc0(sizeof(*new_block));
@@ -2670,12 +2751,21 @@ ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
     }
     new_block->length = size;
 
+    old_ram_size = last_ram_offset() >> TARGET_PAGE_BITS;
     QLIST_INSERT_HEAD(&ram_list.blocks, new_block, next);
-
-    ram_list.phys_dirty = g_realloc(ram_list.phys_dirty,
-                                       last_ram_offset() >> TARGET_PAGE_BITS);
-    memset(ram_list.phys_dirty + (new_block->offset >> TARGET_PAGE_BITS),
-           0xff, size >> TARGET_PAGE_BITS);
+    new_ram_size = last_ram_offset() >> TARGET_PAGE_BITS;
+
+    if (new_ram_size > old_ram_size) {
+        for (i = 0; i < DIRTY_MEMORY_NUM; i++) {
+            ram_list.dirty_memory[i] =
+                g_realloc(ram_list.dirty_memory[i],
+                          BITS_TO_LONGS(new_ram_size) * sizeof(unsigned long));
+            bitmap_clear(ram_list.dirty_memory[i], old_ram_size,
+                         BITS_TO_LONGS(new_ram_size) * BITS_PER_LONG -
+                         old_ram_size);
+        }
+    }
+    cpu_physical_memory_set_dirty_range(new_block->offset, size);
 
     if (kvm_enabled())
         kvm_setup_guest_memory(new_block->host, size);
@@ -3004,12 +3094,9 @@ static const MemoryRegionOps rom_mem_ops = {
 static void notdirty_mem_write(void *opaque, target_phys_addr_t ram_addr,
                                uint64_t val, unsigned size)
 {
-    int dirty_flags;
-    dirty_flags = cpu_physical_memory_get_dirty_flags(ram_addr);
-    if (!(dirty_flags & CODE_DIRTY_FLAG)) {
+    if (!cpu_physical_memory_get_dirty_flag(ram_addr, DIRTY_MEMORY_CODE)) {
 #if !defined(CONFIG_USER_ONLY)
         tb_invalidate_phys_page_fast(ram_addr, size);
-        dirty_flags = cpu_physical_memory_get_dirty_flags(ram_addr);
 #endif
     }
     switch (size) {
@@ -3025,11 +3112,11 @@ static void notdirty_mem_write(void *opaque, target_phys_addr_t ram_addr,
     default:
         abort();
     }
-    dirty_flags |= (0xff & ~CODE_DIRTY_FLAG);
-    cpu_physical_memory_set_dirty_flags(ram_addr, dirty_flags);
+    cpu_physical_memory_set_dirty_flag(ram_addr, DIRTY_MEMORY_MIGRATION);
+    cpu_physical_memory_set_dirty_flag(ram_addr, DIRTY_MEMORY_VGA);
     /* we remove the notdirty callback only if the code has been
        flushed */
-    if (dirty_flags == 0xff)
+    if (cpu_physical_memory_is_dirty(ram_addr))
         tlb_set_dirty(cpu_single_env, cpu_single_env->mem_io_vaddr);
 }
 
@@ -3566,8 +3653,7 @@ void cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
                     /* invalidate code */
                     tb_invalidate_phys_page_range(addr1, addr1 + l, 0);
                     /* set dirty bit */
-                    cpu_physical_memory_set_dirty_flags(
-                        addr1, (0xff & ~CODE_DIRTY_FLAG));
+                    cpu_physical_memory_set_dirty_nocode(addr1);
                 }
                 qemu_put_ram_ptr(ptr);
             }
@@ -3763,8 +3849,7 @@ void cpu_physical_memory_unmap(void *buffer, target_phys_addr_t len,
                     /* invalidate code */
                     tb_invalidate_phys_page_range(addr1, addr1 + l, 0);
                     /* set dirty bit */
-                    cpu_physical_memory_set_dirty_flags(
-                        addr1, (0xff & ~CODE_DIRTY_FLAG));
+                    cpu_physical_memory_set_dirty_nocode(addr1);
                 }
                 addr1 += l;
                 access_len -= l;
@@ -3996,8 +4081,7 @@ void stl_phys_notdirty(target_phys_addr_t addr, uint32_t val)
                 /* invalidate code */
                 tb_invalidate_phys_page_range(addr1, addr1 + 4, 0);
                 /* set dirty bit */
-                cpu_physical_memory_set_dirty_flags(
-                    addr1, (0xff & ~CODE_DIRTY_FLAG));
+                cpu_physical_memory_set_dirty_nocode(addr1);
             }
         }
     }
@@ -4075,8 +4159,7 @@ static inline void stl_phys_internal(target_phys_addr_t addr, uint32_t val,
             /* invalidate code */
             tb_invalidate_phys_page_range(addr1, addr1 + 4, 0);
             /* set dirty bit */
-            cpu_physical_memory_set_dirty_flags(addr1,
-                (0xff & ~CODE_DIRTY_FLAG));
+            cpu_physical_memory_set_dirty_nocode(addr1);
         }
     }
 }
@@ -4148,8 +4231,7 @@ static inline void stw_phys_internal(target_phys_addr_t addr, uint32_t val,
             /* invalidate code */
             tb_invalidate_phys_page_range(addr1, addr1 + 2, 0);
             /* set dirty bit */
-            cpu_physical_memory_set_dirty_flags(addr1,
-                (0xff & ~CODE_DIRTY_FLAG));
+            cpu_physical_memory_set_dirty_nocode(addr1);
         }
     }
 }
@@ -0,0 +1,101 @@
+/*
+ * Event loop with file descriptor polling
+ *
+ * Copyright 2012 IBM, Corp.
+ * Copyright 2012 Red Hat, Inc. and/or its affiliates
+ *
+ * Authors:
+ *   Stefan Hajnoczi <stefanha@redhat.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "event-poll.h"
+
+#define EVENT_POLL_MAX_EVENTS   8
+
+void event_poll_add(EventPoll *poll, EventHandler *handler,
+                    EventNotifier *notifier, EventCallback *callback)
+{
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.ptr = handler,
+    };
+    int rc;
+
+    handler->notifier = notifier;
+    handler->callback = callback;
+
+    rc = epoll_ctl(poll->epoll_fd, EPOLL_CTL_ADD,
+                   event_notifier_get_fd(notifier), &event);
+    if (rc < 0) {
+        fprintf(stderr, "failed to add event handler for fd %d: %s\n",
+                event_notifier_get_fd(notifier), strerror(errno));
+        abort();
+    }
+}
+
+/* Event callback for stopping event_poll() */
+static void handle_stop(EventHandler *handler)
+{
+    /* Do nothing */
+}
+
+int event_poll_init(EventPoll *poll)
+{
+    int ret;
+
+    poll->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (poll->epoll_fd < 0) {
+        return -errno;
+    }
+
+    ret = event_notifier_init(&poll->stop_notifier, 0);
+    if (ret < 0) {
+        close(poll->epoll_fd);
+        return ret;
+    }
+
+    event_poll_add(poll, &poll->stop_handler,
+                   &poll->stop_notifier, handle_stop);
+    return 0;
+}
+
+void event_poll_cleanup(EventPoll *poll)
+{
+    event_notifier_cleanup(&poll->stop_notifier);
+    close(poll->epoll_fd);
+    poll->epoll_fd = -1;
+}
+
+void event_poll(EventPoll *poll)
+{
+    struct epoll_event events[EVENT_POLL_MAX_EVENTS];
+    int i, nevents;
+
+    do {
+        nevents = epoll_wait(poll->epoll_fd, events, ARRAY_SIZE(events), -1);
+    } while (nevents < 0 && errno == EINTR);
+    if (nevents < 0) {
+        fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+        abort();
+    }
+
+    for (i = 0; i < nevents; i++) {
+        EventHandler *handler = events[i].data.ptr;
+
+        event_notifier_test_and_clear(handler->notifier);
+        handler->callback(handler);
+    }
+}
+
+void event_poll_notify(EventPoll *poll)
+{
+    if (event_notifier_set(&poll->stop_notifier) < 0) {
+        fprintf(stderr, "failed to notify stop event: %s\n", strerror(errno));
+        abort();
+    }
+}
@@ -0,0 +1,57 @@
+/*
+ * Thread-safe guest to host memory mapping
+ *
+ * Copyright 2012 IBM, Corp.
+ * Copyright 2012 Red Hat, Inc. and/or its affiliates
+ *
+ * Authors:
+ *   Stefan Hajnoczi <stefanha@redhat.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef HOSTMEM_H
+#define HOSTMEM_H
+
+#include "memory.h"
+#include "qemu-thread.h"
+
+typedef struct {
+    void *host_addr;
+    target_phys_addr_t guest_addr;
+    uint64_t size;
+    bool readonly;
+} HostMemRegion;
+
+/*
+ * A copy of the guest RAM layout that can be searched without the global
+ * mutex.  It is kept up to date by a memory listener, which runs in the
+ * main loop, and swapped in under current_regions_lock.
+ */
+typedef struct {
+    MemoryListener listener;
+
+    QemuMutex current_regions_lock;
+    HostMemRegion *current_regions;
+    size_t num_current_regions;
+
+    /* Only used by the memory listener */
+    HostMemRegion *new_regions;
+    size_t num_new_regions;
+} HostMem;
+
+void hostmem_init(HostMem *hostmem);
+void hostmem_finalize(HostMem *hostmem);
+
+/**
+ * hostmem_lookup: map guest physical memory to a host pointer
+ *
+ * Returns a host pointer to [@phys, @phys + @len) or NULL if the range is
+ * not contiguous guest RAM, or is read-only and @is_write is set.
+ */
+void *hostmem_lookup(HostMem *hostmem, target_phys_addr_t phys,
+                     target_phys_addr_t len, bool is_write);
+
+#endif /* HOSTMEM_H */
@@ -0,0 +1,144 @@
+/*
+ * Linux AIO request queue
+ *
+ * Copyright 2012 IBM, Corp.
+ * Copyright 2012 Red Hat, Inc. and/or its affiliates
+ *
+ * Authors:
+ *   Stefan Hajnoczi <stefanha@redhat.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "ioq.h"
+
+int ioq_init(IOQueue *ioq, int fd, unsigned int max_reqs)
+{
+    int rc;
+
+    ioq->fd = fd;
+    ioq->max_reqs = max_reqs;
+
+    memset(&ioq->io_ctx, 0, sizeof(ioq->io_ctx));
+    rc = io_setup(max_reqs, &ioq->io_ctx);
+    if (rc != 0) {
+        return rc;
+    }
+
+    rc = event_notifier_init(&ioq->io_notifier, 0);
+    if (rc != 0) {
+        io_destroy(ioq->io_ctx);
+        return rc;
+    }
+
+    ioq->freelist = g_malloc0(sizeof(ioq->freelist[0]) * max_reqs);
+    ioq->freelist_idx = 0;
+
+    ioq->queue = g_malloc0(sizeof(ioq->queue[0]) * max_reqs);
+    ioq->queue_idx = 0;
+    return 0;
+}
+
+void ioq_cleanup(IOQueue *ioq)
+{
+    g_free(ioq->freelist);
+    g_free(ioq->queue);
+
+    event_notifier_cleanup(&ioq->io_notifier);
+    io_destroy(ioq->io_ctx);
+}
+
+EventNotifier *ioq_get_notifier(IOQueue *ioq)
+{
+    return &ioq->io_notifier;
+}
+
+struct iocb *ioq_get_iocb(IOQueue *ioq)
+{
+    /* The caller never has more requests in flight than iocbs */
+    assert(ioq->freelist_idx > 0);
+
+    return ioq->freelist[--ioq->freelist_idx];
+}
+
+void ioq_put_iocb(IOQueue *ioq, struct iocb *iocb)
+{
+    assert(ioq->freelist_idx < ioq->max_reqs);
+
+    ioq->freelist[ioq->freelist_idx++] = iocb;
+}
+
+struct iocb *ioq_rdwr(IOQueue *ioq, bool read, struct iovec *iov,
+                      unsigned int count, long long offset)
+{
+    struct iocb *iocb = ioq_get_iocb(ioq);
+
+    if (read) {
+        io_prep_preadv(iocb, ioq->fd, iov, count, offset);
+    } else {
+        io_prep_pwritev(iocb, ioq->fd, iov, count, offset);
+    }
+    io_set_eventfd(iocb, event_notifier_get_fd(&ioq->io_notifier));
+
+    ioq->queue[ioq->queue_idx++] = iocb;
+    return iocb;
+}
+
+/* Drop the first @n entries of the queue */
+static void ioq_dequeue(IOQueue *ioq, unsigned int n)
+{
+    ioq->queue_idx -= n;
+    memmove(ioq->queue, ioq->queue + n,
+            ioq->queue_idx * sizeof(ioq->queue[0]));
+}
+
+int ioq_submit(IOQueue *ioq, IOQueueCompletion *completion, void *opaque)
+{
+    struct iocb *iocb;
+    int rc, submitted = 0;
+
+    while (ioq->queue_idx > 0) {
+        rc = io_submit(ioq->io_ctx, ioq->queue_idx, ioq->queue);
+        if (rc > 0) {
+            ioq_dequeue(ioq, rc);
+            submitted += rc;
+            continue;
+        }
+        if (rc == -EAGAIN) {
+            break;
+        }
+
+        /* The first request is bad, fail it and carry on with the others */
+        iocb = ioq->queue[0];
+        ioq_dequeue(ioq, 1);
+        completion(iocb, rc ? rc : -EIO, opaque);
+        ioq_put_iocb(ioq, iocb);
+    }
+    return submitted;
+}
+
+int ioq_run_completion(IOQueue *ioq, IOQueueCompletion *completion,
+                       void *opaque)
+{
+    struct io_event events[ioq->max_reqs];
+    struct timespec ts = { 0 };
+    int nevents, i;
+
+    do {
+        nevents = io_getevents(ioq->io_ctx, 0, ioq->max_reqs, events, &ts);
+    } while (nevents == -EINTR);
+    if (nevents < 0) {
+        return nevents;
+    }
+
+    for (i = 0; i < nevents; i++) {
+        ssize_t ret = ((uint64_t)events[i].res2 << 32) | events[i].res;
+
+        completion(events[i].obj, ret, opaque);
+        ioq_put_iocb(ioq, events[i].obj);
+    }
+    return nevents;
+}
@@ -0,0 +1,87 @@
+/*
+ * Linux AIO request queue
+ *
+ * Copyright 2012 IBM, Corp.
+ * Copyright 2012 Red Hat, Inc. and/or its affiliates
+ *
+ * Authors:
+ *   Stefan Hajnoczi <stefanha@redhat.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef IOQ_H
+#define IOQ_H
+
+#include <libaio.h>
+#include "event_notifier.h"
+
+typedef struct {
+    int fd;                         /* file descriptor */
+    unsigned int max_reqs;          /* max length of freelist and queue */
+
+    io_context_t io_ctx;            /* Linux AIO context */
+    EventNotifier io_notifier;      /* Linux AIO eventfd */
+
+    /* Requests can complete in any order so a free list is necessary to
+     * manage available iocbs.
+     */
+    struct iocb **freelist;         /* free iocbs */
+    unsigned int freelist_idx;
+
+    /* Multiple requests are queued up before submitting them all in one go */
+    struct iocb **queue;            /* queued iocbs */
+    unsigned int queue_idx;
+} IOQueue;
+
+typedef void IOQueueCompletion(struct iocb *iocb, ssize_t ret, void *opaque);
+
+/**
+ * ioq_init: set up a queue for up to @max_reqs requests on @fd
+ *
+ * The free list starts out empty, the caller adds the iocbs it wants to
+ * use with ioq_put_iocb().
+ *
+ * Returns 0 on success, -errno on failure
+ */
+int ioq_init(IOQueue *ioq, int fd, unsigned int max_reqs);
+void ioq_cleanup(IOQueue *ioq);
+
+/* The notifier is signalled when requests have completed */
+EventNotifier *ioq_get_notifier(IOQueue *ioq);
+
+struct iocb *ioq_get_iocb(IOQueue *ioq);
+void ioq_put_iocb(IOQueue *ioq, struct iocb *iocb);
+
+/* Queue a read or write, it is not issued before ioq_submit() */
+struct iocb *ioq_rdwr(IOQueue *ioq, bool read, struct iovec *iov,
+                      unsigned int count, long long offset);
+
+/**
+ * ioq_submit: issue all queued requests with as few system calls as possible
+ *
+ * Requests that the kernel refuses are completed with the error through
+ * @completion.  If the kernel is out of resources the remaining requests
+ * stay queued, to be retried after some requests have completed.
+ *
+ * Returns the number of requests that were issued
+ */
+int ioq_submit(IOQueue *ioq, IOQueueCompletion *completion, void *opaque);
+
+/**
+ * ioq_run_completion: report completed requests through @completion and
+ * return their iocbs to the free list
+ *
+ * Returns the number of completed requests or -errno
+ */
+int ioq_run_completion(IOQueue *ioq, IOQueueCompletion *completion,
+                       void *opaque);
+
+static inline unsigned int ioq_num_queued(IOQueue *ioq)
+{
+    return ioq->queue_idx;
+}
+
+#endif /* IOQ_H */
@@ -0,0 +1,581 @@
+/*
+ * Dedicated thread for virtio-blk I/O processing
+ *
+ * Copyright 2012 IBM, Corp.
+ * Copyright 2012 Red Hat, Inc. and/or its affiliates
+ *
+ * Authors:
+ *   Stefan Hajnoczi <stefanha@redhat.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The I/O thread takes guest kicks from the ioeventfd, reads requests
+ * straight out of the vring, submits them with Linux AIO and signals
+ * completions through the guest notifier (an irqfd with KVM), all without
+ * taking the global mutex.  Only raw images are supported: the block layer
+ * is bypassed and the image file is accessed through its own descriptor.
+ */
+
+#include "trace.h"
+#include "iov.h"
+#include "qemu-thread.h"
+#include "qemu-error.h"
+#include "qerror.h"
+#include "migration.h"
+#include "blockdev.h"
+#include "block_int.h"
+#include "hw/virtio-blk.h"
+#include "hw/dataplane/event-poll.h"
+#include "hw/dataplane/vring.h"
+#include "hw/dataplane/ioq.h"
+#include "hw/dataplane/virtio-blk.h"
+
+enum {
+    SEG_MAX = 126,                  /* maximum number of I/O segments */
+    VRING_MAX = SEG_MAX + 2,        /* maximum number of vring descriptors */
+    REQ_MAX = VRING_MAX,            /* maximum number of requests in the vring,
+                                     * is VRING_MAX / 2 with traditional and
+                                     * VRING_MAX with indirect descriptors */
+    IOV_MAX_BATCH = 1024,           /* iovecs translated per batch */
+};
+
+typedef struct {
+    struct iocb iocb;               /* Linux AIO control block */
+    struct virtio_blk_inhdr *inhdr; /* status byte in guest memory */
+    unsigned int head;              /* vring descriptor index */
+    size_t len;                     /* bytes to transfer */
+
+    /* Bounce buffer for guest buffers that O_DIRECT cannot use */
+    void *bounce_buf;
+    struct iovec *read_iov;         /* guest buffers to copy read data to */
+    unsigned int read_niov;
+} VirtIOBlockRequest;
+
+struct VirtIOBlockDataPlane {
+    bool started;
+    bool starting;
+    bool stopping;
+    bool failed;
+
+    VirtIOBlkConf *blk;
+    int fd;                         /* image file descriptor */
+    bool direct;                    /* fd was opened with O_DIRECT */
+    unsigned int sector_mask;
+
+    VirtIODevice *vdev;
+    Vring vring;                    /* virtqueue vring */
+    EventNotifier *guest_notifier;  /* irq */
+
+    QemuThread thread;
+    EventPoll event_poll;           /* event poller */
+    EventHandler notify_handler;    /* virtqueue notify handler */
+    EventHandler io_handler;        /* Linux AIO completion handler */
+
+    IOQueue ioqueue;                /* Linux AIO queue */
+    VirtIOBlockRequest requests[REQ_MAX];
+    unsigned int num_reqs;          /* requests in flight */
+
+    Error *migration_blocker;
+};
+
+/* Raise an interrupt to signal guest, if necessary */
+static void notify_guest(VirtIOBlockDataPlane *s)
+{
+    if (!vring_should_notify(s->vdev, &s->vring)) {
+        return;
+    }
+
+    event_notifier_set(s->guest_notifier);
+}
+
+static void complete_request(struct iocb *iocb, ssize_t ret, void *opaque)
+{
+    VirtIOBlockDataPlane *s = opaque;
+    VirtIOBlockRequest *req = container_of(iocb, VirtIOBlockRequest, iocb);
+    unsigned char status;
+    int len;
+
+    if (likely(ret >= 0 && ret == req->len)) {
+        status = VIRTIO_BLK_S_OK;
+        len = ret;
+    } else {
+        status = VIRTIO_BLK_S_IOERR;
+        len = 0;
+    }
+
+    trace_virtio_blk_data_plane_complete_request(s, req->head, ret);
+
+    if (req->bounce_buf) {
+        if (req->read_iov && len) {
+            iov_from_buf(req->read_iov, req->read_niov, req->bounce_buf,
+                         0, len);
+        }
+        qemu_vfree(req->bounce_buf);
+        g_free(req->read_iov);
+        req->bounce_buf = NULL;
+        req->read_iov = NULL;
+    }
+
+    stb_p(&req->inhdr->status, status);
+
+    /* According to the virtio specification len should be the number of
+     * bytes written to, but for virtio-blk it seems to be the number of
+     * bytes transferred plus the status bytes.
+     */
+    vring_push(&s->vring, req->head, len + sizeof(*req->inhdr));
+
+    s->num_reqs--;
+}
+
+static void complete_request_early(VirtIOBlockDataPlane *s, unsigned int head,
+                                   struct virtio_blk_inhdr *inhdr,
+                                   unsigned char status)
+{
+    stb_p(&inhdr->status, status);
+
+    vring_push(&s->vring, head, sizeof(*inhdr));
+    notify_guest(s);
+}
+
+/* Get disk serial number */
+static void do_get_id_cmd(VirtIOBlockDataPlane *s,
+                          struct iovec *iov, unsigned int iov_cnt,
+                          unsigned int head, struct virtio_blk_inhdr *inhdr)
+{
+    char id[VIRTIO_BLK_ID_BYTES];
+
+    /* Serial number not NUL-terminated when shorter than buffer */
+    strncpy(id, s->blk->serial ? s->blk->serial : "", sizeof(id));
+    iov_from_buf(iov, iov_cnt, id, 0, sizeof(id));
+    complete_request_early(s, head, inhdr, VIRTIO_BLK_S_OK);
+}
+
+/* Can the kernel use the guest buffers directly for O_DIRECT? */
+static bool iov_is_aligned(struct iovec *iov, unsigned int count)
+{
+    unsigned int i;
+
+    for (i = 0; i < count; i++) {
+        if (((uintptr_t)iov[i].iov_base | iov[i].iov_len) &
+            (BDRV_SECTOR_SIZE - 1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int do_rdwr_cmd(VirtIOBlockDataPlane *s, bool read,
+                       struct iovec *iov, unsigned int iov_cnt,
+                       uint64_t sector, unsigned int head,
+                       struct virtio_blk_inhdr *inhdr)
+{
+    VirtIOBlockRequest *req;
+    struct iocb *iocb;
+    size_t len = iov_size(iov, iov_cnt);
+    struct iovec *read_iov = NULL;
+    unsigned int read_niov = 0;
+    void *bounce_buf = NULL;
+
+    if ((sector & s->sector_mask) ||
+        len % s->blk->conf.logical_block_size) {
+        complete_request_early(s, head, inhdr, VIRTIO_BLK_S_IOERR);
+        return 0;
+    }
+
+    /* The translated iovecs only need to live until the request is
+     * submitted, so the first one can be pointed at a bounce buffer.
+     */
+    if (s->direct && !iov_is_aligned(iov, iov_cnt)) {
+        bounce_buf = qemu_memalign(BDRV_SECTOR_SIZE, len);
+        if (read) {
+            read_iov = g_memdup(iov, sizeof(iov[0]) * iov_cnt);
+            read_niov = iov_cnt;
+        } else {
+            iov_to_buf(iov, iov_cnt, bounce_buf, 0, len);
+        }
+        iov[0].iov_base = bounce_buf;
+        iov[0].iov_len = len;
+        iov_cnt = 1;
+    }
+
+    iocb = ioq_rdwr(&s->ioqueue, read, iov, iov_cnt, sector * 512);
+
+    /* Fill in virtio block metadata needed for completion */
+    req = container_of(iocb, VirtIOBlockRequest, iocb);
+    req->head = head;
+    req->inhdr = inhdr;
+    req->len = len;
+    req->bounce_buf = bounce_buf;
+    req->read_iov = read_iov;
+    req->read_niov = read_niov;
+
+    s->num_reqs++;
+    return 0;
+}
+
+static int process_request(VirtIOBlockDataPlane *s, struct iovec iov[],
+                           unsigned int out_num, unsigned int in_num,
+                           unsigned int head)
+{
+    struct iovec *in_iov = &iov[out_num];
+    struct virtio_blk_outhdr *outhdr;
+    struct virtio_blk_inhdr *inhdr;
+    uint32_t type;
+
+    if (unlikely(out_num < 1 || in_num < 1)) {
+        error_report("virtio-blk missing headers");
+        return -EFAULT;
+    }
+
+    if (unlikely(iov[0].iov_len < sizeof(*outhdr) ||
+                 in_iov[in_num - 1].iov_len < sizeof(*inhdr))) {
+        error_report("virtio-blk header not in correct element");
+        return -EFAULT;
+    }
+
+    outhdr = iov[0].iov_base;
+    inhdr = in_iov[in_num - 1].iov_base;
+    type = ldl_p(&outhdr->type);
+
+    if (type & VIRTIO_BLK_T_FLUSH) {
+        /* Linux AIO has no flush, the preceding writes have completed */
+        if (qemu_fdatasync(s->fd) < 0) {
+            complete_request_early(s, head, inhdr, VIRTIO_BLK_S_IOERR);
+        } else {
+            complete_request_early(s, head, inhdr, VIRTIO_BLK_S_OK);
+        }
+        return 0;
+    } else if (type & VIRTIO_BLK_T_SCSI_CMD) {
+        complete_request_early(s, head, inhdr, VIRTIO_BLK_S_UNSUPP);
+        return 0;
+    } else if (type & VIRTIO_BLK_T_GET_ID) {
+        do_get_id_cmd(s, in_iov, in_num - 1, head, inhdr);
+        return 0;
+    } else if (type & VIRTIO_BLK_T_OUT) {
+        return do_rdwr_cmd(s, false, &iov[1], out_num - 1,
+                           ldq_p(&outhdr->sector), head, inhdr);
+    } else {
+        return do_rdwr_cmd(s, true, in_iov, in_num - 1,
+                           ldq_p(&outhdr->sector), head, inhdr);
+    }
+}
+
+static void submit_requests(VirtIOBlockDataPlane *s)
+{
+    if (ioq_num_queued(&s->ioqueue) > 0) {
+        ioq_submit(&s->ioqueue, complete_request, s);
+    }
+}
+
+static void handle_notify(EventHandler *handler)
+{
+    VirtIOBlockDataPlane *s = container_of(handler, VirtIOBlockDataPlane,
+                                           notify_handler);
+
+    /* There is one array of iovecs into which all new requests are extracted
+     * from the vring.  The iovecs do not have to persist across batches
+     * because the kernel copies them on io_submit(), so the array is reused
+     * once the requests that point into it are submitted.
+     */
+    struct iovec iovec[IOV_MAX_BATCH];
+    struct iovec *end = &iovec[IOV_MAX_BATCH];
+    struct iovec *iov = iovec;
+
+    /* When a request is read from the vring, the index of the first
+     * descriptor (aka head) is returned so that the completed request can be
+     * pushed onto the vring later.
+     *
+     * The number of hypervisor read-only iovecs is out_num.  The number of
+     * hypervisor write-only iovecs is in_num.
+     */
+    int head;
+    unsigned int out_num = 0, in_num = 0;
+
+    if (s->stopping) {
+        return;
+    }
+
+    for (;;) {
+        /* Disable guest->host notifies to avoid unnecessary vmexits */
+        vring_disable_notification(s->vdev, &s->vring);
+
+        for (;;) {
+            head = vring_pop(s->vdev, &s->vring, iov, end, &out_num, &in_num);
+            if (head < 0) {
+                break; /* no more requests */
+            }
+
+            trace_virtio_blk_data_plane_process_request(s, out_num, in_num,
+                                                        head);
+
+            if (process_request(s, iov, out_num, in_num, head) < 0) {
+                vring_set_broken(&s->vring);
+                break;
+            }
+            iov += out_num + in_num;
+        }
+
+        if (likely(head == -EAGAIN)) { /* vring emptied */
+            /* Re-enable guest->host notifies and stop processing the vring.
+             * But if the guest has snuck in more descriptors, keep
+             * processing.
+             */
+            if (vring_enable_notification(s->vdev, &s->vring)) {
+                break;
+            }
+        } else if (head == -ENOBUFS && iov != iovec) {
+            /* iovecs[] is depleted, submit what we have and reuse it */
+            submit_requests(s);
+            iov = iovec;
+        } else {
+            /* Fatal error, or a single request with more segments than we
+             * can handle.
+             */
+            if (head == -ENOBUFS) {
+                error_report("virtio-blk request has too many segments");
+                vring_set_broken(&s->vring);
+            }
+            break;
+        }
+    }
+
+    /* Submit everything from this notification together */
+    submit_requests(s);
+}
+
+static void handle_io(EventHandler *handler)
+{
+    VirtIOBlockDataPlane *s = container_of(handler, VirtIOBlockDataPlane,
+                                           io_handler);
+
+    if (ioq_run_completion(&s->ioqueue, complete_request, s) > 0) {
+        notify_guest(s);
+    }
+
+    /* Retry requests that the kernel had no room for */
+    submit_requests(s);
+
+    /* If there were more requests than iovecs, the vring will not be empty
+     * yet so check again.  There should now be enough resources to process
+     * more requests.
+     */
+    if (unlikely(vring_more_avail(&s->vring))) {
+        handle_notify(&s->notify_handler);
+    }
+}
+
+static void *data_plane_thread(void *opaque)
+{
+    VirtIOBlockDataPlane *s = opaque;
+
+    do {
+        event_poll(&s->event_poll);
+    } while (!s->stopping || s->num_reqs > 0);
+    return NULL;
+}
+
+bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
+                                  VirtIOBlockDataPlane **dataplane)
+{
+    VirtIOBlockDataPlane *s;
+    BlockDriverState *bs = blk->conf.bs;
+    char format[32];
+    int flags, fd;
+
+    *dataplane = NULL;
+
+    if (!blk->data_plane) {
+        return true;
+    }
+
+    if (blk->scsi) {
+        error_report("device is incompatible with x-data-plane, "
+                     "use scsi=off");
+        return false;
+    }
+
+    /* The data plane reads and writes the image file directly */
+    bdrv_get_format(bs, format, sizeof(format));
+    if (strcmp(format, "raw")) {
+        error_report("x-data-plane does not support drive format '%s'",
+                     format);
+        return false;
+    }
+
+    /* Same caching as raw-posix */
+    flags = bdrv_is_read_only(bs) ? O_RDONLY : O_RDWR;
+    if (bs->open_flags & BDRV_O_NOCACHE) {
+        flags |= O_DIRECT;
+    }
+    if (!(bs->open_flags & BDRV_O_CACHE_WB)) {
+        flags |= O_DSYNC;
+    }
+    fd = qemu_open(bs->filename, flags);
+    if (fd < 0) {
+        error_report("x-data-plane cannot open '%s': %s", bs->filename,
+                     strerror(errno));
+        return false;
+    }
+
+    s = g_new0(VirtIOBlockDataPlane, 1);
+    s->vdev = vdev;
+    s->blk = blk;
+    s->fd = fd;
+    s->direct = flags & O_DIRECT;
+    s->sector_mask = (blk->conf.logical_block_size / BDRV_SECTOR_SIZE) - 1;
+
+    /* Prevent block operations that conflict with data plane thread */
+    bdrv_set_in_use(bs, 1);
+
+    /* Guest memory is written behind the back of dirty logging */
+    error_set(&s->migration_blocker, QERR_DEVICE_FEATURE_BLOCKS_MIGRATION,
+              "virtio-blk", "x-data-plane");
+    migrate_add_blocker(s->migration_blocker);
+
+    *dataplane = s;
+    return true;
+}
+
+void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
+{
+    if (!s) {
+        return;
+    }
+
+    virtio_blk_data_plane_stop(s);
+    migrate_del_blocker(s->migration_blocker);
+    error_free(s->migration_blocker);
+    bdrv_set_in_use(s->blk->conf.bs, 0);
+    close(s->fd);
+    g_free(s);
+}
+
+bool virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
+{
+    const VirtIOBindings *binding = s->vdev->binding;
+    void *opaque = s->vdev->binding_opaque;
+    VirtQueue *vq = virtio_get_queue(s->vdev, 0);
+    int i;
+
+    if (s->failed || s->stopping) {
+        return false;
+    }
+
+    /* A kick that races with setting up, it is picked up below */
+    if (s->starting) {
+        return true;
+    }
+
+    /* With TCG the kick still arrives here, forward it */
+    if (s->started) {
+        event_notifier_set(virtio_queue_get_host_notifier(vq));
+        return true;
+    }
+
+    if (!binding->set_host_notifier || !binding->set_guest_notifiers) {
+        error_report("x-data-plane is not supported on this virtio "
+                     "transport");
+        s->failed = true;
+        return false;
+    }
+
+    s->starting = true;
+
+    if (virtio_queue_get_num(s->vdev, 0) > REQ_MAX) {
+        error_report("x-data-plane does not support a virtqueue with "
+                     "more than %d entries", REQ_MAX);
+        goto fail;
+    }
+
+    if (!vring_setup(&s->vring, s->vdev, 0)) {
+        goto fail_vring;
+    }
+
+    if (event_poll_init(&s->event_poll) < 0) {
+        error_report("x-data-plane failed to set up polling");
+        goto fail_vring;
+    }
+
+    if (ioq_init(&s->ioqueue, s->fd, REQ_MAX) < 0) {
+        error_report("x-data-plane failed to set up Linux AIO");
+        goto fail_poll;
+    }
+    for (i = 0; i < ARRAY_SIZE(s->requests); i++) {
+        ioq_put_iocb(&s->ioqueue, &s->requests[i].iocb);
+    }
+
+    /* Set up guest notifier (irq) */
+    if (binding->set_guest_notifiers(opaque, true) != 0) {
+        error_report("x-data-plane failed to set guest notifier");
+        goto fail_ioq;
+    }
+    s->guest_notifier = virtio_queue_get_guest_notifier(vq);
+
+    /* Set up virtqueue notify */
+    if (binding->set_host_notifier(opaque, 0, true) != 0) {
+        error_report("x-data-plane failed to set host notifier");
+        goto fail_guest_notifier;
+    }
+
+    event_poll_add(&s->event_poll, &s->notify_handler,
+                   virtio_queue_get_host_notifier(vq), handle_notify);
+    event_poll_add(&s->event_poll, &s->io_handler,
+                   ioq_get_notifier(&s->ioqueue), handle_io);
+
+    s->starting = false;
+    s->started = true;
+    trace_virtio_blk_data_plane_start(s);
+
+    /* Kick right away to begin processing requests already in vring */
+    event_notifier_set(virtio_queue_get_host_notifier(vq));
+
+    qemu_thread_create(&s->thread, data_plane_thread, s,
+                       QEMU_THREAD_JOINABLE);
+    return true;
+
+fail_guest_notifier:
+    binding->set_guest_notifiers(opaque, false);
+fail_ioq:
+    ioq_cleanup(&s->ioqueue);
+fail_poll:
+    event_poll_cleanup(&s->event_poll);
+fail_vring:
+    vring_teardown(&s->vring, s->vdev, 0);
+fail:
+    s->starting = false;
+    s->failed = true;
+    return false;
+}
+
+void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
+{
+    const VirtIOBindings *binding = s->vdev->binding;
+    void *opaque = s->vdev->binding_opaque;
+
+    if (!s->started || s->stopping) {
+        return;
+    }
+    s->stopping = true;
+    trace_virtio_blk_data_plane_stop(s);
+
+    /* The thread exits once in-flight requests have completed */
+    event_poll_notify(&s->event_poll);
+    qemu_thread_join(&s->thread);
+
+    ioq_cleanup(&s->ioqueue);
+
+    /* The main loop continues where the thread stopped, this must happen
+     * before a pending kick is delivered by set_host_notifier().
+     */
+    vring_teardown(&s->vring, s->vdev, 0);
+
+    binding->set_host_notifier(opaque, 0, false);
+    event_poll_cleanup(&s->event_poll);
+
+    /* Clean up guest notifier (irq) */
+    binding->set_guest_notifiers(opaque, false);
+
+    s->started = false;
+    s->stopping = false;
+}
@@ -0,0 +1,43 @@
+/*
+ * Dedicated thread for virtio-blk I/O processing
+ *
+ * Copyright 2012 IBM, Corp.
+ * Copyright 2012 Red Hat, Inc. and/or its affiliates
+ *
+ * Authors:
+ *   Stefan Hajnoczi <stefanha@redhat.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef HW_DATAPLANE_VIRTIO_BLK_H
+#define HW_DATAPLANE_VIRTIO_BLK_H
+
+#include "hw/virtio.h"
+
+typedef struct VirtIOBlockDataPlane VirtIOBlockDataPlane;
+
+/**
+ * virtio_blk_data_plane_create: set up the data plane if @blk asks for it
+ *
+ * Returns false if the configuration cannot use a data plane.  On success
+ * *@dataplane is NULL when the data plane was not requested.
+ */
+bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
+                                  VirtIOBlockDataPlane **dataplane);
+void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s);
+
+/**
+ * virtio_blk_data_plane_start: hand the virtqueue over to the I/O thread
+ *
+ * Returns true if the I/O thread takes care of the virtqueue, false if
+ * requests must be processed in the main loop.
+ */
+bool virtio_blk_data_plane_start(VirtIOBlockDataPlane *s);
+
+/* Wait for in-flight requests and give the virtqueue back to the main loop */
+void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s);
+
+#endif /* HW_DATAPLANE_VIRTIO_BLK_H */
@@ -102,6 +102,9 @@ struct VirtIOBlkConf
     BlockConf conf;
     char *serial;
     uint32_t scsi;
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    uint32_t data_plane;
+#endif
 };
 
 #define DEFINE_VIRTIO_BLK_FEATURES(_state, _field) \
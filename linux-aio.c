@@ -15,14 +15,13 @@
 #include <libaio.h>
 
 /*
- * Queue size (per-device).
+ * Default queue size (per-device), can be overridden with aio-queue-depth.
  *
- * XXX: eventually we need to communicate this to the guest and/or make it
- *      tunable by the guest.  If we get more outstanding requests at a time
- *      than this we will get EAGAIN from io_submit which is communicated to
- *      the guest as an I/O error.
+ * Requests beyond the queue size are kept in a queue and submitted as
+ * earlier requests complete.
  */
-#define MAX_EVENTS 128
+#define DEFAULT_MAX_EVENTS 128
+#define MAX_MAX_EVENTS     4096
 
 struct qemu_laiocb {
     BlockDriverAIOCB common;
@@ -32,15 +31,28 @@ struct qemu_laiocb {
     size_t nbytes;
     QEMUIOVector *qiov;
     bool is_read;
-    QLIST_ENTRY(qemu_laiocb) node;
+    bool queued;
+    QSIMPLEQ_ENTRY(qemu_laiocb) next;
 };
 
 struct qemu_laio_state {
     io_context_t ctx;
     int efd;
-    int count;
+    int count;              /* requests not completed yet */
+    unsigned int max_events;
+    struct io_event *events;
+
+    /* Requests that have not been passed to the kernel yet */
+    struct {
+        QSIMPLEQ_HEAD(, qemu_laiocb) pending;
+        struct iocb **iocbs;
+        unsigned int in_flight;
+        int plugged;
+    } io_q;
 };
 
+static void ioq_submit(struct qemu_laio_state *s);
+
 static inline ssize_t io_event_ret(struct io_event *ev)
 {
     return (ssize_t)(((uint64_t)ev->res2 << 32) | ev->res);
@@ -81,7 +93,7 @@ static void qemu_laio_completion_cb(void *opaque)
     struct qemu_laio_state *s = opaque;
 
     while (1) {
-        struct io_event events[MAX_EVENTS];
+        struct io_event *events = s->events;
         uint64_t val;
         ssize_t ret;
         struct timespec ts = { 0 };
@@ -98,7 +110,7 @@ static void qemu_laio_completion_cb(void *opaque)
             break;
 
         do {
-            nevents = io_getevents(s->ctx, val, MAX_EVENTS, events, &ts);
+            nevents = io_getevents(s->ctx, val, s->max_events, events, &ts);
         } while (nevents == -EINTR);
 
         for (i = 0; i < nevents; i++) {
@@ -106,16 +118,69 @@ static void qemu_laio_completion_cb(void *opaque)
             struct qemu_laiocb *laiocb =
                     container_of(iocb, struct qemu_laiocb, iocb);
 
+            s->io_q.in_flight--;
             laiocb->ret = io_event_ret(&events[i]);
             qemu_laio_process_completion(s, laiocb);
         }
     }
+
+    /* Completions made room for queued requests */
+    if (!s->io_q.plugged) {
+        ioq_submit(s);
+    }
+}
+
+/*
+ * Passes queued requests to the kernel, as many as the queue depth allows,
+ * with one io_submit() call per batch.
+ */
+static void ioq_submit(struct qemu_laio_state *s)
+{
+    struct qemu_laiocb *laiocb;
+    int len, ret, i;
+
+    while (!QSIMPLEQ_EMPTY(&s->io_q.pending) &&
+           s->io_q.in_flight < s->max_events) {
+        len = 0;
+        QSIMPLEQ_FOREACH(laiocb, &s->io_q.pending, next) {
+            if (s->io_q.in_flight + len == s->max_events) {
+                break;
+            }
+            s->io_q.iocbs[len++] = &laiocb->iocb;
+        }
+
+        ret = io_submit(s->ctx, len, s->io_q.iocbs);
+        if (ret == -EAGAIN && s->io_q.in_flight > 0) {
+            /* Retry when the next request completes */
+            return;
+        }
+
+        if (ret < 0) {
+            /* The first request couldn't be submitted, fail it */
+            laiocb = QSIMPLEQ_FIRST(&s->io_q.pending);
+            QSIMPLEQ_REMOVE_HEAD(&s->io_q.pending, next);
+            laiocb->queued = false;
+            laiocb->ret = ret;
+            qemu_laio_process_completion(s, laiocb);
+            continue;
+        }
+
+        for (i = 0; i < ret; i++) {
+            laiocb = QSIMPLEQ_FIRST(&s->io_q.pending);
+            QSIMPLEQ_REMOVE_HEAD(&s->io_q.pending, next);
+            laiocb->queued = false;
+        }
+        s->io_q.in_flight += ret;
+    }
 }
 
 static int qemu_laio_flush_cb(void *opaque)
 {
     struct qemu_laio_state *s = opaque;
 
+    /* Whoever waits for the requests needs them to be submitted */
+    ioq_submit(s);
+
     return (s->count > 0) ? 1 : 0;
 }
 
@@ -128,6 +193,14 @@ static void laio_cancel(BlockDriverAIOCB *blockacb)
     if (laiocb->ret != -EINPROGRESS)
         return;
 
+    /* Requests that the kernel hasn't seen yet are simply dropped */
+    if (laiocb->queued) {
+        QSIMPLEQ_REMOVE(&laiocb->ctx->io_q.pending, laiocb, qemu_laiocb, next);
+        laiocb->ctx->count--;
+        qemu_aio_release(laiocb);
+        return;
+    }
+
     /*
      * Note that as of Linux 2.6.31 neither the block device code nor any
      * filesystem implements cancellation of AIO request.
@@ -189,8 +262,21 @@ BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
     io_set_eventfd(&laiocb->iocb, s->efd);
     s->count++;
 
-    if (io_submit(s->ctx, 1, &iocbs) < 0)
-        goto out_dec_count;
+    /* Submit right away unless the request has to wait for others */
+    if (!s->io_q.plugged && QSIMPLEQ_EMPTY(&s->io_q.pending) &&
+        s->io_q.in_flight < s->max_events) {
+        int ret = io_submit(s->ctx, 1, &iocbs);
+
+        if (ret == 1) {
+            s->io_q.in_flight++;
+            return &laiocb->common;
+        } else if (ret != -EAGAIN || s->io_q.in_flight == 0) {
+            goto out_dec_count;
+        }
+    }
+
+    laiocb->queued = true;
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.pending, laiocb, next);
     return &laiocb->common;
 
 out_dec_count:
@@ -200,17 +286,55 @@ out_free_aiocb:
     return NULL;
 }
 
-void *laio_init(void)
+/*
+ * Requests submitted between laio_io_plug() and laio_io_unplug() are
+ * queued and passed to the kernel in a single io_submit() call on unplug.
+ * Calls may be nested.
+ */
+void laio_io_plug(void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    s->io_q.plugged++;
+}
+
+void laio_io_unplug(void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    assert(s->io_q.plugged > 0);
+    if (--s->io_q.plugged == 0) {
+        ioq_submit(s);
+    }
+}
+
+/*
+ * max_events is the number of requests that may be outstanding in the
+ * kernel at a time, 0 selects the default.
+ */
+void *laio_init(unsigned int max_events)
 {
     struct qemu_laio_state *s;
 
+    if (max_events == 0) {
+        max_events = DEFAULT_MAX_EVENTS;
+    }
+    if (max_events > MAX_MAX_EVENTS) {
+        return NULL;
+    }
+
     s = g_malloc0(sizeof(*s));
+    s->max_events = max_events;
+    s->events = g_new(struct io_event, max_events);
+    s->io_q.iocbs = g_new(struct iocb *, max_events);
+    QSIMPLEQ_INIT(&s->io_q.pending);
+
     s->efd = eventfd(0, 0);
     if (s->efd == -1)
         goto out_free_state;
     fcntl(s->efd, F_SETFL, O_NONBLOCK);
 
-    if (io_setup(MAX_EVENTS, &s->ctx) != 0)
+    if (io_setup(max_events, &s->ctx) != 0)
         goto out_close_efd;
 
     qemu_aio_set_fd_handler(s->efd, qemu_laio_completion_cb, NULL,
@@ -221,6 +345,8 @@ void *laio_init(void)
 out_close_efd:
     close(s->efd);
 out_free_state:
+    g_free(s->io_q.iocbs);
+    g_free(s->events);
     g_free(s);
     return NULL;
 }
@@ -1077,15 +1077,14 @@ bool memory_region_get_dirty(MemoryRegion *mr, target_phys_addr_t addr,
                              target_phys_addr_t size, unsigned client)
 {
     assert(mr->terminates);
-    return cpu_physical_memory_get_dirty(mr->ram_addr + addr, size,
-                                         1 << client);
+    return cpu_physical_memory_get_dirty(mr->ram_addr + addr, size, client);
 }
 
 void memory_region_set_dirty(MemoryRegion *mr, target_phys_addr_t addr,
                              target_phys_addr_t size)
 {
     assert(mr->terminates);
-    return cpu_physical_memory_set_dirty_range(mr->ram_addr + addr, size, -1);
+    return cpu_physical_memory_set_dirty_range(mr->ram_addr + addr, size);
 }
 
 void memory_region_sync_dirty_bitmap(MemoryRegion *mr)
@@ -1122,7 +1121,17 @@ void memory_region_reset_dirty(MemoryRegion *mr, target_phys_addr_t addr,
     assert(mr->terminates);
     cpu_physical_memory_reset_dirty(mr->ram_addr + addr,
                                     mr->ram_addr + addr + size,
-                                    1 << client);
+                                    client);
+}
+
+bool memory_region_test_and_clear_dirty(MemoryRegion *mr,
+                                        target_phys_addr_t addr,
+                                        target_phys_addr_t size,
+                                        unsigned client)
+{
+    assert(mr->terminates);
+    return cpu_physical_memory_test_and_clear_dirty(mr->ram_addr + addr,
+                                                    size, client);
 }
 
 void *memory_region_get_ram_ptr(MemoryRegion *mr)
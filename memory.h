@@ -31,13 +31,6 @@ typedef struct MemoryRegion MemoryRegion;
 typedef struct MemoryRegionPortio MemoryRegionPortio;
 typedef struct MemoryRegionMmio MemoryRegionMmio;
 
-/* Must match *_DIRTY_FLAGS in cpu-all.h.  To be replaced with dynamic
- * registration.
- */
-#define DIRTY_MEMORY_VGA       0
-#define DIRTY_MEMORY_CODE      1
-#define DIRTY_MEMORY_MIGRATION 3
-
 struct MemoryRegionMmio {
     CPUReadMemoryFunc *read[3];
     CPUWriteMemoryFunc *write[3];
@@ -458,6 +451,26 @@ void memory_region_sync_dirty_bitmap(MemoryRegion *mr);
 void memory_region_reset_dirty(MemoryRegion *mr, target_phys_addr_t addr,
                                target_phys_addr_t size, unsigned client);
 
+/**
+ * memory_region_test_and_clear_dirty: Check whether a range of bytes is dirty
+ *                                     for a specified client and mark it
+ *                                     as clean.
+ *
+ * Equivalent to memory_region_get_dirty() followed by
+ * memory_region_reset_dirty(), but the bits are tested and cleared a
+ * word at a time.
+ *
+ * @mr: the region being updated.
+ * @addr: the start of the subrange being cleaned.
+ * @size: the size of the subrange being cleaned.
+ * @client: the user of the logging information; %DIRTY_MEMORY_MIGRATION or
+ *          %DIRTY_MEMORY_VGA.
+ */
+bool memory_region_test_and_clear_dirty(MemoryRegion *mr,
+                                        target_phys_addr_t addr,
+                                        target_phys_addr_t size,
+                                        unsigned client);
+
 /**
  * memory_region_set_readonly: Turn a memory region read-only (or read-write)
  *
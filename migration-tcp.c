@@ -135,7 +135,10 @@ static void tcp_accept_incoming_migration(void *opaque)
 
     set_use_raw(f, RAW_NONE);
 
-    process_incoming_migration(f);
+    if (process_incoming_migration(f) > 0) {
+        /* the post-copy thread owns the connection from now on */
+        goto out2;
+    }
     qemu_fclose(f);
 out:
     close(c);
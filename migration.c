@@ -21,6 +21,7 @@
 #include "block.h"
 #include "qemu_socket.h"
 #include "block-migration.h"
+#include "cpus.h"
 #include "qmp-commands.h"
 #include "cloudlet/qemu-cloudlet.h"
 
@@ -46,6 +47,15 @@ enum {
 
 #define MAX_THROTTLE  (32 << 20)      /* Migration speed throttling */
 
+/* Migration XBZRLE default cache size */
+#define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
+
+/* Migration page compression defaults */
+#define DEFAULT_MIGRATE_COMPRESS_LEVEL 1
+#define DEFAULT_MIGRATE_COMPRESS_THREAD_COUNT 8
+#define DEFAULT_MIGRATE_DECOMPRESS_THREAD_COUNT 2
+#define MAX_MIGRATE_COMPRESS_THREAD_COUNT 255
+
 static NotifierList migration_state_notifiers =
     NOTIFIER_LIST_INITIALIZER(migration_state_notifiers);
 
@@ -81,6 +91,10 @@ static MigrationState *migrate_get_current(void)
     static MigrationState current_migration = {
         .state = MIG_STATE_SETUP,
         .bandwidth_limit = MAX_THROTTLE,
+        .xbzrle_cache_size = DEFAULT_MIGRATE_CACHE_SIZE,
+        .compress_level = DEFAULT_MIGRATE_COMPRESS_LEVEL,
+        .compress_thread_count = DEFAULT_MIGRATE_COMPRESS_THREAD_COUNT,
+        .decompress_thread_count = DEFAULT_MIGRATE_DECOMPRESS_THREAD_COUNT,
     };
 
     return &current_migration;
@@ -91,6 +105,7 @@ void init_migration_state(void)
     MigrationState *s = migrate_get_current();
 
     qemu_mutex_init(&s->serial_lock);
+    xbzrle_init();
 }
 
 void clean_migration_state(void)
@@ -141,12 +156,25 @@ int qemu_start_incoming_migration(const char *uri, Error **errp)
     return ret;
 }
 
-void process_incoming_migration(QEMUFile *f)
+/*
+ * Returns 1 if post-copy has started and keeps reading from @f in the
+ * background, in which case the caller must not close the connection.
+ */
+int process_incoming_migration(QEMUFile *f)
 {
+    int postcopy;
+
     if (qemu_loadvm_state(f) < 0) {
         fprintf(stderr, "load of migration failed\n");
         exit(0);
     }
+    migrate_decompress_threads_join();
+
+    postcopy = ram_postcopy_incoming(f);
+    if (postcopy < 0) {
+        fprintf(stderr, "post-copy migration failed\n");
+        exit(0);
+    }
     qemu_announce_self();
 
     bdrv_clear_incoming_migration_all();
@@ -159,6 +187,8 @@ void process_incoming_migration(QEMUFile *f)
     }
 
     debug_print_timestamp("INCOMING_FINISH");
+
+    return postcopy;
 }
 
 /* amount of nanoseconds we are willing to wait for migration to be down.
@@ -172,6 +202,43 @@ uint64_t migrate_max_downtime(void)
     return max_downtime;
 }
 
+MigrationCapabilityStatusList *qmp_query_migrate_capabilities(Error **errp)
+{
+    MigrationCapabilityStatusList *head = NULL;
+    MigrationCapabilityStatusList *caps;
+    MigrationState *s = migrate_get_current();
+    int i;
+
+    for (i = 0; i < MIGRATION_CAPABILITY_MAX; i++) {
+        if (head == NULL) {
+            head = g_malloc0(sizeof(*caps));
+            caps = head;
+        } else {
+            caps->next = g_malloc0(sizeof(*caps));
+            caps = caps->next;
+        }
+        caps->value = g_malloc(sizeof(*caps->value));
+        caps->value->capability = i;
+        caps->value->state = s->enabled_capabilities[i];
+    }
+
+    return head;
+}
+
+static void get_xbzrle_cache_stats(MigrationInfo *info)
+{
+    if (migrate_use_xbzrle()) {
+        info->has_xbzrle_cache = true;
+        info->xbzrle_cache = g_malloc0(sizeof(*info->xbzrle_cache));
+        info->xbzrle_cache->cache_size = migrate_xbzrle_cache_size();
+        info->xbzrle_cache->bytes = xbzrle_mig_bytes_transferred();
+        info->xbzrle_cache->pages = xbzrle_mig_pages_transferred();
+        info->xbzrle_cache->cache_hit = xbzrle_mig_pages_cache_hit();
+        info->xbzrle_cache->cache_miss = xbzrle_mig_pages_cache_miss();
+        info->xbzrle_cache->overflow = xbzrle_mig_pages_overflow();
+    }
+}
+
 MigrationInfo *qmp_query_migrate(Error **errp)
 {
     MigrationInfo *info = g_malloc0(sizeof(*info));
@@ -183,7 +250,18 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         break;
     case MIG_STATE_ACTIVE:
         info->has_status = true;
-        info->status = g_strdup("active");
+        if (s->postcopy_started) {
+            info->status = g_strdup("postcopy-active");
+            info->has_postcopy_requests = true;
+            info->postcopy_requests = postcopy_ram_requests();
+        } else {
+            info->status = g_strdup("active");
+        }
+
+        if (cpu_throttle_active()) {
+            info->has_cpu_throttle_percentage = true;
+            info->cpu_throttle_percentage = cpu_throttle_get_percentage();
+        }
 
         info->has_ram = true;
         info->ram = g_malloc0(sizeof(*info->ram));
@@ -199,8 +277,15 @@ MigrationInfo *qmp_query_migrate(Error **errp)
             info->disk->total = blk_mig_bytes_total();
         }
 
+        get_xbzrle_cache_stats(info);
         break;
     case MIG_STATE_COMPLETED:
+        get_xbzrle_cache_stats(info);
+        if (s->postcopy_started) {
+            info->has_postcopy_requests = true;
+            info->postcopy_requests = postcopy_ram_requests();
+        }
+
         info->has_status = true;
         info->status = g_strdup("completed");
         break;
@@ -217,6 +302,22 @@ MigrationInfo *qmp_query_migrate(Error **errp)
     return info;
 }
 
+void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
+                                  Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+    MigrationCapabilityStatusList *cap;
+
+    if (s->state == MIG_STATE_ACTIVE) {
+        error_set(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+
+    for (cap = params; cap; cap = cap->next) {
+        s->enabled_capabilities[cap->value->capability] = cap->value->state;
+    }
+}
+
 /* shared migration helpers */
 
 static int migrate_fd_cleanup(MigrationState *s)
@@ -323,12 +424,23 @@ static void migrate_fd_put_ready(void *opaque)
 	     * note last iteration writes frozen memory pages and
 	     * output of non-live savevm handlers
 	     */
-	    if (qemu_savevm_state_complete(s->file, true) < 0)
+	    if (qemu_savevm_state_complete(s->file, true) < 0) {
 		migrate_fd_error(s);
-	    else
+	    } else if (ram_postcopy_pending()) {
+		/*
+		 * the destination runs from here on, the source must not
+		 * be restarted even if sending the remaining pages fails
+		 */
+		s->postcopy_started = true;
+		if (ram_postcopy_outgoing(s->file, s->fd) < 0)
+		    migrate_fd_error(s);
+		else
+		    migrate_fd_completed(s);
+	    } else {
 		migrate_fd_completed(s);
-	    
-	    if (s->state != MIG_STATE_COMPLETED) {
+	    }
+
+	    if (s->state != MIG_STATE_COMPLETED && !s->postcopy_started) {
 		if (old_vm_running) {
 		    vm_start();
 		}
@@ -343,6 +455,10 @@ static void migrate_fd_cancel(MigrationState *s)
     if (s->state != MIG_STATE_ACTIVE)
         return;
 
+    /* the destination is already running the guest */
+    if (s->postcopy_started)
+        return;
+
     DPRINTF("cancelling migration\n");
 
     s->state = MIG_STATE_CANCELLED;
@@ -484,9 +600,23 @@ static MigrationState *migrate_init(int blk, int inc)
 {
     MigrationState *s = migrate_get_current();
     int64_t bandwidth_limit = s->bandwidth_limit;
+    bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
+    int64_t xbzrle_cache_size = s->xbzrle_cache_size;
+    int compress_level = s->compress_level;
+    int compress_thread_count = s->compress_thread_count;
+    int decompress_thread_count = s->decompress_thread_count;
+
+    memcpy(enabled_capabilities, s->enabled_capabilities,
+           sizeof(enabled_capabilities));
 
     memset(s, 0, sizeof(*s));
     s->bandwidth_limit = bandwidth_limit;
+    memcpy(s->enabled_capabilities, enabled_capabilities,
+           sizeof(enabled_capabilities));
+    s->xbzrle_cache_size = xbzrle_cache_size;
+    s->compress_level = compress_level;
+    s->compress_thread_count = compress_thread_count;
+    s->decompress_thread_count = decompress_thread_count;
     s->blk = blk;
     s->shared = inc;
 
@@ -602,6 +732,89 @@ void qmp_migrate_set_speed(int64_t value, Error **errp)
     qemu_file_set_rate_limit(s->file, s->bandwidth_limit);
 }
 
+void qmp_migrate_set_cache_size(int64_t value, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+    int64_t new_size;
+
+    /* Check for truncation */
+    if (value != (size_t)value) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "cache size",
+                  "exceeding address space");
+        return;
+    }
+
+    new_size = xbzrle_cache_resize(value);
+    if (new_size < 0) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "cache size",
+                  "is smaller than page size");
+        return;
+    }
+
+    s->xbzrle_cache_size = new_size;
+}
+
+int64_t qmp_query_migrate_cache_size(Error **errp)
+{
+    return migrate_xbzrle_cache_size();
+}
+
+void qmp_migrate_set_parameters(bool has_compress_level, int64_t compress_level,
+                                bool has_compress_threads,
+                                int64_t compress_threads,
+                                bool has_decompress_threads,
+                                int64_t decompress_threads, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (s->state == MIG_STATE_ACTIVE) {
+        error_set(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+
+    if (has_compress_level && (compress_level < 0 || compress_level > 9)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "compress-level",
+                  "a value between 0 and 9");
+        return;
+    }
+    if (has_compress_threads &&
+        (compress_threads < 1 ||
+         compress_threads > MAX_MIGRATE_COMPRESS_THREAD_COUNT)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "compress-threads",
+                  "a value between 1 and 255");
+        return;
+    }
+    if (has_decompress_threads &&
+        (decompress_threads < 1 ||
+         decompress_threads > MAX_MIGRATE_COMPRESS_THREAD_COUNT)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "decompress-threads",
+                  "a value between 1 and 255");
+        return;
+    }
+
+    if (has_compress_level) {
+        s->compress_level = compress_level;
+    }
+    if (has_compress_threads) {
+        s->compress_thread_count = compress_threads;
+    }
+    if (has_decompress_threads) {
+        s->decompress_thread_count = decompress_threads;
+    }
+}
+
+MigrationParameters *qmp_query_migrate_parameters(Error **errp)
+{
+    MigrationParameters *params = g_malloc0(sizeof(*params));
+    MigrationState *s = migrate_get_current();
+
+    params->compress_level = s->compress_level;
+    params->compress_threads = s->compress_thread_count;
+    params->decompress_threads = s->decompress_thread_count;
+
+    return params;
+}
+
 void qmp_migrate_set_downtime(double value, Error **errp)
 {
     value *= 1e9;
@@ -640,3 +853,59 @@ void qmp_unrandomize_raw_live(Error **err)
 {
     raw_live_unrandomize();
 }
+
+int migrate_use_xbzrle(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_XBZRLE];
+}
+
+int64_t migrate_xbzrle_cache_size(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->xbzrle_cache_size;
+}
+
+int migrate_use_compression(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_COMPRESS];
+}
+
+int migrate_compress_level(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->compress_level;
+}
+
+int migrate_compress_threads(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->compress_thread_count;
+}
+
+int migrate_decompress_threads(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->decompress_thread_count;
+}
+
+int migrate_use_postcopy(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY];
+}
+
+int migrate_auto_converge(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_AUTO_CONVERGE];
+}
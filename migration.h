@@ -19,6 +19,7 @@
 #include "notify.h"
 #include "error.h"
 #include "qemu-thread.h"
+#include "qapi-types.h"
 
 typedef struct MigrationState MigrationState;
 
@@ -37,6 +38,12 @@ struct MigrationState
     QemuThread raw_thread;
     QemuMutex serial_lock;
     bool ongoing;  /* protected by serial_lock */
+    bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
+    int64_t xbzrle_cache_size;
+    int compress_level;
+    int compress_thread_count;
+    int decompress_thread_count;
+    bool postcopy_started;
 };
 
 typedef enum {
@@ -45,7 +52,7 @@ typedef enum {
     RAW_LIVE
 } raw_type;
 
-void process_incoming_migration(QEMUFile *f);
+int process_incoming_migration(QEMUFile *f);
 
 int qemu_start_incoming_migration(const char *uri, Error **errp);
 
@@ -92,6 +99,19 @@ uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
 
+bool ram_postcopy_pending(void);
+int ram_postcopy_outgoing(QEMUFile *f, int fd);
+int ram_postcopy_incoming(QEMUFile *f);
+uint64_t postcopy_ram_requests(void);
+
+void xbzrle_init(void);
+int64_t xbzrle_cache_resize(int64_t new_size);
+uint64_t xbzrle_mig_bytes_transferred(void);
+uint64_t xbzrle_mig_pages_transferred(void);
+uint64_t xbzrle_mig_pages_cache_hit(void);
+uint64_t xbzrle_mig_pages_cache_miss(void);
+uint64_t xbzrle_mig_pages_overflow(void);
+
 int ram_save_live(QEMUFile *f, int stage, void *opaque);
 void ram_save_raw(QEMUFile *f, void *opaque);
 int ram_save_raw_live(QEMUFile *f, int stage, void *opaque);
@@ -111,6 +131,23 @@ void migrate_add_blocker(Error *reason);
  */
 void migrate_del_blocker(Error *reason);
 
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen);
+int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
+
+int migrate_use_xbzrle(void);
+int64_t migrate_xbzrle_cache_size(void);
+
+int migrate_use_compression(void);
+int migrate_compress_level(void);
+int migrate_compress_threads(void);
+int migrate_decompress_threads(void);
+void migrate_decompress_threads_join(void);
+
+int migrate_use_postcopy(void);
+
+int migrate_auto_converge(void);
+
 void set_use_raw(QEMUFile *file, raw_type type);
 bool use_raw_none(QEMUFile *file);
 bool use_raw_suspend(QEMUFile *file);
@@ -66,6 +66,9 @@
 #include "memory.h"
 #include "qmp-commands.h"
 #include "hmp.h"
+#ifdef CONFIG_POSIX
+#include "block/raw-posix-aio.h"
+#endif
 
 /* for pic/irq_info */
 #if defined(TARGET_SPARC)
@@ -484,6 +487,9 @@ void monitor_protocol_event(MonitorEvent event, QObject *data)
         case QEVENT_BLOCK_JOB_CANCELLED:
             event_name = "BLOCK_JOB_CANCELLED";
             break;
+        case QEVENT_BLOCK_JOB_READY:
+            event_name = "BLOCK_JOB_READY";
+            break;
         case QEVENT_DEVICE_TRAY_MOVED:
              event_name = "DEVICE_TRAY_MOVED";
             break;
@@ -805,6 +811,13 @@ static void do_info_jit(Monitor *mon)
     dump_exec_info((FILE *)mon, monitor_fprintf);
 }
 
+#ifdef CONFIG_POSIX
+static void do_info_threadpool(Monitor *mon)
+{
+    paio_dump_stats((FILE *)mon, monitor_fprintf);
+}
+#endif
+
 static void do_info_history(Monitor *mon)
 {
     int i;
@@ -2453,6 +2466,15 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show dynamic compiler info",
         .mhandler.info = do_info_jit,
     },
+#ifdef CONFIG_POSIX
+    {
+        .name       = "threadpool",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show block I/O thread pool statistics",
+        .mhandler.info = do_info_threadpool,
+    },
+#endif
     {
         .name       = "kvm",
         .args_type  = "",
@@ -2578,6 +2600,27 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show migration status",
         .mhandler.info = hmp_info_migrate,
     },
+    {
+        .name       = "migrate_capabilities",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show current migration capabilities",
+        .mhandler.info = hmp_info_migrate_capabilities,
+    },
+    {
+        .name       = "migrate_cache_size",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show current migration xbzrle cache size",
+        .mhandler.info = hmp_info_migrate_cache_size,
+    },
+    {
+        .name       = "migrate_parameters",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show current migration parameters",
+        .mhandler.info = hmp_info_migrate_parameters,
+    },
     {
         .name       = "balloon",
         .args_type  = "",
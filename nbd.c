@@ -228,7 +228,8 @@ static int nbd_send_negotiate(int csock, off_t size, uint32_t flags)
     cpu_to_be64w((uint64_t*)(buf + 16), size);
     cpu_to_be32w((uint32_t*)(buf + 24),
                  flags | NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_TRIM |
-                 NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA);
+                 NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA |
+                 NBD_FLAG_SEND_BLOCK_STATUS);
     memset(buf + 28, 0, 124);
 
     if (write_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
@@ -580,11 +581,8 @@ ssize_t nbd_receive_reply(int csock, struct nbd_reply *reply)
     return 0;
 }
 
-static ssize_t nbd_send_reply(int csock, struct nbd_reply *reply)
+static void nbd_encode_reply(uint8_t *buf, struct nbd_reply *reply)
 {
-    uint8_t buf[4 + 4 + 8];
-    ssize_t ret;
-
     /* Reply
        [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
        [ 4 ..  7]    error   (0 == no error)
@@ -593,23 +591,8 @@ static ssize_t nbd_send_reply(int csock, struct nbd_reply *reply)
     cpu_to_be32w((uint32_t*)buf, NBD_REPLY_MAGIC);
     cpu_to_be32w((uint32_t*)(buf + 4), reply->error);
     cpu_to_be64w((uint64_t*)(buf + 8), reply->handle);
-
-    TRACE("Sending response to client");
-
-    ret = write_sync(csock, buf, sizeof(buf));
-    if (ret < 0) {
-        return ret;
-    }
-
-    if (ret != sizeof(buf)) {
-        LOG("writing to socket failed");
-        return -EINVAL;
-    }
-    return 0;
 }
 
-#define MAX_NBD_REQUESTS 16
-
 typedef struct NBDRequest NBDRequest;
 
 struct NBDRequest {
@@ -623,6 +606,7 @@ struct NBDExport {
     off_t dev_offset;
     off_t size;
     uint32_t nbdflags;
+    int max_requests;           /* in-flight requests per client */
     QSIMPLEQ_HEAD(, NBDRequest) requests;
 };
 
@@ -639,6 +623,7 @@ struct NBDClient {
     Coroutine *send_coroutine;
 
     int nb_requests;
+    NBDClientStats stats;
 };
 
 static void nbd_client_get(NBDClient *client)
@@ -669,12 +654,13 @@ static NBDRequest *nbd_request_get(NBDClient *client)
     NBDRequest *req;
     NBDExport *exp = client->exp;
 
-    assert(client->nb_requests <= MAX_NBD_REQUESTS - 1);
+    assert(client->nb_requests <= exp->max_requests - 1);
     client->nb_requests++;
+    client->stats.max_in_flight = MAX(client->stats.max_in_flight,
+                                      client->nb_requests);
 
     if (QSIMPLEQ_EMPTY(&exp->requests)) {
         req = g_malloc0(sizeof(NBDRequest));
-        req->data = qemu_blockalign(exp->bs, NBD_BUFFER_SIZE);
     } else {
         req = QSIMPLEQ_FIRST(&exp->requests);
         QSIMPLEQ_REMOVE_HEAD(&exp->requests, entry);
@@ -687,21 +673,29 @@ static NBDRequest *nbd_request_get(NBDClient *client)
 static void nbd_request_put(NBDRequest *req)
 {
     NBDClient *client = req->client;
+
+    /* Payload buffers are sized for the request, so that a large limit on
+     * requests in flight does not pin a megabyte of memory per request.
+     */
+    qemu_vfree(req->data);
+    req->data = NULL;
     QSIMPLEQ_INSERT_HEAD(&client->exp->requests, req, entry);
-    if (client->nb_requests-- == MAX_NBD_REQUESTS) {
+    if (client->nb_requests-- == client->exp->max_requests) {
         qemu_notify_event();
     }
     nbd_client_put(client);
 }
 
 NBDExport *nbd_export_new(BlockDriverState *bs, off_t dev_offset,
-                          off_t size, uint32_t nbdflags)
+                          off_t size, uint32_t nbdflags, int max_requests)
 {
     NBDExport *exp = g_malloc0(sizeof(NBDExport));
     QSIMPLEQ_INIT(&exp->requests);
     exp->bs = bs;
     exp->dev_offset = dev_offset;
     exp->nbdflags = nbdflags;
+    exp->max_requests = max_requests > 0 ? max_requests
+                                         : NBD_DEFAULT_MAX_REQUESTS;
     exp->size = size == -1 ? bdrv_getlength(bs) : size;
     return exp;
 }
@@ -711,7 +705,6 @@ void nbd_export_close(NBDExport *exp)
     while (!QSIMPLEQ_EMPTY(&exp->requests)) {
         NBDRequest *first = QSIMPLEQ_FIRST(&exp->requests);
         QSIMPLEQ_REMOVE_HEAD(&exp->requests, entry);
-        qemu_vfree(first->data);
         g_free(first);
     }
 
@@ -728,25 +721,34 @@ static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
 {
     NBDClient *client = req->client;
     int csock = client->sock;
-    ssize_t rc, ret;
+    uint8_t buf[NBD_REPLY_SIZE];
+    struct iovec iov[2];
+    ssize_t rc;
+
+    /* The header and the payload of a read reply go out with a single
+     * sendmsg(), so there is neither a separate small packet for the
+     * header nor any copy of the payload, and the send lock is only held
+     * for as long as the socket takes the data.
+     */
+    nbd_encode_reply(buf, reply);
+    iov[0].iov_base = buf;
+    iov[0].iov_len = sizeof(buf);
+    iov[1].iov_base = req->data;
+    iov[1].iov_len = len;
+
+    TRACE("Sending response to client");
 
     qemu_co_mutex_lock(&client->send_lock);
     qemu_set_fd_handler2(csock, nbd_can_read, nbd_read,
                          nbd_restart_write, client);
     client->send_coroutine = qemu_coroutine_self();
 
-    if (!len) {
-        rc = nbd_send_reply(csock, reply);
+    rc = qemu_co_sendv(csock, iov, sizeof(buf) + len, 0);
+    if (rc != sizeof(buf) + len) {
+        LOG("writing to socket failed");
+        rc = -EIO;
     } else {
-        socket_set_cork(csock, 1);
-        rc = nbd_send_reply(csock, reply);
-        if (rc >= 0) {
-            ret = qemu_co_send(csock, req->data, len);
-            if (ret != len) {
-                rc = -EIO;
-            }
-        }
-        socket_set_cork(csock, 0);
+        rc = 0;
     }
 
     client->send_coroutine = NULL;
@@ -759,6 +761,7 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
 {
     NBDClient *client = req->client;
     int csock = client->sock;
+    uint32_t command;
     ssize_t rc;
 
     client->recv_coroutine = qemu_coroutine_self();
@@ -770,7 +773,8 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
         goto out;
     }
 
-    if (request->len > NBD_BUFFER_SIZE) {
+    command = request->type & NBD_CMD_MASK_COMMAND;
+    if (request->len > NBD_BUFFER_SIZE && command != NBD_CMD_BLOCK_STATUS) {
         LOG("len (%u) is larger than max len (%u)",
             request->len, NBD_BUFFER_SIZE);
         rc = -EINVAL;
@@ -786,7 +790,13 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
 
     TRACE("Decoding type");
 
-    if ((request->type & NBD_CMD_MASK_COMMAND) == NBD_CMD_WRITE) {
+    if (request->len &&
+        (command == NBD_CMD_READ || command == NBD_CMD_WRITE)) {
+        req->data = qemu_blockalign(client->exp->bs, request->len);
+    } else if (command == NBD_CMD_BLOCK_STATUS) {
+        req->data = qemu_blockalign(client->exp->bs, NBD_STATUS_REPLY_SIZE);
+    }
+    if (command == NBD_CMD_WRITE) {
         TRACE("Reading %u byte(s)", request->len);
 
         if (qemu_co_recv(csock, req->data, request->len) != request->len) {
@@ -802,6 +812,66 @@ out:
     return rc;
 }
 
+/*
+ * Fill buf with the extents of [from, from + len) in the format described
+ * for NBD_CMD_BLOCK_STATUS and return its length, or -errno.  Data that is
+ * not allocated anywhere in the backing chain of the export reads as zeroes.
+ */
+static int coroutine_fn nbd_co_block_status(NBDExport *exp, uint64_t from,
+                                            uint32_t len, uint8_t *buf)
+{
+    int64_t sector_num = (from + exp->dev_offset) / 512;
+    int64_t end = sector_num + len / 512;
+    uint32_t extent_len = 0, extent_flags = 0;
+    int nb_extents = 0;
+    int ret, n;
+
+    if (from + len > exp->size) {
+        return -EINVAL;
+    }
+
+    while (sector_num < end) {
+        uint32_t flags;
+
+        ret = bdrv_co_is_allocated_above(exp->bs, NULL, sector_num,
+                                         MIN(end - sector_num, INT_MAX >> 1),
+                                         &n);
+        if (ret < 0) {
+            return ret;
+        }
+        if (n == 0) {
+            break;
+        }
+
+        flags = ret ? 0 : NBD_STATE_HOLE | NBD_STATE_ZERO;
+        if (nb_extents > 0 && flags == extent_flags) {
+            extent_len += (uint32_t)n * 512;
+        } else {
+            if (nb_extents == NBD_MAX_EXTENTS) {
+                break;
+            }
+            if (nb_extents > 0) {
+                cpu_to_be32w((uint32_t*)(buf + nb_extents * 8 - 4),
+                             extent_len);
+                cpu_to_be32w((uint32_t*)(buf + nb_extents * 8),
+                             extent_flags);
+            }
+            nb_extents++;
+            extent_len = (uint32_t)n * 512;
+            extent_flags = flags;
+        }
+        sector_num += n;
+    }
+
+    if (nb_extents == 0) {
+        return -EINVAL;
+    }
+    cpu_to_be32w((uint32_t*)(buf + nb_extents * 8 - 4), extent_len);
+    cpu_to_be32w((uint32_t*)(buf + nb_extents * 8), extent_flags);
+    cpu_to_be32w((uint32_t*)buf, nb_extents);
+    return 4 + nb_extents * 8;
+}
+
 static void nbd_trip(void *opaque)
 {
     NBDClient *client = opaque;
@@ -809,6 +879,8 @@ static void nbd_trip(void *opaque)
     NBDExport *exp = client->exp;
     struct nbd_request request;
     struct nbd_reply reply;
+    struct iovec iov;
+    QEMUIOVector qiov;
     ssize_t ret;
 
     TRACE("Reading request.");
@@ -824,6 +896,10 @@ static void nbd_trip(void *opaque)
     reply.handle = request.handle;
     reply.error = 0;
 
+    iov.iov_base = req->data;
+    iov.iov_len = request.len;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
     if (ret < 0) {
         reply.error = -ret;
         goto error_reply;
@@ -851,8 +927,8 @@ static void nbd_trip(void *opaque)
             }
         }
 
-        ret = bdrv_read(exp->bs, (request.from + exp->dev_offset) / 512,
-                        req->data, request.len / 512);
+        ret = bdrv_co_readv(exp->bs, (request.from + exp->dev_offset) / 512,
+                            request.len / 512, &qiov);
         if (ret < 0) {
             LOG("reading from file failed");
             reply.error = -ret;
@@ -860,6 +936,8 @@ static void nbd_trip(void *opaque)
         }
 
         TRACE("Read %u byte(s)", request.len);
+        client->stats.rd_ops++;
+        client->stats.rd_bytes += request.len;
         if (nbd_co_send_reply(req, &reply, request.len) < 0)
             goto out;
         break;
@@ -874,8 +952,8 @@ static void nbd_trip(void *opaque)
 
         TRACE("Writing to device");
 
-        ret = bdrv_write(exp->bs, (request.from + exp->dev_offset) / 512,
-                         req->data, request.len / 512);
+        ret = bdrv_co_writev(exp->bs, (request.from + exp->dev_offset) / 512,
+                             request.len / 512, &qiov);
         if (ret < 0) {
             LOG("writing to file failed");
             reply.error = -ret;
@@ -891,6 +969,8 @@ static void nbd_trip(void *opaque)
             }
         }
 
+        client->stats.wr_ops++;
+        client->stats.wr_bytes += request.len;
         if (nbd_co_send_reply(req, &reply, 0) < 0) {
             goto out;
         }
@@ -906,6 +986,9 @@ static void nbd_trip(void *opaque)
         if (ret < 0) {
             LOG("flush failed");
             reply.error = -ret;
+            client->stats.errors++;
+        } else {
+            client->stats.flush_ops++;
         }
         if (nbd_co_send_reply(req, &reply, 0) < 0) {
             goto out;
@@ -918,16 +1001,39 @@ static void nbd_trip(void *opaque)
         if (ret < 0) {
             LOG("discard failed");
             reply.error = -ret;
+            client->stats.errors++;
+        } else {
+            client->stats.trim_ops++;
         }
         if (nbd_co_send_reply(req, &reply, 0) < 0) {
             goto out;
         }
         break;
+    case NBD_CMD_BLOCK_STATUS:
+        TRACE("Request type is BLOCK_STATUS");
+
+        if ((request.from | request.len) & 511 || request.len == 0) {
+            goto invalid_request;
+        }
+
+        ret = nbd_co_block_status(exp, request.from, request.len, req->data);
+        if (ret < 0) {
+            LOG("querying block status failed");
+            reply.error = -ret;
+            goto error_reply;
+        }
+
+        client->stats.status_ops++;
+        if (nbd_co_send_reply(req, &reply, ret) < 0) {
+            goto out;
+        }
+        break;
     default:
         LOG("invalid request type (%u) received", request.type);
     invalid_request:
-        reply.error = -EINVAL;
+        reply.error = EINVAL;
     error_reply:
+        client->stats.errors++;
         if (nbd_co_send_reply(req, &reply, 0) < 0) {
             goto out;
         }
@@ -949,7 +1055,8 @@ static int nbd_can_read(void *opaque)
 {
     NBDClient *client = opaque;
 
-    return client->recv_coroutine || client->nb_requests < MAX_NBD_REQUESTS;
+    return client->recv_coroutine ||
+           client->nb_requests < client->exp->max_requests;
 }
 
 static void nbd_read(void *opaque)
@@ -970,6 +1077,11 @@ static void nbd_restart_write(void *opaque)
     qemu_coroutine_enter(client->send_coroutine, NULL);
 }
 
+void nbd_client_get_stats(NBDClient *client, NBDClientStats *stats)
+{
+    *stats = client->stats;
+}
+
 NBDClient *nbd_client_new(NBDExport *exp, int csock,
                           void (*close)(NBDClient *))
 {
@@ -43,6 +43,8 @@ struct nbd_reply {
 #define NBD_FLAG_SEND_FUA       (1 << 3)        /* Send FUA (Force Unit Access) */
 #define NBD_FLAG_ROTATIONAL     (1 << 4)        /* Use elevator algorithm - rotational media */
 #define NBD_FLAG_SEND_TRIM      (1 << 5)        /* Send TRIM (discard) */
+/* QEMU extension, kept clear of the bits that the protocol assigns */
+#define NBD_FLAG_SEND_BLOCK_STATUS (1 << 15)    /* Send BLOCK_STATUS */
 
 #define NBD_CMD_MASK_COMMAND	0x0000ffff
 #define NBD_CMD_FLAG_FUA	(1 << 16)
@@ -52,13 +54,35 @@ enum {
     NBD_CMD_WRITE = 1,
     NBD_CMD_DISC = 2,
     NBD_CMD_FLUSH = 3,
-    NBD_CMD_TRIM = 4
+    NBD_CMD_TRIM = 4,
+    /* QEMU extension, far from the commands that the protocol assigns */
+    NBD_CMD_BLOCK_STATUS = 0xfe00
 };
 
+/* The reply to NBD_CMD_BLOCK_STATUS is followed, if there was no error, by
+ * the number of extents and the extents themselves, all big endian:
+
+   [ 0 ..  3]   number of extents (at least one, at most NBD_MAX_EXTENTS)
+   [ 4 ..  7]   length of the first extent in bytes
+   [ 8 .. 11]   flags of the first extent (NBD_STATE_*)
+   ...
+
+ * The extents are contiguous and start at the offset of the request, but
+ * may cover less than the requested length.
+ */
+#define NBD_MAX_EXTENTS         128
+#define NBD_STATUS_REPLY_SIZE   (4 + NBD_MAX_EXTENTS * 8)
+
+#define NBD_STATE_HOLE          (1 << 0)        /* Not allocated */
+#define NBD_STATE_ZERO          (1 << 1)        /* Reads as zeroes */
+
 #define NBD_DEFAULT_PORT	10809
 
 #define NBD_BUFFER_SIZE (1024*1024)
 
+/* Requests that the server handles at the same time for each client */
+#define NBD_DEFAULT_MAX_REQUESTS 64
+
 ssize_t nbd_wr_sync(int fd, void *buffer, size_t size, bool do_read);
 int tcp_socket_outgoing(const char *address, uint16_t port);
 int tcp_socket_incoming(const char *address, uint16_t port);
@@ -78,10 +102,23 @@ int nbd_disconnect(int fd);
 typedef struct NBDExport NBDExport;
 typedef struct NBDClient NBDClient;
 
+typedef struct NBDClientStats {
+    uint64_t rd_ops;
+    uint64_t wr_ops;
+    uint64_t flush_ops;
+    uint64_t trim_ops;
+    uint64_t status_ops;
+    uint64_t rd_bytes;
+    uint64_t wr_bytes;
+    uint64_t errors;            /* requests that got an error reply */
+    int max_in_flight;          /* peak number of requests in flight */
+} NBDClientStats;
+
 NBDExport *nbd_export_new(BlockDriverState *bs, off_t dev_offset,
-                          off_t size, uint32_t nbdflags);
+                          off_t size, uint32_t nbdflags, int max_requests);
 void nbd_export_close(NBDExport *exp);
 NBDClient *nbd_client_new(NBDExport *exp, int csock,
                           void (*close)(NBDClient *));
+void nbd_client_get_stats(NBDClient *client, NBDClientStats *stats);
 
 #endif
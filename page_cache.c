@@ -0,0 +1,241 @@
+/*
+ * Page cache for QEMU
+ * The cache is base on a hash of the page address
+ *
+ * Copyright 2012 Red Hat, Inc. and/or its affiliates
+ *
+ * Authors:
+ *  Orit Wasserman  <owasserm@redhat.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "qemu-common.h"
+#include "host-utils.h"
+#include "page_cache.h"
+
+//#define DEBUG_CACHE
+
+#ifdef DEBUG_CACHE
+#define DPRINTF(fmt, ...) \
+    do { fprintf(stdout, "cache: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+/*
+ * The cache is set associative: the page address selects a set of
+ * CACHE_WAYS slots and, inside a set, the least recently used slot is
+ * the one evicted.
+ */
+#define CACHE_WAYS 4
+
+typedef struct CacheItem CacheItem;
+
+struct CacheItem {
+    uint64_t it_addr;
+    uint64_t it_age;
+    uint8_t *it_data;
+};
+
+struct PageCache {
+    CacheItem *page_cache;
+    unsigned int page_size;
+    int64_t max_num_items;
+    uint64_t max_item_age;
+    int64_t num_items;
+};
+
+PageCache *cache_init(int64_t num_pages, unsigned int page_size)
+{
+    int64_t i;
+    PageCache *cache;
+
+    if (num_pages < CACHE_WAYS) {
+        DPRINTF("invalid number of pages\n");
+        return NULL;
+    }
+
+    /* round down to the nearest power of 2 */
+    num_pages = 1ULL << (63 - clz64(num_pages));
+
+    cache = g_malloc(sizeof(*cache));
+    cache->page_size = page_size;
+    cache->num_items = 0;
+    cache->max_item_age = 0;
+    cache->max_num_items = num_pages;
+
+    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+
+    cache->page_cache = g_malloc(cache->max_num_items *
+                                 sizeof(*cache->page_cache));
+
+    for (i = 0; i < cache->max_num_items; i++) {
+        cache->page_cache[i].it_data = NULL;
+        cache->page_cache[i].it_age = 0;
+        cache->page_cache[i].it_addr = -1;
+    }
+
+    return cache;
+}
+
+void cache_fini(PageCache *cache)
+{
+    int64_t i;
+
+    g_assert(cache);
+    g_assert(cache->page_cache);
+
+    for (i = 0; i < cache->max_num_items; i++) {
+        g_free(cache->page_cache[i].it_data);
+    }
+
+    g_free(cache->page_cache);
+    g_free(cache);
+}
+
+static CacheItem *cache_get_set(const PageCache *cache, uint64_t address)
+{
+    int64_t num_sets = cache->max_num_items / CACHE_WAYS;
+    int64_t set;
+
+    g_assert(cache->page_cache);
+
+    set = (address / cache->page_size) & (num_sets - 1);
+    return &cache->page_cache[set * CACHE_WAYS];
+}
+
+static CacheItem *cache_find(const PageCache *cache, uint64_t addr)
+{
+    CacheItem *set = cache_get_set(cache, addr);
+    int i;
+
+    for (i = 0; i < CACHE_WAYS; i++) {
+        if (set[i].it_data && set[i].it_addr == addr) {
+            return &set[i];
+        }
+    }
+
+    return NULL;
+}
+
+bool cache_is_cached(const PageCache *cache, uint64_t addr)
+{
+    return cache_find(cache, addr) != NULL;
+}
+
+uint8_t *get_cached_data(PageCache *cache, uint64_t addr)
+{
+    CacheItem *it = cache_find(cache, addr);
+
+    if (!it) {
+        return NULL;
+    }
+
+    it->it_age = ++cache->max_item_age;
+    return it->it_data;
+}
+
+void cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata)
+{
+    CacheItem *set = cache_get_set(cache, addr);
+    CacheItem *it = NULL;
+    int i;
+
+    for (i = 0; i < CACHE_WAYS; i++) {
+        if (set[i].it_data && set[i].it_addr == addr) {
+            it = &set[i];
+            break;
+        }
+        /* prefer a free slot, otherwise the least recently used one */
+        if (!it || (it->it_data &&
+                    (!set[i].it_data || set[i].it_age < it->it_age))) {
+            it = &set[i];
+        }
+    }
+
+    if (it->it_data) {
+        g_free(it->it_data);
+    } else {
+        cache->num_items++;
+    }
+
+    it->it_data = pdata;
+    it->it_age = ++cache->max_item_age;
+    it->it_addr = addr;
+}
+
+int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
+{
+    PageCache *new_cache;
+    int64_t i;
+
+    g_assert(cache);
+
+    /* cache was not inited */
+    if (cache->page_cache == NULL) {
+        return -1;
+    }
+
+    if (new_num_pages < CACHE_WAYS) {
+        return -1;
+    }
+
+    /* same size */
+    if (1ULL << (63 - clz64(new_num_pages)) == cache->max_num_items) {
+        return cache->max_num_items;
+    }
+
+    new_cache = cache_init(new_num_pages, cache->page_size);
+    if (!new_cache) {
+        DPRINTF("Error creating new cache\n");
+        return -1;
+    }
+
+    /* move all data from old cache, most recently used pages win */
+    for (i = 0; i < cache->max_num_items; i++) {
+        CacheItem *old_it = &cache->page_cache[i];
+        CacheItem *set, *new_it = NULL;
+        int j;
+
+        if (!old_it->it_data) {
+            continue;
+        }
+
+        set = cache_get_set(new_cache, old_it->it_addr);
+        for (j = 0; j < CACHE_WAYS; j++) {
+            if (!new_it || (new_it->it_data &&
+                            (!set[j].it_data ||
+                             set[j].it_age < new_it->it_age))) {
+                new_it = &set[j];
+            }
+        }
+
+        if (new_it->it_data) {
+            if (new_it->it_age >= old_it->it_age) {
+                g_free(old_it->it_data);
+                continue;
+            }
+            g_free(new_it->it_data);
+        } else {
+            new_cache->num_items++;
+        }
+        *new_it = *old_it;
+    }
+
+    g_free(cache->page_cache);
+    cache->page_cache = new_cache->page_cache;
+    cache->max_num_items = new_cache->max_num_items;
+    cache->num_items = new_cache->num_items;
+
+    g_free(new_cache);
+
+    return cache->max_num_items;
+}
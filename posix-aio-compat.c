@@ -29,10 +29,30 @@
 #include "qemu-common.h"
 #include "trace.h"
 #include "block_int.h"
+#include "qemu-timer.h"
 
 #include "block/raw-posix-aio.h"
 
-static void do_spawn_thread(void);
+/*
+ * Thread pool
+ *
+ * Every worker thread has its own request queue and its own lock, so that
+ * submission and the workers don't all serialize on one mutex.  A new
+ * request goes to a parked worker if there is one, which is woken alone.
+ * Otherwise a new worker is started while there are fewer than max_threads,
+ * and as a last resort the request is queued to the worker with the
+ * shortest queue.  Workers that run out of work steal from the other queues
+ * before they park, and exit after IDLE_TIMEOUT seconds without work.
+ *
+ * Completed requests are pushed onto a lock-free list.  Only the push that
+ * finds the list empty notifies the main loop, which then completes the
+ * whole batch without looking at requests that are still in flight.
+ */
+
+#define MAX_THREADS     64
+#define IDLE_TIMEOUT    10      /* seconds */
+
+typedef struct PaioWorker PaioWorker;
 
 struct qemu_paiocb {
     BlockDriverAIOCB common;
@@ -40,36 +60,57 @@ struct qemu_paiocb {
     union {
         struct iovec *aio_iov;
         void *aio_ioctl_buf;
+        void *aio_func_arg;
     };
+    PaioFunc *aio_func;         /* for QEMU_AIO_FUNC */
     int aio_niov;
     size_t aio_nbytes;
 #define aio_ioctl_cmd   aio_nbytes /* for QEMU_AIO_IOCTL */
     off_t aio_offset;
 
+    PaioWorker *worker;         /* owner of the queue the request is on */
     QTAILQ_ENTRY(qemu_paiocb) node;
     int aio_type;
     ssize_t ret;
     int active;
-    struct qemu_paiocb *next;
+    bool cancelled;
+    struct qemu_paiocb *next;   /* in the list of completed requests */
+};
+
+enum {
+    WORKER_DEAD,
+    WORKER_STARTING,    /* has requests, thread not created yet */
+    WORKER_RUNNING,
+};
+
+struct PaioWorker {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    QTAILQ_HEAD(, qemu_paiocb) queue;
+    int queued;
+    int state;
+    bool parked;
+
+    /* statistics, protected by lock */
+    uint64_t requests;
+    int64_t busy_ns;
+    int64_t start_ns;
 };
 
 typedef struct PosixAioState {
     int rfd, wfd;
-    struct qemu_paiocb *first_aio;
+    int count;                      /* requests not completed yet */
+    struct qemu_paiocb *completed;  /* pushed by the workers */
+    uint64_t nr_completed;
+    uint64_t nr_notifications;
 } PosixAioState;
 
-
-static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
-static pthread_t thread_id;
 static pthread_attr_t attr;
-static int max_threads = 64;
-static int cur_threads = 0;
-static int idle_threads = 0;
-static int new_threads = 0;     /* backlog of threads we need to create */
-static int pending_threads = 0; /* threads created but not running yet */
+static int max_threads = MAX_THREADS;
+static PaioWorker workers[MAX_THREADS];
+static int next_worker;             /* round-robin start for the search */
+static uint64_t nr_stolen;
 static QEMUBH *new_thread_bh;
-static QTAILQ_HEAD(, qemu_paiocb) request_list;
 
 #ifdef CONFIG_PREADV
 static int preadv_present = 1;
@@ -309,173 +350,263 @@ static ssize_t handle_aiocb_rw(struct qemu_paiocb *aiocb)
     return nbytes;
 }
 
-static void posix_aio_notify_event(void);
+static PosixAioState *posix_aio_state;
 
-static void *aio_thread(void *unused)
+static void posix_aio_notify_event(void)
 {
-    mutex_lock(&lock);
-    pending_threads--;
-    mutex_unlock(&lock);
-    do_spawn_thread();
+    /* Write 8 bytes to be compatible with eventfd.  */
+    static const uint64_t val = 1;
+    ssize_t ret;
 
-    while (1) {
-        struct qemu_paiocb *aiocb;
-        ssize_t ret = 0;
-        qemu_timeval tv;
-        struct timespec ts;
-
-        qemu_gettimeofday(&tv);
-        ts.tv_sec = tv.tv_sec + 10;
-        ts.tv_nsec = 0;
-
-        mutex_lock(&lock);
-
-        while (QTAILQ_EMPTY(&request_list) &&
-               !(ret == ETIMEDOUT)) {
-            idle_threads++;
-            ret = cond_timedwait(&cond, &lock, &ts);
-            idle_threads--;
+    do {
+        ret = write(posix_aio_state->wfd, &val, sizeof(val));
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0 && errno != EAGAIN)
+        die("write()");
+}
+
+/*
+ * Hands a finished request to the main loop.  Only the first request of a
+ * batch needs to kick it, the others are picked up by the same run of
+ * posix_aio_read().
+ */
+static void paio_complete(struct qemu_paiocb *aiocb, ssize_t ret)
+{
+    PosixAioState *s = posix_aio_state;
+    struct qemu_paiocb *old;
+
+    aiocb->ret = ret;
+    do {
+        old = s->completed;
+        aiocb->next = old;
+    } while (!__sync_bool_compare_and_swap(&s->completed, old, aiocb));
+
+    if (old == NULL) {
+        posix_aio_notify_event();
+    }
+}
+
+/* Takes the oldest request from another worker's queue */
+static struct qemu_paiocb *paio_steal(PaioWorker *self)
+{
+    struct qemu_paiocb *aiocb = NULL;
+    int i, n;
+
+    n = self - workers;
+    for (i = 1; i < max_threads && !aiocb; i++) {
+        PaioWorker *w = &workers[(n + i) % max_threads];
+
+        /* Only a hint, checked again under the lock */
+        if (w->queued == 0 || pthread_mutex_trylock(&w->lock)) {
+            continue;
         }
+        aiocb = QTAILQ_FIRST(&w->queue);
+        if (aiocb) {
+            QTAILQ_REMOVE(&w->queue, aiocb, node);
+            w->queued--;
+            aiocb->active = 1;
+        }
+        mutex_unlock(&w->lock);
+    }
 
-        if (QTAILQ_EMPTY(&request_list))
-            break;
+    if (aiocb) {
+        __sync_fetch_and_add(&nr_stolen, 1);
+    }
+    return aiocb;
+}
 
-        aiocb = QTAILQ_FIRST(&request_list);
-        QTAILQ_REMOVE(&request_list, aiocb, node);
-        aiocb->active = 1;
-        mutex_unlock(&lock);
+static ssize_t paio_handle_request(struct qemu_paiocb *aiocb)
+{
+    ssize_t ret;
 
-        switch (aiocb->aio_type & QEMU_AIO_TYPE_MASK) {
-        case QEMU_AIO_READ:
-            ret = handle_aiocb_rw(aiocb);
-            if (ret >= 0 && ret < aiocb->aio_nbytes && aiocb->common.bs->growable) {
-                /* A short read means that we have reached EOF. Pad the buffer
-                 * with zeros for bytes after EOF. */
-                QEMUIOVector qiov;
+    switch (aiocb->aio_type & QEMU_AIO_TYPE_MASK) {
+    case QEMU_AIO_READ:
+        ret = handle_aiocb_rw(aiocb);
+        if (ret >= 0 && ret < aiocb->aio_nbytes && aiocb->common.bs->growable) {
+            /* A short read means that we have reached EOF. Pad the buffer
+             * with zeros for bytes after EOF. */
+            QEMUIOVector qiov;
 
-                qemu_iovec_init_external(&qiov, aiocb->aio_iov,
-                                         aiocb->aio_niov);
-                qemu_iovec_memset_skip(&qiov, 0, aiocb->aio_nbytes - ret, ret);
+            qemu_iovec_init_external(&qiov, aiocb->aio_iov,
+                                     aiocb->aio_niov);
+            qemu_iovec_memset_skip(&qiov, 0, aiocb->aio_nbytes - ret, ret);
 
-                ret = aiocb->aio_nbytes;
+            ret = aiocb->aio_nbytes;
+        }
+        break;
+    case QEMU_AIO_WRITE:
+        ret = handle_aiocb_rw(aiocb);
+        break;
+    case QEMU_AIO_FLUSH:
+        ret = handle_aiocb_flush(aiocb);
+        break;
+    case QEMU_AIO_IOCTL:
+        ret = handle_aiocb_ioctl(aiocb);
+        break;
+    case QEMU_AIO_FUNC:
+        ret = aiocb->aio_func(aiocb->aio_func_arg);
+        break;
+    default:
+        fprintf(stderr, "invalid aio request (0x%x)\n", aiocb->aio_type);
+        ret = -EINVAL;
+        break;
+    }
+
+    return ret;
+}
+
+static void *aio_thread(void *opaque)
+{
+    PaioWorker *w = opaque;
+    struct qemu_paiocb *aiocb;
+    qemu_timeval tv;
+    struct timespec ts;
+    int64_t start;
+    ssize_t ret;
+
+    mutex_lock(&w->lock);
+    while (1) {
+        aiocb = QTAILQ_FIRST(&w->queue);
+        if (aiocb) {
+            QTAILQ_REMOVE(&w->queue, aiocb, node);
+            w->queued--;
+            aiocb->active = 1;
+        } else {
+            mutex_unlock(&w->lock);
+            aiocb = paio_steal(w);
+            mutex_lock(&w->lock);
+        }
+
+        if (!aiocb) {
+            if (!QTAILQ_EMPTY(&w->queue)) {
+                continue;
             }
-            break;
-        case QEMU_AIO_WRITE:
-            ret = handle_aiocb_rw(aiocb);
-            break;
-        case QEMU_AIO_FLUSH:
-            ret = handle_aiocb_flush(aiocb);
-            break;
-        case QEMU_AIO_IOCTL:
-            ret = handle_aiocb_ioctl(aiocb);
-            break;
-        default:
-            fprintf(stderr, "invalid aio request (0x%x)\n", aiocb->aio_type);
-            ret = -EINVAL;
-            break;
+
+            qemu_gettimeofday(&tv);
+            ts.tv_sec = tv.tv_sec + IDLE_TIMEOUT;
+            ts.tv_nsec = 0;
+
+            w->parked = true;
+            ret = cond_timedwait(&w->cond, &w->lock, &ts);
+            w->parked = false;
+
+            if (ret == ETIMEDOUT && QTAILQ_EMPTY(&w->queue)) {
+                break;
+            }
+            continue;
         }
+        mutex_unlock(&w->lock);
 
-        mutex_lock(&lock);
-        aiocb->ret = ret;
-        mutex_unlock(&lock);
+        start = get_clock();
+        ret = paio_handle_request(aiocb);
+        paio_complete(aiocb, ret);
 
-        posix_aio_notify_event();
+        mutex_lock(&w->lock);
+        w->requests++;
+        w->busy_ns += get_clock() - start;
     }
 
-    cur_threads--;
-    mutex_unlock(&lock);
+    w->state = WORKER_DEAD;
+    mutex_unlock(&w->lock);
 
     return NULL;
 }
 
-static void do_spawn_thread(void)
+static void spawn_thread_bh_fn(void *opaque)
 {
     sigset_t set, oldset;
-
-    mutex_lock(&lock);
-    if (!new_threads) {
-        mutex_unlock(&lock);
-        return;
-    }
-
-    new_threads--;
-    pending_threads++;
-
-    mutex_unlock(&lock);
+    pthread_t thread_id;
+    int i;
 
     /* block all signals */
     if (sigfillset(&set)) die("sigfillset");
     if (sigprocmask(SIG_SETMASK, &set, &oldset)) die("sigprocmask");
 
-    thread_create(&thread_id, &attr, aio_thread, NULL);
+    for (i = 0; i < max_threads; i++) {
+        PaioWorker *w = &workers[i];
+        bool start;
+
+        mutex_lock(&w->lock);
+        start = (w->state == WORKER_STARTING);
+        if (start) {
+            w->state = WORKER_RUNNING;
+            w->requests = 0;
+            w->busy_ns = 0;
+            w->start_ns = get_clock();
+        }
+        mutex_unlock(&w->lock);
+
+        if (start) {
+            thread_create(&thread_id, &attr, aio_thread, w);
+        }
+    }
 
     if (sigprocmask(SIG_SETMASK, &oldset, NULL)) die("sigprocmask restore");
 }
 
-static void spawn_thread_bh_fn(void *opaque)
+/*
+ * Picks the worker for a new request: a parked one if possible, else a free
+ * slot for a new thread, else the one with the shortest queue.  The fields
+ * are read without locks, a wrong guess only costs some balance.
+ */
+static PaioWorker *paio_pick_worker(void)
 {
-    do_spawn_thread();
-}
+    PaioWorker *free_slot = NULL, *shortest = NULL;
+    int i;
 
-static void spawn_thread(void)
-{
-    cur_threads++;
-    new_threads++;
-    /* If there are threads being created, they will spawn new workers, so
-     * we don't spend time creating many threads in a loop holding a mutex or
-     * starving the current vcpu.
-     *
-     * If there are no idle threads, ask the main thread to create one, so we
-     * inherit the correct affinity instead of the vcpu affinity.
-     */
-    if (!pending_threads) {
-        qemu_bh_schedule(new_thread_bh);
+    for (i = 0; i < max_threads; i++) {
+        PaioWorker *w = &workers[(next_worker + i) % max_threads];
+
+        if (w->state == WORKER_DEAD) {
+            if (!free_slot) {
+                free_slot = w;
+            }
+        } else if (w->parked && w->queued == 0) {
+            next_worker = (w - workers + 1) % max_threads;
+            return w;
+        } else if (!shortest || w->queued < shortest->queued) {
+            shortest = w;
+        }
     }
+
+    next_worker = (next_worker + 1) % max_threads;
+    return free_slot ? free_slot : shortest;
 }
 
 static void qemu_paio_submit(struct qemu_paiocb *aiocb)
 {
+    PaioWorker *w = paio_pick_worker();
+
     aiocb->ret = -EINPROGRESS;
     aiocb->active = 0;
-    mutex_lock(&lock);
-    if (idle_threads == 0 && cur_threads < max_threads)
-        spawn_thread();
-    QTAILQ_INSERT_TAIL(&request_list, aiocb, node);
-    mutex_unlock(&lock);
-    cond_signal(&cond);
-}
-
-static ssize_t qemu_paio_return(struct qemu_paiocb *aiocb)
-{
-    ssize_t ret;
-
-    mutex_lock(&lock);
-    ret = aiocb->ret;
-    mutex_unlock(&lock);
-
-    return ret;
-}
-
-static int qemu_paio_error(struct qemu_paiocb *aiocb)
-{
-    ssize_t ret = qemu_paio_return(aiocb);
-
-    if (ret < 0)
-        ret = -ret;
-    else
-        ret = 0;
-
-    return ret;
+    aiocb->cancelled = false;
+    aiocb->worker = w;
+    posix_aio_state->count++;
+
+    mutex_lock(&w->lock);
+    if (w->state == WORKER_DEAD) {
+        /* Create the thread from the main loop, so we inherit the correct
+         * affinity instead of the vcpu affinity */
+        w->state = WORKER_STARTING;
+        qemu_bh_schedule(new_thread_bh);
+    }
+    QTAILQ_INSERT_TAIL(&w->queue, aiocb, node);
+    w->queued++;
+    if (w->parked) {
+        cond_signal(&w->cond);
+    }
+    mutex_unlock(&w->lock);
 }
 
 static void posix_aio_read(void *opaque)
 {
     PosixAioState *s = opaque;
-    struct qemu_paiocb *acb, **pacb;
-    int ret;
+    struct qemu_paiocb *acb, *list, *next;
     ssize_t len;
+    int ret;
 
-    /* read all bytes from signal pipe */
+    /* Drain the notifier before taking the list, see paio_complete() */
     for (;;) {
         char bytes[16];
 
@@ -486,107 +617,76 @@ static void posix_aio_read(void *opaque)
             continue; /* more to read */
         break;
     }
-
-    for(;;) {
-        pacb = &s->first_aio;
-        for(;;) {
-            acb = *pacb;
-            if (!acb)
-                return;
-
-            ret = qemu_paio_error(acb);
-            if (ret == ECANCELED) {
-                /* remove the request */
-                *pacb = acb->next;
-                qemu_aio_release(acb);
-            } else if (ret != EINPROGRESS) {
-                /* end of aio */
-                if (ret == 0) {
-                    ret = qemu_paio_return(acb);
-                    if (ret == acb->aio_nbytes)
-                        ret = 0;
-                    else
-                        ret = -EINVAL;
-                } else {
-                    ret = -ret;
-                }
-
-                trace_paio_complete(acb, acb->common.opaque, ret);
-
-                /* remove the request */
-                *pacb = acb->next;
-                /* call the callback */
-                acb->common.cb(acb->common.opaque, ret);
-                qemu_aio_release(acb);
-                break;
-            } else {
-                pacb = &acb->next;
-            }
-        }
+    s->nr_notifications++;
+
+    /* Complete in submission order, the list was built in reverse */
+    list = __sync_lock_test_and_set(&s->completed, NULL);
+    __sync_synchronize();
+    for (acb = NULL; list; list = next) {
+        next = list->next;
+        list->next = acb;
+        acb = list;
     }
-}
 
-static int posix_aio_flush(void *opaque)
-{
-    PosixAioState *s = opaque;
-    return !!s->first_aio;
-}
+    for (; acb; acb = next) {
+        next = acb->next;
+        s->count--;
+        s->nr_completed++;
 
-static PosixAioState *posix_aio_state;
+        if (acb->cancelled) {
+            qemu_aio_release(acb);
+            continue;
+        }
 
-static void posix_aio_notify_event(void)
-{
-    char byte = 0;
-    ssize_t ret;
+        ret = acb->ret;
+        if (ret == acb->aio_nbytes) {
+            ret = 0;
+        } else if (ret >= 0) {
+            ret = -EINVAL;
+        }
 
-    ret = write(posix_aio_state->wfd, &byte, sizeof(byte));
-    if (ret < 0 && errno != EAGAIN)
-        die("write()");
+        trace_paio_complete(acb, acb->common.opaque, ret);
+
+        acb->common.cb(acb->common.opaque, ret);
+        qemu_aio_release(acb);
+    }
 }
 
-static void paio_remove(struct qemu_paiocb *acb)
+static int posix_aio_flush(void *opaque)
 {
-    struct qemu_paiocb **pacb;
-
-    /* remove the callback from the queue */
-    pacb = &posix_aio_state->first_aio;
-    for(;;) {
-        if (*pacb == NULL) {
-            fprintf(stderr, "paio_remove: aio request not found!\n");
-            break;
-        } else if (*pacb == acb) {
-            *pacb = acb->next;
-            qemu_aio_release(acb);
-            break;
-        }
-        pacb = &(*pacb)->next;
-    }
+    PosixAioState *s = opaque;
+    return !!s->count;
 }
 
 static void paio_cancel(BlockDriverAIOCB *blockacb)
 {
     struct qemu_paiocb *acb = (struct qemu_paiocb *)blockacb;
-    int active = 0;
+    PaioWorker *w = acb->worker;
+    int active;
 
     trace_paio_cancel(acb, acb->common.opaque);
 
-    mutex_lock(&lock);
-    if (!acb->active) {
-        QTAILQ_REMOVE(&request_list, acb, node);
-        acb->ret = -ECANCELED;
-    } else if (acb->ret == -EINPROGRESS) {
-        active = 1;
+    mutex_lock(&w->lock);
+    active = acb->active;
+    if (!active) {
+        QTAILQ_REMOVE(&w->queue, acb, node);
+        w->queued--;
     }
-    mutex_unlock(&lock);
+    mutex_unlock(&w->lock);
 
-    if (active) {
-        /* fail safe: if the aio could not be canceled, we wait for
-           it */
-        while (qemu_paio_error(acb) == EINPROGRESS)
-            ;
+    if (!active) {
+        posix_aio_state->count--;
+        qemu_aio_release(acb);
+        return;
+    }
+
+    /* fail safe: if the aio could not be canceled, we wait for it */
+    while (acb->ret == -EINPROGRESS) {
+        __sync_synchronize();
     }
 
-    paio_remove(acb);
+    /* posix_aio_read() frees it without calling the callback */
+    acb->cancelled = true;
 }
 
 static AIOPool raw_aio_pool = {
@@ -611,9 +711,6 @@ BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
     acb->aio_nbytes = nb_sectors * 512;
     acb->aio_offset = sector_num * 512;
 
-    acb->next = posix_aio_state->first_aio;
-    posix_aio_state->first_aio = acb;
-
     trace_paio_submit(acb, opaque, sector_num, nb_sectors, type);
     qemu_paio_submit(acb);
     return &acb->common;
@@ -632,27 +729,77 @@ BlockDriverAIOCB *paio_ioctl(BlockDriverState *bs, int fd,
     acb->aio_ioctl_buf = buf;
     acb->aio_ioctl_cmd = req;
 
-    acb->next = posix_aio_state->first_aio;
-    posix_aio_state->first_aio = acb;
+    qemu_paio_submit(acb);
+    return &acb->common;
+}
+
+/*
+ * Runs func(arg) in a worker thread and passes its result, 0 or -errno, to
+ * cb.  func must not touch any state that the main loop uses.
+ */
+BlockDriverAIOCB *paio_submit_func(BlockDriverState *bs,
+        PaioFunc *func, void *arg,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    struct qemu_paiocb *acb;
+
+    acb = qemu_aio_get(&raw_aio_pool, bs, cb, opaque);
+    acb->aio_type = QEMU_AIO_FUNC;
+    acb->aio_fildes = -1;
+    acb->aio_nbytes = 0;
+    acb->aio_offset = 0;
+    acb->aio_func = func;
+    acb->aio_func_arg = arg;
 
+    trace_paio_submit_func(acb, opaque, arg);
     qemu_paio_submit(acb);
     return &acb->common;
 }
 
+typedef struct PaioCo {
+    Coroutine *co;
+    int ret;
+} PaioCo;
+
+static void paio_co_cb(void *opaque, int ret)
+{
+    PaioCo *pco = opaque;
+
+    pco->ret = ret;
+    qemu_coroutine_enter(pco->co, NULL);
+}
+
+/* Like paio_submit_func(), but yields until func has returned */
+int coroutine_fn paio_co_submit_func(BlockDriverState *bs,
+        PaioFunc *func, void *arg)
+{
+    PaioCo pco = {
+        .co = qemu_coroutine_self(),
+        .ret = -EINPROGRESS,
+    };
+
+    if (paio_init() < 0) {
+        return func(arg);
+    }
+
+    paio_submit_func(bs, func, arg, paio_co_cb, &pco);
+    qemu_coroutine_yield();
+    return pco.ret;
+}
+
 int paio_init(void)
 {
     PosixAioState *s;
     int fds[2];
-    int ret;
+    int ret, i;
 
     if (posix_aio_state)
         return 0;
 
-    s = g_malloc(sizeof(PosixAioState));
+    s = g_malloc0(sizeof(PosixAioState));
 
-    s->first_aio = NULL;
-    if (qemu_pipe(fds) == -1) {
-        fprintf(stderr, "failed to create pipe\n");
+    if (qemu_eventfd(fds) == -1) {
+        fprintf(stderr, "failed to create eventfd\n");
         g_free(s);
         return -1;
     }
@@ -673,9 +820,60 @@ int paio_init(void)
     if (ret)
         die2(ret, "pthread_attr_setdetachstate");
 
-    QTAILQ_INIT(&request_list);
+    for (i = 0; i < MAX_THREADS; i++) {
+        PaioWorker *w = &workers[i];
+
+        ret = pthread_mutex_init(&w->lock, NULL);
+        if (ret)
+            die2(ret, "pthread_mutex_init");
+        ret = pthread_cond_init(&w->cond, NULL);
+        if (ret)
+            die2(ret, "pthread_cond_init");
+        QTAILQ_INIT(&w->queue);
+        w->state = WORKER_DEAD;
+    }
     new_thread_bh = qemu_bh_new(spawn_thread_bh_fn, NULL);
 
     posix_aio_state = s;
     return 0;
 }
+
+void paio_dump_stats(FILE *f, fprintf_function cpu_fprintf)
+{
+    PosixAioState *s = posix_aio_state;
+    int64_t now = get_clock();
+    int i, threads = 0, parked = 0, queued = 0;
+
+    if (!s) {
+        cpu_fprintf(f, "thread pool not initialized\n");
+        return;
+    }
+
+    for (i = 0; i < max_threads; i++) {
+        PaioWorker *w = &workers[i];
+
+        mutex_lock(&w->lock);
+        queued += w->queued;
+        if (w->state != WORKER_DEAD) {
+            threads++;
+            parked += w->parked;
+        }
+        if (w->state == WORKER_RUNNING) {
+            int64_t alive = now - w->start_ns;
+
+            cpu_fprintf(f, "worker %d: queue depth %d, %" PRIu64 " requests, "
+                        "%.1f%% busy%s\n", i, w->queued, w->requests,
+                        alive > 0 ? w->busy_ns * 100.0 / alive : 0.0,
+                        w->parked ? ", parked" : "");
+        }
+        mutex_unlock(&w->lock);
+    }
+
+    cpu_fprintf(f, "threads: %d (max %d), parked: %d\n",
+                threads, max_threads, parked);
+    cpu_fprintf(f, "requests: %d outstanding, %d queued, "
+                "%" PRIu64 " completed, %" PRIu64 " stolen\n",
+                s->count, queued, s->nr_completed, nr_stolen);
+    cpu_fprintf(f, "completion notifications: %" PRIu64 "\n",
+                s->nr_notifications);
+}
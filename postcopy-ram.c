@@ -0,0 +1,492 @@
+/*
+ * Post-copy live migration of guest RAM
+ *
+ * Copyright Carnegie Mellon University 2012
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <poll.h>
+
+#include "qemu-common.h"
+#include "qemu-queue.h"
+#include "qemu-thread.h"
+#include "qemu_socket.h"
+#include "bitmap.h"
+#include "migration.h"
+#include "postcopy-ram.h"
+
+#ifdef CONFIG_USERFAULTFD
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/userfaultfd.h>
+#endif
+
+//#define DEBUG_POSTCOPY
+
+#ifdef DEBUG_POSTCOPY
+#define DPRINTF(fmt, ...) \
+    do { fprintf(stdout, "postcopy: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+/*
+ * A page request on the return path is the length of the block id as one
+ * byte, the block id, and the big-endian offset of the page in the block.
+ */
+
+static RAMBlock *find_ram_block(const char *idstr)
+{
+    RAMBlock *block;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (!strcmp(idstr, block->idstr)) {
+            return block;
+        }
+    }
+
+    return NULL;
+}
+
+/* Source side */
+
+typedef struct PostcopyRequest {
+    RAMBlock *block;
+    ram_addr_t offset;
+    QSIMPLEQ_ENTRY(PostcopyRequest) next;
+} PostcopyRequest;
+
+static struct {
+    int fd;
+    QemuThread thread;
+    QemuMutex lock;
+    QSIMPLEQ_HEAD(, PostcopyRequest) requests;  /* protected by lock */
+    uint64_t num_requests;
+} return_path;
+
+uint64_t postcopy_ram_requests(void)
+{
+    return return_path.num_requests;
+}
+
+static void *postcopy_return_path_thread(void *opaque)
+{
+    for (;;) {
+        PostcopyRequest *req;
+        RAMBlock *block;
+        char id[256];
+        uint8_t len;
+        uint64_t offset;
+
+        if (qemu_recv_full(return_path.fd, &len, 1, 0) != 1 ||
+            qemu_recv_full(return_path.fd, id, len, 0) != len ||
+            qemu_recv_full(return_path.fd, &offset, 8, 0) != 8) {
+            break;
+        }
+        id[len] = 0;
+        offset = be64_to_cpu(offset);
+
+        block = find_ram_block(id);
+        if (!block || offset >= block->length) {
+            fprintf(stderr, "postcopy: bad page request %s:%" PRIx64 "\n",
+                    id, offset);
+            break;
+        }
+        DPRINTF("request %s:%" PRIx64 "\n", id, offset);
+
+        req = g_malloc(sizeof(*req));
+        req->block = block;
+        req->offset = offset & TARGET_PAGE_MASK;
+
+        qemu_mutex_lock(&return_path.lock);
+        QSIMPLEQ_INSERT_TAIL(&return_path.requests, req, next);
+        return_path.num_requests++;
+        qemu_mutex_unlock(&return_path.lock);
+    }
+
+    return NULL;
+}
+
+int postcopy_return_path_start(int fd)
+{
+    if (fd < 0) {
+        fprintf(stderr, "postcopy: migration has no return path\n");
+        return -1;
+    }
+
+    /* the migration thread and this one both block on the socket */
+    socket_set_block(fd);
+
+    return_path.fd = fd;
+    return_path.num_requests = 0;
+    qemu_mutex_init(&return_path.lock);
+    QSIMPLEQ_INIT(&return_path.requests);
+    qemu_thread_create(&return_path.thread, postcopy_return_path_thread,
+                       NULL, QEMU_THREAD_JOINABLE);
+
+    return 0;
+}
+
+bool postcopy_return_path_next(RAMBlock **block, ram_addr_t *offset)
+{
+    PostcopyRequest *req;
+
+    qemu_mutex_lock(&return_path.lock);
+    req = QSIMPLEQ_FIRST(&return_path.requests);
+    if (req) {
+        QSIMPLEQ_REMOVE_HEAD(&return_path.requests, next);
+    }
+    qemu_mutex_unlock(&return_path.lock);
+
+    if (!req) {
+        return false;
+    }
+
+    *block = req->block;
+    *offset = req->offset;
+    g_free(req);
+
+    return true;
+}
+
+void postcopy_return_path_join(void)
+{
+    RAMBlock *block;
+    ram_addr_t offset;
+
+    qemu_thread_join(&return_path.thread);
+    while (postcopy_return_path_next(&block, &offset)) {
+        /* drop requests that raced with the last pages */
+    }
+    qemu_mutex_destroy(&return_path.lock);
+}
+
+/* Destination side */
+
+#ifdef CONFIG_USERFAULTFD
+
+typedef struct PostcopyBlock {
+    RAMBlock *block;
+    unsigned long *bitmap;  /* pages still to be received */
+} PostcopyBlock;
+
+static struct {
+    int uffd;
+    int fd;                 /* return path */
+    int quit_fds[2];        /* fault thread exits when the pipe closes */
+    QemuThread thread;
+    bool thread_running;
+    PostcopyBlock *blocks;
+    int num_blocks;
+} incoming = { .uffd = -1 };
+
+static PostcopyBlock *find_postcopy_block(void *host)
+{
+    int i;
+
+    for (i = 0; i < incoming.num_blocks; i++) {
+        PostcopyBlock *pb = &incoming.blocks[i];
+        uint8_t *start = pb->block->host;
+
+        if ((uint8_t *)host >= start &&
+            (uint8_t *)host < start + pb->block->length) {
+            return pb;
+        }
+    }
+
+    return NULL;
+}
+
+int postcopy_ram_incoming_init(int fd)
+{
+    struct uffdio_api api = { .api = UFFD_API };
+    int one = 1;
+
+    if (fd < 0) {
+        fprintf(stderr, "postcopy: migration has no return path\n");
+        return -1;
+    }
+    if (getpagesize() != TARGET_PAGE_SIZE) {
+        fprintf(stderr, "postcopy: host and target page size differ\n");
+        return -1;
+    }
+
+    incoming.uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (incoming.uffd < 0) {
+        fprintf(stderr, "postcopy: userfaultfd not available: %s\n",
+                strerror(errno));
+        return -1;
+    }
+    if (ioctl(incoming.uffd, UFFDIO_API, &api) < 0 ||
+        !(api.ioctls & (1ULL << _UFFDIO_REGISTER))) {
+        fprintf(stderr, "postcopy: userfaultfd API mismatch\n");
+        close(incoming.uffd);
+        incoming.uffd = -1;
+        return -1;
+    }
+
+    incoming.fd = fd;
+    incoming.blocks = NULL;
+    incoming.num_blocks = 0;
+
+    /* page requests are small and the guest is waiting on them */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    return 0;
+}
+
+int postcopy_ram_discard(RAMBlock *block, unsigned long *bitmap)
+{
+    struct uffdio_register reg;
+    unsigned long npages = block->length >> TARGET_PAGE_BITS;
+    unsigned long start, end;
+    PostcopyBlock *pb;
+
+    start = find_first_bit(bitmap, npages);
+    if (start >= npages) {
+        /* nothing left to receive, no need to watch the block */
+        g_free(bitmap);
+        return 0;
+    }
+
+    if (block->flags & RAM_PREALLOC_MASK) {
+        fprintf(stderr, "postcopy: RAM block %s is not anonymous memory\n",
+                block->idstr);
+        goto fail;
+    }
+
+#ifdef MADV_NOHUGEPAGE
+    /* pages are placed one target page at a time */
+    madvise(block->host, block->length, MADV_NOHUGEPAGE);
+#endif
+
+    /* drop the stale copies so that the guest faults on them */
+    while (start < npages) {
+        end = find_next_zero_bit(bitmap, npages, start);
+        if (qemu_madvise(block->host + (start << TARGET_PAGE_BITS),
+                         (end - start) << TARGET_PAGE_BITS,
+                         QEMU_MADV_DONTNEED) < 0) {
+            fprintf(stderr, "postcopy: cannot discard pages of %s: %s\n",
+                    block->idstr, strerror(errno));
+            goto fail;
+        }
+        start = find_next_bit(bitmap, npages, end);
+    }
+
+    reg.range.start = (uintptr_t)block->host;
+    reg.range.len = block->length;
+    reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+    if (ioctl(incoming.uffd, UFFDIO_REGISTER, &reg) < 0) {
+        fprintf(stderr, "postcopy: cannot register RAM block %s: %s\n",
+                block->idstr, strerror(errno));
+        goto fail;
+    }
+
+    incoming.blocks = g_realloc(incoming.blocks, (incoming.num_blocks + 1) *
+                                sizeof(*incoming.blocks));
+    pb = &incoming.blocks[incoming.num_blocks++];
+    pb->block = block;
+    pb->bitmap = bitmap;
+
+    return 0;
+
+fail:
+    g_free(bitmap);
+    return -1;
+}
+
+static void postcopy_ram_request_page(RAMBlock *block, ram_addr_t offset)
+{
+    uint8_t len = strlen(block->idstr);
+    uint64_t be_offset = cpu_to_be64(offset);
+
+    DPRINTF("request %s:" RAM_ADDR_FMT "\n", block->idstr, offset);
+
+    if (qemu_send_full(incoming.fd, &len, 1, 0) != 1 ||
+        qemu_send_full(incoming.fd, block->idstr, len, 0) != len ||
+        qemu_send_full(incoming.fd, &be_offset, 8, 0) != 8) {
+        /* the page will still arrive with the background transfer */
+        fprintf(stderr, "postcopy: cannot request page: %s\n",
+                strerror(errno));
+    }
+}
+
+static void *postcopy_ram_fault_thread(void *opaque)
+{
+    struct uffd_msg msg;
+    struct pollfd pfd[2];
+
+    pfd[0].fd = incoming.uffd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = incoming.quit_fds[0];
+    pfd[1].events = POLLIN;
+
+    for (;;) {
+        PostcopyBlock *pb;
+        void *host;
+        ram_addr_t offset;
+        ssize_t ret;
+
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "postcopy: poll failed: %s\n", strerror(errno));
+            break;
+        }
+        if (pfd[1].revents) {
+            break;
+        }
+
+        ret = read(incoming.uffd, &msg, sizeof(msg));
+        if (ret != sizeof(msg)) {
+            if (ret < 0 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            }
+            fprintf(stderr, "postcopy: cannot read fault: %s\n",
+                    strerror(errno));
+            break;
+        }
+        if (msg.event != UFFD_EVENT_PAGEFAULT) {
+            continue;
+        }
+
+        host = (void *)(uintptr_t)(msg.arg.pagefault.address &
+                                   ~(uint64_t)(TARGET_PAGE_SIZE - 1));
+        pb = find_postcopy_block(host);
+        if (!pb) {
+            fprintf(stderr, "postcopy: fault outside guest RAM at %p\n", host);
+            continue;
+        }
+        offset = (uint8_t *)host - pb->block->host;
+
+        if (test_bit(offset >> TARGET_PAGE_BITS, pb->bitmap)) {
+            postcopy_ram_request_page(pb->block, offset);
+        } else {
+            /* never written by the source: a zero page, or already placed */
+            postcopy_place_page(host, NULL);
+        }
+    }
+
+    return NULL;
+}
+
+int postcopy_ram_incoming_start(void)
+{
+    if (qemu_pipe(incoming.quit_fds) < 0) {
+        fprintf(stderr, "postcopy: cannot create pipe: %s\n",
+                strerror(errno));
+        return -1;
+    }
+
+    qemu_thread_create(&incoming.thread, postcopy_ram_fault_thread, NULL,
+                       QEMU_THREAD_JOINABLE);
+    incoming.thread_running = true;
+
+    return 0;
+}
+
+int postcopy_place_page(void *host, uint8_t *data)
+{
+    PostcopyBlock *pb = find_postcopy_block(host);
+    int ret;
+
+    if (data) {
+        struct uffdio_copy copy = {
+            .dst = (uintptr_t)host,
+            .src = (uintptr_t)data,
+            .len = TARGET_PAGE_SIZE,
+        };
+
+        ret = ioctl(incoming.uffd, UFFDIO_COPY, &copy);
+    } else {
+        struct uffdio_zeropage zero = {
+            .range.start = (uintptr_t)host,
+            .range.len = TARGET_PAGE_SIZE,
+        };
+
+        ret = ioctl(incoming.uffd, UFFDIO_ZEROPAGE, &zero);
+    }
+
+    /* EEXIST: a zero page was placed on a fault that raced with us */
+    if (ret < 0 && errno != EEXIST) {
+        fprintf(stderr, "postcopy: cannot place page at %p: %s\n",
+                host, strerror(errno));
+        return -1;
+    }
+
+    /* only cleared once the page is in place, see the fault thread */
+    if (pb) {
+        clear_bit(((uint8_t *)host - pb->block->host) >> TARGET_PAGE_BITS,
+                  pb->bitmap);
+    }
+
+    return 0;
+}
+
+void postcopy_ram_incoming_cleanup(void)
+{
+    int i;
+
+    if (incoming.uffd < 0) {
+        return;
+    }
+
+    if (incoming.thread_running) {
+        close(incoming.quit_fds[1]);
+        qemu_thread_join(&incoming.thread);
+        close(incoming.quit_fds[0]);
+        incoming.thread_running = false;
+    }
+
+    for (i = 0; i < incoming.num_blocks; i++) {
+        struct uffdio_range range = {
+            .start = (uintptr_t)incoming.blocks[i].block->host,
+            .len = incoming.blocks[i].block->length,
+        };
+
+        ioctl(incoming.uffd, UFFDIO_UNREGISTER, &range);
+        g_free(incoming.blocks[i].bitmap);
+    }
+    g_free(incoming.blocks);
+    incoming.blocks = NULL;
+    incoming.num_blocks = 0;
+
+    close(incoming.uffd);
+    incoming.uffd = -1;
+}
+
+#else /* !CONFIG_USERFAULTFD */
+
+int postcopy_ram_incoming_init(int fd)
+{
+    fprintf(stderr, "postcopy: not supported on this host\n");
+    return -1;
+}
+
+int postcopy_ram_discard(RAMBlock *block, unsigned long *bitmap)
+{
+    g_free(bitmap);
+    return -1;
+}
+
+int postcopy_ram_incoming_start(void)
+{
+    return -1;
+}
+
+int postcopy_place_page(void *host, uint8_t *data)
+{
+    return -1;
+}
+
+void postcopy_ram_incoming_cleanup(void)
+{
+}
+
+#endif /* !CONFIG_USERFAULTFD */
@@ -0,0 +1,91 @@
+/*
+ * Post-copy live migration of guest RAM
+ *
+ * Copyright Carnegie Mellon University 2012
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef POSTCOPY_RAM_H
+#define POSTCOPY_RAM_H
+
+#include "qemu-common.h"
+#include "cpu.h"
+
+/*
+ * Source side: the destination asks for the pages it faults on over the
+ * migration socket, see postcopy_ram_request_page() for the format.
+ */
+
+/**
+ * postcopy_return_path_start: start reading page requests from @fd
+ *
+ * Returns 0 on success, -1 on error
+ */
+int postcopy_return_path_start(int fd);
+
+/**
+ * postcopy_return_path_next: pop the oldest pending page request
+ *
+ * Returns true and fills @block and @offset if there was a request
+ */
+bool postcopy_return_path_next(RAMBlock **block, ram_addr_t *offset);
+
+/**
+ * postcopy_return_path_join: wait for the destination to close the
+ * connection, which it does once it has received every page
+ */
+void postcopy_return_path_join(void);
+
+/*
+ * Destination side: guest RAM that is still owed by the source is
+ * registered with userfaultfd, faults on it are turned into page requests
+ * and the pages are placed atomically as they arrive.
+ */
+
+/**
+ * postcopy_ram_incoming_init: prepare to receive pages on demand, page
+ * requests are sent to @fd
+ *
+ * Returns 0 on success, -1 if post-copy is not supported on this host
+ */
+int postcopy_ram_incoming_init(int fd);
+
+/**
+ * postcopy_ram_discard: drop the pages of @block that the source will send
+ * again and arrange for faults on them to be reported
+ *
+ * Returns 0 on success, -1 on error
+ *
+ * @block: RAM block
+ * @bitmap: one bit per page of @block, set for pages still to be received;
+ *          ownership passes to the callee
+ */
+int postcopy_ram_discard(RAMBlock *block, unsigned long *bitmap);
+
+/**
+ * postcopy_ram_incoming_start: start serving faults on discarded pages
+ *
+ * Returns 0 on success, -1 on error
+ */
+int postcopy_ram_incoming_start(void);
+
+/**
+ * postcopy_place_page: atomically fill in a page the guest may be waiting on
+ *
+ * Returns 0 on success, -1 on error
+ *
+ * @host: host address of the page
+ * @data: page contents, or NULL for a zero page
+ */
+int postcopy_place_page(void *host, uint8_t *data);
+
+/**
+ * postcopy_ram_incoming_cleanup: stop serving faults once every page has
+ * been received
+ */
+void postcopy_ram_incoming_cleanup(void);
+
+#endif
@@ -351,6 +351,7 @@ void qemu_iovec_memset_skip(QEMUIOVector *qiov, int c, size_t count,
                             size_t skip);
 
 bool buffer_is_zero(const void *buf, size_t len);
+bool qemu_iovec_is_zero(QEMUIOVector *qiov, size_t skip, size_t count);
 
 void qemu_progress_init(int enabled, float min_skip);
 void qemu_progress_end(void);
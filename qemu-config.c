@@ -113,6 +113,22 @@ static QemuOptsList qemu_drive_opts = {
             .name = "copy-on-read",
             .type = QEMU_OPT_BOOL,
             .help = "copy read data from backing file into image file",
+        },{
+            .name = "l2-cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the qcow2 L2 table cache in bytes",
+        },{
+            .name = "l2-cache-coverage",
+            .type = QEMU_OPT_NUMBER,
+            .help = "percentage of the disk mapped by the qcow2 L2 table cache",
+        },{
+            .name = "refcount-cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the qcow2 refcount block cache in bytes",
+        },{
+            .name = "aio-queue-depth",
+            .type = QEMU_OPT_NUMBER,
+            .help = "number of requests outstanding in the host with aio=native",
         },{
             .name = "boot",
             .type = QEMU_OPT_BOOL,
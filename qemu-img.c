@@ -27,6 +27,10 @@
 #include "osdep.h"
 #include "sysemu.h"
 #include "block_int.h"
+#include "qjson.h"
+#include "qstring.h"
+#include "qemu-timer.h"
+#include <getopt.h>
 #include <stdio.h>
 
 #ifdef _WIN32
@@ -84,6 +88,27 @@ static void help(void)
            "  '-p' show progress of command (only certain commands)\n"
            "  '-S' indicates the consecutive number of bytes that must contain only zeros\n"
            "       for qemu-img to create a sparse image during conversion\n"
+           "  '-m' number of requests that are in flight at a time (1 to 16), the default\n"
+           "       is 8 for convert and 1 for compare and map\n"
+           "  '-W' allows the output image to be written out of order during conversion\n"
+           "  'ofmt' is the output format of map, 'human' (default) or 'json'\n"
+           "\n"
+           "Parameters to bench subcommand:\n"
+           "  'count' is the number of requests to send (default 75000)\n"
+           "  'depth' is the number of requests in flight (default 64)\n"
+           "  '-n' uses native AIO, with cache mode 'none' or 'directsync'\n"
+           "  'offset' is where the requests start (default 0)\n"
+           "  '-q' only prints the run time\n"
+           "  '-r' uses random offsets instead of sequential ones\n"
+           "  'buffer_size' is the size of each request (default 4k)\n"
+           "  'step_size' is the distance between sequential requests\n"
+           "  '-w' sends writes instead of reads\n"
+           "  'write_percent' is the percentage of requests that are writes\n"
+           "\n"
+           "Parameters to compare subcommand:\n"
+           "  '-f' first image format\n"
+           "  '-F' second image format\n"
+           "  '-s' run in Strict mode - fail on different image size or sector allocation\n"
            "\n"
            "Parameters to snapshot subcommand:\n"
            "  'snapshot' is the name of the snapshot to create, apply or delete\n"
@@ -623,24 +648,385 @@ static int compare_sectors(const uint8_t *buf1, const uint8_t *buf2, int n,
 
 #define IO_BUF_SIZE (2 * 1024 * 1024)
 
+#define MAX_COROUTINES 16
+
+enum ImgConvertBlockStatus {
+    BLK_DATA,
+    BLK_ZERO,
+    BLK_BACKING_FILE,
+};
+
+/*
+ * img_convert() copies the image with several coroutines.  Each of them
+ * takes the next piece of the image under the lock, reads it and writes it
+ * to the target, so that reads and writes of different pieces overlap.
+ * Unless out-of-order writes are allowed, the writes are still issued in
+ * the order of the image.
+ */
+typedef struct ImgConvertState {
+    BlockDriverState **src;
+    int64_t *src_sectors;
+    int src_num;
+    int64_t total_sectors;
+    int64_t sectors_done;
+    int64_t sector_num;         /* next sector to give to a coroutine */
+    int64_t wr_offs;            /* sectors before this have been written */
+    enum ImgConvertBlockStatus status;
+    int64_t sector_next_status; /* status is valid up to here */
+    BlockDriverState *target;
+    bool has_zero_init;
+    bool compressed;
+    bool target_has_backing;
+    bool wr_in_order;
+    int min_sparse;
+    int cluster_sectors;
+    int buf_sectors;
+    int num_coroutines;
+    int running_coroutines;
+    Coroutine *co[MAX_COROUTINES];
+    int64_t wait_sector_num[MAX_COROUTINES];
+    CoMutex lock;
+    int ret;
+} ImgConvertState;
+
+/* Finds the source image that contains sector_num */
+static void convert_select_part(ImgConvertState *s, int64_t sector_num,
+                                int *src_cur, int64_t *src_cur_offset)
+{
+    *src_cur = 0;
+    *src_cur_offset = 0;
+    while (sector_num - *src_cur_offset >= s->src_sectors[*src_cur]) {
+        *src_cur_offset += s->src_sectors[*src_cur];
+        (*src_cur)++;
+        assert(*src_cur < s->src_num);
+    }
+}
+
+/*
+ * Returns the number of sectors starting at sector_num that are copied as
+ * one request, and sets s->status to how they are copied.
+ */
+static int coroutine_fn convert_iteration_sectors(ImgConvertState *s,
+                                                  int64_t sector_num)
+{
+    int64_t src_cur_offset;
+    int src_cur, n, ret;
+
+    convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+
+    if (s->sector_next_status <= sector_num) {
+        BlockDriverState *src = s->src[src_cur];
+        int64_t src_num = sector_num - src_cur_offset;
+        int count = MIN(s->src_sectors[src_cur] - src_num, INT_MAX >> 1);
+
+        if (s->target_has_backing) {
+            /* Unallocated sectors come from the backing file of the target,
+               which has the same content as the one of the source */
+            ret = bdrv_co_is_allocated(src, src_num, count, &n);
+            s->status = ret ? BLK_DATA : BLK_BACKING_FILE;
+        } else {
+            /* Nothing in the backing chain: the sectors read as zeroes */
+            ret = bdrv_co_is_allocated_above(src, NULL, src_num, count, &n);
+            s->status = ret ? BLK_DATA : BLK_ZERO;
+        }
+        if (ret < 0) {
+            return ret;
+        }
+        assert(n > 0);
+        s->sector_next_status = sector_num + n;
+    }
+
+    n = MIN(s->sector_next_status - sector_num, INT_MAX >> 1);
+    if (s->status == BLK_DATA ||
+        (s->status == BLK_ZERO && !s->has_zero_init)) {
+        n = MIN(n, s->buf_sectors);
+    }
+
+    /* Clusters are compressed as a whole, the last one may be partial */
+    if (s->compressed) {
+        if (n < s->cluster_sectors) {
+            n = MIN(s->cluster_sectors, s->total_sectors - sector_num);
+            s->status = BLK_DATA;
+        } else {
+            n = QEMU_ALIGN_DOWN(n, s->cluster_sectors);
+        }
+    }
+
+    return n;
+}
+
+static int coroutine_fn convert_co_read(ImgConvertState *s,
+                                        int64_t sector_num, int nb_sectors,
+                                        uint8_t *buf)
+{
+    int64_t src_cur_offset;
+    int src_cur, ret;
+
+    while (nb_sectors > 0) {
+        QEMUIOVector qiov;
+        struct iovec iov;
+        int n;
+
+        convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+        n = MIN(nb_sectors,
+                s->src_sectors[src_cur] - (sector_num - src_cur_offset));
+
+        iov.iov_base = buf;
+        iov.iov_len = n * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+
+        ret = bdrv_co_readv(s->src[src_cur], sector_num - src_cur_offset,
+                            n, &qiov);
+        if (ret < 0) {
+            error_report("error while reading sector %" PRId64 ": %s",
+                         sector_num - src_cur_offset, strerror(-ret));
+            return ret;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * BDRV_SECTOR_SIZE;
+    }
+
+    return 0;
+}
+
+static int coroutine_fn convert_co_write(ImgConvertState *s,
+                                         int64_t sector_num, int nb_sectors,
+                                         uint8_t *buf,
+                                         enum ImgConvertBlockStatus status)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    bool allocated;
+    int ret, n;
+
+    switch (status) {
+    case BLK_BACKING_FILE:
+        /* Leave the sectors unallocated, so that the backing file of the
+           target shows through */
+        break;
+
+    case BLK_ZERO:
+        /* Whatever is on a host device is garbage, not zeroes */
+        if (!s->has_zero_init) {
+            ret = bdrv_co_write_zeroes(s->target, sector_num, nb_sectors);
+            if (ret < 0) {
+                goto fail;
+            }
+        }
+        break;
+
+    case BLK_DATA:
+        /* A partial cluster at the end of the image can't be compressed,
+           it is written like with uncompressed output */
+        if (s->compressed && nb_sectors == s->cluster_sectors) {
+            if (buffer_is_zero(buf, s->cluster_sectors * BDRV_SECTOR_SIZE)) {
+                break;
+            }
+            ret = bdrv_co_write_compressed(s->target, sector_num, buf,
+                                           s->cluster_sectors);
+            if (ret < 0) {
+                error_report("error while compressing sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                return ret;
+            }
+            break;
+        }
+
+        while (nb_sectors > 0) {
+            /* If the output image is being created as a copy on write
+               image, copy all sectors even the ones containing only NUL
+               bytes, because they may differ from the sectors in the base
+               image.
+
+               If the output is to a host device, we also write out
+               sectors that are entirely 0, since whatever data was
+               already there is garbage, not 0s. */
+            if (!s->has_zero_init || s->target_has_backing) {
+                n = nb_sectors;
+                allocated = true;
+            } else {
+                allocated = is_allocated_sectors_min(buf, nb_sectors, &n,
+                                                     s->min_sparse);
+            }
+
+            if (allocated) {
+                iov.iov_base = buf;
+                iov.iov_len = n * BDRV_SECTOR_SIZE;
+                qemu_iovec_init_external(&qiov, &iov, 1);
+
+                ret = bdrv_co_writev(s->target, sector_num, n, &qiov);
+                if (ret < 0) {
+                    goto fail;
+                }
+            }
+            sector_num += n;
+            nb_sectors -= n;
+            buf += n * BDRV_SECTOR_SIZE;
+        }
+        break;
+    }
+
+    return 0;
+
+fail:
+    error_report("error while writing sector %" PRId64 ": %s",
+                 sector_num, strerror(-ret));
+    return ret;
+}
+
+/* Lets the coroutines that wait for their turn to write see an error */
+static void convert_wake_waiters(ImgConvertState *s)
+{
+    int i;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] && s->wait_sector_num[i] != -1) {
+            s->wait_sector_num[i] = -1;
+            qemu_coroutine_enter(s->co[i], NULL);
+        }
+    }
+}
+
+static void coroutine_fn convert_co_do_copy(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    Coroutine *self = qemu_coroutine_self();
+    enum ImgConvertBlockStatus status;
+    int64_t sector_num;
+    uint8_t *buf;
+    int index, i, n, ret;
+
+    for (index = 0; s->co[index] != self; index++) {
+        assert(index < s->num_coroutines);
+    }
+
+    s->running_coroutines++;
+    buf = qemu_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+
+    for (;;) {
+        qemu_co_mutex_lock(&s->lock);
+        if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        n = convert_iteration_sectors(s, s->sector_num);
+        if (n < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            error_report("error while reading block status of sector %"
+                         PRId64 ": %s", s->sector_num, strerror(-n));
+            s->ret = n;
+            break;
+        }
+
+        /* The next request can be started while this one is still being
+           read */
+        sector_num = s->sector_num;
+        status = s->status;
+        s->sector_num += n;
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (status == BLK_DATA) {
+            ret = convert_co_read(s, sector_num, n, buf);
+            if (ret < 0) {
+                s->ret = ret;
+                break;
+            }
+        }
+
+        if (s->wr_in_order) {
+            while (s->wr_offs != sector_num) {
+                if (s->ret != -EINPROGRESS) {
+                    goto out;
+                }
+                s->wait_sector_num[index] = sector_num;
+                qemu_coroutine_yield();
+            }
+            s->wait_sector_num[index] = -1;
+        }
+
+        ret = convert_co_write(s, sector_num, n, buf, status);
+        if (ret < 0) {
+            s->ret = ret;
+            break;
+        }
+
+        s->sectors_done += n;
+        qemu_progress_print(100.0 * s->sectors_done / s->total_sectors, 0);
+
+        if (s->wr_in_order) {
+            /* Let the coroutine with the next piece write it */
+            s->wr_offs = sector_num + n;
+            for (i = 0; i < s->num_coroutines; i++) {
+                if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
+                    /* The coroutine entered can't enter this one again,
+                       because its wait_sector_num is -1 while it runs */
+                    qemu_coroutine_enter(s->co[i], NULL);
+                    break;
+                }
+            }
+        }
+    }
+
+out:
+    qemu_vfree(buf);
+    s->co[index] = NULL;
+    s->running_coroutines--;
+    if (s->ret != -EINPROGRESS) {
+        convert_wake_waiters(s);
+    } else if (!s->running_coroutines) {
+        s->ret = 0;
+    }
+}
+
+static int convert_do_copy(ImgConvertState *s)
+{
+    int i;
+
+    qemu_co_mutex_init(&s->lock);
+    s->ret = -EINPROGRESS;
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->co[i] = qemu_coroutine_create(convert_co_do_copy);
+        s->wait_sector_num[i] = -1;
+    }
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i]) {
+            qemu_coroutine_enter(s->co[i], s);
+        }
+    }
+
+    while (s->running_coroutines) {
+        qemu_aio_wait();
+    }
+
+    if (s->ret == 0 && s->compressed) {
+        /* signal EOF to align */
+        bdrv_write_compressed(s->target, 0, NULL, 0);
+    }
+
+    return s->ret;
+}
+
 static int img_convert(int argc, char **argv)
 {
-    int c, ret = 0, n, n1, bs_n, bs_i, compress, cluster_size, cluster_sectors;
+    int c, ret = 0, bs_n, bs_i, compress, cluster_size;
     int progress = 0, flags;
     const char *fmt, *out_fmt, *cache, *out_baseimg, *out_filename;
     BlockDriver *drv, *proto_drv;
     BlockDriverState **bs = NULL, *out_bs = NULL;
-    int64_t total_sectors, nb_sectors, sector_num, bs_offset;
-    uint64_t bs_sectors;
-    uint8_t * buf = NULL;
-    const uint8_t *buf1;
+    int64_t total_sectors;
+    int64_t *bs_sectors = NULL;
+    uint64_t sectors;
     BlockDriverInfo bdi;
     QEMUOptionParameter *param = NULL, *create_options = NULL;
     QEMUOptionParameter *out_baseimg_param;
     char *options = NULL;
     const char *snapshot_name = NULL;
-    float local_progress;
     int min_sparse = 8; /* Need at least 4k of zeros for sparse detection */
+    int num_coroutines = 8;
+    bool wr_in_order = true;
+    ImgConvertState state;
 
     fmt = NULL;
     out_fmt = "raw";
@@ -648,7 +1034,7 @@ static int img_convert(int argc, char **argv)
     out_baseimg = NULL;
     compress = 0;
     for(;;) {
-        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:");
+        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:m:W");
         if (c == -1) {
             break;
         }
@@ -702,6 +1088,22 @@ static int img_convert(int argc, char **argv)
         case 't':
             cache = optarg;
             break;
+        case 'm':
+        {
+            char *end;
+            num_coroutines = strtol(optarg, &end, 10);
+            if (*end || num_coroutines < 1 ||
+                num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d",
+                             MAX_COROUTINES);
+                return 1;
+            }
+            break;
+        }
+        case 'W':
+            wr_in_order = false;
+            break;
         }
     }
 
@@ -730,6 +1132,7 @@ static int img_convert(int argc, char **argv)
     qemu_progress_print(0, 100);
 
     bs = g_malloc0(bs_n * sizeof(BlockDriverState *));
+    bs_sectors = g_malloc(bs_n * sizeof(int64_t));
 
     total_sectors = 0;
     for (bs_i = 0; bs_i < bs_n; bs_i++) {
@@ -739,8 +1142,9 @@ static int img_convert(int argc, char **argv)
             ret = -1;
             goto out;
         }
-        bdrv_get_geometry(bs[bs_i], &bs_sectors);
-        total_sectors += bs_sectors;
+        bdrv_get_geometry(bs[bs_i], &sectors);
+        bs_sectors[bs_i] = sectors;
+        total_sectors += sectors;
     }
 
     if (snapshot_name != NULL) {
@@ -806,7 +1210,7 @@ static int img_convert(int argc, char **argv)
         QEMUOptionParameter *preallocation =
             get_option_parameter(param, BLOCK_OPT_PREALLOC);
 
-        if (!drv->bdrv_write_compressed) {
+        if (!drv->bdrv_write_compressed && !drv->bdrv_co_write_compressed) {
             error_report("Compression not supported for this file format");
             ret = -1;
             goto out;
@@ -858,10 +1262,19 @@ static int img_convert(int argc, char **argv)
         goto out;
     }
 
-    bs_i = 0;
-    bs_offset = 0;
-    bdrv_get_geometry(bs[0], &bs_sectors);
-    buf = qemu_blockalign(out_bs, IO_BUF_SIZE);
+    state = (ImgConvertState) {
+        .src                = bs,
+        .src_sectors        = bs_sectors,
+        .src_num            = bs_n,
+        .total_sectors      = total_sectors,
+        .target             = out_bs,
+        .compressed         = compress,
+        .target_has_backing = !!out_baseimg,
+        .wr_in_order        = wr_in_order,
+        .min_sparse         = min_sparse,
+        .buf_sectors        = IO_BUF_SIZE / BDRV_SECTOR_SIZE,
+        .num_coroutines     = num_coroutines,
+    };
 
     if (compress) {
         ret = bdrv_get_info(out_bs, &bdi);
@@ -875,168 +1288,16 @@ static int img_convert(int argc, char **argv)
             ret = -1;
             goto out;
         }
-        cluster_sectors = cluster_size >> 9;
-        sector_num = 0;
-
-        nb_sectors = total_sectors;
-        local_progress = (float)100 /
-            (nb_sectors / MIN(nb_sectors, cluster_sectors));
-
-        for(;;) {
-            int64_t bs_num;
-            int remainder;
-            uint8_t *buf2;
-
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0)
-                break;
-            if (nb_sectors >= cluster_sectors)
-                n = cluster_sectors;
-            else
-                n = nb_sectors;
-
-            bs_num = sector_num - bs_offset;
-            assert (bs_num >= 0);
-            remainder = n;
-            buf2 = buf;
-            while (remainder > 0) {
-                int nlow;
-                while (bs_num == bs_sectors) {
-                    bs_i++;
-                    assert (bs_i < bs_n);
-                    bs_offset += bs_sectors;
-                    bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                    bs_num = 0;
-                    /* printf("changing part: sector_num=%" PRId64 ", "
-                       "bs_i=%d, bs_offset=%" PRId64 ", bs_sectors=%" PRId64
-                       "\n", sector_num, bs_i, bs_offset, bs_sectors); */
-                }
-                assert (bs_num < bs_sectors);
-
-                nlow = (remainder > bs_sectors - bs_num) ? bs_sectors - bs_num : remainder;
-
-                ret = bdrv_read(bs[bs_i], bs_num, buf2, nlow);
-                if (ret < 0) {
-                    error_report("error while reading sector %" PRId64 ": %s",
-                                 bs_num, strerror(-ret));
-                    goto out;
-                }
-
-                buf2 += nlow * 512;
-                bs_num += nlow;
-
-                remainder -= nlow;
-            }
-            assert (remainder == 0);
-
-            if (n < cluster_sectors) {
-                memset(buf + n * 512, 0, cluster_size - n * 512);
-            }
-            if (!buffer_is_zero(buf, cluster_size)) {
-                ret = bdrv_write_compressed(out_bs, sector_num, buf,
-                                            cluster_sectors);
-                if (ret != 0) {
-                    error_report("error while compressing sector %" PRId64
-                                 ": %s", sector_num, strerror(-ret));
-                    goto out;
-                }
-            }
-            sector_num += n;
-            qemu_progress_print(local_progress, 100);
-        }
-        /* signal EOF to align */
-        bdrv_write_compressed(out_bs, 0, NULL, 0);
-    } else {
-        int has_zero_init = bdrv_has_zero_init(out_bs);
-
-        sector_num = 0; // total number of sectors converted so far
-        nb_sectors = total_sectors - sector_num;
-        local_progress = (float)100 /
-            (nb_sectors / MIN(nb_sectors, IO_BUF_SIZE / 512));
-
-        for(;;) {
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0) {
-                break;
-            }
-            if (nb_sectors >= (IO_BUF_SIZE / 512)) {
-                n = (IO_BUF_SIZE / 512);
-            } else {
-                n = nb_sectors;
-            }
-
-            while (sector_num - bs_offset >= bs_sectors) {
-                bs_i ++;
-                assert (bs_i < bs_n);
-                bs_offset += bs_sectors;
-                bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                /* printf("changing part: sector_num=%" PRId64 ", bs_i=%d, "
-                  "bs_offset=%" PRId64 ", bs_sectors=%" PRId64 "\n",
-                   sector_num, bs_i, bs_offset, bs_sectors); */
-            }
-
-            if (n > bs_offset + bs_sectors - sector_num) {
-                n = bs_offset + bs_sectors - sector_num;
-            }
-
-            if (has_zero_init) {
-                /* If the output image is being created as a copy on write image,
-                   assume that sectors which are unallocated in the input image
-                   are present in both the output's and input's base images (no
-                   need to copy them). */
-                if (out_baseimg) {
-                    if (!bdrv_is_allocated(bs[bs_i], sector_num - bs_offset,
-                                           n, &n1)) {
-                        sector_num += n1;
-                        continue;
-                    }
-                    /* The next 'n1' sectors are allocated in the input image. Copy
-                       only those as they may be followed by unallocated sectors. */
-                    n = n1;
-                }
-            } else {
-                n1 = n;
-            }
-
-            ret = bdrv_read(bs[bs_i], sector_num - bs_offset, buf, n);
-            if (ret < 0) {
-                error_report("error while reading sector %" PRId64 ": %s",
-                             sector_num - bs_offset, strerror(-ret));
-                goto out;
-            }
-            /* NOTE: at the same time we convert, we do not write zero
-               sectors to have a chance to compress the image. Ideally, we
-               should add a specific call to have the info to go faster */
-            buf1 = buf;
-            while (n > 0) {
-                /* If the output image is being created as a copy on write image,
-                   copy all sectors even the ones containing only NUL bytes,
-                   because they may differ from the sectors in the base image.
-
-                   If the output is to a host device, we also write out
-                   sectors that are entirely 0, since whatever data was
-                   already there is garbage, not 0s. */
-                if (!has_zero_init || out_baseimg ||
-                    is_allocated_sectors_min(buf1, n, &n1, min_sparse)) {
-                    ret = bdrv_write(out_bs, sector_num, buf1, n1);
-                    if (ret < 0) {
-                        error_report("error while writing sector %" PRId64
-                                     ": %s", sector_num, strerror(-ret));
-                        goto out;
-                    }
-                }
-                sector_num += n1;
-                n -= n1;
-                buf1 += n1 * 512;
-            }
-            qemu_progress_print(local_progress, 100);
-        }
+        state.cluster_sectors = cluster_size >> 9;
+        state.buf_sectors = state.cluster_sectors;
     }
+    state.has_zero_init = bdrv_has_zero_init(out_bs);
+
+    ret = convert_do_copy(&state);
 out:
     qemu_progress_end();
     free_option_parameters(create_options);
     free_option_parameters(param);
-    qemu_vfree(buf);
     if (out_bs) {
         bdrv_delete(out_bs);
     }
@@ -1048,63 +1309,352 @@ out:
         }
         g_free(bs);
     }
+    g_free(bs_sectors);
     if (ret) {
         return 1;
     }
     return 0;
 }
 
-
-static void dump_snapshots(BlockDriverState *bs)
+/*
+ * Runs num coroutines with entry(opaque) and waits until they have all
+ * finished.  entry must decrement *running when it returns.
+ */
+static void run_coroutines(CoroutineEntry *entry, void *opaque, int num,
+                           int *running)
 {
-    QEMUSnapshotInfo *sn_tab, *sn;
-    int nb_sns, i;
-    char buf[256];
+    Coroutine *co;
+    int i;
 
-    nb_sns = bdrv_snapshot_list(bs, &sn_tab);
-    if (nb_sns <= 0)
-        return;
-    printf("Snapshot list:\n");
-    printf("%s\n", bdrv_snapshot_dump(buf, sizeof(buf), NULL));
-    for(i = 0; i < nb_sns; i++) {
-        sn = &sn_tab[i];
-        printf("%s\n", bdrv_snapshot_dump(buf, sizeof(buf), sn));
+    *running = num;
+    for (i = 0; i < num; i++) {
+        co = qemu_coroutine_create(entry);
+        qemu_coroutine_enter(co, opaque);
+    }
+    while (*running) {
+        qemu_aio_wait();
     }
-    g_free(sn_tab);
 }
 
-static int img_info(int argc, char **argv)
+/*
+ * img_compare() splits the images into chunks that have the same allocation
+ * status in both of them.  Several coroutines take the next chunk and read
+ * it, and the lowest offset that differs is reported.
+ */
+typedef struct ImgCompareState {
+    BlockDriverState *bs[2];
+    int64_t sectors[2];
+    int64_t total_sectors;
+    int64_t sectors_done;
+    int64_t sector_num;         /* next chunk */
+    int64_t mismatch;           /* first sector that differs, or -1 */
+    bool mismatch_alloc;        /* ... in its allocation status */
+    bool strict;
+    CoMutex lock;
+    int running_coroutines;
+    int ret;
+} ImgCompareState;
+
+/*
+ * Returns the number of sectors at sector_num that have the same allocation
+ * status in both images.  Beyond the end of the shorter image, it counts as
+ * unallocated.
+ */
+static int coroutine_fn compare_chunk_sectors(ImgCompareState *s,
+                                              int64_t sector_num,
+                                              bool *allocated)
 {
-    int c;
-    const char *filename, *fmt;
-    BlockDriverState *bs;
-    char fmt_name[128], size_buf[128], dsize_buf[128];
-    uint64_t total_sectors;
-    int64_t allocated_size;
-    char backing_filename[1024];
-    char backing_filename2[1024];
-    BlockDriverInfo bdi;
+    int i, n, pnum, ret;
 
-    fmt = NULL;
-    for(;;) {
-        c = getopt(argc, argv, "f:h");
-        if (c == -1) {
-            break;
+    n = MIN(s->total_sectors - sector_num, IO_BUF_SIZE / BDRV_SECTOR_SIZE);
+    for (i = 0; i < 2; i++) {
+        if (sector_num >= s->sectors[i]) {
+            allocated[i] = false;
+            continue;
         }
-        switch(c) {
-        case '?':
-        case 'h':
-            help();
-            break;
-        case 'f':
-            fmt = optarg;
-            break;
+        n = MIN(n, s->sectors[i] - sector_num);
+        ret = bdrv_co_is_allocated_above(s->bs[i], NULL, sector_num, n,
+                                         &pnum);
+        if (ret < 0) {
+            error_report("error while reading block status of sector %"
+                         PRId64 ": %s", sector_num, strerror(-ret));
+            return ret;
         }
+        assert(pnum > 0);
+        allocated[i] = ret;
+        n = MIN(n, pnum);
     }
-    if (optind >= argc) {
-        help();
-    }
-    filename = argv[optind++];
+    return n;
+}
+
+static int coroutine_fn compare_co_read(BlockDriverState *bs,
+                                        int64_t sector_num, int nb_sectors,
+                                        uint8_t *buf)
+{
+    QEMUIOVector qiov;
+    struct iovec iov = {
+        .iov_base = buf,
+        .iov_len = nb_sectors * BDRV_SECTOR_SIZE,
+    };
+    int ret;
+
+    qemu_iovec_init_external(&qiov, &iov, 1);
+    ret = bdrv_co_readv(bs, sector_num, nb_sectors, &qiov);
+    if (ret < 0) {
+        error_report("error while reading sector %" PRId64 " of %s: %s",
+                     sector_num, bs->filename, strerror(-ret));
+    }
+    return ret;
+}
+
+static void compare_set_mismatch(ImgCompareState *s, int64_t sector_num,
+                                 bool alloc)
+{
+    if (s->mismatch == -1 || sector_num < s->mismatch) {
+        s->mismatch = sector_num;
+        s->mismatch_alloc = alloc;
+    }
+}
+
+static void coroutine_fn compare_co_do_compare(void *opaque)
+{
+    ImgCompareState *s = opaque;
+    uint8_t *buf[2];
+    bool allocated[2];
+    int64_t sector_num;
+    int i, n, pnum, ret;
+
+    for (i = 0; i < 2; i++) {
+        buf[i] = qemu_blockalign(s->bs[i], IO_BUF_SIZE);
+    }
+
+    for (;;) {
+        qemu_co_mutex_lock(&s->lock);
+        if (s->ret < 0 || s->sector_num >= s->total_sectors ||
+            (s->mismatch != -1 && s->sector_num >= s->mismatch)) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        n = compare_chunk_sectors(s, s->sector_num, allocated);
+        if (n < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            s->ret = n;
+            break;
+        }
+        sector_num = s->sector_num;
+        s->sector_num += n;
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (allocated[0] != allocated[1] && s->strict) {
+            compare_set_mismatch(s, sector_num, true);
+        } else if (allocated[0] && allocated[1]) {
+            /* The images are read one after the other, but the other
+               coroutines keep requests to both in flight meanwhile */
+            for (i = 0; i < 2; i++) {
+                ret = compare_co_read(s->bs[i], sector_num, n, buf[i]);
+                if (ret < 0) {
+                    s->ret = ret;
+                    goto out;
+                }
+            }
+            if (memcmp(buf[0], buf[1], n * BDRV_SECTOR_SIZE)) {
+                ret = compare_sectors(buf[0], buf[1], n, &pnum);
+                compare_set_mismatch(s, sector_num + (ret ? 0 : pnum), false);
+            }
+        } else if (allocated[0] || allocated[1]) {
+            /* The unallocated side reads as zeroes */
+            i = allocated[0] ? 0 : 1;
+            ret = compare_co_read(s->bs[i], sector_num, n, buf[i]);
+            if (ret < 0) {
+                s->ret = ret;
+                goto out;
+            }
+            if (!buffer_is_zero(buf[i], n * BDRV_SECTOR_SIZE)) {
+                ret = is_allocated_sectors(buf[i], n, &pnum);
+                compare_set_mismatch(s, sector_num + (ret ? 0 : pnum), false);
+            }
+        }
+
+        s->sectors_done += n;
+        qemu_progress_print(100.0 * s->sectors_done / s->total_sectors, 0);
+    }
+
+out:
+    for (i = 0; i < 2; i++) {
+        qemu_vfree(buf[i]);
+    }
+    s->running_coroutines--;
+}
+
+/*
+ * Returns 0 if the images have the same content, 1 if they differ, and 2 on
+ * errors.
+ */
+static int img_compare(int argc, char **argv)
+{
+    const char *fmt1 = NULL, *fmt2 = NULL, *filename1, *filename2;
+    ImgCompareState s;
+    uint64_t sectors;
+    int c, i, progress = 0, num_coroutines = 1;
+    bool strict = false;
+    int ret = 2;
+
+    for (;;) {
+        c = getopt(argc, argv, "hf:F:m:ps");
+        if (c == -1) {
+            break;
+        }
+        switch (c) {
+        case '?':
+        case 'h':
+            help();
+            break;
+        case 'f':
+            fmt1 = optarg;
+            break;
+        case 'F':
+            fmt2 = optarg;
+            break;
+        case 'm':
+        {
+            char *end;
+            num_coroutines = strtol(optarg, &end, 10);
+            if (*end || num_coroutines < 1 ||
+                num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d",
+                             MAX_COROUTINES);
+                return 2;
+            }
+            break;
+        }
+        case 'p':
+            progress = 1;
+            break;
+        case 's':
+            strict = true;
+            break;
+        }
+    }
+
+    if (optind + 2 != argc) {
+        help();
+    }
+    filename1 = argv[optind];
+    filename2 = argv[optind + 1];
+
+    /* Initialize before goto out */
+    memset(&s, 0, sizeof(s));
+
+    s.bs[0] = bdrv_new_open(filename1, fmt1, BDRV_O_FLAGS);
+    if (!s.bs[0]) {
+        goto out;
+    }
+    s.bs[1] = bdrv_new_open(filename2, fmt2 ? fmt2 : fmt1, BDRV_O_FLAGS);
+    if (!s.bs[1]) {
+        goto out;
+    }
+
+    for (i = 0; i < 2; i++) {
+        bdrv_get_geometry(s.bs[i], &sectors);
+        s.sectors[i] = sectors;
+    }
+    s.total_sectors = MAX(s.sectors[0], s.sectors[1]);
+    s.mismatch = -1;
+    s.strict = strict;
+    qemu_co_mutex_init(&s.lock);
+
+    if (s.sectors[0] != s.sectors[1]) {
+        if (strict) {
+            printf("Strict mode: Image size mismatch!\n");
+            ret = 1;
+            goto out;
+        }
+        printf("Warning: Image size mismatch!\n");
+    }
+
+    qemu_progress_init(progress, 2.0);
+    qemu_progress_print(0, 100);
+    run_coroutines(compare_co_do_compare, &s, num_coroutines,
+                   &s.running_coroutines);
+    qemu_progress_end();
+
+    if (s.ret < 0) {
+        goto out;
+    }
+
+    if (s.mismatch == -1) {
+        printf("Images are identical.\n");
+        ret = 0;
+    } else if (s.mismatch_alloc) {
+        printf("Strict mode: Offset %" PRId64 " allocation mismatch!\n",
+               s.mismatch << BDRV_SECTOR_BITS);
+        ret = 1;
+    } else {
+        printf("Content mismatch at offset %" PRId64 "!\n",
+               s.mismatch << BDRV_SECTOR_BITS);
+        ret = 1;
+    }
+
+out:
+    for (i = 0; i < 2; i++) {
+        if (s.bs[i]) {
+            bdrv_delete(s.bs[i]);
+        }
+    }
+    return ret;
+}
+
+static void dump_snapshots(BlockDriverState *bs)
+{
+    QEMUSnapshotInfo *sn_tab, *sn;
+    int nb_sns, i;
+    char buf[256];
+
+    nb_sns = bdrv_snapshot_list(bs, &sn_tab);
+    if (nb_sns <= 0)
+        return;
+    printf("Snapshot list:\n");
+    printf("%s\n", bdrv_snapshot_dump(buf, sizeof(buf), NULL));
+    for(i = 0; i < nb_sns; i++) {
+        sn = &sn_tab[i];
+        printf("%s\n", bdrv_snapshot_dump(buf, sizeof(buf), sn));
+    }
+    g_free(sn_tab);
+}
+
+static int img_info(int argc, char **argv)
+{
+    int c;
+    const char *filename, *fmt;
+    BlockDriverState *bs;
+    char fmt_name[128], size_buf[128], dsize_buf[128];
+    uint64_t total_sectors;
+    int64_t allocated_size;
+    char backing_filename[1024];
+    char backing_filename2[1024];
+    BlockDriverInfo bdi;
+
+    fmt = NULL;
+    for(;;) {
+        c = getopt(argc, argv, "f:h");
+        if (c == -1) {
+            break;
+        }
+        switch(c) {
+        case '?':
+        case 'h':
+            help();
+            break;
+        case 'f':
+            fmt = optarg;
+            break;
+        }
+    }
+    if (optind >= argc) {
+        help();
+    }
+    filename = argv[optind++];
 
     bs = bdrv_new_open(filename, fmt, BDRV_O_FLAGS | BDRV_O_NO_BACKING);
     if (!bs) {
@@ -1137,6 +1687,22 @@ static int img_info(int argc, char **argv)
         if (bdi.is_dirty) {
             printf("cleanly shut down: no\n");
         }
+        if (bdi.dedup_index_memory != 0) {
+            char buf[128];
+
+            get_human_readable_size(buf, sizeof(buf),
+                                    bdi.dedup_referenced_bytes);
+            printf("dedup referenced: %s\n", buf);
+            get_human_readable_size(buf, sizeof(buf), bdi.dedup_stored_bytes);
+            printf("dedup stored: %s\n", buf);
+            if (bdi.dedup_stored_bytes != 0) {
+                printf("dedup ratio: %.2f\n",
+                       (double)bdi.dedup_referenced_bytes /
+                       bdi.dedup_stored_bytes);
+            }
+            get_human_readable_size(buf, sizeof(buf), bdi.dedup_index_memory);
+            printf("dedup index memory: %s\n", buf);
+        }
     }
     bdrv_get_backing_filename(bs, backing_filename, sizeof(backing_filename));
     if (backing_filename[0] != '\0') {
@@ -1153,6 +1719,279 @@ static int img_info(int argc, char **argv)
     return 0;
 }
 
+/*
+ * img_map() looks up the allocation status of the image in chunks of
+ * MAP_CHUNK_SECTORS, several coroutines at a time, and prints the extents
+ * once all chunks are done.
+ */
+#define MAP_CHUNK_SECTORS (1LL << 21) /* 1 GB */
+
+typedef struct MapEntry {
+    int64_t start;              /* in sectors */
+    int64_t length;
+    int depth;                  /* backing file level the data comes from */
+    bool data;                  /* the range is read from the image file */
+    bool zero;                  /* the range reads as zeroes */
+} MapEntry;
+
+typedef struct MapChunk {
+    MapEntry *entries;
+    int nb_entries;
+} MapChunk;
+
+typedef struct ImgMapState {
+    BlockDriverState *bs;
+    int64_t total_sectors;
+    int64_t next_chunk;
+    int64_t nb_chunks;
+    MapChunk *chunks;
+    int running_coroutines;
+    int ret;
+} ImgMapState;
+
+/*
+ * Finds the image in the backing chain of bs that sector_num is read from.
+ * Returns 1 if one has the sector allocated, and 0 if no image has, in
+ * which case *depth is the number of images in the chain.  *zero is set if
+ * the sector reads as zeroes, either because no image has it or because it
+ * is allocated as zeroes.
+ */
+static int coroutine_fn map_co_lookup(BlockDriverState *bs,
+                                      int64_t sector_num, int nb_sectors,
+                                      int *pnum, int *depth, bool *zero)
+{
+    int ret, n = nb_sectors;
+
+    *zero = true;
+
+    for (*depth = 0; bs; bs = bs->backing_hd, (*depth)++) {
+        /* A backing file that is shorter than its overlay reads as zeroes
+           beyond its end */
+        if (sector_num >= bs->total_sectors) {
+            break;
+        }
+        ret = bdrv_co_is_allocated(bs, sector_num, n, pnum);
+        if (ret < 0) {
+            return ret;
+        }
+        assert(*pnum > 0);
+        if (ret) {
+            ret = bdrv_co_is_zero(bs, sector_num, *pnum, pnum);
+            if (ret < 0) {
+                return ret;
+            }
+            *zero = ret;
+            return 1;
+        }
+        n = *pnum;
+    }
+
+    *pnum = n;
+    return 0;
+}
+
+static void coroutine_fn map_co_do_map(void *opaque)
+{
+    ImgMapState *s = opaque;
+
+    while (s->ret == 0 && s->next_chunk < s->nb_chunks) {
+        MapChunk *chunk = &s->chunks[s->next_chunk];
+        int64_t sector_num = s->next_chunk * MAP_CHUNK_SECTORS;
+        int64_t end = MIN(sector_num + MAP_CHUNK_SECTORS, s->total_sectors);
+
+        s->next_chunk++;
+        while (sector_num < end) {
+            MapEntry *e;
+            int ret, n, depth;
+            bool zero;
+
+            ret = map_co_lookup(s->bs, sector_num, end - sector_num, &n,
+                                &depth, &zero);
+            if (ret < 0) {
+                error_report("error while reading block status of sector %"
+                             PRId64 ": %s", sector_num, strerror(-ret));
+                s->ret = ret;
+                break;
+            }
+
+            e = chunk->nb_entries ? &chunk->entries[chunk->nb_entries - 1]
+                                  : NULL;
+            if (!e || e->depth != depth || e->data != (ret && !zero) ||
+                e->zero != zero) {
+                chunk->entries = g_renew(MapEntry, chunk->entries,
+                                         chunk->nb_entries + 1);
+                e = &chunk->entries[chunk->nb_entries++];
+                e->start = sector_num;
+                e->length = 0;
+                e->depth = depth;
+                e->data = ret && !zero;
+                e->zero = zero;
+            }
+            e->length += n;
+            sector_num += n;
+        }
+    }
+
+    s->running_coroutines--;
+}
+
+static void map_dump_entry(MapEntry *e, BlockDriverState **layers,
+                           bool json, bool first)
+{
+    if (!json) {
+        if (e->data) {
+            printf("%#-16" PRIx64 "%#-16" PRIx64 "%-7d%s\n",
+                   e->start << BDRV_SECTOR_BITS, e->length << BDRV_SECTOR_BITS,
+                   e->depth, layers[e->depth]->filename);
+        }
+        return;
+    }
+
+    printf("%s{ \"start\": %" PRId64 ", \"length\": %" PRId64 ", "
+           "\"depth\": %d, \"zero\": %s, \"data\": %s",
+           first ? "" : ",\n",
+           e->start << BDRV_SECTOR_BITS, e->length << BDRV_SECTOR_BITS,
+           e->depth, e->zero ? "true" : "false", e->data ? "true" : "false");
+    if (e->data) {
+        QString *file, *str;
+
+        file = qstring_from_str(layers[e->depth]->filename);
+        str = qobject_to_json(QOBJECT(file));
+        printf(", \"file\": %s", qstring_get_str(str));
+        QDECREF(str);
+        QDECREF(file);
+    }
+    printf(" }");
+}
+
+static int img_map(int argc, char **argv)
+{
+    const char *filename, *fmt = NULL, *output = "human";
+    BlockDriverState *bs, *layer, **layers;
+    ImgMapState s;
+    MapEntry cur;
+    uint64_t sectors;
+    int64_t i;
+    int c, j, nb_layers, num_coroutines = 1;
+    bool json, first = true;
+    static const struct option long_options[] = {
+        {"help", no_argument, NULL, 'h'},
+        {"format", required_argument, NULL, 'f'},
+        {"output", required_argument, NULL, 'O'},
+        {NULL, 0, NULL, 0}
+    };
+
+    for (;;) {
+        c = getopt_long(argc, argv, "hf:m:", long_options, NULL);
+        if (c == -1) {
+            break;
+        }
+        switch (c) {
+        case '?':
+        case 'h':
+            help();
+            break;
+        case 'f':
+            fmt = optarg;
+            break;
+        case 'O':
+            output = optarg;
+            break;
+        case 'm':
+        {
+            char *end;
+            num_coroutines = strtol(optarg, &end, 10);
+            if (*end || num_coroutines < 1 ||
+                num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d",
+                             MAX_COROUTINES);
+                return 1;
+            }
+            break;
+        }
+        }
+    }
+    if (optind >= argc) {
+        help();
+    }
+    filename = argv[optind];
+
+    if (!strcmp(output, "json")) {
+        json = true;
+    } else if (!strcmp(output, "human")) {
+        json = false;
+    } else {
+        error_report("--output must be used with human or json as argument.");
+        return 1;
+    }
+
+    bs = bdrv_new_open(filename, fmt, BDRV_O_FLAGS);
+    if (!bs) {
+        return 1;
+    }
+
+    nb_layers = 0;
+    for (layer = bs; layer; layer = layer->backing_hd) {
+        nb_layers++;
+    }
+    layers = g_new(BlockDriverState *, nb_layers);
+    for (j = 0, layer = bs; layer; layer = layer->backing_hd) {
+        layers[j++] = layer;
+    }
+
+    bdrv_get_geometry(bs, &sectors);
+    memset(&s, 0, sizeof(s));
+    s.bs = bs;
+    s.total_sectors = sectors;
+    s.nb_chunks = DIV_ROUND_UP(s.total_sectors, MAP_CHUNK_SECTORS);
+    s.chunks = g_new0(MapChunk, s.nb_chunks);
+
+    run_coroutines(map_co_do_map, &s, num_coroutines, &s.running_coroutines);
+    if (s.ret < 0) {
+        goto out;
+    }
+
+    /* Print the extents, merging those that continue across chunks */
+    if (json) {
+        printf("[");
+    } else {
+        printf("%-16s%-16s%-7s%s\n", "Offset", "Length", "Depth", "File");
+    }
+    cur.length = 0;
+    for (i = 0; i < s.nb_chunks; i++) {
+        for (j = 0; j < s.chunks[i].nb_entries; j++) {
+            MapEntry *e = &s.chunks[i].entries[j];
+
+            if (cur.length && cur.depth == e->depth && cur.data == e->data &&
+                cur.zero == e->zero) {
+                cur.length += e->length;
+                continue;
+            }
+            if (cur.length) {
+                map_dump_entry(&cur, layers, json, first);
+                first = false;
+            }
+            cur = *e;
+        }
+    }
+    if (cur.length) {
+        map_dump_entry(&cur, layers, json, first);
+    }
+    if (json) {
+        printf("]\n");
+    }
+
+out:
+    for (i = 0; i < s.nb_chunks; i++) {
+        g_free(s.chunks[i].entries);
+    }
+    g_free(s.chunks);
+    g_free(layers);
+    bdrv_delete(bs);
+    return s.ret < 0 ? 1 : 0;
+}
+
 #define SNAPSHOT_LIST   1
 #define SNAPSHOT_CREATE 2
 #define SNAPSHOT_APPLY  3
@@ -1647,6 +2486,317 @@ out:
     return 0;
 }
 
+/*
+ * img_bench() keeps depth coroutines busy with requests until count
+ * requests have completed, and records the latency of each of them.
+ */
+typedef struct BenchData {
+    BlockDriverState *bs;
+    uint64_t image_size;
+    int bufsize;
+    int64_t step;
+    bool random;
+    int write_percent;
+    int64_t start;              /* no request is before this offset */
+    int64_t offset;             /* of the next sequential request */
+    uint64_t rand_state;
+    int count;
+    int n;                      /* requests started */
+    int n_writes;
+    int64_t *latency;           /* in ns, per request */
+    int running_coroutines;
+    int ret;
+} BenchData;
+
+/* xorshift64*, a fixed seed makes runs repeatable */
+static uint64_t bench_rand(BenchData *b)
+{
+    b->rand_state ^= b->rand_state >> 12;
+    b->rand_state ^= b->rand_state << 25;
+    b->rand_state ^= b->rand_state >> 27;
+    return b->rand_state * 2685821657736338717ULL;
+}
+
+static void coroutine_fn bench_co(void *opaque)
+{
+    BenchData *b = opaque;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    uint8_t *buf;
+
+    buf = qemu_blockalign(b->bs, b->bufsize);
+    /* Not zero, so that no driver can skip the writes */
+    memset(buf, 0xa5, b->bufsize);
+    iov.iov_base = buf;
+    iov.iov_len = b->bufsize;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    while (b->ret == 0 && b->n < b->count) {
+        int64_t offset, start;
+        bool is_write;
+        int i, ret;
+
+        i = b->n++;
+        if (b->random) {
+            offset = b->start +
+                     (bench_rand(b) % ((b->image_size - b->start) /
+                                       b->bufsize)) * b->bufsize;
+        } else {
+            offset = b->offset;
+            b->offset += b->step;
+            if (b->offset + b->bufsize > b->image_size) {
+                b->offset = b->start;
+            }
+        }
+        is_write = b->write_percent == 100 ||
+                   (b->write_percent && bench_rand(b) % 100 <
+                                        b->write_percent);
+
+        start = get_clock();
+        if (is_write) {
+            b->n_writes++;
+            ret = bdrv_co_writev(b->bs, offset >> BDRV_SECTOR_BITS,
+                                 b->bufsize >> BDRV_SECTOR_BITS, &qiov);
+        } else {
+            ret = bdrv_co_readv(b->bs, offset >> BDRV_SECTOR_BITS,
+                                b->bufsize >> BDRV_SECTOR_BITS, &qiov);
+        }
+        b->latency[i] = get_clock() - start;
+
+        if (ret < 0 && b->ret == 0) {
+            error_report("Failed %s request at offset %" PRId64 ": %s",
+                         is_write ? "write" : "read", offset, strerror(-ret));
+            b->ret = ret;
+        }
+    }
+
+    qemu_vfree(buf);
+    b->running_coroutines--;
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Latency in microseconds below which pct percent of the requests were */
+static double bench_percentile(BenchData *b, double pct)
+{
+    int i = (int)(b->count * pct / 100);
+
+    return b->latency[MIN(i, b->count - 1)] / 1000.0;
+}
+
+static int img_bench(int argc, char **argv)
+{
+    const char *filename, *fmt = NULL, *cache = "writeback";
+    BlockDriverState *bs;
+    BenchData b = {
+        .count = 75000,
+        .bufsize = 4096,
+        .step = 0,
+        .rand_state = 88172645463325252ULL,
+    };
+    int c, depth = 64, flags = BDRV_O_CACHE_WB;
+    int64_t start, elapsed, total_ns;
+    bool quiet = false;
+    int ret, i;
+
+    for (;;) {
+        c = getopt(argc, argv, "hc:d:f:nM:o:qrs:S:t:w");
+        if (c == -1) {
+            break;
+        }
+        switch (c) {
+        case '?':
+        case 'h':
+            help();
+            break;
+        case 'c':
+        {
+            char *end;
+            b.count = strtol(optarg, &end, 0);
+            if (*end || b.count <= 0) {
+                error_report("Invalid request count specified");
+                return 1;
+            }
+            break;
+        }
+        case 'd':
+        {
+            char *end;
+            depth = strtol(optarg, &end, 0);
+            if (*end || depth <= 0 || depth > 1024) {
+                error_report("Invalid queue depth specified");
+                return 1;
+            }
+            break;
+        }
+        case 'f':
+            fmt = optarg;
+            break;
+        case 'n':
+            flags |= BDRV_O_NATIVE_AIO;
+            break;
+        case 'M':
+        {
+            char *end;
+            b.write_percent = strtol(optarg, &end, 0);
+            if (*end || b.write_percent < 0 || b.write_percent > 100) {
+                error_report("Invalid write percentage specified");
+                return 1;
+            }
+            break;
+        }
+        case 'o':
+        {
+            char *end;
+            b.start = strtosz_suffix(optarg, &end, STRTOSZ_DEFSUFFIX_B);
+            if (b.start < 0 || *end) {
+                error_report("Invalid offset specified");
+                return 1;
+            }
+            break;
+        }
+        case 'q':
+            quiet = true;
+            break;
+        case 'r':
+            b.random = true;
+            break;
+        case 's':
+        {
+            int64_t sval;
+            char *end;
+            sval = strtosz_suffix(optarg, &end, STRTOSZ_DEFSUFFIX_B);
+            if (sval <= 0 || sval > INT_MAX || *end ||
+                sval % BDRV_SECTOR_SIZE) {
+                error_report("Invalid buffer size specified");
+                return 1;
+            }
+            b.bufsize = sval;
+            break;
+        }
+        case 'S':
+        {
+            char *end;
+            b.step = strtosz_suffix(optarg, &end, STRTOSZ_DEFSUFFIX_B);
+            if (b.step <= 0 || *end || b.step % BDRV_SECTOR_SIZE) {
+                error_report("Invalid step size specified");
+                return 1;
+            }
+            break;
+        }
+        case 't':
+            cache = optarg;
+            break;
+        case 'w':
+            b.write_percent = 100;
+            break;
+        }
+    }
+    if (optind != argc - 1) {
+        help();
+    }
+    filename = argv[optind];
+
+    if (b.step == 0) {
+        b.step = b.bufsize;
+    }
+    if (b.start % BDRV_SECTOR_SIZE) {
+        error_report("Offset must be a multiple of 512");
+        return 1;
+    }
+    b.offset = b.start;
+
+    flags &= ~BDRV_O_CACHE_MASK;
+    ret = bdrv_parse_cache_flags(cache, &flags);
+    if (ret < 0) {
+        error_report("Invalid cache option: %s", cache);
+        return 1;
+    }
+    /* Otherwise the requests would silently go to the thread pool */
+    if ((flags & BDRV_O_NATIVE_AIO) && !(flags & BDRV_O_NOCACHE)) {
+        error_report("Native AIO (-n) requires cache mode 'none' or "
+                     "'directsync'");
+        return 1;
+    }
+    if (b.write_percent) {
+        flags |= BDRV_O_RDWR;
+    }
+
+    bs = bdrv_new_open(filename, fmt, flags);
+    if (!bs) {
+        return 1;
+    }
+
+    b.bs = bs;
+    b.image_size = bdrv_getlength(bs);
+    if (b.image_size < b.start + b.bufsize) {
+        error_report("Image is too small for a request of %d bytes at offset %"
+                     PRId64, b.bufsize, b.start);
+        bdrv_delete(bs);
+        return 1;
+    }
+    b.latency = g_new(int64_t, b.count);
+
+    if (!quiet) {
+        printf("Sending %d %s requests, %d bytes each, %d in parallel (",
+               b.count, b.write_percent == 100 ? "write" :
+                        b.write_percent ? "mixed" : "read",
+               b.bufsize, depth);
+        if (b.random) {
+            printf("random offsets from offset %" PRId64, b.start);
+        } else {
+            printf("starting at offset %" PRId64 ", step size %" PRId64,
+                   b.start, b.step);
+        }
+        if (b.write_percent && b.write_percent < 100) {
+            printf(", %d%% writes", b.write_percent);
+        }
+        printf(")\n");
+    }
+
+    start = get_clock();
+    run_coroutines(bench_co, &b, depth, &b.running_coroutines);
+    elapsed = get_clock() - start;
+
+    if (b.ret < 0) {
+        goto out;
+    }
+
+    total_ns = 0;
+    for (i = 0; i < b.count; i++) {
+        total_ns += b.latency[i];
+    }
+    qsort(b.latency, b.count, sizeof(b.latency[0]), compare_int64);
+
+    printf("Run completed in %3.3f seconds.\n", elapsed / 1e9);
+    if (!quiet) {
+        double secs = elapsed / 1e9;
+
+        printf("IOPS: %.0f, throughput: %.2f MB/s", b.count / secs,
+               (double)b.count * b.bufsize / secs / (1024 * 1024));
+        if (b.write_percent && b.write_percent < 100) {
+            printf(" (%d writes)", b.n_writes);
+        }
+        printf("\n");
+        printf("Latency (us): min %.1f, avg %.1f, 50%% %.1f, 90%% %.1f, "
+               "99%% %.1f, 99.9%% %.1f, max %.1f\n",
+               b.latency[0] / 1000.0, total_ns / 1000.0 / b.count,
+               bench_percentile(&b, 50), bench_percentile(&b, 90),
+               bench_percentile(&b, 99), bench_percentile(&b, 99.9),
+               b.latency[b.count - 1] / 1000.0);
+    }
+
+out:
+    g_free(b.latency);
+    bdrv_delete(bs);
+    return b.ret < 0 ? 1 : 0;
+}
+
 static const img_cmd_t img_cmds[] = {
 #define DEF(option, callback, arg_string)        \
     { option, callback },
@@ -19,6 +19,8 @@
 #include "qemu-common.h"
 #include "block.h"
 #include "nbd.h"
+#include "qemu-queue.h"
+#include "qemu_socket.h"
 
 #include <stdarg.h>
 #include <stdio.h>
@@ -32,6 +34,8 @@
 #include <signal.h>
 #include <libgen.h>
 #include <pthread.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
 
 #define SOCKET_PATH    "/var/lock/qemu-nbd-%s"
 
@@ -40,9 +44,20 @@ static int verbose;
 static char *srcpath;
 static char *sockpath;
 static bool sigterm_reported;
+static bool stats_requested;
 static bool nbd_started;
 static int shared = 1;
-static int nb_fds;
+static int local_fds;
+static int *nb_fds = &local_fds;    /* of all workers, see run_workers() */
+static int nb_workers = 1;
+
+typedef struct NBDPeer {
+    NBDClient *client;
+    char name[64];
+    QLIST_ENTRY(NBDPeer) next;
+} NBDPeer;
+
+static QLIST_HEAD(, NBDPeer) peers = QLIST_HEAD_INITIALIZER(peers);
 
 static void usage(const char *name)
 {
@@ -63,12 +78,16 @@ static void usage(const char *name)
 "  -d, --disconnect     disconnect the specified device\n"
 "  -e, --shared=NUM     device can be shared by NUM clients (default '1')\n"
 "  -t, --persistent     don't exit on the last connection\n"
+"  -m, --max-requests=NUM  handle up to NUM requests of each client at the\n"
+"                       same time (default '%d')\n"
+"  -w, --workers=NUM    serve clients from NUM processes (default '1'),\n"
+"                       requires --read-only and implies --persistent\n"
 "  -v, --verbose        display extra debugging information\n"
 "  -h, --help           display this help and exit\n"
 "  -V, --version        output version information and exit\n"
 "\n"
 "Report bugs to <anthony@codemonkey.ws>\n"
-    , name, NBD_DEFAULT_PORT, "DEVICE");
+    , name, NBD_DEFAULT_PORT, "DEVICE", NBD_DEFAULT_MAX_REQUESTS);
 }
 
 static void version(const char *name)
@@ -173,6 +192,37 @@ static void termsig_handler(int signum)
     qemu_notify_event();
 }
 
+static void statsig_handler(int signum)
+{
+    stats_requested = true;
+    qemu_notify_event();
+}
+
+static void print_peer_stats(NBDPeer *peer)
+{
+    NBDClientStats stats;
+
+    nbd_client_get_stats(peer->client, &stats);
+    fprintf(stderr, "%s: %" PRIu64 " reads (%" PRIu64 " bytes), "
+            "%" PRIu64 " writes (%" PRIu64 " bytes), %" PRIu64 " flushes, "
+            "%" PRIu64 " trims, %" PRIu64 " status queries, "
+            "%" PRIu64 " errors, "
+            "up to %d requests in flight\n",
+            peer->name, stats.rd_ops, stats.rd_bytes,
+            stats.wr_ops, stats.wr_bytes, stats.flush_ops,
+            stats.trim_ops, stats.status_ops, stats.errors,
+            stats.max_in_flight);
+}
+
+static void print_stats(void)
+{
+    NBDPeer *peer;
+
+    QLIST_FOREACH(peer, &peers, next) {
+        print_peer_stats(peer);
+    }
+}
+
 static void *show_parts(void *arg)
 {
     char *device = arg;
@@ -249,12 +299,27 @@ out:
 
 static int nbd_can_accept(void *opaque)
 {
-    return nb_fds < shared;
+    return *nb_fds < shared;
 }
 
 static void nbd_client_closed(NBDClient *client)
 {
-    nb_fds--;
+    NBDPeer *peer;
+
+    QLIST_FOREACH(peer, &peers, next) {
+        if (peer->client == client) {
+            break;
+        }
+    }
+    if (peer) {
+        if (verbose) {
+            print_peer_stats(peer);
+        }
+        QLIST_REMOVE(peer, next);
+        g_free(peer);
+    }
+
+    __sync_fetch_and_sub(nb_fds, 1);
     qemu_notify_event();
 }
 
@@ -263,11 +328,130 @@ static void nbd_accept(void *opaque)
     int server_fd = (uintptr_t) opaque;
     struct sockaddr_in addr;
     socklen_t addr_len = sizeof(addr);
+    NBDClient *client;
+    NBDPeer *peer;
+    int fd;
+
+    /* Take a slot before accepting, other workers may be accepting too */
+    if (__sync_fetch_and_add(nb_fds, 1) >= shared) {
+        __sync_fetch_and_sub(nb_fds, 1);
+        return;
+    }
 
-    int fd = accept(server_fd, (struct sockaddr *)&addr, &addr_len);
+    fd = accept(server_fd, (struct sockaddr *)&addr, &addr_len);
+    if (fd < 0 && errno == EAGAIN) {
+        /* Another worker was faster */
+        __sync_fetch_and_sub(nb_fds, 1);
+        return;
+    }
     nbd_started = true;
-    if (fd >= 0 && nbd_client_new(exp, fd, nbd_client_closed)) {
-        nb_fds++;
+    if (fd < 0) {
+        __sync_fetch_and_sub(nb_fds, 1);
+        return;
+    }
+
+    client = nbd_client_new(exp, fd, nbd_client_closed);
+    if (!client) {
+        __sync_fetch_and_sub(nb_fds, 1);
+        return;
+    }
+
+    peer = g_malloc0(sizeof(*peer));
+    peer->client = client;
+    if (addr.sin_family == AF_INET) {
+        snprintf(peer->name, sizeof(peer->name), "%s:%u",
+                 inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+    } else {
+        snprintf(peer->name, sizeof(peer->name), "client on fd %d", fd);
+    }
+    if (nb_workers > 1) {
+        size_t len = strlen(peer->name);
+        snprintf(peer->name + len, sizeof(peer->name) - len,
+                 " (pid %d)", (int)getpid());
+    }
+    QLIST_INSERT_HEAD(&peers, peer, next);
+}
+
+/*
+ * The block layer and the main loop are single-threaded, so clients are
+ * spread over several processes with their own event loop instead.  They
+ * all accept connections from the same listening socket and each opens the
+ * image itself, which is only safe when nobody writes to it.  Returns in
+ * the workers, the parent waits for them and exits.
+ *
+ * The number of clients is counted in memory shared by the workers, so that
+ * --shared limits the clients of the whole server.
+ */
+static void run_workers(int server_fd)
+{
+    pid_t *pids = g_malloc0(nb_workers * sizeof(pid_t));
+    int running = 0;
+    int failed = 0;
+    int i;
+
+    nb_fds = mmap(NULL, sizeof(*nb_fds), PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (nb_fds == MAP_FAILED) {
+        err(EXIT_FAILURE, "Failed to allocate the client count");
+    }
+    *nb_fds = 0;
+
+    socket_set_nonblock(server_fd);
+    for (i = 0; i < nb_workers; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            err(EXIT_FAILURE, "Failed to start worker");
+        }
+        if (pid == 0) {
+            g_free(pids);
+            return;
+        }
+        pids[i] = pid;
+        running++;
+    }
+
+    while (running > 0) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+
+        if (pid < 0) {
+            if (errno != EINTR) {
+                break;
+            }
+            for (i = 0; i < nb_workers; i++) {
+                if (pids[i] && sigterm_reported) {
+                    kill(pids[i], SIGTERM);
+                } else if (pids[i] && stats_requested) {
+                    kill(pids[i], SIGUSR1);
+                }
+            }
+            stats_requested = false;
+            continue;
+        }
+
+        for (i = 0; i < nb_workers; i++) {
+            if (pids[i] == pid) {
+                pids[i] = 0;
+                running--;
+            }
+        }
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            failed = 1;
+        }
+    }
+
+    if (sockpath) {
+        unlink(sockpath);
+    }
+    exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+static int listen_socket(const char *bindto, int port)
+{
+    if (sockpath) {
+        return unix_socket_incoming(sockpath);
+    } else {
+        return tcp_socket_incoming(bindto, port);
     }
 }
 
@@ -281,7 +465,7 @@ int main(int argc, char **argv)
     char *device = NULL;
     int port = NBD_DEFAULT_PORT;
     off_t fd_size;
-    const char *sopt = "hVb:o:p:rsnP:c:dvk:e:t";
+    const char *sopt = "hVb:o:p:rsnP:c:dvk:e:tm:w:";
     struct option lopt[] = {
         { "help", 0, NULL, 'h' },
         { "version", 0, NULL, 'V' },
@@ -297,6 +481,8 @@ int main(int argc, char **argv)
         { "nocache", 0, NULL, 'n' },
         { "shared", 1, NULL, 'e' },
         { "persistent", 0, NULL, 't' },
+        { "max-requests", 1, NULL, 'm' },
+        { "workers", 1, NULL, 'w' },
         { "verbose", 0, NULL, 'v' },
         { NULL, 0, NULL, 0 }
     };
@@ -309,6 +495,8 @@ int main(int argc, char **argv)
     int ret;
     int fd;
     int persistent = 0;
+    int max_requests = NBD_DEFAULT_MAX_REQUESTS;
+    sigset_t sigusr1_set;
     pthread_t client_thread;
 
     /* The client thread uses SIGTERM to interrupt the server.  A signal
@@ -319,6 +507,12 @@ int main(int argc, char **argv)
     sa_sigterm.sa_handler = termsig_handler;
     sigaction(SIGTERM, &sa_sigterm, NULL);
 
+    /* SIGUSR1 prints the statistics of all connected clients */
+    struct sigaction sa_sigusr1;
+    memset(&sa_sigusr1, 0, sizeof(sa_sigusr1));
+    sa_sigusr1.sa_handler = statsig_handler;
+    sigaction(SIGUSR1, &sa_sigusr1, NULL);
+
     while ((ch = getopt_long(argc, argv, sopt, lopt, &opt_ind)) != -1) {
         switch (ch) {
         case 's':
@@ -383,6 +577,24 @@ int main(int argc, char **argv)
 	case 't':
 	    persistent = 1;
 	    break;
+        case 'm':
+            max_requests = strtol(optarg, &end, 0);
+            if (*end) {
+                errx(EXIT_FAILURE, "Invalid number of requests '%s'", optarg);
+            }
+            if (max_requests < 1) {
+                errx(EXIT_FAILURE, "Number of requests must be greater than 0\n");
+            }
+            break;
+        case 'w':
+            nb_workers = strtol(optarg, &end, 0);
+            if (*end) {
+                errx(EXIT_FAILURE, "Invalid number of workers '%s'", optarg);
+            }
+            if (nb_workers < 1) {
+                errx(EXIT_FAILURE, "Number of workers must be greater than 0\n");
+            }
+            break;
         case 'v':
             verbose = 1;
             break;
@@ -406,6 +618,17 @@ int main(int argc, char **argv)
              argv[0]);
     }
 
+    if (nb_workers > 1) {
+        if (!(nbdflags & NBD_FLAG_READ_ONLY)) {
+            errx(EXIT_FAILURE, "--workers requires --read-only");
+        }
+        if (device || disconnect) {
+            errx(EXIT_FAILURE, "--workers cannot be used with --connect "
+                 "or --disconnect");
+        }
+        persistent = 1;
+    }
+
     if (disconnect) {
         fd = open(argv[optind], O_RDWR);
         if (fd < 0) {
@@ -477,6 +700,18 @@ int main(int argc, char **argv)
         snprintf(sockpath, 128, SOCKET_PATH, basename(device));
     }
 
+    fd = -1;
+    if (nb_workers > 1) {
+        /* The workers must not share the I/O threads of the block layer,
+         * so they are started before the image is opened.
+         */
+        fd = listen_socket(bindto, port);
+        if (fd < 0) {
+            return 1;
+        }
+        run_workers(fd);
+    }
+
     bdrv_init();
     atexit(bdrv_close_all);
 
@@ -487,7 +722,7 @@ int main(int argc, char **argv)
         err(EXIT_FAILURE, "Failed to bdrv_open '%s'", argv[optind]);
     }
 
-    fd_size = bdrv_getlength(bs);
+    fd_size = bdrv_getlength(bs) - dev_offset;
 
     if (partition != -1) {
         ret = find_partition(bs, partition, &dev_offset, &fd_size);
@@ -497,16 +732,13 @@ int main(int argc, char **argv)
         }
     }
 
-    exp = nbd_export_new(bs, dev_offset, fd_size, nbdflags);
-
-    if (sockpath) {
-        fd = unix_socket_incoming(sockpath);
-    } else {
-        fd = tcp_socket_incoming(bindto, port);
-    }
+    exp = nbd_export_new(bs, dev_offset, fd_size, nbdflags, max_requests);
 
     if (fd < 0) {
-        return 1;
+        fd = listen_socket(bindto, port);
+        if (fd < 0) {
+            return 1;
+        }
     }
 
     if (device) {
@@ -523,6 +755,13 @@ int main(int argc, char **argv)
     }
 
     qemu_init_main_loop();
+
+    /* The main loop blocks SIGUSR1 for the CPU threads of QEMU, which
+     * qemu-nbd does not have.  Take it back for the statistics.
+     */
+    sigemptyset(&sigusr1_set);
+    sigaddset(&sigusr1_set, SIGUSR1);
+    pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL);
     qemu_set_fd_handler2(fd, nbd_can_accept, nbd_accept, NULL,
                          (void *)(uintptr_t)fd);
 
@@ -534,10 +773,14 @@ int main(int argc, char **argv)
 
     do {
         main_loop_wait(false);
-    } while (!sigterm_reported && (persistent || !nbd_started || nb_fds > 0));
+        if (stats_requested) {
+            stats_requested = false;
+            print_stats();
+        }
+    } while (!sigterm_reported && (persistent || !nbd_started || *nb_fds > 0));
 
     nbd_export_close(exp);
-    if (sockpath) {
+    if (sockpath && nb_workers == 1) {
         unlink(sockpath);
     }
 
@@ -140,8 +140,9 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "-drive [file=file][,if=type][,bus=n][,unit=m][,media=d][,index=i]\n"
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
-    "       [,serial=s][,addr=A][,id=name][,aio=threads|native]\n"
+    "       [,serial=s][,addr=A][,id=name][,aio=threads|native[,aio-queue-depth=n]]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
+    "       [[,l2-cache-size=s]|[,l2-cache-coverage=p]][,refcount-cache-size=s]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]][[,iops=i]|[[,iops_rd=r][,iops_wr=w]]\n"
     "                use 'file' as a drive image\n", QEMU_ARCH_ALL)
 STEXI
@@ -177,6 +178,10 @@ These options have the same definition as they have in @option{-hdachs}.
 @var{cache} is "none", "writeback", "unsafe", "directsync" or "writethrough" and controls how the host cache is used to access block data.
 @item aio=@var{aio}
 @var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
+@item aio-queue-depth=@var{n}
+With @option{aio=native}, the number of requests that may be outstanding in
+the host kernel at a time (default 128, at most 4096).  Further requests wait
+in QEMU until earlier ones complete.
 @item format=@var{format}
 Specify which disk @var{format} will be used rather than detecting
 the format.  Can be used to specifiy format=raw to avoid interpreting
@@ -196,6 +201,14 @@ Open drive @option{file} as read-only. Guest write attempts will fail.
 @item copy-on-read=@var{copy-on-read}
 @var{copy-on-read} is "on" or "off" and enables whether to copy read backing
 file sectors into the image file.
+@item l2-cache-size=@var{size}
+Size of the qcow2 L2 table cache, in bytes.  The default covers 8 GB of
+a disk with 64 KB clusters.
+@item l2-cache-coverage=@var{percent}
+Size the qcow2 L2 table cache so that it maps @var{percent} percent of the
+disk, instead of giving an absolute @option{l2-cache-size}.
+@item refcount-cache-size=@var{size}
+Size of the qcow2 refcount block cache, in bytes.
 @end table
 
 By default, writethrough caching is used for all block device.  This means that
@@ -35,6 +35,10 @@ CommandInfoList * qmp_query_commands(Error **errp);
 int qmp_marshal_input_query_commands(Monitor *mon, const QDict *qdict, QObject **ret);
 MigrationInfo * qmp_query_migrate(Error **errp);
 int qmp_marshal_input_query_migrate(Monitor *mon, const QDict *qdict, QObject **ret);
+void qmp_migrate_set_capabilities(MigrationCapabilityStatusList * capabilities, Error **errp);
+int qmp_marshal_input_migrate_set_capabilities(Monitor *mon, const QDict *qdict, QObject **ret);
+MigrationCapabilityStatusList * qmp_query_migrate_capabilities(Error **errp);
+int qmp_marshal_input_query_migrate_capabilities(Monitor *mon, const QDict *qdict, QObject **ret);
 MouseInfoList * qmp_query_mice(Error **errp);
 int qmp_marshal_input_query_mice(Monitor *mon, const QDict *qdict, QObject **ret);
 CpuInfoList * qmp_query_cpus(Error **errp);
@@ -101,6 +105,14 @@ void qmp_migrate_set_downtime(double value, Error **errp);
 int qmp_marshal_input_migrate_set_downtime(Monitor *mon, const QDict *qdict, QObject **ret);
 void qmp_migrate_set_speed(int64_t value, Error **errp);
 int qmp_marshal_input_migrate_set_speed(Monitor *mon, const QDict *qdict, QObject **ret);
+void qmp_migrate_set_parameters(bool has_compress_level, int64_t compress_level, bool has_compress_threads, int64_t compress_threads, bool has_decompress_threads, int64_t decompress_threads, Error **errp);
+int qmp_marshal_input_migrate_set_parameters(Monitor *mon, const QDict *qdict, QObject **ret);
+MigrationParameters * qmp_query_migrate_parameters(Error **errp);
+int qmp_marshal_input_query_migrate_parameters(Monitor *mon, const QDict *qdict, QObject **ret);
+void qmp_migrate_set_cache_size(int64_t value, Error **errp);
+int qmp_marshal_input_migrate_set_cache_size(Monitor *mon, const QDict *qdict, QObject **ret);
+int64_t qmp_query_migrate_cache_size(Error **errp);
+int qmp_marshal_input_query_migrate_cache_size(Monitor *mon, const QDict *qdict, QObject **ret);
 ObjectPropertyInfoList * qmp_qom_list(const char * path, Error **errp);
 int qmp_marshal_input_qom_list(Monitor *mon, const QDict *qdict, QObject **ret);
 void qmp_set_password(const char * protocol, const char * password, bool has_connected, const char * connected, Error **errp);
@@ -117,10 +129,14 @@ void qmp_block_set_io_throttle(const char * device, int64_t bps, int64_t bps_rd,
 int qmp_marshal_input_block_set_io_throttle(Monitor *mon, const QDict *qdict, QObject **ret);
 void qmp_block_stream(const char * device, bool has_base, const char * base, bool has_speed, int64_t speed, Error **errp);
 int qmp_marshal_input_block_stream(Monitor *mon, const QDict *qdict, QObject **ret);
+void qmp_drive_mirror(const char * device, const char * target, bool has_format, const char * format, MirrorSyncMode sync, bool has_mode, NewImageMode mode, bool has_speed, int64_t speed, Error **errp);
+int qmp_marshal_input_drive_mirror(Monitor *mon, const QDict *qdict, QObject **ret);
 void qmp_block_job_set_speed(const char * device, int64_t speed, Error **errp);
 int qmp_marshal_input_block_job_set_speed(Monitor *mon, const QDict *qdict, QObject **ret);
 void qmp_block_job_cancel(const char * device, Error **errp);
 int qmp_marshal_input_block_job_cancel(Monitor *mon, const QDict *qdict, QObject **ret);
+void qmp_block_job_complete(const char * device, Error **errp);
+int qmp_marshal_input_block_job_complete(Monitor *mon, const QDict *qdict, QObject **ret);
 ObjectTypeInfoList * qmp_qom_list_types(bool has_implements, const char * implements, bool has_abstract, bool abstract, Error **errp);
 int qmp_marshal_input_qom_list_types(Monitor *mon, const QDict *qdict, QObject **ret);
 void qmp_migrate(const char * uri, bool has_blk, bool blk, bool has_inc, bool inc, bool has_detach, bool detach, Error **errp);
@@ -565,6 +565,103 @@ Example:
 -> { "execute": "migrate_set_downtime", "arguments": { "value": 0.1 } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "migrate-set-cache-size",
+        .args_type  = "value:o",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_cache_size,
+    },
+
+SQMP
+migrate-set-cache-size
+----------------------
+
+Set cache size to be used by XBZRLE migration, the cache size will be rounded
+down to the nearest power of 2
+
+Arguments:
+
+- "value": cache size in bytes (json-int)
+
+Example:
+
+-> { "execute": "migrate-set-cache-size", "arguments": { "value": 536870912 } }
+<- { "return": {} }
+
+EQMP
+    {
+        .name       = "query-migrate-cache-size",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_migrate_cache_size,
+    },
+
+SQMP
+query-migrate-cache-size
+------------------------
+
+Show cache size to be used by XBZRLE migration
+
+returns a json-object with the following information:
+- "size" : json-int
+
+Example:
+
+-> { "execute": "query-migrate-cache-size" }
+<- { "return": 67108864 }
+
+EQMP
+
+    {
+        .name       = "migrate-set-parameters",
+        .args_type  = "compress-level:i?,compress-threads:i?,decompress-threads:i?",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_parameters,
+    },
+
+SQMP
+migrate-set-parameters
+----------------------
+
+Set the tunables of the migration capabilities
+
+Arguments:
+
+- "compress-level": zlib compression level, 0 to 9 (json-int, optional)
+- "compress-threads": number of compression threads (json-int, optional)
+- "decompress-threads": number of decompression threads (json-int, optional)
+
+Example:
+
+-> { "execute": "migrate-set-parameters",
+     "arguments": { "compress-level": 1, "compress-threads": 4 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-migrate-parameters",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_migrate_parameters,
+    },
+
+SQMP
+query-migrate-parameters
+------------------------
+
+Show the tunables of the migration capabilities
+
+Returns a json-object with the following information:
+
+- "compress-level": zlib compression level (json-int)
+- "compress-threads": number of compression threads (json-int)
+- "decompress-threads": number of decompression threads (json-int)
+
+Example:
+
+-> { "execute": "query-migrate-parameters" }
+<- { "return": { "compress-level": 1, "compress-threads": 8,
+                 "decompress-threads": 2 } }
+
 EQMP
 
     {
@@ -703,6 +800,12 @@ EQMP
         .args_type  = "device:B",
         .mhandler.cmd_new = qmp_marshal_input_block_job_cancel,
     },
+
+    {
+        .name       = "block-job-complete",
+        .args_type  = "device:B",
+        .mhandler.cmd_new = qmp_marshal_input_block_job_complete,
+    },
     {
         .name       = "transaction",
         .args_type  = "actions:q",
@@ -789,6 +892,53 @@ Example:
                                                         "format": "qcow2" } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "drive-mirror",
+        .args_type  = "sync:s,device:B,target:s,speed:o?,mode:s?,format:s?",
+        .mhandler.cmd_new = qmp_marshal_input_drive_mirror,
+    },
+
+SQMP
+drive-mirror
+------------
+
+Start mirroring a block device's writes to a new destination. target
+specifies the target of the new image. If the file exists, or if it is
+a device, it will be used as the new destination for writes. If it does
+not exist, a new file will be created. format specifies the format of
+the mirror image, default is to probe if mode='existing', else the
+format of the source.
+
+The data of the device is copied to the destination in the background,
+and writes made by the guest in the meantime are copied again.  Once
+the destination is in sync, the BLOCK_JOB_READY event is emitted.  The
+job then keeps the destination in sync until it is ended with
+block-job-complete, which switches the device to the destination, or
+with block-job-cancel, which leaves the device on the source.
+
+Arguments:
+
+- "device": device name to operate on (json-string)
+- "target": name of new image file (json-string)
+- "format": format of new image (json-string, optional)
+- "mode": how an image file should be created into the target
+  file/device (NewImageMode, optional, default 'absolute-paths')
+- "speed": maximum speed of the streaming job, in bytes per second
+  (json-int)
+- "sync": what parts of the disk image should be copied to the destination;
+  possibilities include "full" for all the disk, "top" for only the sectors
+  allocated in the topmost image.
+
+Example:
+
+-> { "execute": "drive-mirror", "arguments": { "device": "ide-hd0",
+                                               "target": "/some/place/my-image",
+                                               "sync": "full",
+                                               "format": "qcow2" } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -1323,11 +1473,12 @@ Each json-object contain the following:
          - "file": device file name (json-string)
          - "ro": true if read-only, false otherwise (json-bool)
          - "drv": driver format name (json-string)
-             - Possible values: "blkdebug", "bochs", "cloop", "cow", "dmg",
-                                "file", "file", "ftp", "ftps", "host_cdrom",
-                                "host_device", "host_floppy", "http", "https",
-                                "nbd", "parallels", "qcow", "qcow2", "raw",
-                                "tftp", "vdi", "vmdk", "vpc", "vvfat"
+             - Possible values: "blkcache", "blkdebug", "bochs", "cloop",
+                                "cow", "dmg", "file", "file", "ftp", "ftps",
+                                "host_cdrom", "host_device", "host_floppy",
+                                "http", "https", "nbd", "parallels", "qcow",
+                                "qcow2", "raw", "tftp", "vdi", "vmdk", "vpc",
+                                "vvfat"
          - "backing_file": backing file name (json-string, optional)
          - "encrypted": true if encrypted, false otherwise (json-bool)
          - "bps": limit total bytes per second (json-int)
@@ -1419,6 +1570,15 @@ Each json-object contain the following:
     - "flush_total_time_ns": total time spend on cache flushes in nano-seconds (json-int)
     - "wr_highest_offset": Highest offset of a sector written since the
                            BlockDriverState has been opened (json-int)
+    - "metadata-caches": metadata caches of the image format or the data
+                         cache of blkcache, if there are any (json-array,
+                         optional).  Each cache is a json-object with:
+        - "name": "l2" or "refcount" for qcow2, "data" for blkcache
+                  (json-string)
+        - "size": cache size in bytes (json-int)
+        - "hits": lookups served from the cache (json-int)
+        - "misses": lookups that read the image (json-int)
+        - "prefetched": entries read ahead of the guest (json-int, optional)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
@@ -1453,7 +1613,13 @@ Example:
                "flush_operations":51,
                "wr_total_times_ns":313253456
                "rd_total_times_ns":3465673657
-               "flush_total_times_ns":49653
+               "flush_total_times_ns":49653,
+               "metadata-caches":[
+                  { "name":"l2", "size":1048576,
+                    "hits":35891, "misses":713 },
+                  { "name":"refcount", "size":262144,
+                    "hits":410, "misses":3 }
+               ]
             }
          },
          {
@@ -2082,8 +2248,10 @@ block migration status.
 The main json-object contains the following:
 
 - "status": migration status (json-string)
-     - Possible values: "active", "completed", "failed", "cancelled"
-- "ram": only present if "status" is "active", it is a json-object with the
+     - Possible values: "active", "postcopy-active", "completed", "failed",
+       "cancelled"
+- "ram": only present if "status" is "active" or "postcopy-active", it is a
+  json-object with the
   following RAM information (in bytes):
          - "transferred": amount transferred (json-int)
          - "remaining": amount remaining (json-int)
@@ -2093,6 +2261,18 @@ The main json-object contains the following:
          - "transferred": amount transferred (json-int)
          - "remaining": amount remaining (json-int)
          - "total": total (json-int)
+- "xbzrle-cache": only present if XBZRLE is active.
+  It is a json-object with the following XBZRLE information:
+         - "cache-size": XBZRLE cache size in bytes (json-int)
+         - "bytes": total XBZRLE bytes transferred (json-int)
+         - "pages": number of XBZRLE compressed pages (json-int)
+         - "cache-hit": number of re-sent pages found in the cache (json-int)
+         - "cache-miss": number of cache misses (json-int)
+         - "overflow": number of XBZRLE overflows (json-int)
+- "postcopy-requests": only present once post-copy has started, number of
+  pages the destination requested on demand (json-int)
+- "cpu-throttle-percentage": only present while auto-converge is throttling
+  the guest, percentage of time the vCPUs are kept asleep (json-int)
 
 Examples:
 
@@ -2144,6 +2324,28 @@ Examples:
       }
    }
 
+6. Migration is being performed and XBZRLE is active:
+
+-> { "execute": "query-migrate" }
+<- {
+      "return":{
+         "status":"active",
+         "ram":{
+            "total":1057024,
+            "remaining":1053304,
+            "transferred":3720
+         },
+         "xbzrle-cache":{
+            "cache-size":67108864,
+            "bytes":20971520,
+            "pages":2444343,
+            "cache-hit":2444343,
+            "cache-miss":2244,
+            "overflow":34434
+         }
+      }
+   }
+
 EQMP
 
     {
@@ -2152,6 +2354,64 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_migrate,
     },
 
+SQMP
+migrate-set-capabilities
+------------------------
+
+Enable/Disable migration capabilities
+
+- "xbzrle": xbzrle support
+- "compress": multi-threaded zlib compression of page payloads
+- "postcopy": switch to post-copy if RAM does not converge after one pass
+- "auto-converge": throttle the vCPUs if RAM does not converge
+
+Arguments:
+
+Example:
+
+-> { "execute": "migrate-set-capabilities" , "arguments":
+     { "capabilities": [ { "capability": "xbzrle", "state": true } ] } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "migrate-set-capabilities",
+        .args_type  = "capabilities:O",
+        .params     = "capability:s,state:b",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_capabilities,
+    },
+
+SQMP
+query-migrate-capabilities
+--------------------------
+
+Query current migration capabilities
+
+- "capabilities": migration capabilities state
+         - "xbzrle" : XBZRLE state (json-bool)
+         - "compress" : page compression state (json-bool)
+         - "postcopy" : post-copy state (json-bool)
+         - "auto-converge" : auto-converge state (json-bool)
+
+Arguments:
+
+Example:
+
+-> { "execute": "query-migrate-capabilities" }
+<- { "return": [ { "state": false, "capability": "xbzrle" },
+                 { "state": false, "capability": "compress" },
+                 { "state": false, "capability": "postcopy" },
+                 { "state": false, "capability": "auto-converge" } ] }
+
+EQMP
+
+    {
+        .name       = "query-migrate-capabilities",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_migrate_capabilities,
+    },
+
 SQMP
 query-balloon
 -------------
@@ -394,6 +394,19 @@ QEMUFile *qemu_fopen_socket(int fd)
     return s->file;
 }
 
+/* Returns the socket behind a file from qemu_fopen_socket(), or -1 */
+int qemu_socket_fd(QEMUFile *f)
+{
+    QEMUFileSocket *s;
+
+    if (f->get_buffer != socket_get_buffer) {
+        return -1;
+    }
+
+    s = (QEMUFileSocket *)f->opaque;
+    return s->fd;
+}
+
 static int file_put_buffer(void *opaque, const uint8_t *buf,
                             int64_t pos, int size)
 {
@@ -464,6 +477,16 @@ static QEMUFile *qemu_fopen_bdrv(BlockDriverState *bs, int is_writable)
     return qemu_fopen_ops(bs, NULL, block_get_buffer, bdrv_fclose, NULL, NULL, NULL);
 }
 
+/* Returns the image that holds the VM state of @f, or NULL */
+BlockDriverState *qemu_file_get_bdrv(QEMUFile *f)
+{
+    if (f->put_buffer != block_put_buffer &&
+        f->get_buffer != block_get_buffer) {
+        return NULL;
+    }
+    return f->opaque;
+}
+
 QEMUFile *qemu_fopen_ops(void *opaque, QEMUFilePutBufferFunc *put_buffer,
                          QEMUFileGetBufferFunc *get_buffer,
                          QEMUFileCloseFunc *close,